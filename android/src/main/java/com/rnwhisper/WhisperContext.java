@@ -359,6 +359,8 @@ public class WhisperContext {
       options.hasKey("bestOf") ? options.getInt("bestOf") : -1,
       // jboolean speed_up,
       options.hasKey("speedUp") ? options.getBoolean("speedUp") : false,
+      // jint audio_ctx,
+      options.hasKey("audioCtx") ? options.getInt("audioCtx") : 0,
       // jboolean translate,
       options.hasKey("translate") ? options.getBoolean("translate") : false,
       // jstring language,
@@ -530,6 +532,7 @@ public class WhisperContext {
     int beam_size,
     int best_of,
     boolean speed_up,
+    int audio_ctx,
     boolean translate,
     String language,
     String prompt,
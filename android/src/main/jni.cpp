@@ -152,7 +152,7 @@ Java_com_rnwhisper_WhisperContext_initContext(
     UNUSED(thiz);
     struct whisper_context *context = nullptr;
     const char *model_path_chars = env->GetStringUTFChars(model_path_str, nullptr);
-    context = whisper_init_from_file(model_path_chars);
+    context = whisper_init_from_file_shared(model_path_chars);
     env->ReleaseStringUTFChars(model_path_str, model_path_chars);
     return reinterpret_cast<jlong>(context);
 }
@@ -209,6 +209,7 @@ Java_com_rnwhisper_WhisperContext_fullTranscribe(
     jint beam_size,
     jint best_of,
     jboolean speed_up,
+    jint audio_ctx,
     jboolean translate,
     jstring language,
     jstring prompt,
@@ -240,6 +241,7 @@ Java_com_rnwhisper_WhisperContext_fullTranscribe(
     params.language = language_chars;
     params.n_threads = n_threads > 0 ? n_threads : default_n_threads;
     params.speed_up = speed_up;
+    params.audio_ctx = audio_ctx;
     params.offset_ms = 0;
     params.no_context = true;
     params.single_segment = false;
@@ -274,11 +276,7 @@ Java_com_rnwhisper_WhisperContext_fullTranscribe(
         params.initial_prompt = env->GetStringUTFChars(prompt, nullptr);
     }
 
-    params.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-        bool is_aborted = *(bool*)user_data;
-        return !is_aborted;
-    };
-    params.encoder_begin_callback_user_data = rn_whisper_assign_abort_map(job_id);
+    rn_whisper_set_abort_callbacks(&params, rn_whisper_assign_abort_token(job_id));
 
     if (progress_callback_instance != nullptr) {
         params.progress_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
@@ -305,7 +303,7 @@ Java_com_rnwhisper_WhisperContext_fullTranscribe(
     }
     env->ReleaseFloatArrayElements(audio_data, audio_data_arr, JNI_ABORT);
     env->ReleaseStringUTFChars(language, language_chars);
-    rn_whisper_remove_abort_map(job_id);
+    rn_whisper_remove_abort_token(job_id);
     return code;
 }
 
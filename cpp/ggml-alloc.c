@@ -0,0 +1,351 @@
+#include "ggml-alloc.h"
+#include "ggml.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//#define WSP_GGML_ALLOCATOR_DEBUG
+
+#if defined(WSP_GGML_ALLOCATOR_DEBUG)
+#define AT_PRINTF(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define AT_PRINTF(...)
+#endif
+
+// a graph has at most WSP_GGML_MAX_NODES nodes and WSP_GGML_MAX_NODES leafs
+// use a prime a bit larger than twice that to keep the open addressing chains short
+#define WSP_GGML_ALLOCR_HASH_SIZE 16411
+
+#define WSP_GGML_ALLOCR_MAX_FREE_BLOCKS 256
+
+struct hash_node {
+    struct wsp_ggml_tensor * t;
+    int  n_children; // number of nodes of the graph that read this tensor
+    int  n_views;    // number of views of this tensor in the graph
+    bool allocated;  // the data was assigned by wsp_ggml_allocr_alloc_graph and can be reused
+};
+
+struct free_block {
+    void * addr;
+    size_t size;
+};
+
+struct wsp_ggml_allocr {
+    void * data;
+    size_t size;
+    size_t alignment;
+
+    // sorted by address
+    int n_free_blocks;
+    struct free_block free_blocks[WSP_GGML_ALLOCR_MAX_FREE_BLOCKS];
+
+    struct hash_node * hash_table;
+
+    size_t max_size;
+    bool   measure;
+};
+
+static size_t hash(void * p) {
+    return (size_t) p % WSP_GGML_ALLOCR_HASH_SIZE;
+}
+
+static struct hash_node * hash_get(struct hash_node * hash_table, struct wsp_ggml_tensor * t) {
+    size_t h = hash(t);
+
+    // linear probing
+    size_t i = h;
+    while (hash_table[i].t != NULL) {
+        if (hash_table[i].t == t) {
+            return &hash_table[i];
+        }
+        i = (i + 1) % WSP_GGML_ALLOCR_HASH_SIZE;
+        if (i == h) {
+            // hash table is full
+            WSP_GGML_ASSERT(false);
+        }
+    }
+
+    hash_table[i].t = t;
+    return &hash_table[i];
+}
+
+static size_t aligned_offset(const void * buffer, size_t offset, size_t alignment) {
+    assert(alignment && !(alignment & (alignment - 1))); // power of 2
+    size_t align = (alignment - (((uintptr_t) buffer + offset) % alignment)) % alignment;
+    return offset + align;
+}
+
+static size_t tensor_alloc_size(const struct wsp_ggml_allocr * alloc, const struct wsp_ggml_tensor * tensor) {
+    return aligned_offset(NULL, wsp_ggml_nbytes(tensor), alloc->alignment);
+}
+
+static void allocate_tensor(struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * tensor) {
+    WSP_GGML_ASSERT(tensor->data == NULL);
+    WSP_GGML_ASSERT(tensor->view_src == NULL);
+
+    const size_t size = tensor_alloc_size(alloc, tensor);
+
+    // best fit: the smallest free block that is large enough
+    int best = -1;
+    for (int i = 0; i < alloc->n_free_blocks; i++) {
+        const struct free_block * block = &alloc->free_blocks[i];
+        if (block->size >= size && (best == -1 || block->size < alloc->free_blocks[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best == -1) {
+        fprintf(stderr, "%s: not enough space in the buffer (needed %zu, largest free block %zu)\n",
+                __func__, size, alloc->n_free_blocks > 0 ? alloc->free_blocks[alloc->n_free_blocks - 1].size : (size_t) 0);
+        WSP_GGML_ASSERT(!"not enough space in the buffer");
+        return;
+    }
+
+    struct free_block * block = &alloc->free_blocks[best];
+    void * addr = block->addr;
+
+    block->addr  = (char *) block->addr + size;
+    block->size -= size;
+
+    if (block->size == 0) {
+        alloc->n_free_blocks--;
+        for (int j = best; j < alloc->n_free_blocks; j++) {
+            alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+        }
+    }
+
+    tensor->data = addr;
+
+    AT_PRINTF("%s: allocated %s at %p, %zu bytes\n", __func__, tensor->name, addr, size);
+
+    alloc->max_size = MAX(alloc->max_size, (size_t) ((char *) addr - (char *) alloc->data) + size);
+}
+
+static void free_tensor(struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * tensor) {
+    void * ptr = tensor->data;
+
+    WSP_GGML_ASSERT(ptr >= alloc->data && (char *) ptr < (char *) alloc->data + alloc->size);
+
+    const size_t size = tensor_alloc_size(alloc, tensor);
+
+    AT_PRINTF("%s: freed %s at %p, %zu bytes\n", __func__, tensor->name, ptr, size);
+
+    // merge with an adjacent block if possible
+    for (int i = 0; i < alloc->n_free_blocks; i++) {
+        struct free_block * block = &alloc->free_blocks[i];
+
+        // the tensor is at the end of this block
+        if ((char *) block->addr + block->size == (char *) ptr) {
+            block->size += size;
+
+            // and the next block starts right after the tensor
+            if (i < alloc->n_free_blocks - 1 && (char *) block->addr + block->size == (char *) alloc->free_blocks[i + 1].addr) {
+                block->size += alloc->free_blocks[i + 1].size;
+                alloc->n_free_blocks--;
+                for (int j = i + 1; j < alloc->n_free_blocks; j++) {
+                    alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+                }
+            }
+            return;
+        }
+
+        // the tensor is at the beginning of this block
+        if ((char *) ptr + size == (char *) block->addr) {
+            block->addr  = ptr;
+            block->size += size;
+
+            // and the previous block ends right before the tensor
+            if (i > 0 && (char *) alloc->free_blocks[i - 1].addr + alloc->free_blocks[i - 1].size == (char *) block->addr) {
+                alloc->free_blocks[i - 1].size += block->size;
+                alloc->n_free_blocks--;
+                for (int j = i; j < alloc->n_free_blocks; j++) {
+                    alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+                }
+            }
+            return;
+        }
+    }
+
+    // otherwise, add a new block, keeping the list sorted by address
+    WSP_GGML_ASSERT(alloc->n_free_blocks < WSP_GGML_ALLOCR_MAX_FREE_BLOCKS && "out of free blocks");
+
+    int insert_pos = 0;
+    while (insert_pos < alloc->n_free_blocks && alloc->free_blocks[insert_pos].addr < ptr) {
+        insert_pos++;
+    }
+
+    for (int i = alloc->n_free_blocks; i > insert_pos; i--) {
+        alloc->free_blocks[i] = alloc->free_blocks[i - 1];
+    }
+
+    alloc->free_blocks[insert_pos].addr = ptr;
+    alloc->free_blocks[insert_pos].size = size;
+    alloc->n_free_blocks++;
+}
+
+static struct wsp_ggml_allocr * allocr_new_impl(void * data, size_t size, size_t alignment, bool measure) {
+    struct wsp_ggml_allocr * alloc = (struct wsp_ggml_allocr *) malloc(sizeof(struct wsp_ggml_allocr));
+    struct hash_node * hash_table = (struct hash_node *) calloc(WSP_GGML_ALLOCR_HASH_SIZE, sizeof(struct hash_node));
+
+    WSP_GGML_ASSERT(alloc != NULL && hash_table != NULL);
+
+    *alloc = (struct wsp_ggml_allocr) {
+        /*.data          =*/ data,
+        /*.size          =*/ size,
+        /*.alignment     =*/ alignment,
+        /*.n_free_blocks =*/ 0,
+        /*.free_blocks   =*/ {{0}},
+        /*.hash_table    =*/ hash_table,
+        /*.max_size      =*/ 0,
+        /*.measure       =*/ measure,
+    };
+
+    wsp_ggml_allocr_reset(alloc);
+
+    return alloc;
+}
+
+struct wsp_ggml_allocr * wsp_ggml_allocr_new(void * data, size_t size, size_t alignment) {
+    return allocr_new_impl(data, size, alignment, false);
+}
+
+struct wsp_ggml_allocr * wsp_ggml_allocr_new_measure(size_t alignment) {
+    // the addresses are never dereferenced - use a fake, suitably aligned base and a buffer that never runs out
+    return allocr_new_impl((void *) 0x1000, SIZE_MAX/4, alignment, true);
+}
+
+void wsp_ggml_allocr_free(struct wsp_ggml_allocr * alloc) {
+    if (alloc == NULL) {
+        return;
+    }
+
+    free(alloc->hash_table);
+    free(alloc);
+}
+
+bool wsp_ggml_allocr_is_measure(struct wsp_ggml_allocr * alloc) {
+    return alloc->measure;
+}
+
+void wsp_ggml_allocr_reset(struct wsp_ggml_allocr * alloc) {
+    const size_t offs = aligned_offset(alloc->data, 0, alloc->alignment);
+
+    alloc->n_free_blocks = 1;
+    alloc->free_blocks[0].addr = (char *) alloc->data + offs;
+    alloc->free_blocks[0].size = alloc->size > offs ? alloc->size - offs : 0;
+}
+
+void wsp_ggml_allocr_alloc(struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * tensor) {
+    allocate_tensor(alloc, tensor);
+}
+
+size_t wsp_ggml_allocr_max_size(struct wsp_ggml_allocr * alloc) {
+    return alloc->max_size;
+}
+
+static void allocate_node(struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * node) {
+    if (node->data != NULL) {
+        return;
+    }
+
+    if (node->view_src != NULL) {
+        // the data of a view is owned by its source
+        allocate_node(alloc, node->view_src);
+        node->data = (char *) node->view_src->data + node->view_offs;
+        return;
+    }
+
+    allocate_tensor(alloc, node);
+    hash_get(alloc->hash_table, node)->allocated = true;
+}
+
+static void release_node(struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * node) {
+    struct hash_node * hn = hash_get(alloc->hash_table, node);
+
+    hn->n_children -= 1;
+
+    if (hn->n_children != 0 || hn->n_views != 0) {
+        return;
+    }
+
+    if (node->view_src != NULL) {
+        struct wsp_ggml_tensor * src = node->view_src;
+        struct hash_node * hs = hash_get(alloc->hash_table, src);
+
+        hs->n_views -= 1;
+        if (hs->n_children == 0 && hs->n_views == 0 && hs->allocated) {
+            free_tensor(alloc, src);
+            hs->allocated = false;
+        }
+    } else if (hn->allocated) {
+        free_tensor(alloc, node);
+        hn->allocated = false;
+    }
+}
+
+#define WSP_GGML_ALLOCR_N_SRC (2 + WSP_GGML_MAX_OPT)
+
+static int node_srcs(struct wsp_ggml_tensor * node, struct wsp_ggml_tensor ** srcs) {
+    int n = 0;
+
+    if (node->src0) srcs[n++] = node->src0;
+    if (node->src1) srcs[n++] = node->src1;
+
+    for (int i = 0; i < WSP_GGML_MAX_OPT; i++) {
+        if (node->opt[i]) srcs[n++] = node->opt[i];
+    }
+
+    return n;
+}
+
+size_t wsp_ggml_allocr_alloc_graph(struct wsp_ggml_allocr * alloc, struct wsp_ggml_cgraph * graph) {
+    struct hash_node * hash_table = alloc->hash_table;
+    struct wsp_ggml_tensor * srcs[WSP_GGML_ALLOCR_N_SRC];
+
+    memset(hash_table, 0, WSP_GGML_ALLOCR_HASH_SIZE*sizeof(struct hash_node));
+
+    // count the number of children and views of each tensor
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct wsp_ggml_tensor * node = graph->nodes[i];
+
+        if (node->view_src != NULL) {
+            hash_get(hash_table, node->view_src)->n_views += 1;
+        }
+
+        const int n_src = node_srcs(node, srcs);
+        for (int j = 0; j < n_src; j++) {
+            hash_get(hash_table, srcs[j])->n_children += 1;
+        }
+    }
+
+    for (int i = 0; i < graph->n_leafs; i++) {
+        struct wsp_ggml_tensor * leaf = graph->leafs[i];
+
+        if (leaf->view_src != NULL) {
+            hash_get(hash_table, leaf->view_src)->n_views += 1;
+        }
+    }
+
+    // evaluate the nodes in order: allocate their inputs and outputs, then release the inputs that are no longer needed
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct wsp_ggml_tensor * node = graph->nodes[i];
+
+        const int n_src = node_srcs(node, srcs);
+        for (int j = 0; j < n_src; j++) {
+            allocate_node(alloc, srcs[j]);
+        }
+
+        allocate_node(alloc, node);
+
+        for (int j = 0; j < n_src; j++) {
+            release_node(alloc, srcs[j]);
+        }
+    }
+
+    return alloc->max_size;
+}
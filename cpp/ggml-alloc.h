@@ -0,0 +1,60 @@
+#pragma once
+
+//
+// Graph allocator
+//
+// Assigns the data of the tensors of a graph inside a single buffer, based on the liveness of each tensor:
+// the memory of an intermediate result is reused as soon as all the nodes that read it have been evaluated.
+// The tensors must be created in a context with no_alloc = true. Tensors that already have data (model
+// weights, KV cache, ...) are left untouched.
+//
+// Typical usage:
+//
+//   // find the size of the buffer needed by the graph
+//   struct wsp_ggml_allocr * measure = wsp_ggml_allocr_new_measure(alignment);
+//   const size_t size = wsp_ggml_allocr_alloc_graph(measure, build_graph()) + alignment;
+//   wsp_ggml_allocr_free(measure);
+//
+//   // evaluate
+//   struct wsp_ggml_allocr * alloc = wsp_ggml_allocr_new(buf, size, alignment);
+//   ...
+//   wsp_ggml_allocr_reset(alloc);
+//   struct wsp_ggml_cgraph * gf = build_graph();
+//   wsp_ggml_allocr_alloc_graph(alloc, gf);
+//   // set the inputs and compute
+//
+
+#include "ggml.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+    struct wsp_ggml_allocr;
+
+    WSP_GGML_API struct wsp_ggml_allocr * wsp_ggml_allocr_new(void * data, size_t size, size_t alignment);
+
+    // the returned allocator does not own any memory - it only records the peak usage of the graphs
+    // the data pointers that it assigns are not valid and the graphs must not be computed
+    WSP_GGML_API struct wsp_ggml_allocr * wsp_ggml_allocr_new_measure(size_t alignment);
+
+    WSP_GGML_API void   wsp_ggml_allocr_free      (struct wsp_ggml_allocr * alloc);
+    WSP_GGML_API bool   wsp_ggml_allocr_is_measure(struct wsp_ggml_allocr * alloc);
+
+    // release all the memory - the tensors allocated previously become invalid
+    WSP_GGML_API void   wsp_ggml_allocr_reset     (struct wsp_ggml_allocr * alloc);
+
+    // allocate a single tensor (e.g. a graph input)
+    // it stays alive until the next reset
+    WSP_GGML_API void   wsp_ggml_allocr_alloc     (struct wsp_ggml_allocr * alloc, struct wsp_ggml_tensor * tensor);
+
+    // allocate all the tensors of the graph that do not have data yet
+    // returns the peak memory usage of the allocator so far
+    WSP_GGML_API size_t wsp_ggml_allocr_alloc_graph(struct wsp_ggml_allocr * alloc, struct wsp_ggml_cgraph * graph);
+
+    // peak memory usage since the allocator was created
+    WSP_GGML_API size_t wsp_ggml_allocr_max_size  (struct wsp_ggml_allocr * alloc);
+
+#ifdef  __cplusplus
+}
+#endif
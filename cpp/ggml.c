@@ -4488,7 +4488,17 @@ struct wsp_ggml_tensor * wsp_ggml_new_tensor_impl(
         enum   wsp_ggml_type type,
         int    n_dims,
         const int64_t* ne,
-        void*  data) {
+        struct wsp_ggml_tensor * view_src,
+        size_t view_offs) {
+    // views always point to the tensor that owns the data
+    if (view_src != NULL && view_src->view_src != NULL) {
+        view_offs += view_src->view_offs;
+        view_src   = view_src->view_src;
+    }
+
+    // the data of a view is not known yet if its source has not been allocated (no_alloc contexts)
+    void * data = view_src != NULL && view_src->data != NULL ? (char *) view_src->data + view_offs : NULL;
+
     // always insert objects at the end of the context's memory pool
     struct wsp_ggml_object * obj_cur = ctx->objects_end;
 
@@ -4498,7 +4508,7 @@ struct wsp_ggml_tensor * wsp_ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL && !ctx->no_alloc) {
+    if (view_src == NULL && !ctx->no_alloc) {
         size_needed += WSP_GGML_TYPE_SIZE[type]*(ne[0]/WSP_GGML_BLCK_SIZE[type]);
         for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
@@ -4510,7 +4520,7 @@ struct wsp_ggml_tensor * wsp_ggml_new_tensor_impl(
     char * const mem_buffer = ctx->mem_buffer;
     struct wsp_ggml_object * const obj_new = (struct wsp_ggml_object *)(mem_buffer + cur_end);
 
-    if (ctx->scratch.data == NULL || data != NULL) {
+    if (ctx->scratch.data == NULL || view_src != NULL) {
         size_needed += WSP_GGML_TENSOR_SIZE;
 
         if (cur_end + size_needed + WSP_GGML_OBJECT_SIZE > ctx->mem_size) {
@@ -4584,7 +4594,9 @@ struct wsp_ggml_tensor * wsp_ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ view_src,
+        /*.view_offs    =*/ view_offs,
+        /*.data         =*/ (view_src == NULL && data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
         /*.name         =*/ { 0 },
         /*.extra        =*/ NULL,
         /*.pad          =*/ { 0 },
@@ -4613,7 +4625,7 @@ struct wsp_ggml_tensor * wsp_ggml_new_tensor(
         enum   wsp_ggml_type type,
         int    n_dims,
         const int64_t * ne) {
-    return wsp_ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL);
+    return wsp_ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL, 0);
 }
 
 struct wsp_ggml_tensor * wsp_ggml_new_tensor_1d(
@@ -4678,7 +4690,7 @@ struct wsp_ggml_tensor * wsp_ggml_new_f32(struct wsp_ggml_context * ctx, float v
 }
 
 struct wsp_ggml_tensor * wsp_ggml_dup_tensor(struct wsp_ggml_context * ctx, const struct wsp_ggml_tensor * src) {
-    return wsp_ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL);
+    return wsp_ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL, 0);
 }
 
 struct wsp_ggml_tensor * wsp_ggml_set_zero(struct wsp_ggml_tensor * tensor) {
@@ -4960,7 +4972,7 @@ struct wsp_ggml_tensor * wsp_ggml_format_name(struct wsp_ggml_tensor * tensor, c
 struct wsp_ggml_tensor * wsp_ggml_view_tensor(
         struct wsp_ggml_context * ctx,
         const struct wsp_ggml_tensor * src) {
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, (struct wsp_ggml_tensor *) src, 0);
     wsp_ggml_format_name(result, "%s (view)", src->name);
 
     result->nb[0] = src->nb[0];
@@ -6299,7 +6311,7 @@ struct wsp_ggml_tensor * wsp_ggml_reshape(
         //WSP_GGML_ASSERT(false);
     }
 
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a, 0);
     wsp_ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = WSP_GGML_OP_RESHAPE;
@@ -6324,7 +6336,7 @@ struct wsp_ggml_tensor * wsp_ggml_reshape_1d(
     }
 
     const int64_t ne[1] = { ne0 };
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 1, ne, a->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 1, ne, a, 0);
     wsp_ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = WSP_GGML_OP_RESHAPE;
@@ -6350,7 +6362,7 @@ struct wsp_ggml_tensor * wsp_ggml_reshape_2d(
     }
 
     const int64_t ne[2] = { ne0, ne1 };
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 2, ne, a, 0);
     wsp_ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = WSP_GGML_OP_RESHAPE;
@@ -6377,7 +6389,7 @@ struct wsp_ggml_tensor * wsp_ggml_reshape_3d(
     }
 
     const int64_t ne[3] = { ne0, ne1, ne2 };
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 3, ne, a, 0);
     wsp_ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = WSP_GGML_OP_RESHAPE;
@@ -6406,7 +6418,7 @@ struct wsp_ggml_tensor * wsp_ggml_reshape_4d(
     }
 
     const int64_t ne[4] = { ne0, ne1, ne2, ne3 };
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 4, ne, a->data);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 4, ne, a, 0);
     wsp_ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = WSP_GGML_OP_RESHAPE;
@@ -6431,7 +6443,7 @@ struct wsp_ggml_tensor * wsp_ggml_view_1d(
         is_node = true;
     }
 
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 1, &ne0, a, offset);
     wsp_ggml_format_name(result, "%s (view)", a->name);
 
     wsp_ggml_scratch_save(ctx);
@@ -6469,7 +6481,7 @@ struct wsp_ggml_tensor * wsp_ggml_view_2d(
 
     const int64_t ne[WSP_GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 2, ne, a, offset);
     wsp_ggml_format_name(result, "%s (view)", a->name);
 
     wsp_ggml_scratch_save(ctx);
@@ -6513,7 +6525,7 @@ struct wsp_ggml_tensor * wsp_ggml_view_3d(
 
     const int64_t ne[WSP_GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
 
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 3, ne, (char *) a->data + offset);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 3, ne, a, offset);
     wsp_ggml_format_name(result, "%s (view)", a->name);
 
     wsp_ggml_scratch_save(ctx);
@@ -6559,7 +6571,7 @@ struct wsp_ggml_tensor * wsp_ggml_view_4d(
 
     const int64_t ne[WSP_GGML_MAX_DIMS] = { ne0, ne1, ne2, ne3 };
 
-    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 4, ne, (char *) a->data + offset);
+    struct wsp_ggml_tensor * result = wsp_ggml_new_tensor_impl(ctx, a->type, 4, ne, a, offset);
     wsp_ggml_format_name(result, "%s (view)", a->name);
 
     wsp_ggml_scratch_save(ctx);
@@ -16129,6 +16141,7 @@ struct wsp_ggml_cgraph wsp_ggml_build_forward(struct wsp_ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ WSP_GGML_DEFAULT_N_THREADS,
+        /*.sync_mode    =*/ WSP_GGML_SYNC_SPIN,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
@@ -16245,6 +16258,40 @@ typedef pthread_t wsp_ggml_thread_t;
 
 #endif
 
+// blocking primitives used to park the workers of a persistent thread pool between graphs
+
+#if defined(_WIN32)
+
+typedef CRITICAL_SECTION   wsp_ggml_mutex_t;
+typedef CONDITION_VARIABLE wsp_ggml_cond_t;
+
+#define wsp_ggml_mutex_init(x)      InitializeCriticalSection(x)
+#define wsp_ggml_mutex_destroy(x)   DeleteCriticalSection(x)
+#define wsp_ggml_mutex_lock(x)      EnterCriticalSection(x)
+#define wsp_ggml_mutex_unlock(x)    LeaveCriticalSection(x)
+#define wsp_ggml_cond_init(x)       InitializeConditionVariable(x)
+#define wsp_ggml_cond_destroy(x)    UNUSED(x)
+#define wsp_ggml_cond_wait(x, m)    SleepConditionVariableCS(x, m, INFINITE)
+#define wsp_ggml_cond_signal(x)     WakeConditionVariable(x)
+#define wsp_ggml_cond_broadcast(x)  WakeAllConditionVariable(x)
+
+#else
+
+typedef pthread_mutex_t wsp_ggml_mutex_t;
+typedef pthread_cond_t  wsp_ggml_cond_t;
+
+#define wsp_ggml_mutex_init(x)      pthread_mutex_init(x, NULL)
+#define wsp_ggml_mutex_destroy(x)   pthread_mutex_destroy(x)
+#define wsp_ggml_mutex_lock(x)      pthread_mutex_lock(x)
+#define wsp_ggml_mutex_unlock(x)    pthread_mutex_unlock(x)
+#define wsp_ggml_cond_init(x)       pthread_cond_init(x, NULL)
+#define wsp_ggml_cond_destroy(x)    pthread_cond_destroy(x)
+#define wsp_ggml_cond_wait(x, m)    pthread_cond_wait(x, m)
+#define wsp_ggml_cond_signal(x)     pthread_cond_signal(x)
+#define wsp_ggml_cond_broadcast(x)  pthread_cond_broadcast(x)
+
+#endif
+
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__linux__) && !defined(__BIONIC__)
 void set_numa_thread_affinity(int thread_n, int n_threads) {
@@ -16311,12 +16358,38 @@ struct wsp_ggml_compute_state_shared {
     // synchronization primitives
     atomic_int n_active; // num active threads
     atomic_int node_n;   // active graph node
+
+    // used only with WSP_GGML_SYNC_HYBRID
+    enum wsp_ggml_sync_mode sync_mode;
+    atomic_int       n_sleeping; // threads blocked on cond waiting for node_n to change
+    wsp_ggml_mutex_t mutex;
+    wsp_ggml_cond_t  cond;
 };
 
 struct wsp_ggml_compute_state {
     wsp_ggml_thread_t thrd;
     int ith;
     struct wsp_ggml_compute_state_shared * shared;
+    struct wsp_ggml_threadpool * pool;
+};
+
+// persistent worker threads
+// the caller of wsp_ggml_graph_compute_with_pool() acts as thread 0, so a pool for N threads owns N - 1 workers
+// between graphs the workers sleep on a condition variable instead of being joined and re-created
+struct wsp_ggml_threadpool {
+    wsp_ggml_mutex_t mutex;
+    wsp_ggml_cond_t  cond_work; // signaled when a new graph is submitted or the pool is stopped
+    wsp_ggml_cond_t  cond_done; // signaled when the last worker has finished the current graph
+
+    int n_threads;
+
+    int     n_pending; // workers that have not yet finished the current graph
+    int64_t n_graphs;  // incremented on each submitted graph
+    bool    stop;
+
+    struct wsp_ggml_compute_state_shared * shared; // the graph currently being computed
+
+    struct wsp_ggml_compute_state * workers;
 };
 
 static void wsp_ggml_graph_compute_perf_stats_node(struct wsp_ggml_tensor * node, const struct wsp_ggml_compute_state_shared * st) {
@@ -16328,6 +16401,38 @@ static void wsp_ggml_graph_compute_perf_stats_node(struct wsp_ggml_tensor * node
     node->perf_time_us += time_us_cur;
 }
 
+// max time a thread busy-waits for the next node before going to sleep in WSP_GGML_SYNC_HYBRID mode
+#define WSP_GGML_SYNC_SPIN_US 200
+
+static int wsp_ggml_graph_compute_wait_hybrid(struct wsp_ggml_compute_state_shared * shared, int last) {
+    int node_n = last;
+
+    // most nodes are short, so spin first
+    const int64_t t_start = wsp_ggml_time_us();
+    for (int i = 1; ; ++i) {
+        node_n = atomic_load(&shared->node_n);
+        if (node_n != last) {
+            return node_n;
+        }
+        if ((i % 16) == 0 && wsp_ggml_time_us() - t_start > WSP_GGML_SYNC_SPIN_US) {
+            break;
+        }
+        sched_yield();
+    }
+
+    // n_sleeping is incremented before node_n is re-checked, so the thread that publishes
+    // the next node either sees the sleeper and wakes it, or the sleeper sees the new node
+    wsp_ggml_mutex_lock(&shared->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+    while ((node_n = atomic_load(&shared->node_n)) == last) {
+        wsp_ggml_cond_wait(&shared->cond, &shared->mutex);
+    }
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    wsp_ggml_mutex_unlock(&shared->mutex);
+
+    return node_n;
+}
+
 static thread_ret_t wsp_ggml_graph_compute_thread(void * data) {
     struct wsp_ggml_compute_state * state = (struct wsp_ggml_compute_state *) data;
     struct wsp_ggml_cgraph * cgraph = state->shared->cgraph;
@@ -16394,13 +16499,23 @@ static thread_ret_t wsp_ggml_graph_compute_thread(void * data) {
 
             atomic_store(&state->shared->n_active, n_threads);
             atomic_store(&state->shared->node_n,   node_n);
+
+            if (state->shared->sync_mode == WSP_GGML_SYNC_HYBRID && atomic_load(&state->shared->n_sleeping) > 0) {
+                wsp_ggml_mutex_lock(&state->shared->mutex);
+                wsp_ggml_cond_broadcast(&state->shared->cond);
+                wsp_ggml_mutex_unlock(&state->shared->mutex);
+            }
         } else {
             // wait for other threads to finish
             const int last = node_n;
-            do {
-                sched_yield();
-                node_n = atomic_load(&state->shared->node_n);
-            } while (node_n == last);
+            if (state->shared->sync_mode == WSP_GGML_SYNC_HYBRID) {
+                node_n = wsp_ggml_graph_compute_wait_hybrid(state->shared, last);
+            } else {
+                do {
+                    sched_yield();
+                    node_n = atomic_load(&state->shared->node_n);
+                } while (node_n == last);
+            }
         }
 
         // check if we should stop
@@ -16425,354 +16540,480 @@ static thread_ret_t wsp_ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
-void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
+static thread_ret_t wsp_ggml_threadpool_worker(void * data) {
+    struct wsp_ggml_compute_state * state = (struct wsp_ggml_compute_state *) data;
+    struct wsp_ggml_threadpool * pool = state->pool;
 
-    struct wsp_ggml_compute_state_shared state_shared = {
-        /*.cgraph                  =*/ cgraph,
-        /*.perf_node_start_cycles  =*/ 0,
-        /*.perf_node_start_time_us =*/ 0,
-        /*.n_threads               =*/ n_threads,
-        /*.n_active                =*/ n_threads,
-        /*.node_n                  =*/ -1,
-    };
-    struct wsp_ggml_compute_state * workers = alloca(sizeof(struct wsp_ggml_compute_state)*n_threads);
+    int64_t n_graphs_seen = 0;
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
+    while (true) {
+        wsp_ggml_mutex_lock(&pool->mutex);
+        while (!pool->stop && pool->n_graphs == n_graphs_seen) {
+            wsp_ggml_cond_wait(&pool->cond_work, &pool->mutex);
+        }
+        if (pool->stop) {
+            wsp_ggml_mutex_unlock(&pool->mutex);
+            break;
+        }
+        n_graphs_seen = pool->n_graphs;
+        state->shared = pool->shared;
+        wsp_ggml_mutex_unlock(&pool->mutex);
 
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct wsp_ggml_tensor * node = cgraph->nodes[i];
+        // graphs computed with fewer threads than the pool size leave the extra workers idle
+        if (state->ith < state->shared->n_threads) {
+            wsp_ggml_graph_compute_thread(state);
+        }
 
-            switch (node->op) {
-                case WSP_GGML_OP_CPY:
-                case WSP_GGML_OP_DUP:
-                    {
-                        node->n_tasks = n_threads;
+        wsp_ggml_mutex_lock(&pool->mutex);
+        if (--pool->n_pending == 0) {
+            wsp_ggml_cond_signal(&pool->cond_done);
+        }
+        wsp_ggml_mutex_unlock(&pool->mutex);
+    }
 
-                        size_t cur = 0;
-                        if (wsp_ggml_is_quantized(node->type)) {
-                            cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->ne[0] * n_threads;
-                        }
+    return 0;
+}
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_ADD:
-                case WSP_GGML_OP_ADD1:
-                    {
-                        node->n_tasks = n_threads;
+struct wsp_ggml_threadpool * wsp_ggml_threadpool_new(int n_threads) {
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
 
-                        size_t cur = 0;
+    struct wsp_ggml_threadpool * pool = malloc(sizeof(struct wsp_ggml_threadpool));
+    WSP_GGML_ASSERT(pool != NULL);
 
-                        if (wsp_ggml_is_quantized(node->src0->type)) {
-                            cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
-                        }
+    wsp_ggml_mutex_init(&pool->mutex);
+    wsp_ggml_cond_init(&pool->cond_work);
+    wsp_ggml_cond_init(&pool->cond_done);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_ACC:
-                    {
-                        node->n_tasks = n_threads;
+    pool->n_threads = n_threads;
+    pool->n_pending = 0;
+    pool->n_graphs  = 0;
+    pool->stop      = false;
+    pool->shared    = NULL;
+    pool->workers   = malloc(sizeof(struct wsp_ggml_compute_state)*n_threads);
+    WSP_GGML_ASSERT(pool->workers != NULL);
 
-                        size_t cur = 0;
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = (struct wsp_ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j,
+            .shared = NULL,
+            .pool   = pool,
+        };
+    }
 
-                        if (wsp_ggml_is_quantized(node->src0->type)) {
-                            cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
-                        }
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = wsp_ggml_thread_create(&pool->workers[j].thrd, NULL, wsp_ggml_threadpool_worker, &pool->workers[j]);
+        WSP_GGML_ASSERT(rc == 0);
+    }
+
+    return pool;
+}
+
+void wsp_ggml_threadpool_free(struct wsp_ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    wsp_ggml_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    wsp_ggml_cond_broadcast(&pool->cond_work);
+    wsp_ggml_mutex_unlock(&pool->mutex);
+
+    for (int j = 1; j < pool->n_threads; ++j) {
+        const int rc = wsp_ggml_thread_join(pool->workers[j].thrd, NULL);
+        WSP_GGML_ASSERT(rc == 0);
+    }
+
+    wsp_ggml_cond_destroy(&pool->cond_done);
+    wsp_ggml_cond_destroy(&pool->cond_work);
+    wsp_ggml_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int wsp_ggml_threadpool_n_threads(const struct wsp_ggml_threadpool * pool) {
+    return pool ? pool->n_threads : 0;
+}
+
+// set the number of tasks for each node and return the size of the work buffer that the graph needs
+static size_t wsp_ggml_graph_compute_plan(struct wsp_ggml_cgraph * cgraph, const int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct wsp_ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case WSP_GGML_OP_CPY:
+            case WSP_GGML_OP_DUP:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+                    if (wsp_ggml_is_quantized(node->type)) {
+                        cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->ne[0] * n_threads;
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_ADD:
+            case WSP_GGML_OP_ADD1:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (wsp_ggml_is_quantized(node->src0->type)) {
+                        cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_ACC:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (wsp_ggml_is_quantized(node->src0->type)) {
+                        cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_SUB:
+            case WSP_GGML_OP_DIV:
+            case WSP_GGML_OP_SQR:
+            case WSP_GGML_OP_SQRT:
+            case WSP_GGML_OP_LOG:
+            case WSP_GGML_OP_SUM:
+            case WSP_GGML_OP_SUM_ROWS:
+            case WSP_GGML_OP_MEAN:
+            case WSP_GGML_OP_ARGMAX:
+            case WSP_GGML_OP_REPEAT:
+            case WSP_GGML_OP_REPEAT_BACK:
+            case WSP_GGML_OP_ABS:
+            case WSP_GGML_OP_SGN:
+            case WSP_GGML_OP_NEG:
+            case WSP_GGML_OP_STEP:
+            case WSP_GGML_OP_TANH:
+            case WSP_GGML_OP_ELU:
+            case WSP_GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case WSP_GGML_OP_MUL:
+            case WSP_GGML_OP_GELU:
+            case WSP_GGML_OP_GELU_QUICK:
+            case WSP_GGML_OP_SILU:
+            case WSP_GGML_OP_SILU_BACK:
+            case WSP_GGML_OP_NORM:
+            case WSP_GGML_OP_RMS_NORM:
+            case WSP_GGML_OP_RMS_NORM_BACK:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case WSP_GGML_OP_MUL_MAT:
+            case WSP_GGML_OP_OUT_PROD:
+                {
+                    node->n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = wsp_ggml_nrows(node->src0);
+                    //const int nr1 = wsp_ggml_nrows(node->src1);
+
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_SUB:
-                case WSP_GGML_OP_DIV:
-                case WSP_GGML_OP_SQR:
-                case WSP_GGML_OP_SQRT:
-                case WSP_GGML_OP_LOG:
-                case WSP_GGML_OP_SUM:
-                case WSP_GGML_OP_SUM_ROWS:
-                case WSP_GGML_OP_MEAN:
-                case WSP_GGML_OP_ARGMAX:
-                case WSP_GGML_OP_REPEAT:
-                case WSP_GGML_OP_REPEAT_BACK:
-                case WSP_GGML_OP_ABS:
-                case WSP_GGML_OP_SGN:
-                case WSP_GGML_OP_NEG:
-                case WSP_GGML_OP_STEP:
-                case WSP_GGML_OP_TANH:
-                case WSP_GGML_OP_ELU:
-                case WSP_GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case WSP_GGML_OP_MUL:
-                case WSP_GGML_OP_GELU:
-                case WSP_GGML_OP_GELU_QUICK:
-                case WSP_GGML_OP_SILU:
-                case WSP_GGML_OP_SILU_BACK:
-                case WSP_GGML_OP_NORM:
-                case WSP_GGML_OP_RMS_NORM:
-                case WSP_GGML_OP_RMS_NORM_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case WSP_GGML_OP_MUL_MAT:
-                case WSP_GGML_OP_OUT_PROD:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = wsp_ggml_nrows(node->src0);
-                        //const int nr1 = wsp_ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
+                    size_t cur = 0;
 
 #if defined(WSP_GGML_USE_CUBLAS)
-                        if (wsp_ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                        }
-                        else
+                    if (wsp_ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
+                        node->n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                    }
+                    else
 #elif defined(WSP_GGML_USE_CLBLAST)
-                        if (wsp_ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                            cur = wsp_ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
-                        }
-                        else
+                    if (wsp_ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
+                        node->n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                        cur = wsp_ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
+                    }
+                    else
 #endif
-                        if (node->src0->type == WSP_GGML_TYPE_F16 && node->src1->type == WSP_GGML_TYPE_F32) {
+                    if (node->src0->type == WSP_GGML_TYPE_F16 && node->src1->type == WSP_GGML_TYPE_F32) {
 #if defined(WSP_GGML_USE_ACCELERATE) || defined(WSP_GGML_USE_OPENBLAS)
-                            if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                   //       the threads are still spinning
-                                // here we need memory just for single 2D matrix from src0
-                                cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else {
-                                cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F16]*wsp_ggml_nelements(node->src1);
-                            }
-#else
+                        if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1; // TODO: this actually is doing nothing
+                                               //       the threads are still spinning
+                            // here we need memory just for single 2D matrix from src0
+                            cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else {
                             cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F16]*wsp_ggml_nelements(node->src1);
+                        }
+#else
+                        cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F16]*wsp_ggml_nelements(node->src1);
 #endif
-                        } else if (node->src0->type == WSP_GGML_TYPE_F32 && node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur = 0;
+                    } else if (node->src0->type == WSP_GGML_TYPE_F32 && node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur = 0;
 #if defined(WSP_GGML_USE_ACCELERATE) || defined(WSP_GGML_USE_OPENBLAS)
-                            if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                            }
+                        if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                        }
 #endif
-                        } else if (wsp_ggml_is_quantized(node->src0->type) && node->src1->type == WSP_GGML_TYPE_F32) {
+                    } else if (wsp_ggml_is_quantized(node->src0->type) && node->src1->type == WSP_GGML_TYPE_F32) {
 #if defined(WSP_GGML_USE_ACCELERATE) || defined(WSP_GGML_USE_OPENBLAS)
-                            if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                                cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else
+                        if (wsp_ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                            cur = WSP_GGML_TYPE_SIZE[WSP_GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else
 #endif
-                            {
-                                const enum wsp_ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
-                                cur = WSP_GGML_TYPE_SIZE[type_q]*wsp_ggml_nelements(node->src1)/WSP_GGML_BLCK_SIZE[type_q];
-                            }
-                        } else {
-                            WSP_GGML_ASSERT(false);
+                        {
+                            const enum wsp_ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
+                            cur = WSP_GGML_TYPE_SIZE[type_q]*wsp_ggml_nelements(node->src1)/WSP_GGML_BLCK_SIZE[type_q];
                         }
+                    } else {
+                        WSP_GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_SCALE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case WSP_GGML_OP_SET:
-                case WSP_GGML_OP_CONT:
-                case WSP_GGML_OP_RESHAPE:
-                case WSP_GGML_OP_VIEW:
-                case WSP_GGML_OP_PERMUTE:
-                case WSP_GGML_OP_TRANSPOSE:
-                case WSP_GGML_OP_GET_ROWS:
-                case WSP_GGML_OP_GET_ROWS_BACK:
-                case WSP_GGML_OP_DIAG:
-                case WSP_GGML_OP_DIAG_MASK_ZERO:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case WSP_GGML_OP_DIAG_MASK_INF:
-                case WSP_GGML_OP_SOFT_MAX:
-                case WSP_GGML_OP_SOFT_MAX_BACK:
-                case WSP_GGML_OP_ROPE:
-                case WSP_GGML_OP_ROPE_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case WSP_GGML_OP_ALIBI:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case WSP_GGML_OP_CLAMP:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case WSP_GGML_OP_CONV_1D:
-                    {
-                        node->n_tasks = n_threads;
-
-                        WSP_GGML_ASSERT(node->src0->ne[3] == 1);
-                        WSP_GGML_ASSERT(node->src1->ne[2] == 1);
-                        WSP_GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == WSP_GGML_TYPE_F16 &&
-                            node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur = sizeof(wsp_ggml_fp16_t)*(
-                                    nk*wsp_ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == WSP_GGML_TYPE_F32 &&
-                                   node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*wsp_ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            WSP_GGML_ASSERT(false);
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_SCALE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case WSP_GGML_OP_SET:
+            case WSP_GGML_OP_CONT:
+            case WSP_GGML_OP_RESHAPE:
+            case WSP_GGML_OP_VIEW:
+            case WSP_GGML_OP_PERMUTE:
+            case WSP_GGML_OP_TRANSPOSE:
+            case WSP_GGML_OP_GET_ROWS:
+            case WSP_GGML_OP_GET_ROWS_BACK:
+            case WSP_GGML_OP_DIAG:
+            case WSP_GGML_OP_DIAG_MASK_ZERO:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case WSP_GGML_OP_DIAG_MASK_INF:
+            case WSP_GGML_OP_SOFT_MAX:
+            case WSP_GGML_OP_SOFT_MAX_BACK:
+            case WSP_GGML_OP_ROPE:
+            case WSP_GGML_OP_ROPE_BACK:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case WSP_GGML_OP_ALIBI:
+                {
+                    node->n_tasks = 1; //TODO
+                } break;
+            case WSP_GGML_OP_CLAMP:
+                {
+                    node->n_tasks = 1; //TODO
+                } break;
+            case WSP_GGML_OP_CONV_1D:
+                {
+                    node->n_tasks = n_threads;
+
+                    WSP_GGML_ASSERT(node->src0->ne[3] == 1);
+                    WSP_GGML_ASSERT(node->src1->ne[2] == 1);
+                    WSP_GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == WSP_GGML_TYPE_F16 &&
+                        node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur = sizeof(wsp_ggml_fp16_t)*(
+                                nk*wsp_ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == WSP_GGML_TYPE_F32 &&
+                               node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*wsp_ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        WSP_GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_CONV_2D:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_CONV_2D:
+                {
+                    node->n_tasks = n_threads;
 
-                        WSP_GGML_ASSERT(node->src1->ne[3] == 1);
+                    WSP_GGML_ASSERT(node->src1->ne[3] == 1);
 
-                        const int64_t ne00 = node->src0->ne[0]; // W
-                        const int64_t ne01 = node->src0->ne[1]; // H
-                        const int64_t ne02 = node->src0->ne[2]; // C
-                        const int64_t ne03 = node->src0->ne[3]; // N
+                    const int64_t ne00 = node->src0->ne[0]; // W
+                    const int64_t ne01 = node->src0->ne[1]; // H
+                    const int64_t ne02 = node->src0->ne[2]; // C
+                    const int64_t ne03 = node->src0->ne[3]; // N
 
-                        const int64_t ne10 = node->src1->ne[0]; // W
-                        const int64_t ne11 = node->src1->ne[1]; // H
-                        const int64_t ne12 = node->src1->ne[2]; // C
+                    const int64_t ne10 = node->src1->ne[0]; // W
+                    const int64_t ne11 = node->src1->ne[1]; // H
+                    const int64_t ne12 = node->src1->ne[2]; // C
 
-                        const int64_t nk = ne00*ne01;
+                    const int64_t nk = ne00*ne01;
 
-                        UNUSED(ne02);
-                        UNUSED(ne03);
-                        UNUSED(nk);
+                    UNUSED(ne02);
+                    UNUSED(ne03);
+                    UNUSED(nk);
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src0->type == WSP_GGML_TYPE_F16 &&
-                            node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur = sizeof(wsp_ggml_fp16_t)*(ne10*ne11*ne12);
-                        } else if (node->src0->type == WSP_GGML_TYPE_F32 &&
-                                   node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur = sizeof(float)*      (ne10*ne11*ne12);
-                        } else {
-                            WSP_GGML_ASSERT(false);
-                        }
+                    if (node->src0->type == WSP_GGML_TYPE_F16 &&
+                        node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur = sizeof(wsp_ggml_fp16_t)*(ne10*ne11*ne12);
+                    } else if (node->src0->type == WSP_GGML_TYPE_F32 &&
+                               node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur = sizeof(float)*      (ne10*ne11*ne12);
+                    } else {
+                        WSP_GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t ne11 = wsp_ggml_up(node->src1->ne[1], WSP_GGML_SOFT_MAX_UNROLL);
+                    const int64_t ne11 = wsp_ggml_up(node->src1->ne[1], WSP_GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == WSP_GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == WSP_GGML_TYPE_F16) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == WSP_GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == WSP_GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_FLASH_ATTN_BACK:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t    D = node->src0->ne[0];
-                        const int64_t ne11 = wsp_ggml_up(node->src1->ne[1], WSP_GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in wsp_ggml_compute_forward_flash_attn_back
-                        if (node->src1->type == WSP_GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    const int64_t    D = node->src0->ne[0];
+                    const int64_t ne11 = wsp_ggml_up(node->src1->ne[1], WSP_GGML_SOFT_MAX_UNROLL);
+                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in wsp_ggml_compute_forward_flash_attn_back
+                    if (node->src1->type == WSP_GGML_TYPE_F32) {
+                        cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == WSP_GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == WSP_GGML_TYPE_F16) {
+                        cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_WIN_PART:
-                case WSP_GGML_OP_WIN_UNPART:
-                case WSP_GGML_OP_MAP_UNARY:
-                case WSP_GGML_OP_MAP_BINARY:
-                case WSP_GGML_OP_MAP_CUSTOM1:
-                case WSP_GGML_OP_MAP_CUSTOM2:
-                case WSP_GGML_OP_MAP_CUSTOM3:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case WSP_GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = wsp_ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = wsp_ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case WSP_GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case WSP_GGML_OP_COUNT:
-                    {
-                        WSP_GGML_ASSERT(false);
-                    } break;
-            }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_WIN_PART:
+            case WSP_GGML_OP_WIN_UNPART:
+            case WSP_GGML_OP_MAP_UNARY:
+            case WSP_GGML_OP_MAP_BINARY:
+            case WSP_GGML_OP_MAP_CUSTOM1:
+            case WSP_GGML_OP_MAP_CUSTOM2:
+            case WSP_GGML_OP_MAP_CUSTOM3:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case WSP_GGML_OP_CROSS_ENTROPY_LOSS:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = wsp_ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = wsp_ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case WSP_GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case WSP_GGML_OP_COUNT:
+                {
+                    WSP_GGML_ASSERT(false);
+                } break;
         }
+    }
+
+    return work_size;
+}
+
+size_t wsp_ggml_graph_work_size(struct wsp_ggml_cgraph * cgraph) {
+    const size_t work_size = wsp_ggml_graph_compute_plan(cgraph, cgraph->n_threads);
+
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(cgraph->n_threads - 1) : 0;
+}
+
+void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * cgraph) {
+    wsp_ggml_graph_compute_with_pool(ctx, cgraph, NULL);
+}
+
+void wsp_ggml_graph_compute_with_pool(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * cgraph, struct wsp_ggml_threadpool * pool) {
+    if (pool && cgraph->n_threads > pool->n_threads) {
+        cgraph->n_threads = pool->n_threads;
+    }
+
+    const int n_threads = cgraph->n_threads;
+
+    // zeroed first: the mutex and the cond are only initialized with WSP_GGML_SYNC_HYBRID
+    struct wsp_ggml_compute_state_shared state_shared;
+    memset(&state_shared, 0, sizeof(state_shared));
+
+    state_shared.cgraph     = cgraph;
+    state_shared.n_threads  = n_threads;
+    state_shared.n_active   = n_threads;
+    state_shared.node_n     = -1;
+    state_shared.sync_mode  = n_threads > 1 ? cgraph->sync_mode : WSP_GGML_SYNC_SPIN;
+    state_shared.n_sleeping = 0;
+
+    if (state_shared.sync_mode == WSP_GGML_SYNC_HYBRID) {
+        wsp_ggml_mutex_init(&state_shared.mutex);
+        wsp_ggml_cond_init(&state_shared.cond);
+    }
+    struct wsp_ggml_compute_state * workers = alloca(sizeof(struct wsp_ggml_compute_state)*n_threads);
+
+    // initialize tasks + work buffer
+    {
+        const size_t work_size = wsp_ggml_graph_compute_plan(cgraph, n_threads);
 
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
             WSP_GGML_ASSERT(false); // TODO: better handling
@@ -16786,13 +17027,23 @@ void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgrap
         }
     }
 
-    // create thread pool
-    if (n_threads > 1) {
+    const bool use_pool = pool != NULL && pool->n_threads > 1;
+
+    // create thread pool, or wake up the parked workers of the persistent one
+    if (use_pool) {
+        wsp_ggml_mutex_lock(&pool->mutex);
+        pool->shared    = &state_shared;
+        pool->n_pending = pool->n_threads - 1;
+        pool->n_graphs++;
+        wsp_ggml_cond_broadcast(&pool->cond_work);
+        wsp_ggml_mutex_unlock(&pool->mutex);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct wsp_ggml_compute_state) {
                 .thrd   = 0,
-                .ith = j,
+                .ith    = j,
                 .shared = &state_shared,
+                .pool   = NULL,
             };
 
             const int rc = wsp_ggml_thread_create(&workers[j].thrd, NULL, wsp_ggml_graph_compute_thread, &workers[j]);
@@ -16801,6 +17052,7 @@ void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgrap
     }
     workers[0].ith = 0;
     workers[0].shared = &state_shared;
+    workers[0].pool = pool;
 
     const int64_t perf_start_cycles  = wsp_ggml_perf_cycles();
     const int64_t perf_start_time_us = wsp_ggml_perf_time_us();
@@ -16811,14 +17063,27 @@ void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgrap
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
-    // join thread pool
-    if (n_threads > 1) {
+    // join thread pool, or wait for the persistent workers to park again
+    if (use_pool) {
+        wsp_ggml_mutex_lock(&pool->mutex);
+        while (pool->n_pending > 0) {
+            wsp_ggml_cond_wait(&pool->cond_done, &pool->mutex);
+        }
+        pool->shared = NULL;
+        wsp_ggml_mutex_unlock(&pool->mutex);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = wsp_ggml_thread_join(workers[j].thrd, NULL);
             WSP_GGML_ASSERT(rc == 0);
         }
     }
 
+    // all threads are done with the shared state at this point
+    if (state_shared.sync_mode == WSP_GGML_SYNC_HYBRID) {
+        wsp_ggml_cond_destroy(&state_shared.cond);
+        wsp_ggml_mutex_destroy(&state_shared.mutex);
+    }
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = wsp_ggml_perf_cycles()  - perf_start_cycles;
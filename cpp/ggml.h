@@ -255,6 +255,7 @@ extern "C" {
 
     struct wsp_ggml_object;
     struct wsp_ggml_context;
+    struct wsp_ggml_threadpool;
 
     enum wsp_ggml_type {
         WSP_GGML_TYPE_F32  = 0,
@@ -426,6 +427,10 @@ extern "C" {
         int64_t perf_cycles;
         int64_t perf_time_us;
 
+        // the tensor that owns the data of a view and the offset of the view in it
+        struct wsp_ggml_tensor * view_src;
+        size_t               view_offs;
+
         void * data;
 
         char name[WSP_GGML_MAX_NAME];
@@ -437,12 +442,20 @@ extern "C" {
 
     static const size_t WSP_GGML_TENSOR_SIZE = sizeof(struct wsp_ggml_tensor);
 
+    // how the compute threads wait for each other between graph nodes
+    enum wsp_ggml_sync_mode {
+        WSP_GGML_SYNC_SPIN,   // busy-wait (lowest latency, keeps all threads at 100% CPU)
+        WSP_GGML_SYNC_HYBRID, // spin for a short time, then sleep until the next node is ready
+    };
+
     // computation graph
     struct wsp_ggml_cgraph {
         int n_nodes;
         int n_leafs;
         int n_threads;
 
+        enum wsp_ggml_sync_mode sync_mode;
+
         size_t work_size;
         struct wsp_ggml_tensor * work;
 
@@ -1298,8 +1311,21 @@ extern "C" {
     WSP_GGML_API struct wsp_ggml_cgraph wsp_ggml_build_backward(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * gf, bool keep);
 
     WSP_GGML_API void wsp_ggml_graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * cgraph);
+
+    // persistent compute threads that are reused across graphs
+    // the workers park on a condition variable between graphs instead of being created and joined on every compute
+    // cgraph->n_threads is clamped to the size of the pool
+    WSP_GGML_API struct wsp_ggml_threadpool * wsp_ggml_threadpool_new      (int n_threads);
+    WSP_GGML_API void                         wsp_ggml_threadpool_free     (struct wsp_ggml_threadpool * pool);
+    WSP_GGML_API int                          wsp_ggml_threadpool_n_threads(const struct wsp_ggml_threadpool * pool);
+
+    WSP_GGML_API void wsp_ggml_graph_compute_with_pool(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * cgraph, struct wsp_ggml_threadpool * pool);
     WSP_GGML_API void wsp_ggml_graph_reset  (struct wsp_ggml_cgraph * cgraph);
 
+    // size of the work buffer that wsp_ggml_graph_compute() would allocate for the graph with cgraph->n_threads
+    // can be used to pre-allocate cgraph->work in a buffer owned by the caller
+    WSP_GGML_API size_t wsp_ggml_graph_work_size(struct wsp_ggml_cgraph * cgraph);
+
     WSP_GGML_API struct wsp_ggml_tensor * wsp_ggml_graph_get_tensor(struct wsp_ggml_cgraph * cgraph, const char * name);
 
     WSP_GGML_API void               wsp_ggml_graph_export(const struct wsp_ggml_cgraph * cgraph, const char * fname);
@@ -0,0 +1,1385 @@
+#include "k_quants.h"
+#include "ggml.h"
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define WSP_K_QUANTS_NEON
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#undef MIN
+#undef MAX
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//
+// quantization
+//
+
+// round to the nearest integer, for |fval| < 2^22
+static inline int nearest_int(float fval) {
+    assert(fabsf(fval) <= 4194303.f);
+    float val = fval + 12582912.f;
+    int i;
+    memcpy(&i, &val, sizeof(int));
+    return (i & 0x007fffff) - 0x00400000;
+}
+
+// symmetric quantization of n values to [-nmax, nmax - 1]: x = scale*(L - nmax)
+// the scale is refined with a few least-squares iterations, weighted by x^2 so the large values are kept accurate
+static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t * restrict L) {
+    float max  = 0;
+    float amax = 0;
+    for (int i = 0; i < n; ++i) {
+        const float ax = fabsf(x[i]);
+        if (ax > amax) {
+            amax = ax;
+            max  = x[i];
+        }
+    }
+
+    if (amax == 0.0f) {
+        for (int i = 0; i < n; ++i) {
+            L[i] = nmax;
+        }
+        return 0.0f;
+    }
+
+    float iscale = -nmax/max;
+    float scale  = 1/iscale;
+    float best   = 0;
+
+    for (int itry = 0; itry < 4; ++itry) {
+        float sumlx = 0;
+        float suml2 = 0;
+        bool changed = false;
+
+        for (int i = 0; i < n; ++i) {
+            const int l = MAX(-nmax, MIN(nmax - 1, nearest_int(iscale*x[i])));
+            const float w = x[i]*x[i];
+
+            sumlx += w*x[i]*l;
+            suml2 += w*l*l;
+
+            if (itry == 0 || l + nmax != L[i]) {
+                changed = true;
+            }
+        }
+
+        // keep the previous quants if the new scale does not reduce the error
+        if (suml2 == 0.0f || (itry > 0 && sumlx*sumlx <= best*suml2)) {
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            L[i] = nmax + MAX(-nmax, MIN(nmax - 1, nearest_int(iscale*x[i])));
+        }
+
+        scale  = sumlx/suml2;
+        best   = scale*sumlx;
+        iscale = 1/scale;
+
+        if (!changed) {
+            break;
+        }
+    }
+
+    return scale;
+}
+
+// asymmetric quantization of n values to [0, nmax]: x = scale*L - min
+// returns the scale, the_min gets min >= 0
+static float make_qkx_quants(int n, int nmax, const float * restrict x, uint8_t * restrict L, float * restrict the_min, int ntry) {
+    float min = x[0];
+    float max = x[0];
+    for (int i = 1; i < n; ++i) {
+        min = MIN(min, x[i]);
+        max = MAX(max, x[i]);
+    }
+
+    if (max == min) {
+        for (int i = 0; i < n; ++i) {
+            L[i] = 0;
+        }
+        *the_min = 0;
+        return 0.0f;
+    }
+
+    if (min > 0) {
+        min = 0;
+    }
+
+    float iscale = nmax/(max - min);
+    float scale  = 1/iscale;
+
+    for (int itry = 0; itry < ntry; ++itry) {
+        float sumlx = 0;
+        int   suml2 = 0;
+        bool changed = false;
+
+        for (int i = 0; i < n; ++i) {
+            const int l = MAX(0, MIN(nmax, nearest_int(iscale*(x[i] - min))));
+            if (itry == 0 || l != L[i]) {
+                L[i] = l;
+                changed = true;
+            }
+            sumlx += (x[i] - min)*l;
+            suml2 += l*l;
+        }
+
+        if (suml2 == 0) {
+            break;
+        }
+
+        scale = sumlx/suml2;
+
+        // the min that minimizes the error for this scale
+        float sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += x[i] - scale*L[i];
+        }
+        min = MIN(0.0f, sum/n);
+
+        iscale = 1/scale;
+
+        if (!changed) {
+            break;
+        }
+    }
+
+    *the_min = -min;
+
+    return scale;
+}
+
+// the 6-bit scales and mins of Q4_K / Q5_K:
+//   - j < 4:  low 6 bits of q[j] and q[j + 4]
+//   - j >= 4: low / high 4 bits of q[j + 4] + the top 2 bits of q[j - 4] and q[j]
+static inline void get_scale_min_k4(int j, const uint8_t * restrict q, uint8_t * restrict d, uint8_t * restrict m) {
+    if (j < 4) {
+        *d = q[j] & 63;
+        *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+        *m = (q[j + 4] >>  4) | ((q[j - 0] >> 6) << 4);
+    }
+}
+
+static inline void set_scale_min_k4(int j, uint8_t * restrict q, uint8_t ls, uint8_t lm) {
+    if (j < 4) {
+        q[j]     = ls;
+        q[j + 4] = lm;
+    } else {
+        q[j + 4]  = (ls & 0xF) | ((lm & 0xF) << 4);
+        q[j - 4] |= ((ls >> 4) << 6);
+        q[j - 0] |= ((lm >> 4) << 6);
+    }
+}
+
+// the 6-bit scales of Q3_K: the low 4 bits of scale j are in scales[j % 8] (low nibble for j < 8),
+// the high 2 bits in scales[8 + j % 4] at bit 2*(j/4)
+static inline void get_scales_q3_K(const uint8_t * restrict scales, int8_t * restrict sc) {
+    for (int j = 0; j < 16; ++j) {
+        const int lo = (scales[j % 8] >> (4*(j / 8))) & 0xF;
+        const int hi = (scales[8 + j % 4] >> (2*(j / 4))) & 3;
+        sc[j] = (int8_t) ((lo | (hi << 4)) - 32);
+    }
+}
+
+static inline void hist_add(int64_t * restrict hist, const uint8_t * restrict L, int n, int shift) {
+    if (hist == NULL) {
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        hist[L[i] >> shift]++;
+    }
+}
+
+static void quantize_row_q2_K_impl(const float * restrict x, block_q2_K * restrict y, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    const float q4scale = 15.f;
+
+    uint8_t L[QK_K];
+    float   mins[QK_K/16];
+    float   scales[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0;
+        float max_min   = 0;
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            scales[j] = make_qkx_quants(16, 3, x + 16*j, L + 16*j, &mins[j], 5);
+            max_scale = MAX(max_scale, scales[j]);
+            max_min   = MAX(max_min,   mins[j]);
+        }
+
+        memset(y[i].scales, 0, QK_K/16);
+
+        if (max_scale > 0) {
+            const float iscale = q4scale/max_scale;
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[j] = MIN(15, nearest_int(iscale*scales[j]));
+            }
+            y[i].d = wsp_ggml_fp32_to_fp16(max_scale/q4scale);
+        } else {
+            y[i].d = wsp_ggml_fp32_to_fp16(0.f);
+        }
+
+        if (max_min > 0) {
+            const float iscale = q4scale/max_min;
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[j] |= MIN(15, nearest_int(iscale*mins[j])) << 4;
+            }
+            y[i].dmin = wsp_ggml_fp32_to_fp16(max_min/q4scale);
+        } else {
+            y[i].dmin = wsp_ggml_fp32_to_fp16(0.f);
+        }
+
+        // quantize again with the quantized scales
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float d = wsp_ggml_fp16_to_fp32(y[i].d) * (y[i].scales[j] & 0xF);
+            if (d == 0.0f) {
+                continue;
+            }
+            const float dm = wsp_ggml_fp16_to_fp32(y[i].dmin) * (y[i].scales[j] >> 4);
+            for (int ii = 0; ii < 16; ++ii) {
+                L[16*j + ii] = MAX(0, MIN(3, nearest_int((x[16*j + ii] + dm)/d)));
+            }
+        }
+
+        hist_add(hist, L, QK_K, 0);
+
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                y[i].qs[j/4 + l] = L[j + l] | (L[j + l + 32] << 2) | (L[j + l + 64] << 4) | (L[j + l + 96] << 6);
+            }
+        }
+
+        x += QK_K;
+    }
+}
+
+static void quantize_row_q3_K_impl(const float * restrict x, block_q3_K * restrict y, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    int8_t  L[QK_K];
+    uint8_t U[QK_K];
+    float   scales[QK_K/16];
+    int8_t  sc[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0;
+        float amax      = 0;
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            scales[j] = make_qx_quants(16, 4, x + 16*j, L + 16*j);
+            const float scale = fabsf(scales[j]);
+            if (scale > amax) {
+                amax      = scale;
+                max_scale = scales[j];
+            }
+        }
+
+        memset(y[i].scales, 0, 12);
+
+        if (max_scale != 0.0f) {
+            const float iscale = -32.f/max_scale;
+            for (int j = 0; j < 16; ++j) {
+                const int l = MAX(-32, MIN(31, nearest_int(iscale*scales[j]))) + 32;
+                y[i].scales[j % 8]     |= (l & 0xF) << (4*(j / 8));
+                y[i].scales[8 + j % 4] |= (l >> 4)  << (2*(j / 4));
+            }
+            y[i].d = wsp_ggml_fp32_to_fp16(1/iscale);
+        } else {
+            y[i].d = wsp_ggml_fp32_to_fp16(0.f);
+        }
+
+        get_scales_q3_K(y[i].scales, sc);
+
+        // quantize again with the quantized scales
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float d = wsp_ggml_fp16_to_fp32(y[i].d) * sc[j];
+            if (d == 0.0f) {
+                for (int ii = 0; ii < 16; ++ii) {
+                    U[16*j + ii] = 4;
+                }
+                continue;
+            }
+            for (int ii = 0; ii < 16; ++ii) {
+                U[16*j + ii] = MAX(-4, MIN(3, nearest_int(x[16*j + ii]/d))) + 4;
+            }
+        }
+
+        hist_add(hist, U, QK_K, 0);
+
+        // the high bit of value j is bit j/32 of hmask[j % 32]
+        memset(y[i].hmask, 0, QK_K/8);
+        for (int j = 0; j < QK_K; ++j) {
+            if (U[j] > 3) {
+                y[i].hmask[j % (QK_K/8)] |= 1 << (j / (QK_K/8));
+                U[j] -= 4;
+            }
+        }
+
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                y[i].qs[j/4 + l] = U[j + l] | (U[j + l + 32] << 2) | (U[j + l + 64] << 4) | (U[j + l + 96] << 6);
+            }
+        }
+
+        x += QK_K;
+    }
+}
+
+// the scales and mins of the 8 blocks of 32 values of Q4_K / Q5_K, quantized to 6 bits
+static void quantize_scales_k4(int nmax, const float * restrict x, uint8_t * restrict L, wsp_ggml_fp16_t * d, wsp_ggml_fp16_t * dmin, uint8_t * restrict packed) {
+    float mins[QK_K/32];
+    float scales[QK_K/32];
+
+    float max_scale = 0;
+    float max_min   = 0;
+
+    for (int j = 0; j < QK_K/32; ++j) {
+        scales[j] = make_qkx_quants(32, nmax, x + 32*j, L + 32*j, &mins[j], 5);
+        max_scale = MAX(max_scale, scales[j]);
+        max_min   = MAX(max_min,   mins[j]);
+    }
+
+    const float inv_scale = max_scale > 0 ? 63.f/max_scale : 0.f;
+    const float inv_min   = max_min   > 0 ? 63.f/max_min   : 0.f;
+
+    memset(packed, 0, K_SCALE_SIZE);
+
+    for (int j = 0; j < QK_K/32; ++j) {
+        const uint8_t ls = MIN(63, nearest_int(inv_scale*scales[j]));
+        const uint8_t lm = MIN(63, nearest_int(inv_min*mins[j]));
+        set_scale_min_k4(j, packed, ls, lm);
+    }
+
+    *d    = wsp_ggml_fp32_to_fp16(max_scale/63.f);
+    *dmin = wsp_ggml_fp32_to_fp16(max_min/63.f);
+
+    // quantize again with the quantized scales
+    for (int j = 0; j < QK_K/32; ++j) {
+        uint8_t sc;
+        uint8_t m;
+        get_scale_min_k4(j, packed, &sc, &m);
+
+        const float dl = wsp_ggml_fp16_to_fp32(*d) * sc;
+        if (dl == 0.0f) {
+            continue;
+        }
+        const float dm = wsp_ggml_fp16_to_fp32(*dmin) * m;
+        for (int ii = 0; ii < 32; ++ii) {
+            L[32*j + ii] = MAX(0, MIN(nmax, nearest_int((x[32*j + ii] + dm)/dl)));
+        }
+    }
+}
+
+static void quantize_row_q4_K_impl(const float * restrict x, block_q4_K * restrict y, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; i++) {
+        quantize_scales_k4(15, x, L, &y[i].d, &y[i].dmin, y[i].scales);
+
+        hist_add(hist, L, QK_K, 0);
+
+        uint8_t * q = y[i].qs;
+        for (int j = 0; j < QK_K; j += 64) {
+            for (int l = 0; l < 32; ++l) {
+                q[l] = L[j + l] | (L[j + l + 32] << 4);
+            }
+            q += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+static void quantize_row_q5_K_impl(const float * restrict x, block_q5_K * restrict y, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; i++) {
+        quantize_scales_k4(31, x, L, &y[i].d, &y[i].dmin, y[i].scales);
+
+        hist_add(hist, L, QK_K, 1);
+
+        // the high bit of value j is bit j/32 of qh[j % 32]
+        memset(y[i].qh, 0, QK_K/8);
+        for (int j = 0; j < QK_K; ++j) {
+            if (L[j] > 15) {
+                y[i].qh[j % (QK_K/8)] |= 1 << (j / (QK_K/8));
+                L[j] -= 16;
+            }
+        }
+
+        uint8_t * q = y[i].qs;
+        for (int j = 0; j < QK_K; j += 64) {
+            for (int l = 0; l < 32; ++l) {
+                q[l] = L[j + l] | (L[j + l + 32] << 4);
+            }
+            q += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+static void quantize_row_q6_K_impl(const float * restrict x, block_q6_K * restrict y, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    int8_t  L[QK_K];
+    uint8_t U[QK_K];
+    float   scales[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0;
+        float amax      = 0;
+
+        for (int ib = 0; ib < QK_K/16; ++ib) {
+            scales[ib] = make_qx_quants(16, 32, x + 16*ib, L + 16*ib);
+            const float scale = fabsf(scales[ib]);
+            if (scale > amax) {
+                amax      = scale;
+                max_scale = scales[ib];
+            }
+        }
+
+        if (max_scale == 0.0f) {
+            memset(&y[i], 0, sizeof(block_q6_K));
+            for (int j = 0; j < QK_K; ++j) {
+                U[j] = 32;
+            }
+        } else {
+            const float iscale = -128.f/max_scale;
+            y[i].d = wsp_ggml_fp32_to_fp16(1/iscale);
+            for (int ib = 0; ib < QK_K/16; ++ib) {
+                y[i].scales[ib] = MIN(127, nearest_int(iscale*scales[ib]));
+            }
+
+            // quantize again with the quantized scales
+            for (int j = 0; j < QK_K/16; ++j) {
+                const float d = wsp_ggml_fp16_to_fp32(y[i].d) * y[i].scales[j];
+                if (d == 0.0f) {
+                    for (int ii = 0; ii < 16; ++ii) {
+                        U[16*j + ii] = 32;
+                    }
+                    continue;
+                }
+                for (int ii = 0; ii < 16; ++ii) {
+                    U[16*j + ii] = MAX(-32, MIN(31, nearest_int(x[16*j + ii]/d))) + 32;
+                }
+            }
+        }
+
+        hist_add(hist, U, QK_K, 2);
+
+        uint8_t * restrict ql = y[i].ql;
+        uint8_t * restrict qh = y[i].qh;
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                const uint8_t q1 = U[j + l +  0] & 0xF;
+                const uint8_t q2 = U[j + l + 32] & 0xF;
+                const uint8_t q3 = U[j + l + 64] & 0xF;
+                const uint8_t q4 = U[j + l + 96] & 0xF;
+                ql[l +  0] = q1 | (q3 << 4);
+                ql[l + 32] = q2 | (q4 << 4);
+                qh[l] = (U[j + l] >> 4) | ((U[j + l + 32] >> 4) << 2) | ((U[j + l + 64] >> 4) << 4) | ((U[j + l + 96] >> 4) << 6);
+            }
+            ql += 64;
+            qh += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k) {
+    quantize_row_q2_K_impl(x, y, k, NULL);
+}
+
+void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k) {
+    quantize_row_q3_K_impl(x, y, k, NULL);
+}
+
+void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict y, int k) {
+    quantize_row_q4_K_impl(x, y, k, NULL);
+}
+
+void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k) {
+    quantize_row_q5_K_impl(x, y, k, NULL);
+}
+
+void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict y, int k) {
+    quantize_row_q6_K_impl(x, y, k, NULL);
+}
+
+void quantize_row_q8_K_reference(const float * restrict x, block_q8_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        float max  = 0;
+        float amax = 0;
+        for (int j = 0; j < QK_K; ++j) {
+            const float ax = fabsf(x[j]);
+            if (ax > amax) {
+                amax = ax;
+                max  = x[j];
+            }
+        }
+
+        if (amax == 0.0f) {
+            y[i].d = 0;
+            memset(y[i].qs,    0, sizeof(y[i].qs));
+            memset(y[i].bsums, 0, sizeof(y[i].bsums));
+            x += QK_K;
+            continue;
+        }
+
+        const float iscale = -128.f/max;
+        for (int j = 0; j < QK_K; ++j) {
+            y[i].qs[j] = MIN(127, nearest_int(iscale*x[j]));
+        }
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            int sum = 0;
+            for (int ii = 0; ii < 16; ++ii) {
+                sum += y[i].qs[j*16 + ii];
+            }
+            y[i].bsums[j] = sum;
+        }
+
+        y[i].d = 1/iscale;
+
+        x += QK_K;
+    }
+}
+
+void quantize_row_q2_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q2_K_reference(x, y, k);
+}
+
+void quantize_row_q3_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q3_K_reference(x, y, k);
+}
+
+void quantize_row_q4_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q4_K_reference(x, y, k);
+}
+
+void quantize_row_q5_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q5_K_reference(x, y, k);
+}
+
+void quantize_row_q6_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q6_K_reference(x, y, k);
+}
+
+void quantize_row_q8_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q8_K_reference(x, y, k);
+}
+
+size_t wsp_ggml_quantize_q2_K(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK_K == 0);
+
+    for (int j = 0; j < n; j += k) {
+        block_q2_K * restrict y = (block_q2_K *) dst + j/QK_K;
+        quantize_row_q2_K_impl(src + j, y, k, hist);
+    }
+
+    return (n/QK_K*sizeof(block_q2_K));
+}
+
+size_t wsp_ggml_quantize_q3_K(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK_K == 0);
+
+    for (int j = 0; j < n; j += k) {
+        block_q3_K * restrict y = (block_q3_K *) dst + j/QK_K;
+        quantize_row_q3_K_impl(src + j, y, k, hist);
+    }
+
+    return (n/QK_K*sizeof(block_q3_K));
+}
+
+size_t wsp_ggml_quantize_q4_K(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK_K == 0);
+
+    for (int j = 0; j < n; j += k) {
+        block_q4_K * restrict y = (block_q4_K *) dst + j/QK_K;
+        quantize_row_q4_K_impl(src + j, y, k, hist);
+    }
+
+    return (n/QK_K*sizeof(block_q4_K));
+}
+
+size_t wsp_ggml_quantize_q5_K(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK_K == 0);
+
+    for (int j = 0; j < n; j += k) {
+        block_q5_K * restrict y = (block_q5_K *) dst + j/QK_K;
+        quantize_row_q5_K_impl(src + j, y, k, hist);
+    }
+
+    return (n/QK_K*sizeof(block_q5_K));
+}
+
+size_t wsp_ggml_quantize_q6_K(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK_K == 0);
+
+    for (int j = 0; j < n; j += k) {
+        block_q6_K * restrict y = (block_q6_K *) dst + j/QK_K;
+        quantize_row_q6_K_impl(src + j, y, k, hist);
+    }
+
+    return (n/QK_K*sizeof(block_q6_K));
+}
+
+//
+// dequantization
+//
+
+void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = wsp_ggml_fp16_to_fp32(x[i].d);
+        const float min = wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        const uint8_t * q = x[i].qs;
+
+        int is = 0;
+        for (int n = 0; n < QK_K; n += 128) {
+            for (int shift = 0; shift < 8; shift += 2) {
+                for (int h = 0; h < 2; ++h) {
+                    const uint8_t sc = x[i].scales[is++];
+                    const float dl = d * (sc & 0xF);
+                    const float ml = min * (sc >> 4);
+                    for (int l = 0; l < 16; ++l) {
+                        *y++ = dl * ((q[16*h + l] >> shift) & 3) - ml;
+                    }
+                }
+            }
+            q += 32;
+        }
+    }
+}
+
+void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    int8_t sc[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        const float d_all = wsp_ggml_fp16_to_fp32(x[i].d);
+
+        get_scales_q3_K(x[i].scales, sc);
+
+        const uint8_t * restrict q  = x[i].qs;
+        const uint8_t * restrict hm = x[i].hmask;
+
+        int is = 0;
+        uint8_t m = 1;
+        for (int n = 0; n < QK_K; n += 128) {
+            for (int shift = 0; shift < 8; shift += 2) {
+                for (int h = 0; h < 2; ++h) {
+                    const float dl = d_all * sc[is++];
+                    for (int l = 0; l < 16; ++l) {
+                        *y++ = dl * ((int8_t) ((q[16*h + l] >> shift) & 3) - ((hm[16*h + l] & m) ? 0 : 4));
+                    }
+                }
+                m <<= 1;
+            }
+            q += 32;
+        }
+    }
+}
+
+void dequantize_row_q4_K(const block_q4_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = wsp_ggml_fp16_to_fp32(x[i].d);
+        const float min = wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        const uint8_t * q = x[i].qs;
+
+        int is = 0;
+        uint8_t sc;
+        uint8_t m;
+        for (int j = 0; j < QK_K; j += 64) {
+            get_scale_min_k4(is + 0, x[i].scales, &sc, &m);
+            const float d1 = d * sc;
+            const float m1 = min * m;
+            get_scale_min_k4(is + 1, x[i].scales, &sc, &m);
+            const float d2 = d * sc;
+            const float m2 = min * m;
+            for (int l = 0; l < 32; ++l) {
+                *y++ = d1 * (q[l] & 0xF) - m1;
+            }
+            for (int l = 0; l < 32; ++l) {
+                *y++ = d2 * (q[l] >> 4) - m2;
+            }
+            q  += 32;
+            is += 2;
+        }
+    }
+}
+
+void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = wsp_ggml_fp16_to_fp32(x[i].d);
+        const float min = wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        const uint8_t * ql = x[i].qs;
+        const uint8_t * qh = x[i].qh;
+
+        int is = 0;
+        uint8_t sc;
+        uint8_t m;
+        uint8_t u1 = 1;
+        uint8_t u2 = 2;
+        for (int j = 0; j < QK_K; j += 64) {
+            get_scale_min_k4(is + 0, x[i].scales, &sc, &m);
+            const float d1 = d * sc;
+            const float m1 = min * m;
+            get_scale_min_k4(is + 1, x[i].scales, &sc, &m);
+            const float d2 = d * sc;
+            const float m2 = min * m;
+            for (int l = 0; l < 32; ++l) {
+                *y++ = d1 * ((ql[l] & 0xF) + (qh[l] & u1 ? 16 : 0)) - m1;
+            }
+            for (int l = 0; l < 32; ++l) {
+                *y++ = d2 * ((ql[l]  >> 4) + (qh[l] & u2 ? 16 : 0)) - m2;
+            }
+            ql += 32;
+            is += 2;
+            u1 <<= 2;
+            u2 <<= 2;
+        }
+    }
+}
+
+void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = wsp_ggml_fp16_to_fp32(x[i].d);
+
+        const uint8_t * restrict ql = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict sc = x[i].scales;
+
+        for (int n = 0; n < QK_K; n += 128) {
+            for (int l = 0; l < 32; ++l) {
+                const int is = l/16;
+                const int8_t q1 = (int8_t) ((ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4)) - 32;
+                const int8_t q2 = (int8_t) ((ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4)) - 32;
+                const int8_t q3 = (int8_t) ((ql[l +  0]  >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+                const int8_t q4 = (int8_t) ((ql[l + 32]  >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+                y[l +  0] = d * sc[is + 0] * q1;
+                y[l + 32] = d * sc[is + 2] * q2;
+                y[l + 64] = d * sc[is + 4] * q3;
+                y[l + 96] = d * sc[is + 6] * q4;
+            }
+            y  += 128;
+            ql += 64;
+            qh += 32;
+            sc += 8;
+        }
+    }
+}
+
+void dequantize_row_q8_K(const block_q8_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        for (int j = 0; j < QK_K; ++j) {
+            *y++ = x[i].d * x[i].qs[j];
+        }
+    }
+}
+
+//
+// dot products
+//
+// the quants of the weights are unpacked to unsigned 8-bit values, 32 at a time, and multiplied with the Q8_K quants
+// the block scales are applied to the integer sums; the mins and the offsets of the signed types are applied with
+// the bsums of the Q8_K blocks
+//
+
+#if defined(WSP_K_QUANTS_NEON)
+
+#if defined(__ARM_FEATURE_DOTPROD)
+#define wsp_k_vdotq_s32(acc, a, b) vdotq_s32(acc, a, b)
+#else
+static inline int32x4_t wsp_k_vdotq_s32(int32x4_t acc, int8x16_t a, int8x16_t b) {
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (a), vget_low_s8 (b));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(a), vget_high_s8(b));
+    return vaddq_s32(acc, vaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)));
+}
+#endif
+
+// acc += s0*dot(q0, y[0..16)) + s1*dot(q1, y[16..32))
+static inline int32x4_t mul_add_q8(int32x4_t acc, uint8x16_t q0, uint8x16_t q1, const int8_t * restrict y, int32_t s0, int32_t s1) {
+    const int32x4_t p0 = wsp_k_vdotq_s32(vdupq_n_s32(0), vreinterpretq_s8_u8(q0), vld1q_s8(y));
+    const int32x4_t p1 = wsp_k_vdotq_s32(vdupq_n_s32(0), vreinterpretq_s8_u8(q1), vld1q_s8(y + 16));
+    return vmlaq_n_s32(vmlaq_n_s32(acc, p0, s0), p1, s1);
+}
+
+#elif defined(__AVX2__)
+
+static inline int hsum_i32_8(const __m256i a) {
+    const __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    const __m128i hi64   = _mm_unpackhi_epi64(sum128, sum128);
+    const __m128i sum64  = _mm_add_epi32(hi64, sum128);
+    const __m128i hi32   = _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_cvtsi128_si32(_mm_add_epi32(sum64, hi32));
+}
+
+// acc += s0*dot(q[0..16), y[0..16)) + s1*dot(q[16..32), y[16..32))
+// q must be in [0, 63]: the pairs of products fit in int16
+static inline __m256i mul_add_q8(__m256i acc, __m256i q, const int8_t * restrict y, int16_t s0, int16_t s1) {
+    const __m256i p16 = _mm256_maddubs_epi16(q, _mm256_loadu_si256((const __m256i *) y));
+    const __m256i sc  = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi16(s0)), _mm_set1_epi16(s1), 1);
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(p16, sc));
+}
+
+#else
+
+// s0*dot(q[0..16), y[0..16)) + s1*dot(q[16..32), y[16..32))
+static inline int32_t mul_add_q8(const uint8_t * restrict q, const int8_t * restrict y, int32_t s0, int32_t s1) {
+    int32_t sum0 = 0;
+    int32_t sum1 = 0;
+    for (int l = 0; l < 16; ++l) {
+        sum0 += q[l]*y[l];
+        sum1 += q[l + 16]*y[l + 16];
+    }
+    return s0*sum0 + s1*sum1;
+}
+
+#endif
+
+void wsp_ggml_vec_dot_q2_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    const block_q2_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+        const uint8_t * restrict sc = x[i].scales;
+        const uint8_t * restrict q2 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+        int32_t summs = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            summs += y[i].bsums[j] * (sc[j] >> 4);
+        }
+
+#if defined(WSP_K_QUANTS_NEON)
+        const uint8x16_t m3 = vdupq_n_u8(3);
+
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const uint8x16_t b0 = vld1q_u8(q2);
+            const uint8x16_t b1 = vld1q_u8(q2 + 16);
+
+            acc = mul_add_q8(acc, vandq_u8(b0, m3),                 vandq_u8(b1, m3),                 q8 +  0, sc[0] & 0xF, sc[1] & 0xF);
+            acc = mul_add_q8(acc, vandq_u8(vshrq_n_u8(b0, 2), m3), vandq_u8(vshrq_n_u8(b1, 2), m3), q8 + 32, sc[2] & 0xF, sc[3] & 0xF);
+            acc = mul_add_q8(acc, vandq_u8(vshrq_n_u8(b0, 4), m3), vandq_u8(vshrq_n_u8(b1, 4), m3), q8 + 64, sc[4] & 0xF, sc[5] & 0xF);
+            acc = mul_add_q8(acc, vshrq_n_u8(b0, 6),                vshrq_n_u8(b1, 6),                q8 + 96, sc[6] & 0xF, sc[7] & 0xF);
+
+            q2 += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+        const __m256i m3 = _mm256_set1_epi8(3);
+
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *) q2);
+
+            acc = mul_add_q8(acc, _mm256_and_si256(b, m3),                        q8 +  0, sc[0] & 0xF, sc[1] & 0xF);
+            acc = mul_add_q8(acc, _mm256_and_si256(_mm256_srli_epi16(b, 2), m3), q8 + 32, sc[2] & 0xF, sc[3] & 0xF);
+            acc = mul_add_q8(acc, _mm256_and_si256(_mm256_srli_epi16(b, 4), m3), q8 + 64, sc[4] & 0xF, sc[5] & 0xF);
+            acc = mul_add_q8(acc, _mm256_and_si256(_mm256_srli_epi16(b, 6), m3), q8 + 96, sc[6] & 0xF, sc[7] & 0xF);
+
+            q2 += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = hsum_i32_8(acc);
+#else
+        uint8_t aux[32];
+
+        int32_t isum = 0;
+        for (int j = 0; j < QK_K/128; ++j) {
+            for (int shift = 0; shift < 8; shift += 2) {
+                for (int l = 0; l < 32; ++l) {
+                    aux[l] = (q2[l] >> shift) & 3;
+                }
+                isum += mul_add_q8(aux, q8, sc[0] & 0xF, sc[1] & 0xF);
+                q8 += 32;
+                sc += 2;
+            }
+            q2 += 32;
+        }
+#endif
+
+        const float dall = y[i].d * wsp_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = y[i].d * wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        sumf += dall*isum - dmin*summs;
+    }
+
+    *s = sumf;
+}
+
+void wsp_ggml_vec_dot_q3_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    const block_q3_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    int8_t scales[QK_K/16];
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_q3_K(x[i].scales, scales);
+
+        // the quants are unpacked to [0, 7], the offset of -4 is applied with the bsums
+        int32_t summs = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            summs += y[i].bsums[j] * scales[j];
+        }
+
+        const int8_t  * restrict sc = scales;
+        const uint8_t * restrict q3 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+#if defined(WSP_K_QUANTS_NEON)
+        const uint8x16_t m3 = vdupq_n_u8(3);
+        const uint8x16_t m1 = vdupq_n_u8(1);
+
+        uint8x16_t h0 = vld1q_u8(x[i].hmask);
+        uint8x16_t h1 = vld1q_u8(x[i].hmask + 16);
+
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const uint8x16_t b0 = vld1q_u8(q3);
+            const uint8x16_t b1 = vld1q_u8(q3 + 16);
+
+#define Q3_K_GROUP(shift, k)                                                                              \
+            acc = mul_add_q8(acc,                                                                         \
+                    vorrq_u8(vandq_u8(vshrq_n_u8(b0, shift), m3), vshlq_n_u8(vandq_u8(h0, m1), 2)),       \
+                    vorrq_u8(vandq_u8(vshrq_n_u8(b1, shift), m3), vshlq_n_u8(vandq_u8(h1, m1), 2)),       \
+                    q8 + 32*k, sc[2*k], sc[2*k + 1]);                                                     \
+            h0 = vshrq_n_u8(h0, 1);                                                                       \
+            h1 = vshrq_n_u8(h1, 1);
+
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vandq_u8(b0, m3), vshlq_n_u8(vandq_u8(h0, m1), 2)),
+                    vorrq_u8(vandq_u8(b1, m3), vshlq_n_u8(vandq_u8(h1, m1), 2)),
+                    q8, sc[0], sc[1]);
+            h0 = vshrq_n_u8(h0, 1);
+            h1 = vshrq_n_u8(h1, 1);
+
+            Q3_K_GROUP(2, 1)
+            Q3_K_GROUP(4, 2)
+            Q3_K_GROUP(6, 3)
+
+#undef Q3_K_GROUP
+
+            q3 += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+        const __m256i m3 = _mm256_set1_epi8(3);
+        const __m256i m1 = _mm256_set1_epi8(1);
+
+        __m256i hm = _mm256_loadu_si256((const __m256i *) x[i].hmask);
+
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *) q3);
+
+            __m256i q;
+
+            q   = _mm256_or_si256(_mm256_and_si256(b, m3), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 2));
+            acc = mul_add_q8(acc, q, q8 + 0, sc[0], sc[1]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(b, 2), m3), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 2));
+            acc = mul_add_q8(acc, q, q8 + 32, sc[2], sc[3]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(b, 4), m3), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 2));
+            acc = mul_add_q8(acc, q, q8 + 64, sc[4], sc[5]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(b, 6), m3), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 2));
+            acc = mul_add_q8(acc, q, q8 + 96, sc[6], sc[7]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q3 += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = hsum_i32_8(acc);
+#else
+        uint8_t aux[32];
+
+        int32_t isum = 0;
+        int bit = 0;
+        for (int j = 0; j < QK_K/128; ++j) {
+            for (int shift = 0; shift < 8; shift += 2) {
+                for (int l = 0; l < 32; ++l) {
+                    aux[l] = ((q3[l] >> shift) & 3) | (((x[i].hmask[l] >> bit) & 1) << 2);
+                }
+                isum += mul_add_q8(aux, q8, sc[0], sc[1]);
+                q8 += 32;
+                sc += 2;
+                bit++;
+            }
+            q3 += 32;
+        }
+#endif
+
+        const float d = y[i].d * wsp_ggml_fp16_to_fp32(x[i].d);
+
+        sumf += d*(isum - 4*summs);
+    }
+
+    *s = sumf;
+}
+
+void wsp_ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    uint8_t sc[QK_K/32];
+    uint8_t m[QK_K/32];
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+        int32_t summs = 0;
+        for (int j = 0; j < QK_K/32; ++j) {
+            get_scale_min_k4(j, x[i].scales, &sc[j], &m[j]);
+            summs += (y[i].bsums[2*j] + y[i].bsums[2*j + 1]) * m[j];
+        }
+
+        const uint8_t * restrict q4 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+#if defined(WSP_K_QUANTS_NEON)
+        const uint8x16_t m4 = vdupq_n_u8(0xF);
+
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const uint8x16_t b0 = vld1q_u8(q4);
+            const uint8x16_t b1 = vld1q_u8(q4 + 16);
+
+            acc = mul_add_q8(acc, vandq_u8(b0, m4),  vandq_u8(b1, m4),  q8,      sc[2*j + 0], sc[2*j + 0]);
+            acc = mul_add_q8(acc, vshrq_n_u8(b0, 4), vshrq_n_u8(b1, 4), q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+
+            q4 += 32;
+            q8 += 64;
+        }
+        const int32_t isum = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *) q4);
+
+            acc = mul_add_q8(acc, _mm256_and_si256(b, m4),                        q8,      sc[2*j + 0], sc[2*j + 0]);
+            acc = mul_add_q8(acc, _mm256_and_si256(_mm256_srli_epi16(b, 4), m4), q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+
+            q4 += 32;
+            q8 += 64;
+        }
+        const int32_t isum = hsum_i32_8(acc);
+#else
+        uint8_t aux[32];
+
+        int32_t isum = 0;
+        for (int j = 0; j < QK_K/64; ++j) {
+            for (int l = 0; l < 32; ++l) {
+                aux[l] = q4[l] & 0xF;
+            }
+            isum += mul_add_q8(aux, q8, sc[2*j + 0], sc[2*j + 0]);
+            for (int l = 0; l < 32; ++l) {
+                aux[l] = q4[l] >> 4;
+            }
+            isum += mul_add_q8(aux, q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+
+            q4 += 32;
+            q8 += 64;
+        }
+#endif
+
+        const float d    = y[i].d * wsp_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = y[i].d * wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        sumf += d*isum - dmin*summs;
+    }
+
+    *s = sumf;
+}
+
+void wsp_ggml_vec_dot_q5_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    uint8_t sc[QK_K/32];
+    uint8_t m[QK_K/32];
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+        int32_t summs = 0;
+        for (int j = 0; j < QK_K/32; ++j) {
+            get_scale_min_k4(j, x[i].scales, &sc[j], &m[j]);
+            summs += (y[i].bsums[2*j] + y[i].bsums[2*j + 1]) * m[j];
+        }
+
+        const uint8_t * restrict q5 = x[i].qs;
+        const int8_t  * restrict q8 = y[i].qs;
+
+#if defined(WSP_K_QUANTS_NEON)
+        const uint8x16_t m4 = vdupq_n_u8(0xF);
+        const uint8x16_t m1 = vdupq_n_u8(1);
+
+        uint8x16_t h0 = vld1q_u8(x[i].qh);
+        uint8x16_t h1 = vld1q_u8(x[i].qh + 16);
+
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const uint8x16_t b0 = vld1q_u8(q5);
+            const uint8x16_t b1 = vld1q_u8(q5 + 16);
+
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vandq_u8(b0, m4), vshlq_n_u8(vandq_u8(h0, m1), 4)),
+                    vorrq_u8(vandq_u8(b1, m4), vshlq_n_u8(vandq_u8(h1, m1), 4)),
+                    q8, sc[2*j + 0], sc[2*j + 0]);
+            h0 = vshrq_n_u8(h0, 1);
+            h1 = vshrq_n_u8(h1, 1);
+
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vshrq_n_u8(b0, 4), vshlq_n_u8(vandq_u8(h0, m1), 4)),
+                    vorrq_u8(vshrq_n_u8(b1, 4), vshlq_n_u8(vandq_u8(h1, m1), 4)),
+                    q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+            h0 = vshrq_n_u8(h0, 1);
+            h1 = vshrq_n_u8(h1, 1);
+
+            q5 += 32;
+            q8 += 64;
+        }
+        const int32_t isum = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        const __m256i m1 = _mm256_set1_epi8(1);
+
+        __m256i hm = _mm256_loadu_si256((const __m256i *) x[i].qh);
+
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *) q5);
+
+            __m256i q;
+
+            q   = _mm256_or_si256(_mm256_and_si256(b, m4), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 4));
+            acc = mul_add_q8(acc, q, q8, sc[2*j + 0], sc[2*j + 0]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(b, 4), m4), _mm256_slli_epi16(_mm256_and_si256(hm, m1), 4));
+            acc = mul_add_q8(acc, q, q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+            hm  = _mm256_srli_epi16(hm, 1);
+
+            q5 += 32;
+            q8 += 64;
+        }
+        const int32_t isum = hsum_i32_8(acc);
+#else
+        uint8_t aux[32];
+
+        int32_t isum = 0;
+        for (int j = 0; j < QK_K/64; ++j) {
+            for (int l = 0; l < 32; ++l) {
+                aux[l] = (q5[l] & 0xF) | (((x[i].qh[l] >> (2*j + 0)) & 1) << 4);
+            }
+            isum += mul_add_q8(aux, q8, sc[2*j + 0], sc[2*j + 0]);
+            for (int l = 0; l < 32; ++l) {
+                aux[l] = (q5[l] >> 4)  | (((x[i].qh[l] >> (2*j + 1)) & 1) << 4);
+            }
+            isum += mul_add_q8(aux, q8 + 32, sc[2*j + 1], sc[2*j + 1]);
+
+            q5 += 32;
+            q8 += 64;
+        }
+#endif
+
+        const float d    = y[i].d * wsp_ggml_fp16_to_fp32(x[i].d);
+        const float dmin = y[i].d * wsp_ggml_fp16_to_fp32(x[i].dmin);
+
+        sumf += d*isum - dmin*summs;
+    }
+
+    *s = sumf;
+}
+
+void wsp_ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    float sumf = 0;
+
+    for (int i = 0; i < nb; ++i) {
+        // the quants are unpacked to [0, 63], the offset of -32 is applied with the bsums
+        int32_t summs = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            summs += y[i].bsums[j] * x[i].scales[j];
+        }
+
+        const uint8_t * restrict ql = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+        const int8_t  * restrict sc = x[i].scales;
+        const int8_t  * restrict q8 = y[i].qs;
+
+#if defined(WSP_K_QUANTS_NEON)
+        const uint8x16_t m4 = vdupq_n_u8(0xF);
+        const uint8x16_t m3 = vdupq_n_u8(3);
+
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const uint8x16_t l0 = vld1q_u8(ql);
+            const uint8x16_t l1 = vld1q_u8(ql + 16);
+            const uint8x16_t l2 = vld1q_u8(ql + 32);
+            const uint8x16_t l3 = vld1q_u8(ql + 48);
+            const uint8x16_t h0 = vld1q_u8(qh);
+            const uint8x16_t h1 = vld1q_u8(qh + 16);
+
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vandq_u8(l0, m4), vshlq_n_u8(vandq_u8(h0, m3), 4)),
+                    vorrq_u8(vandq_u8(l1, m4), vshlq_n_u8(vandq_u8(h1, m3), 4)),
+                    q8 +  0, sc[0], sc[1]);
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vandq_u8(l2, m4), vshlq_n_u8(vandq_u8(vshrq_n_u8(h0, 2), m3), 4)),
+                    vorrq_u8(vandq_u8(l3, m4), vshlq_n_u8(vandq_u8(vshrq_n_u8(h1, 2), m3), 4)),
+                    q8 + 32, sc[2], sc[3]);
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vshrq_n_u8(l0, 4), vshlq_n_u8(vandq_u8(vshrq_n_u8(h0, 4), m3), 4)),
+                    vorrq_u8(vshrq_n_u8(l1, 4), vshlq_n_u8(vandq_u8(vshrq_n_u8(h1, 4), m3), 4)),
+                    q8 + 64, sc[4], sc[5]);
+            acc = mul_add_q8(acc,
+                    vorrq_u8(vshrq_n_u8(l2, 4), vshlq_n_u8(vshrq_n_u8(h0, 6), 4)),
+                    vorrq_u8(vshrq_n_u8(l3, 4), vshlq_n_u8(vshrq_n_u8(h1, 6), 4)),
+                    q8 + 96, sc[6], sc[7]);
+
+            ql += 64;
+            qh += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        const __m256i m3 = _mm256_set1_epi8(3);
+
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i l0 = _mm256_loadu_si256((const __m256i *) ql);
+            const __m256i l1 = _mm256_loadu_si256((const __m256i *) (ql + 32));
+            const __m256i h  = _mm256_loadu_si256((const __m256i *) qh);
+
+            __m256i q;
+
+            q   = _mm256_or_si256(_mm256_and_si256(l0, m4), _mm256_slli_epi16(_mm256_and_si256(h, m3), 4));
+            acc = mul_add_q8(acc, q, q8 + 0, sc[0], sc[1]);
+
+            q   = _mm256_or_si256(_mm256_and_si256(l1, m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 2), m3), 4));
+            acc = mul_add_q8(acc, q, q8 + 32, sc[2], sc[3]);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l0, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 4), m3), 4));
+            acc = mul_add_q8(acc, q, q8 + 64, sc[4], sc[5]);
+
+            q   = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l1, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 6), m3), 4));
+            acc = mul_add_q8(acc, q, q8 + 96, sc[6], sc[7]);
+
+            ql += 64;
+            qh += 32;
+            q8 += 128;
+            sc += 8;
+        }
+        const int32_t isum = hsum_i32_8(acc);
+#else
+        uint8_t aux[32];
+
+        int32_t isum = 0;
+        for (int j = 0; j < QK_K/128; ++j) {
+            for (int k = 0; k < 4; ++k) {
+                const uint8_t * restrict lo = ql + 32*(k % 2);
+                const int shift = 4*(k / 2);
+                for (int l = 0; l < 32; ++l) {
+                    aux[l] = ((lo[l] >> shift) & 0xF) | (((qh[l] >> (2*k)) & 3) << 4);
+                }
+                isum += mul_add_q8(aux, q8, sc[0], sc[1]);
+                q8 += 32;
+                sc += 2;
+            }
+            ql += 64;
+            qh += 32;
+        }
+#endif
+
+        const float d = y[i].d * wsp_ggml_fp16_to_fp32(x[i].d);
+
+        sumf += d*(isum - 32*summs);
+    }
+
+    *s = sumf;
+}
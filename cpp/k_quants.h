@@ -0,0 +1,127 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <stdint.h>
+#include <assert.h>
+#include <stddef.h>
+
+//
+// k-quants
+//
+// The weights are quantized in super-blocks of QK_K values. Each super-block is made of smaller blocks of 16 or 32
+// values with their own scale (and min), and the scales themselves are quantized with a single fp16 scale per
+// super-block. The matrix multiplications use the Q8_K type for the activations.
+//
+// The rows must have a multiple of QK_K elements.
+//
+
+// super-block size
+#define QK_K 256
+
+// size of the packed 6-bit scales and mins of Q4_K / Q5_K
+#define K_SCALE_SIZE 12
+
+// 2-bit quantization
+// 16 blocks of 16 values: x = d*sc*q - dmin*m, with 4-bit scales and mins
+// 2.5625 bits per weight
+typedef struct {
+    uint8_t scales[QK_K/16]; // scales (low 4 bits) and mins (high 4 bits)
+    uint8_t qs[QK_K/4];      // quants
+    wsp_ggml_fp16_t d;       // super-block scale of the scales
+    wsp_ggml_fp16_t dmin;    // super-block scale of the mins
+} block_q2_K;
+static_assert(sizeof(block_q2_K) == 2*sizeof(wsp_ggml_fp16_t) + QK_K/16 + QK_K/4, "wrong q2_K block size/padding");
+
+// 3-bit quantization
+// 16 blocks of 16 values: x = d*sc*(q - 4), with 6-bit signed scales
+// 3.4375 bits per weight
+typedef struct {
+    uint8_t hmask[QK_K/8]; // quants - high bit
+    uint8_t qs[QK_K/4];    // quants - low 2 bits
+    uint8_t scales[12];    // scales, 6 bits each
+    wsp_ggml_fp16_t d;     // super-block scale
+} block_q3_K;
+static_assert(sizeof(block_q3_K) == sizeof(wsp_ggml_fp16_t) + QK_K/4 + QK_K/8 + 12, "wrong q3_K block size/padding");
+
+// 4-bit quantization
+// 8 blocks of 32 values: x = d*sc*q - dmin*m, with 6-bit scales and mins
+// 4.5 bits per weight
+typedef struct {
+    wsp_ggml_fp16_t d;            // super-block scale of the scales
+    wsp_ggml_fp16_t dmin;         // super-block scale of the mins
+    uint8_t scales[K_SCALE_SIZE]; // scales and mins, 6 bits each
+    uint8_t qs[QK_K/2];           // 4-bit quants
+} block_q4_K;
+static_assert(sizeof(block_q4_K) == 2*sizeof(wsp_ggml_fp16_t) + K_SCALE_SIZE + QK_K/2, "wrong q4_K block size/padding");
+
+// 5-bit quantization
+// 8 blocks of 32 values: x = d*sc*q - dmin*m, with 6-bit scales and mins
+// 5.5 bits per weight
+typedef struct {
+    wsp_ggml_fp16_t d;            // super-block scale of the scales
+    wsp_ggml_fp16_t dmin;         // super-block scale of the mins
+    uint8_t scales[K_SCALE_SIZE]; // scales and mins, 6 bits each
+    uint8_t qh[QK_K/8];           // quants - high bit
+    uint8_t qs[QK_K/2];           // quants - low 4 bits
+} block_q5_K;
+static_assert(sizeof(block_q5_K) == 2*sizeof(wsp_ggml_fp16_t) + K_SCALE_SIZE + QK_K/2 + QK_K/8, "wrong q5_K block size/padding");
+
+// 6-bit quantization
+// 16 blocks of 16 values: x = d*sc*(q - 32), with 8-bit signed scales
+// 6.5625 bits per weight
+typedef struct {
+    uint8_t ql[QK_K/2];      // quants - low 4 bits
+    uint8_t qh[QK_K/4];      // quants - high 2 bits
+    int8_t  scales[QK_K/16]; // scales
+    wsp_ggml_fp16_t d;       // super-block scale
+} block_q6_K;
+static_assert(sizeof(block_q6_K) == sizeof(wsp_ggml_fp16_t) + QK_K/16 + 3*QK_K/4, "wrong q6_K block size/padding");
+
+// 8-bit quantization of the activations, used for the dot products
+// bsums are the sums of the quants of each block of 16 values - they apply the mins and the offsets of the weights
+typedef struct {
+    float   d;              // delta
+    int8_t  qs[QK_K];       // quants
+    int16_t bsums[QK_K/16]; // sums of the quants in groups of 16
+} block_q8_K;
+static_assert(sizeof(block_q8_K) == sizeof(float) + QK_K + QK_K/16*sizeof(int16_t), "wrong q8_K block size/padding");
+
+// quantization
+void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k);
+void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k);
+void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict y, int k);
+void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k);
+void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict y, int k);
+void quantize_row_q8_K_reference(const float * restrict x, block_q8_K * restrict y, int k);
+
+void quantize_row_q2_K(const float * restrict x, void * restrict y, int k);
+void quantize_row_q3_K(const float * restrict x, void * restrict y, int k);
+void quantize_row_q4_K(const float * restrict x, void * restrict y, int k);
+void quantize_row_q5_K(const float * restrict x, void * restrict y, int k);
+void quantize_row_q6_K(const float * restrict x, void * restrict y, int k);
+void quantize_row_q8_K(const float * restrict x, void * restrict y, int k);
+
+// dequantization
+void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int k);
+void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int k);
+void dequantize_row_q4_K(const block_q4_K * restrict x, float * restrict y, int k);
+void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int k);
+void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k);
+void dequantize_row_q8_K(const block_q8_K * restrict x, float * restrict y, int k);
+
+// dot products with a row quantized with quantize_row_q8_K
+void wsp_ggml_vec_dot_q2_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void wsp_ggml_vec_dot_q3_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void wsp_ggml_vec_dot_q4_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void wsp_ggml_vec_dot_q5_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void wsp_ggml_vec_dot_q6_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+// quantize n values in rows of k values
+// hist gets the distribution of the quants, in 16 bins over the range of the type
+// returns the size of the quantized data in bytes
+size_t wsp_ggml_quantize_q2_K(const float * src, void * dst, int n, int k, int64_t * hist);
+size_t wsp_ggml_quantize_q3_K(const float * src, void * dst, int n, int k, int64_t * hist);
+size_t wsp_ggml_quantize_q4_K(const float * src, void * dst, int n, int k, int64_t * hist);
+size_t wsp_ggml_quantize_q5_K(const float * src, void * dst, int n, int k, int64_t * hist);
+size_t wsp_ggml_quantize_q6_K(const float * src, void * dst, int n, int k, int64_t * hist);
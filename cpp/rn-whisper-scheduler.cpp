@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "whisper.h"
+#include "rn-whisper.h"
+#include "rn-whisper-scheduler.h"
+
+struct rn_whisper_job {
+  int job_id;
+  int priority;
+  long long seq;
+
+  whisper_full_params params;
+  std::vector<float> samples;
+
+  // copies of the strings and the prompt of the params
+  std::string language;
+  std::string initial_prompt;
+  std::vector<whisper_token> prompt_tokens;
+
+  rn_whisper_abort_token * token;
+
+  rn_whisper_job_callback callback;
+  void * user_data;
+};
+
+struct rn_whisper_worker {
+  whisper_state * state = nullptr;
+  bool busy = false;
+  std::thread thread;
+};
+
+struct rn_whisper_scheduler {
+  whisper_context * ctx;
+  int n_threads;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop = false;
+
+  long long n_submitted = 0;
+  std::vector<rn_whisper_job> pending;
+  std::vector<rn_whisper_worker> workers;
+};
+
+static void rn_whisper_job_end(rn_whisper_job & job, int code, whisper_state * state) {
+  if (job.callback != nullptr) {
+    job.callback(job.job_id, code, state, job.user_data);
+  }
+  rn_whisper_remove_abort_token(job.job_id);
+}
+
+// split the threads evenly between the running jobs - called with the mutex held
+static void rn_whisper_scheduler_rebalance(rn_whisper_scheduler * scheduler) {
+  int n_running = 0;
+  for (auto & worker : scheduler->workers) {
+    n_running += worker.busy;
+  }
+  if (n_running == 0) {
+    return;
+  }
+
+  int i = 0;
+  for (auto & worker : scheduler->workers) {
+    if (!worker.busy) {
+      continue;
+    }
+    const int n = scheduler->n_threads/n_running + (i < scheduler->n_threads%n_running);
+    whisper_state_set_n_threads_max(worker.state, std::max(1, n));
+    ++i;
+  }
+}
+
+static void rn_whisper_scheduler_run(rn_whisper_scheduler * scheduler, rn_whisper_worker * worker) {
+  while (true) {
+    rn_whisper_job job;
+    {
+      std::unique_lock<std::mutex> lock(scheduler->mutex);
+      scheduler->cv.wait(lock, [&]() { return scheduler->stop || !scheduler->pending.empty(); });
+      if (scheduler->stop) {
+        return;
+      }
+
+      // highest priority, then oldest
+      auto best = scheduler->pending.begin();
+      for (auto it = scheduler->pending.begin(); it != scheduler->pending.end(); ++it) {
+        if (it->priority > best->priority || (it->priority == best->priority && it->seq < best->seq)) {
+          best = it;
+        }
+      }
+      job = std::move(*best);
+      scheduler->pending.erase(best);
+
+      if (rn_whisper_abort_token_is_set(job.token)) {
+        lock.unlock();
+        rn_whisper_job_end(job, 0, nullptr);
+        continue;
+      }
+
+      worker->busy = true;
+      rn_whisper_scheduler_rebalance(scheduler);
+    }
+
+    job.params.language       = job.language.empty() ? nullptr : job.language.c_str();
+    job.params.initial_prompt = job.initial_prompt.empty() ? nullptr : job.initial_prompt.c_str();
+    job.params.prompt_tokens  = job.prompt_tokens.empty() ? nullptr : job.prompt_tokens.data();
+
+    const int code = whisper_full_with_state(scheduler->ctx, worker->state, job.params, job.samples.data(), job.samples.size());
+    rn_whisper_job_end(job, code, worker->state);
+
+    {
+      std::lock_guard<std::mutex> lock(scheduler->mutex);
+      worker->busy = false;
+      rn_whisper_scheduler_rebalance(scheduler);
+    }
+  }
+}
+
+extern "C" {
+
+rn_whisper_scheduler * rn_whisper_scheduler_init(whisper_context * ctx, int n_states, int n_threads) {
+  rn_whisper_scheduler * scheduler = new rn_whisper_scheduler;
+  scheduler->ctx = ctx;
+  scheduler->n_threads = std::max(1, n_threads);
+
+  scheduler->workers.resize(std::max(1, n_states));
+  for (auto & worker : scheduler->workers) {
+    worker.state = whisper_init_state(ctx);
+    if (worker.state == nullptr) {
+      rn_whisper_scheduler_free(scheduler);
+      return nullptr;
+    }
+  }
+  for (auto & worker : scheduler->workers) {
+    worker.thread = std::thread(rn_whisper_scheduler_run, scheduler, &worker);
+  }
+  return scheduler;
+}
+
+void rn_whisper_scheduler_free(rn_whisper_scheduler * scheduler) {
+  if (scheduler == nullptr) {
+    return;
+  }
+
+  std::vector<rn_whisper_job> pending;
+  {
+    std::lock_guard<std::mutex> lock(scheduler->mutex);
+    scheduler->stop = true;
+    pending.swap(scheduler->pending);
+  }
+  scheduler->cv.notify_all();
+
+  for (auto & job : pending) {
+    rn_whisper_job_end(job, 0, nullptr);
+  }
+  for (auto & worker : scheduler->workers) {
+    if (worker.thread.joinable()) {
+      worker.thread.join();
+    }
+    whisper_free_state(worker.state);
+  }
+  delete scheduler;
+}
+
+int rn_whisper_scheduler_submit(
+  rn_whisper_scheduler * scheduler,
+  int job_id,
+  int priority,
+  whisper_full_params params,
+  const float * samples,
+  int n_samples,
+  rn_whisper_job_callback callback,
+  void * user_data
+) {
+  rn_whisper_job job;
+  job.job_id = job_id;
+  job.priority = priority;
+  job.samples.assign(samples, samples + n_samples);
+  job.language = params.language != nullptr ? params.language : "";
+  job.initial_prompt = params.initial_prompt != nullptr ? params.initial_prompt : "";
+  if (params.prompt_tokens != nullptr) {
+    job.prompt_tokens.assign(params.prompt_tokens, params.prompt_tokens + params.prompt_n_tokens);
+  }
+  job.callback = callback;
+  job.user_data = user_data;
+
+  job.token = rn_whisper_assign_abort_token(job_id);
+  if (job.token == nullptr) {
+    return -1;
+  }
+
+  // all the budget is requested, the state limit gives the job its share
+  // the window encoded ahead would run outside of the budget
+  job.params = params;
+  job.params.n_threads = scheduler->n_threads;
+  job.params.n_threads_ahead = 0;
+  rn_whisper_set_abort_callbacks(&job.params, job.token);
+
+  {
+    std::lock_guard<std::mutex> lock(scheduler->mutex);
+    if (scheduler->stop) {
+      rn_whisper_remove_abort_token(job_id);
+      return -1;
+    }
+    job.seq = scheduler->n_submitted++;
+    scheduler->pending.push_back(std::move(job));
+  }
+  scheduler->cv.notify_one();
+  return 0;
+}
+
+int rn_whisper_scheduler_n_pending(rn_whisper_scheduler * scheduler) {
+  std::lock_guard<std::mutex> lock(scheduler->mutex);
+  return scheduler->pending.size();
+}
+
+}
@@ -0,0 +1,41 @@
+#ifdef __cplusplus
+#include <whisper.h>
+extern "C" {
+#endif
+
+// runs the transcribe jobs of one context on a pool of states
+// the running jobs share a fixed number of threads, rebalanced each time a job starts or ends
+struct rn_whisper_scheduler;
+
+// called on the thread of the job when it ends
+// the segments are read from state with the whisper_full_*_from_state() functions, during the call only
+// state is NULL when the job was aborted before it started, code is the result of whisper_full_with_state() otherwise
+typedef void (*rn_whisper_job_callback)(int job_id, int code, struct whisper_state * state, void * user_data);
+
+// up to n_states jobs run at once, with n_threads threads in total
+struct rn_whisper_scheduler * rn_whisper_scheduler_init(struct whisper_context * ctx, int n_states, int n_threads);
+
+// the pending jobs are ended with a NULL state, the running ones are waited for
+void rn_whisper_scheduler_free(struct rn_whisper_scheduler * scheduler);
+
+// queue a job: the jobs of higher priority start first, the ones of the same priority in the order of submission
+// the samples, the language, the initial prompt and the prompt tokens are copied
+// the threads of the params are set by the scheduler, and the job is aborted with rn_whisper_abort_transcribe(job_id)
+// returns 0 on success
+int rn_whisper_scheduler_submit(
+    struct rn_whisper_scheduler * scheduler,
+    int job_id,
+    int priority,
+    struct whisper_full_params params,
+    const float * samples,
+    int n_samples,
+    rn_whisper_job_callback callback,
+    void * user_data
+);
+
+// number of jobs waiting for a state
+int rn_whisper_scheduler_n_pending(struct rn_whisper_scheduler * scheduler);
+
+#ifdef __cplusplus
+}
+#endif
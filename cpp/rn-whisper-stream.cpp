@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+#include "whisper.h"
+#include "rn-whisper-stream.h"
+
+// a text token of a hypothesis, and the segment it belongs to
+struct rn_whisper_stream_token {
+  whisper_token id;
+  int i_segment;
+};
+
+struct rn_whisper_stream {
+  whisper_context * ctx;
+  whisper_state * state;
+
+  whisper_full_params params;
+  int max_samples;
+
+  // copies of the strings of the params
+  std::string language;
+  std::vector<whisper_token> initial_tokens;
+
+  std::mutex mutex;
+  std::vector<float> incoming; // pushed since the last poll
+
+  std::vector<float> audio; // not dropped yet, starts after the n_dropped first samples
+  int64_t n_dropped = 0;
+
+  // committed tokens of the audio that is still decoded, they lead the next hypothesis
+  std::vector<whisper_token> committed_pending;
+  // committed tokens of the dropped audio, the prompt of the next polls
+  std::vector<whisper_token> committed_past;
+
+  // tokens of the last hypothesis that are not committed
+  std::vector<rn_whisper_stream_token> tentative;
+
+  std::string committed_text;
+  std::string tentative_text;
+};
+
+// how the start of a hypothesis repeats the committed tokens of the audio decoded again
+struct rn_whisper_stream_alignment {
+  int n_skip;       // tokens of the hypothesis that repeat committed tokens
+  bool end_aligned; // hyp[0, n_skip) ends where the committed tokens end, it starts where they start otherwise
+  bool aligned;     // false when the committed tokens were not found: only the ones repeated in order are skipped
+};
+
+// the hypothesis normally starts with the committed tokens, otherwise it is aligned on the last tokens that were
+// committed: at least 2 tokens so that a common one does not match by chance, near where they would be with no change
+static rn_whisper_stream_alignment rn_whisper_stream_align(const std::vector<whisper_token> & pending, const std::vector<rn_whisper_stream_token> & hyp) {
+  const int n_pending = pending.size();
+  const int n_hyp = hyp.size();
+  const int n_shift_max = 4;
+
+  int n_match = 0;
+  while (n_match < n_pending && n_match < n_hyp && hyp[n_match].id == pending[n_match]) {
+    ++n_match;
+  }
+  if (n_match == n_pending || n_match == n_hyp) {
+    return { n_match, false, true };
+  }
+
+  for (int k = std::min(n_pending, 4); k >= 2; --k) {
+    int best = -1;
+    for (int j = std::max(k, n_pending - n_shift_max); j <= std::min(n_hyp, n_pending + n_shift_max); ++j) {
+      bool match = true;
+      for (int i = 0; i < k && match; ++i) {
+        match = hyp[j - k + i].id == pending[n_pending - k + i];
+      }
+      if (match && (best < 0 || std::abs(j - n_pending) < std::abs(best - n_pending))) {
+        best = j;
+      }
+    }
+    if (best >= 0) {
+      return { best, true, true };
+    }
+  }
+
+  return { n_match, false, false };
+}
+
+extern "C" {
+
+rn_whisper_stream * rn_whisper_stream_init(whisper_context * ctx, whisper_full_params params, int max_audio_ms) {
+  whisper_state * state = whisper_init_state(ctx);
+  if (state == nullptr) {
+    return nullptr;
+  }
+
+  rn_whisper_stream * stream = new rn_whisper_stream;
+  stream->ctx = ctx;
+  stream->state = state;
+  stream->max_samples = std::max(1000, max_audio_ms)*(WHISPER_SAMPLE_RATE/1000);
+
+  stream->language = params.language != nullptr ? params.language : "";
+  if (params.prompt_tokens != nullptr) {
+    stream->initial_tokens.assign(params.prompt_tokens, params.prompt_tokens + params.prompt_n_tokens);
+  } else if (params.initial_prompt != nullptr) {
+    stream->initial_tokens.resize(1024);
+    const int n = whisper_tokenize(ctx, params.initial_prompt, stream->initial_tokens.data(), stream->initial_tokens.size());
+    stream->initial_tokens.resize(std::max(0, n));
+  }
+
+  // the prompt is given by the stream, one call per poll
+  stream->params = params;
+  stream->params.no_context = true;
+  stream->params.single_segment = false;
+  stream->params.offset_ms = 0;
+  stream->params.duration_ms = 0;
+  stream->params.initial_prompt = nullptr;
+  stream->params.print_progress = false;
+  stream->params.print_realtime = false;
+  stream->params.new_segment_callback = nullptr;
+  stream->params.new_segment_callback_user_data = nullptr;
+  stream->params.progress_callback = nullptr;
+  stream->params.progress_callback_user_data = nullptr;
+  return stream;
+}
+
+void rn_whisper_stream_free(rn_whisper_stream * stream) {
+  if (stream == nullptr) {
+    return;
+  }
+  whisper_free_state(stream->state);
+  delete stream;
+}
+
+void rn_whisper_stream_push(rn_whisper_stream * stream, const float * samples, int n_samples) {
+  std::lock_guard<std::mutex> lock(stream->mutex);
+  stream->incoming.insert(stream->incoming.end(), samples, samples + n_samples);
+}
+
+int rn_whisper_stream_poll(rn_whisper_stream * stream, bool flush) {
+  whisper_context * ctx = stream->ctx;
+  whisper_state * state = stream->state;
+
+  {
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    if (stream->incoming.empty() && !flush) {
+      return 0;
+    }
+    stream->audio.insert(stream->audio.end(), stream->incoming.begin(), stream->incoming.end());
+    stream->incoming.clear();
+  }
+
+  // whisper_full() does not decode less than 1 s
+  if (stream->audio.size() < WHISPER_SAMPLE_RATE + WHISPER_SAMPLE_RATE/100) {
+    return 0;
+  }
+
+  // the prompt is the text of the dropped audio, the committed text of the audio decoded again is in the hypothesis
+  std::vector<whisper_token> prompt(stream->initial_tokens);
+  prompt.insert(prompt.end(), stream->committed_past.begin(), stream->committed_past.end());
+  const int n_prompt_max = whisper_n_text_ctx(ctx)/2;
+  if ((int) prompt.size() > n_prompt_max) {
+    prompt.erase(prompt.begin(), prompt.end() - n_prompt_max);
+  }
+
+  whisper_full_params params = stream->params;
+  params.language = stream->language.empty() ? nullptr : stream->language.c_str();
+  params.prompt_tokens = prompt.empty() ? nullptr : prompt.data();
+  params.prompt_n_tokens = prompt.size();
+
+  const int code = whisper_full_with_state(ctx, state, params, stream->audio.data(), stream->audio.size());
+  if (code != 0) {
+    return code;
+  }
+
+  // keep the detected language, the next polls do not detect it again
+  if (stream->language.empty() || stream->language == "auto") {
+    stream->language = whisper_lang_str(whisper_full_lang_id_from_state(state));
+  }
+
+  const whisper_token token_eot = whisper_token_eot(ctx);
+  const int n_segments = whisper_full_n_segments_from_state(state);
+
+  std::vector<rn_whisper_stream_token> hyp;
+  for (int i = 0; i < n_segments; ++i) {
+    const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+    for (int j = 0; j < n_tokens; ++j) {
+      const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+      if (id < token_eot) {
+        hyp.push_back({ id, i });
+      }
+    }
+  }
+
+  // the committed tokens of the audio decoded again lead the hypothesis, they are not committed twice
+  // when the hypothesis cannot be aligned on them, only the ones it repeats in order are skipped: the tokens after
+  // them are not compared with the last hypothesis and nothing is committed by agreement in this poll, and their
+  // audio is kept - at worst, committing all repeats text, it never loses it
+  const int n_pending = stream->committed_pending.size();
+
+  const rn_whisper_stream_alignment alignment = rn_whisper_stream_align(stream->committed_pending, hyp);
+  const int n_skip = alignment.n_skip;
+  if (!alignment.aligned) {
+    stream->tentative.clear();
+  }
+
+  // commit the tokens that the last hypothesis agrees with
+  // the audio is committed in full when too much of it is waiting
+  const bool commit_all = flush || (int) stream->audio.size() > stream->max_samples;
+
+  int n_commit = 0;
+  if (commit_all) {
+    n_commit = hyp.size() - n_skip;
+  } else {
+    const int n_max = std::min(hyp.size() - n_skip, stream->tentative.size());
+    while (n_commit < n_max && hyp[n_skip + n_commit].id == stream->tentative[n_commit].id) {
+      ++n_commit;
+    }
+  }
+
+  for (int i = n_skip; i < n_skip + n_commit; ++i) {
+    stream->committed_pending.push_back(hyp[i].id);
+    stream->committed_text += whisper_token_to_str(ctx, hyp[i].id);
+  }
+
+  stream->tentative.assign(hyp.begin() + n_skip + n_commit, hyp.end());
+  stream->tentative_text.clear();
+  for (const auto & token : stream->tentative) {
+    stream->tentative_text += whisper_token_to_str(ctx, token.id);
+  }
+
+  // the next hypothesis is aligned on the committed tokens, not on where this one stopped matching them
+  if (!alignment.aligned) {
+    stream->tentative.clear();
+  }
+
+  // drop the audio up to the end of the last segment that is committed in full
+  // the last segment can still grow with the next audio, it is kept unless all is committed
+  const int n_committed = n_skip + n_commit;
+
+  const int i_open = n_committed < (int) hyp.size() ? hyp[n_committed].i_segment : n_segments;
+  const int i_drop = std::min(i_open, commit_all ? n_segments : n_segments - 1) - 1;
+
+  int64_t t_drop = 0;
+  if (i_drop >= 0) {
+    t_drop = whisper_full_get_segment_t1_from_state(state, i_drop);
+
+    int n_drop_hyp = 0;
+    while (n_drop_hyp < n_committed && hyp[n_drop_hyp].i_segment <= i_drop) {
+      ++n_drop_hyp;
+    }
+
+    // the tokens committed in this poll follow the n_pending ones committed before
+    int n_drop = 0;
+    if (n_drop_hyp >= n_skip) {
+      n_drop = n_pending + (n_drop_hyp - n_skip);
+    } else if (alignment.end_aligned) {
+      n_drop = std::max(0, n_pending - (n_skip - n_drop_hyp));
+    } else {
+      n_drop = n_drop_hyp;
+    }
+    n_drop = std::min(n_drop, (int) stream->committed_pending.size());
+
+    stream->committed_past.insert(stream->committed_past.end(), stream->committed_pending.begin(), stream->committed_pending.begin() + n_drop);
+    stream->committed_pending.erase(stream->committed_pending.begin(), stream->committed_pending.begin() + n_drop);
+  } else if (commit_all && n_segments == 0) {
+    // no speech: keep the last second, it can hold the start of a word
+    t_drop = (100*(int64_t) stream->audio.size())/WHISPER_SAMPLE_RATE - 100;
+  }
+
+  if ((i_drop >= 0 && i_drop == n_segments - 1) || (commit_all && n_segments == 0)) {
+    // the audio of all the committed tokens was dropped
+    stream->committed_past.insert(stream->committed_past.end(), stream->committed_pending.begin(), stream->committed_pending.end());
+    stream->committed_pending.clear();
+  }
+
+  // the end of the last segment can be past the end of the audio (up to the end of the window)
+  const int64_t n_samples_drop = std::min<int64_t>(stream->audio.size(), t_drop*WHISPER_SAMPLE_RATE/100);
+  if (n_samples_drop > 0) {
+    stream->audio.erase(stream->audio.begin(), stream->audio.begin() + n_samples_drop);
+    stream->n_dropped += n_samples_drop;
+  }
+
+  // keep the prompt bounded, only its end is used
+  if ((int) stream->committed_past.size() > 2*n_prompt_max) {
+    stream->committed_past.erase(stream->committed_past.begin(), stream->committed_past.end() - n_prompt_max);
+  }
+
+  return 0;
+}
+
+const char * rn_whisper_stream_committed_text(rn_whisper_stream * stream) {
+  return stream->committed_text.c_str();
+}
+
+const char * rn_whisper_stream_tentative_text(rn_whisper_stream * stream) {
+  return stream->tentative_text.c_str();
+}
+
+int64_t rn_whisper_stream_committed_ms(rn_whisper_stream * stream) {
+  return (1000*stream->n_dropped)/WHISPER_SAMPLE_RATE;
+}
+
+int rn_whisper_bench_stream(whisper_context * ctx, const float * samples, int n_samples, int step_ms, int n_threads) {
+  fputs(rn_whisper_bench_stream_str(ctx, samples, n_samples, step_ms, n_threads), stderr);
+  return 0;
+}
+
+const char * rn_whisper_bench_stream_str(whisper_context * ctx, const float * samples, int n_samples, int step_ms, int n_threads) {
+  static std::string s;
+  s = "";
+  char strbuf[256];
+
+  whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+  params.n_threads = n_threads;
+  params.print_timestamps = false;
+  params.language = "en";
+
+  rn_whisper_stream * stream = rn_whisper_stream_init(ctx, params, 20000);
+  if (stream == nullptr) {
+    s = "stream: rn_whisper_stream_init() failed\n";
+    return s.c_str();
+  }
+
+  const int n_step = std::max(1, step_ms)*(WHISPER_SAMPLE_RATE/1000);
+
+  int n_pushed = 0;
+  int n_polls = 0;
+  int n_shrink = 0;        // polls after which committed + tentative text is shorter than before
+  int n_lost_max = 0;      // most characters lost by a poll
+  int n_ahead = 0;         // polls after which the committed time is past the pushed audio
+  size_t n_text_last = 0;
+
+  while (n_pushed < n_samples) {
+    const int n = std::min(n_samples - n_pushed, n_step);
+    rn_whisper_stream_push(stream, samples + n_pushed, n);
+    n_pushed += n;
+
+    const bool flush = n_pushed == n_samples;
+    if (rn_whisper_stream_poll(stream, flush) != 0) {
+      s += "stream: rn_whisper_stream_poll() failed\n";
+      break;
+    }
+    n_polls++;
+
+    const size_t n_text = strlen(rn_whisper_stream_committed_text(stream)) + strlen(rn_whisper_stream_tentative_text(stream));
+    if (n_text < n_text_last) {
+      n_shrink++;
+      n_lost_max = std::max(n_lost_max, (int) (n_text_last - n_text));
+    }
+    n_text_last = n_text;
+
+    n_ahead += rn_whisper_stream_committed_ms(stream) > (1000*(int64_t) n_pushed)/WHISPER_SAMPLE_RATE;
+  }
+
+  snprintf(strbuf, sizeof(strbuf), "stream: %d polls of %d ms, text shrank after %d (at most %d chars), committed time ahead after %d\n",
+      n_polls, step_ms, n_shrink, n_lost_max, n_ahead);
+  s += strbuf;
+  s += "stream: ";
+  s += rn_whisper_stream_committed_text(stream);
+  s += "\n";
+
+  rn_whisper_stream_free(stream);
+
+  return s.c_str();
+}
+
+}
@@ -0,0 +1,41 @@
+#ifdef __cplusplus
+#include <whisper.h>
+extern "C" {
+#endif
+
+// transcribes audio as it arrives, on a state of its own
+// each poll decodes the audio that is kept: the text found by two polls in a row is committed, and the audio of
+// the segments that are committed in full is dropped, so the cost of a poll stays bounded
+// the audio of a segment that is committed in part is decoded again, its committed text is not repeated
+struct rn_whisper_stream;
+
+// the language and the initial prompt of the params are copied, the committed text is the prompt of the next polls
+// the audio is committed in full when more than max_audio_ms (~20000) is not committed
+struct rn_whisper_stream * rn_whisper_stream_init(struct whisper_context * ctx, struct whisper_full_params params, int max_audio_ms);
+void rn_whisper_stream_free(struct rn_whisper_stream * stream);
+
+// append 16 kHz mono samples, can be called from another thread than the polls
+void rn_whisper_stream_push(struct rn_whisper_stream * stream, const float * samples, int n_samples);
+
+// decode the audio that is not committed when audio was pushed since the last poll
+// with flush, all the text is committed - at the end of the audio
+// returns the result of whisper_full_with_state(), 0 when there was nothing to decode
+int rn_whisper_stream_poll(struct rn_whisper_stream * stream, bool flush);
+
+// text committed since the start of the stream, and text of the last poll that is not committed yet
+// valid until the next poll, read them on the thread of the polls
+const char * rn_whisper_stream_committed_text(struct rn_whisper_stream * stream);
+const char * rn_whisper_stream_tentative_text(struct rn_whisper_stream * stream);
+
+// time of the audio that was dropped, where the audio of the next poll starts, in ms
+int64_t rn_whisper_stream_committed_ms(struct rn_whisper_stream * stream);
+
+// push the samples in steps of step_ms and poll after each, flushing at the end
+// checks that the committed text plus the tentative text never shrinks, and that the committed time stays
+// within the pushed audio; the _str version returns the report and the committed text
+int          rn_whisper_bench_stream    (struct whisper_context * ctx, const float * samples, int n_samples, int step_ms, int n_threads);
+const char * rn_whisper_bench_stream_str(struct whisper_context * ctx, const float * samples, int n_samples, int step_ms, int n_threads);
+
+#ifdef __cplusplus
+}
+#endif
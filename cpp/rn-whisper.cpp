@@ -1,41 +1,110 @@
 #include <cstdio>
 #include <string>
 #include <vector>
-#include <unordered_map>
+#include <atomic>
+#include <cstdint>
 #include "whisper.h"
+#include "rn-whisper.h"
+
+// the tokens live in a fixed table, so a token given to a running job stays valid
+// the job id and the flags of a slot are one atomic value: a slot is claimed, aborted and released with a
+// compare-and-swap, which fails when the slot was released and taken by another job in the meantime
+#define RN_WHISPER_MAX_JOBS 256
+
+#define RN_WHISPER_TOKEN_ACTIVE  1
+#define RN_WHISPER_TOKEN_ABORTED 2
+
+struct rn_whisper_abort_token {
+  std::atomic<uint64_t> key; // job id << 32 | flags, 0 when free
+};
+
+static rn_whisper_abort_token abort_tokens[RN_WHISPER_MAX_JOBS];
+
+static uint64_t abort_token_key(int job_id) {
+  return (uint64_t) (uint32_t) job_id << 32 | RN_WHISPER_TOKEN_ACTIVE;
+}
+
+static rn_whisper_abort_token * find_abort_token(int job_id, uint64_t & key) {
+  for (auto & token : abort_tokens) {
+    key = token.key.load(std::memory_order_acquire);
+    if ((key & ~(uint64_t) RN_WHISPER_TOKEN_ABORTED) == abort_token_key(job_id)) {
+      return &token;
+    }
+  }
+  return nullptr;
+}
 
 extern "C" {
 
-std::unordered_map<int, bool> abort_map;
+rn_whisper_abort_token * rn_whisper_assign_abort_token(int job_id) {
+  uint64_t key;
+  rn_whisper_abort_token * token = find_abort_token(job_id, key);
+  if (token != nullptr) {
+    // the job id is reused (e.g. the slices of a realtime transcribe)
+    token->key.compare_exchange_strong(key, abort_token_key(job_id), std::memory_order_acq_rel);
+    return token;
+  }
 
-bool* rn_whisper_assign_abort_map(int job_id) {
-  abort_map[job_id] = false;
-  return &abort_map[job_id];
+  for (auto & slot : abort_tokens) {
+    uint64_t expected = 0;
+    if (slot.key.compare_exchange_strong(expected, abort_token_key(job_id), std::memory_order_acq_rel)) {
+      return &slot;
+    }
+  }
+  return nullptr;
 }
 
-void rn_whisper_remove_abort_map(int job_id) {
-  if (abort_map.find(job_id) != abort_map.end()) {
-    abort_map.erase(job_id);
+void rn_whisper_remove_abort_token(int job_id) {
+  uint64_t key;
+  rn_whisper_abort_token * token = find_abort_token(job_id, key);
+  if (token != nullptr) {
+    token->key.compare_exchange_strong(key, 0, std::memory_order_acq_rel);
   }
 }
 
+bool rn_whisper_abort_token_is_set(const rn_whisper_abort_token * token) {
+  return (token->key.load(std::memory_order_acquire) & RN_WHISPER_TOKEN_ABORTED) != 0;
+}
+
 void rn_whisper_abort_transcribe(int job_id) {
-  if (abort_map.find(job_id) != abort_map.end()) {
-    abort_map[job_id] = true;
+  uint64_t key;
+  rn_whisper_abort_token * token = find_abort_token(job_id, key);
+  if (token != nullptr) {
+    token->key.compare_exchange_strong(key, key | RN_WHISPER_TOKEN_ABORTED, std::memory_order_acq_rel);
   }
 }
 
 bool rn_whisper_transcribe_is_aborted(int job_id) {
-  if (abort_map.find(job_id) != abort_map.end()) {
-    return abort_map[job_id];
+  uint64_t key;
+  if (find_abort_token(job_id, key) != nullptr) {
+    return (key & RN_WHISPER_TOKEN_ABORTED) != 0;
   }
   return false;
 }
 
 void rn_whisper_abort_all_transcribe() {
-  for (auto it = abort_map.begin(); it != abort_map.end(); ++it) {
-    it->second = true;
+  for (auto & token : abort_tokens) {
+    uint64_t key = token.key.load(std::memory_order_acquire);
+    while ((key & RN_WHISPER_TOKEN_ACTIVE) != 0 &&
+           !token.key.compare_exchange_weak(key, key | RN_WHISPER_TOKEN_ABORTED, std::memory_order_acq_rel)) {
+    }
   }
 }
 
-}
\ No newline at end of file
+void rn_whisper_set_abort_callbacks(whisper_full_params * params, rn_whisper_abort_token * token) {
+  if (token == nullptr) {
+    return;
+  }
+
+  params->encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+    return !rn_whisper_abort_token_is_set((rn_whisper_abort_token *) user_data);
+  };
+  params->encoder_begin_callback_user_data = token;
+
+  params->abort_callback = [](void * user_data) {
+    return rn_whisper_abort_token_is_set((rn_whisper_abort_token *) user_data);
+  };
+  params->abort_callback_user_data = token;
+}
+
+}
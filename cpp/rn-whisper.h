@@ -1,16 +1,23 @@
-
 #ifdef __cplusplus
 #include <string>
 #include <whisper.h>
 extern "C" {
 #endif
 
-bool* rn_whisper_assign_abort_map(int job_id);
-void rn_whisper_remove_abort_map(int job_id);
+// abort flag of a transcribe job, set from any thread and read by the thread running whisper_full()
+struct rn_whisper_abort_token;
+
+// returns the token of the job, with its flag cleared - NULL when too many jobs are running
+struct rn_whisper_abort_token * rn_whisper_assign_abort_token(int job_id);
+void rn_whisper_remove_abort_token(int job_id);
+bool rn_whisper_abort_token_is_set(const struct rn_whisper_abort_token * token);
 void rn_whisper_abort_transcribe(int job_id);
 bool rn_whisper_transcribe_is_aborted(int job_id);
 void rn_whisper_abort_all_transcribe();
 
+// check the token before each encode and each decoder step of whisper_full()
+void rn_whisper_set_abort_callbacks(struct whisper_full_params * params, struct rn_whisper_abort_token * token);
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
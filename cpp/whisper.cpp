@@ -8,26 +8,46 @@
 #endif
 
 #include "ggml.h"
+#include "ggml-alloc.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <ctime>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <regex>
 #include <random>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(WSP_GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -114,8 +134,22 @@ static void byteswap_tensor(wsp_ggml_tensor * tensor) {
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
-#define WHISPER_USE_SCRATCH
-#define WHISPER_MAX_SCRATCH_BUFFERS 16
+// single-token decoder graphs are cached and re-used for the following tokens
+// the self-attention length of a cached graph is padded to a multiple of WHISPER_DECODE_GRAPH_N_KV_PAD
+// with encode-ahead, the graphs of the two cross-attention caches are kept
+#define WHISPER_MAX_DECODE_GRAPHS      32
+#define WHISPER_DECODE_GRAPH_N_KV_PAD  32
+
+// alignment of the tensor data placed in the compute buffer by the graph allocator
+#define WHISPER_ALLOC_ALIGNMENT 32
+
+// number of tokens in a block of the self-attention KV cache
+#define WHISPER_KV_BLOCK_SIZE 16
+
+// adaptive audio context: the encoder positions of the audio of a window and a margin of silence, rounded up to a
+// multiple of WHISPER_AUDIO_CTX_BUCKET so the windows of similar lengths reuse the same decoder graphs
+#define WHISPER_AUDIO_CTX_BUCKET 128
+#define WHISPER_AUDIO_CTX_MARGIN 64
 
 // available whisper models
 enum e_model {
@@ -231,38 +265,6 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
 
 static const size_t MB = 1ull*1024*1024;
 
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
-    { MODEL_TINY,     62ull*MB },
-    { MODEL_BASE,     80ull*MB },
-    { MODEL_SMALL,   120ull*MB },
-    { MODEL_MEDIUM,  158ull*MB },
-    { MODEL_LARGE,   198ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
-    { MODEL_TINY,     18ull*MB },
-    { MODEL_BASE,     24ull*MB },
-    { MODEL_SMALL,    36ull*MB },
-    { MODEL_MEDIUM,   48ull*MB },
-    { MODEL_LARGE,    60ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH2 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH3 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
 static const std::map<wsp_ggml_type, std::map<e_model, size_t>> MEM_REQ_MODEL = {
     { WSP_GGML_TYPE_F32,
         {
@@ -327,6 +329,51 @@ static const std::map<wsp_ggml_type, std::map<e_model, size_t>> MEM_REQ_MODEL =
             { MODEL_LARGE,  1674ull*MB },
         },
     },
+    { WSP_GGML_TYPE_Q2_K,
+        {
+            { MODEL_TINY,     20ull*MB },
+            { MODEL_BASE,     44ull*MB },
+            { MODEL_SMALL,   124ull*MB },
+            { MODEL_MEDIUM,  382ull*MB },
+            { MODEL_LARGE,   760ull*MB },
+        },
+    },
+    { WSP_GGML_TYPE_Q3_K,
+        {
+            { MODEL_TINY,     22ull*MB },
+            { MODEL_BASE,     46ull*MB },
+            { MODEL_SMALL,   138ull*MB },
+            { MODEL_MEDIUM,  422ull*MB },
+            { MODEL_LARGE,   842ull*MB },
+        },
+    },
+    { WSP_GGML_TYPE_Q4_K,
+        {
+            { MODEL_TINY,     26ull*MB },
+            { MODEL_BASE,     50ull*MB },
+            { MODEL_SMALL,   154ull*MB },
+            { MODEL_MEDIUM,  470ull*MB },
+            { MODEL_LARGE,   940ull*MB },
+        },
+    },
+    { WSP_GGML_TYPE_Q5_K,
+        {
+            { MODEL_TINY,     30ull*MB },
+            { MODEL_BASE,     56ull*MB },
+            { MODEL_SMALL,   178ull*MB },
+            { MODEL_MEDIUM,  540ull*MB },
+            { MODEL_LARGE,  1080ull*MB },
+        },
+    },
+    { WSP_GGML_TYPE_Q6_K,
+        {
+            { MODEL_TINY,     36ull*MB },
+            { MODEL_BASE,     66ull*MB },
+            { MODEL_SMALL,   210ull*MB },
+            { MODEL_MEDIUM,  640ull*MB },
+            { MODEL_LARGE,  1286ull*MB },
+        },
+    },
 };
 
 static const std::map<e_model, size_t> MEM_REQ_KV_SELF = {
@@ -345,28 +392,16 @@ static const std::map<e_model, size_t> MEM_REQ_KV_CROSS = {
     { MODEL_LARGE,   235ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     30ull*MB },
-    { MODEL_BASE,     38ull*MB },
-    { MODEL_SMALL,    56ull*MB },
-    { MODEL_MEDIUM,   74ull*MB },
-    { MODEL_LARGE,    94ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,      3ull*MB },
-    { MODEL_BASE,      5ull*MB },
-    { MODEL_SMALL,    10ull*MB },
-    { MODEL_MEDIUM,   18ull*MB },
-    { MODEL_LARGE,    27ull*MB },
-};
-
 struct whisper_mel {
     int n_len;
     int n_len_org;
     int n_mel;
 
+    // [n_mel][n_stride], n_stride >= n_len - the streaming spectrogram reserves columns to grow in place
+    int n_stride = 0;
     std::vector<float> data;
+
+    int64_t id = 0; // changed with the data, identifies the spectrogram of an encoded window
 };
 
 struct whisper_filters {
@@ -374,6 +409,62 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // non-zero part of the filters (see whisper_filters_compress)
+    // filter j covers the FFT bins [start[j], end[j]), its weights are at sparse[offs[j]]
+    std::vector<int32_t> start;
+    std::vector<int32_t> end;
+    std::vector<int32_t> offs;
+    std::vector<float>   sparse;
+};
+
+// state of the streaming log mel spectrogram (whisper_mel_stream_push)
+// a frame is final when all its samples have been pushed - its raw log mel values are kept, the frames at the end of
+// the audio are computed again at each push
+struct whisper_mel_stream {
+    int64_t n_samples = 0; // samples pushed so far
+
+    std::vector<float> head;    // first samples, for the reflective padding at the beginning of the audio
+    std::vector<float> pending; // samples from i_pending on, used by the frames that are not final
+    int64_t i_pending = 0;
+
+    int n_final = 0;
+    std::vector<float> data; // [n_final][n_mel], log mel before normalization
+    double mmax = -1e20;     // max of data
+
+    std::vector<float> tail; // frames after the final ones, from the last push
+
+    // the spectrogram written by the last push: its columns up to n_final and the zero columns stay valid while the
+    // clamp floor does not move
+    int64_t mel_id = -1;
+    int     n_len  = 0;
+    double  floor  = 0.0;
+};
+
+// stage of a mixed radix FFT: radix sub-transforms of length m, interleaved with stride s
+struct whisper_fft_stage {
+    int radix;
+    int m;
+    int s;
+
+    int i_tw; // offset of the twiddle factors of the stage in tw_re / tw_im
+    int i_rt; // offset of the roots of unity of the radix in rt_re / rt_im (radices without a dedicated butterfly)
+};
+
+// precomputed real FFT of n samples (see whisper_fft_real)
+struct whisper_fft_plan {
+    int n = 0;
+
+    std::vector<whisper_fft_stage> stages; // complex FFT of n/2 points
+
+    std::vector<float> tw_re;
+    std::vector<float> tw_im;
+    std::vector<float> rt_re;
+    std::vector<float> rt_im;
+
+    // e^(-2*pi*i*k/n), k = 0 .. n/2, to split the complex FFT into the real one
+    std::vector<float> sp_re;
+    std::vector<float> sp_im;
 };
 
 struct whisper_vocab {
@@ -530,10 +621,18 @@ struct whisper_layer_decoder {
     struct wsp_ggml_tensor * mlp_1_b;
 };
 
+// cross-attention KV cache
+//
+// k holds the tokens of each layer in rows of n_text_state, v is transposed and holds each layer in rows of n_ctx_pad.
+// with a quantized type the rows of v must be a multiple of the block size, so the audio tokens are padded to
+// n_ctx_pad with copies of the last token and the padding is masked in the attention
 struct whisper_kv_cache {
     struct wsp_ggml_tensor * k;
     struct wsp_ggml_tensor * v;
 
+    struct wsp_ggml_tensor * pad_idx = nullptr; // [n_ctx_pad] I32 - audio token of each padded position
+    struct wsp_ggml_tensor * mask    = nullptr; // [n_ctx_pad] F32 - 0 for the audio tokens, -INF for the padding
+
     struct wsp_ggml_context * ctx;
 
     std::vector<uint8_t> buf;
@@ -541,6 +640,55 @@ struct whisper_kv_cache {
     int n; // number of tokens currently in the cache
 };
 
+// self-attention KV cache, shared by all the decoders of a state
+//
+// the cache is split in blocks of WHISPER_KV_BLOCK_SIZE tokens. the blocks are reference counted: the decoders map
+// their tokens to blocks through a block table (whisper_kv_seq), so beams with a common prefix share its blocks.
+// a shared block is copied only when a decoder writes into it, the other blocks are never copied
+//
+// layout of k and v: [n_text_state, n_text_layer*n_slots], row il*n_slots + slot holds the token in that slot
+struct whisper_kv_paged {
+    struct wsp_ggml_tensor * k = nullptr;
+    struct wsp_ggml_tensor * v = nullptr;
+
+    struct wsp_ggml_context * ctx = nullptr;
+
+    std::vector<uint8_t> buf;
+
+    int n_layer  = 0;
+    int n_blocks = 0;
+    int n_slots  = 0; // n_blocks*WHISPER_KV_BLOCK_SIZE
+
+    size_t row_size = 0; // bytes per token and layer
+
+    std::vector<int> refs; // number of block tables that use each block
+};
+
+// block table of a decoder
+struct whisper_kv_seq {
+    std::vector<int> blocks; // token i is in slot blocks[i/WHISPER_KV_BLOCK_SIZE]*WHISPER_KV_BLOCK_SIZE + i%WHISPER_KV_BLOCK_SIZE
+
+    int n = 0; // number of tokens currently in the cache
+};
+
+// read-only mapping of a model file
+// the weights point into the mapping when possible: the pages are read from disk only when they are first used and are
+// shared with the other processes that map the same file
+struct whisper_mmap {
+    uint8_t * addr = nullptr;
+    size_t    size = 0;
+    size_t    offs = 0; // read position while the model is loaded
+
+    // false: the file is only mapped to load the weights in parallel - they are all copied to the model buffer and
+    //        the file is unmapped once the model is loaded
+    bool in_place = true;
+
+    int n_threads = 1; // threads used to copy the weights
+
+    size_t n_mapped = 0; // bytes of weights used in place
+    size_t n_copied = 0; // bytes of weights that had to be copied
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -576,10 +724,15 @@ struct whisper_model {
     std::vector<whisper_layer_decoder> layers_decoder;
 
     // context
-    struct wsp_ggml_context * ctx;
+    struct wsp_ggml_context * ctx = nullptr;
 
     // the model memory buffer is read-only and can be shared between processors
-    std::vector<uint8_t> * buf;
+    std::vector<uint8_t> * buf = nullptr;
+
+    // model file mapping - when set, buf only holds the tensor objects and the weights are in the mapping,
+    // or in buf_copy for the tensors that cannot be used in place
+    whisper_mmap * mapping = nullptr;
+    std::vector<std::vector<uint8_t>> buf_copy;
 
     // tensors
     int n_loaded;
@@ -601,8 +754,8 @@ struct whisper_sequence {
 
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
-    // each decoders keeps its own KV-cache
-    whisper_kv_cache kv_self;
+    // the tokens of the decoder in the self-attention KV cache of the state
+    whisper_kv_seq kv_self;
 
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -621,6 +774,53 @@ struct whisper_decoder {
     std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
 };
 
+// view into the self-attention KV cache where a decoder stores its new tokens
+// the offset depends on the slot of the token at n_past
+struct whisper_kv_view {
+    struct wsp_ggml_tensor * tensor;
+
+    char * data;   // data at slot 0
+    size_t stride; // bytes per slot
+
+    int  decoder;  // index of the decoder in the graph
+    bool first;    // bound to the slot of the first token of the decoder, of the token at n_past otherwise
+};
+
+// decoder graph that is built once and then computed again for the following tokens
+// only the inputs, the KV cache slots and the n_past of the attention mask are updated
+// the graph attends to n_kv >= n_past + n_tokens entries of the self-attention cache - the extra
+// entries are in the future of every token, so the causal mask removes them
+//
+// a graph can evaluate several decoders at once (one token each): the decoders share the weights and the
+// cross-attention, only the self-attention is done per decoder
+struct whisper_decode_graph {
+    int n_tokens    = 0; // per decoder
+    int n_decoders  = 0;
+    int n_kv        = 0;
+    int n_audio_ctx = 0;
+    int n_threads   = 0;
+
+    const struct wsp_ggml_tensor * kv_self_k = nullptr; // the self-attention cache the graph was built for
+
+    int64_t i_used = 0; // used to evict the least recently used graph
+
+    // tensor meta data
+    // the tensor data is placed in the compute buffer of the state, with the layout computed when the graph was built,
+    // so the inputs must be set again before each computation
+    std::vector<uint8_t> buf;
+
+    struct wsp_ggml_cgraph gf = {};
+
+    struct wsp_ggml_tensor * embd     = nullptr;
+    struct wsp_ggml_tensor * position = nullptr;
+    struct wsp_ggml_tensor * logits   = nullptr;
+
+    std::vector<struct wsp_ggml_tensor *> kv_idx; // per decoder: slots of the n_kv tokens in the self-attention cache
+
+    std::vector<whisper_kv_view>          kv_views;
+    std::vector<struct wsp_ggml_tensor *> kq_masks;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -633,19 +833,56 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int64_t t_vad_us = 0;
+    int64_t t_vad_skipped_ms = 0; // audio skipped as silence by vad_skip_silence
+    int32_t n_vad_skip = 0;       // number of silent spans skipped
+
+    // speech regions of the audio of whisper_full(), in mel frames (see whisper_vad_regions)
+    std::vector<std::pair<int, int>> vad_regions;
+
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
     whisper_mel mel;
 
+    // window of the last encode, kv_cross holds its output
+    // an encode of the same window is skipped, e.g. the language detection and the first window of whisper_full()
+    struct {
+        int64_t mel_id      = -1;
+        int     mel_offset  = 0;
+        int     n_audio_ctx = 0;
+    } encoded;
+
+    whisper_mel_stream mel_stream;
+
+    // self-attention KV cache, the decoders keep their tokens in it
+    whisper_kv_paged kv_self;
+
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
+    // cached single-token decoder graphs
+    // key: (n_tokens, n_kv, decoder index, decoders with contiguous slots, cross-attention cache)
+    // the cross-attention cache is swapped with the one of the window encoded ahead, each keeps its graphs
+    std::map<std::tuple<int, int, int, int, const wsp_ggml_tensor *>, whisper_decode_graph> decode_graphs;
+    int64_t n_decode_graph_uses = 0;
+
     // memory buffers used by encode / decode contexts
+    // buf_compute only holds the tensor and graph objects - the tensor data is placed in buf_alloc by the allocator,
+    // which reuses the memory of the intermediate results that are no longer needed
     std::vector<uint8_t> buf_compute;
-    std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
+    std::vector<uint8_t> buf_alloc;
+    std::vector<uint8_t> buf_work;
+
+    struct wsp_ggml_allocr * alloc = nullptr;
+
+    // compute buffers of the batches of whisper_encode_batch() led by this state, grown to the largest batch
+    std::vector<uint8_t> buf_compute_batch;
+    std::vector<uint8_t> buf_alloc_batch;
 
-    int    buf_last = 0;
-    size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
+    struct wsp_ggml_allocr * alloc_batch = nullptr;
+
+    // size of the compute buffer measured for a batch, key: (number of windows, audio context)
+    std::map<std::pair<int, int>, size_t> mem_encode_batch;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -678,49 +915,85 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
-    void use_buf(struct wsp_ggml_context * ctx, int i) {
-#if defined(WHISPER_USE_SCRATCH)
-        size_t last_size = 0;
+    // encodes the next window of whisper_full() while the current one is decoded (see n_threads_ahead)
+    whisper_state * ahead = nullptr;
 
-        if (i == -1) {
-            last_size = wsp_ggml_set_scratch(ctx, { 0, 0, nullptr, });
-        } else {
-            auto & buf = buf_scratch[i];
-            last_size = wsp_ggml_set_scratch(ctx, { 0, buf.size(), buf.data(), });
+    // persistent compute threads used by the encoder / decoder graphs
+    // re-created only when a call requests more threads than the pool currently has
+    struct wsp_ggml_threadpool * threadpool = nullptr;
+
+    wsp_ggml_sync_mode sync_mode = WSP_GGML_SYNC_SPIN;
+
+    // limit of the threads of a graph, set from any thread (see whisper_state_set_n_threads_max)
+    // it only lowers gf->n_threads, so the work buffers sized for the requested threads stay large enough
+    std::atomic<int> n_threads_max{0};
+
+    void graph_compute(struct wsp_ggml_context * ctx, struct wsp_ggml_cgraph * gf) {
+        gf->sync_mode = sync_mode;
+
+        const int n_max = n_threads_max.load(std::memory_order_relaxed);
+        if (n_max > 0 && gf->n_threads > n_max) {
+            gf->n_threads = n_max;
         }
 
-        if (buf_last >= 0) {
-            buf_max_size[buf_last] = std::max(buf_max_size[buf_last], last_size);
+        if (threadpool == nullptr || wsp_ggml_threadpool_n_threads(threadpool) < gf->n_threads) {
+            wsp_ggml_threadpool_free(threadpool);
+            threadpool = wsp_ggml_threadpool_new(gf->n_threads);
         }
 
-        buf_last = i;
-#else
-        (void) i;
-        (void) ctx;
-#endif
-    }
+        // the graph contexts do not allocate - the work buffer is shared by all the graphs
+        if (gf->work == nullptr) {
+            gf->work_size = wsp_ggml_graph_work_size(gf);
+            if (gf->work_size > 0) {
+                gf->work = wsp_ggml_new_tensor_1d(ctx, WSP_GGML_TYPE_I8, gf->work_size);
+            }
+        }
 
-    size_t get_buf_max_mem(int i) const {
-#if defined(WHISPER_USE_SCRATCH)
-        return buf_max_size[i];
-#else
-        (void) i;
-        return 0;
-#endif
+        if (gf->work != nullptr) {
+            if (buf_work.size() < gf->work_size) {
+                buf_work.resize(gf->work_size);
+            }
+            gf->work->data = buf_work.data();
+        }
+
+        wsp_ggml_graph_compute_with_pool(ctx, gf, threadpool);
     }
 };
 
+// the model and the vocab are read-only once loaded
+// the contexts created with whisper_init_from_file_shared() for the same file share them
+struct whisper_loaded_model {
+    whisper_model model;
+    whisper_vocab vocab;
+};
+
+static void whisper_loaded_model_free(whisper_loaded_model * loaded);
+
 struct whisper_context {
+    whisper_context() : whisper_context(std::shared_ptr<whisper_loaded_model>(new whisper_loaded_model, whisper_loaded_model_free)) {}
+
+    explicit whisper_context(std::shared_ptr<whisper_loaded_model> loaded) : loaded(loaded), model(loaded->model), vocab(loaded->vocab) {}
+
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
     wsp_ggml_type wtype = wsp_ggml_type::WSP_GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     wsp_ggml_type itype = wsp_ggml_type::WSP_GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    wsp_ggml_type ktype = wsp_ggml_type::WSP_GGML_TYPE_F16; // type of the KV caches (FP32 / FP16 / Q8_0)
 
-    whisper_model model;
-    whisper_vocab vocab;
+    std::shared_ptr<whisper_loaded_model> loaded;
+
+    whisper_model & model;
+    whisper_vocab & vocab;
     whisper_state * state = nullptr;
 
+    // states of the chunks of whisper_full_parallel() after the first one, kept for the next calls
+    std::vector<whisper_state *> parallel_states;
+
+    // FFT of the log-mel spectrogram: WHISPER_N_FFT samples and 2*WHISPER_N_FFT for the phase vocoder
+    whisper_fft_plan fft_plan;
+    whisper_fft_plan fft_plan_pv;
+
     std::string path_model; // populated by whisper_init_from_file()
 };
 
@@ -745,13 +1018,38 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+// size in bytes of n values of the given type
+static size_t kv_row_size(wsp_ggml_type type, int64_t n) {
+    return wsp_ggml_type_size(type)*n/wsp_ggml_blck_size(type);
+}
+
+// number of values the rows of the attention must be a multiple of with a cache of the given type
+// the quantized dot products process the blocks by pairs
+static int kv_row_align(wsp_ggml_type type) {
+    return wsp_ggml_is_quantized(type) ? 2*wsp_ggml_blck_size(type) : 1;
+}
+
+// number of audio tokens of the cross-attention cache for n_ctx tokens (see whisper_kv_cache)
+static int kv_cross_n_pad(wsp_ggml_type type, int n_ctx) {
+    const int blck = kv_row_align(type);
+
+    return ((n_ctx + blck - 1)/blck)*blck;
+}
+
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
-                        const size_t   mem_bytes,
              struct whisper_kv_cache & cache,
                            wsp_ggml_type   wtype,
                                  int   n_ctx) {
-    cache.buf.resize(mem_bytes);
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
+
+    const int n_ctx_pad = kv_cross_n_pad(wtype, n_ctx);
+
+    const int n_mem      = n_text_layer*n_ctx_pad;
+    const int n_elements = n_text_state*n_mem;
+
+    cache.buf.resize(2*kv_row_size(wtype, n_elements) + 2*n_ctx_pad*sizeof(float) + 4*(WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE) + 256);
 
     struct wsp_ggml_init_params params = {
         /*.mem_size   =*/ cache.buf.size(),
@@ -766,129 +1064,525 @@ static bool kv_cache_init(
         return false;
     }
 
-    const int n_text_state = hparams.n_text_state;
-    const int n_text_layer = hparams.n_text_layer;
-
-    const int n_mem      = n_text_layer*n_ctx;
-    const int n_elements = n_text_state*n_mem;
-
     cache.k = wsp_ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
     cache.v = wsp_ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
 
+    cache.pad_idx = wsp_ggml_new_tensor_1d(cache.ctx, WSP_GGML_TYPE_I32, n_ctx_pad);
+    cache.mask    = wsp_ggml_new_tensor_1d(cache.ctx, WSP_GGML_TYPE_F32, n_ctx_pad);
+
     return true;
 }
 
-static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
-    WHISPER_ASSERT(cache.ctx);
+// set the padding of the cross-attention cache for n_ctx audio tokens
+static void kv_cache_set_n_ctx(struct whisper_kv_cache & cache, int n_ctx) {
+    const int n_ctx_pad = kv_cross_n_pad(cache.k->type, n_ctx);
+
+    WHISPER_ASSERT(n_ctx_pad <= cache.mask->ne[0]);
+
+    int32_t * idx  = (int32_t *) cache.pad_idx->data;
+    float   * mask = (float   *) cache.mask->data;
+
+    for (int i = 0; i < n_ctx_pad; ++i) {
+        idx[i]  = std::min(i, n_ctx - 1);
+        mask[i] = i < n_ctx ? 0.0f : -INFINITY;
+    }
+}
+
+static void kv_cache_free(struct whisper_kv_cache & cache) {
+    if (cache.ctx) {
+        wsp_ggml_free(cache.ctx);
+        cache.ctx = nullptr;
+    }
+}
+
+// number of blocks of the self-attention KV cache needed by n_decoders decoders
+// one more block is kept for the copy of a shared block while the decoder still holds the original
+static int kv_paged_n_blocks(const struct whisper_hparams & hparams, int n_decoders) {
+    return n_decoders*((hparams.n_text_ctx + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE) + 1;
+}
+
+// grow the cache to at least n_blocks blocks, keeping the content of the current blocks
+static bool kv_paged_reserve(
+        const struct whisper_hparams & hparams,
+             struct whisper_kv_paged & cache,
+                           wsp_ggml_type   wtype,
+                                 int   n_blocks) {
+    if (cache.ctx && cache.n_blocks >= n_blocks) {
+        return true;
+    }
 
-    const int n_elements = wsp_ggml_nelements(cache.k);
-    WHISPER_ASSERT(n_elements == wsp_ggml_nelements(cache.v));
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
 
-    const wsp_ggml_type wtype = cache.k->type;
-    WHISPER_ASSERT(wtype == cache.v->type);
+    const int n_slots    = n_blocks*WHISPER_KV_BLOCK_SIZE;
+    const int n_elements = n_text_state*n_text_layer*n_slots;
 
-    WHISPER_ASSERT(cache.buf.size() >= 2*n_elements*wsp_ggml_type_sizef(wtype));
+    std::vector<uint8_t> buf(2*kv_row_size(wtype, n_elements) + 2*(WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE) + 256);
 
     struct wsp_ggml_init_params params = {
-        /*.mem_size   =*/ cache.buf.size(),
-        /*.mem_buffer =*/ cache.buf.data(),
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
         /*.no_alloc   =*/ false,
     };
 
-    cache.ctx = wsp_ggml_init(params);
+    struct wsp_ggml_context * ctx = wsp_ggml_init(params);
 
-    if (!cache.ctx) {
+    if (!ctx) {
         log("%s: failed to allocate memory for kv cache\n", __func__);
         return false;
     }
 
-    cache.k = wsp_ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = wsp_ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    struct wsp_ggml_tensor * k = wsp_ggml_new_tensor_1d(ctx, wtype, n_elements);
+    struct wsp_ggml_tensor * v = wsp_ggml_new_tensor_1d(ctx, wtype, n_elements);
+
+    const size_t row_size = kv_row_size(wtype, n_text_state);
+
+    if (cache.ctx) {
+        for (int il = 0; il < n_text_layer; ++il) {
+            memcpy((char *) k->data + il*n_slots*row_size, (char *) cache.k->data + il*cache.n_slots*row_size, cache.n_slots*row_size);
+            memcpy((char *) v->data + il*n_slots*row_size, (char *) cache.v->data + il*cache.n_slots*row_size, cache.n_slots*row_size);
+        }
+
+        wsp_ggml_free(cache.ctx);
+    }
+
+    cache.buf.swap(buf);
+
+    cache.ctx = ctx;
+    cache.k   = k;
+    cache.v   = v;
+
+    cache.n_layer  = n_text_layer;
+    cache.n_blocks = n_blocks;
+    cache.n_slots  = n_slots;
+    cache.row_size = row_size;
+
+    cache.refs.resize(n_blocks, 0);
 
     return true;
 }
 
-static void kv_cache_free(struct whisper_kv_cache & cache) {
+static void kv_paged_free(struct whisper_kv_paged & cache) {
     if (cache.ctx) {
         wsp_ggml_free(cache.ctx);
         cache.ctx = nullptr;
     }
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    log("%s: loading model\n", __func__);
-
-    const int64_t t_start_us = wsp_ggml_time_us();
-
-    wctx.t_start_us = t_start_us;
-
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+static bool kv_paged_is_free(const struct whisper_kv_paged & cache, int b0, int n) {
+    if (b0 < 0 || b0 + n > cache.n_blocks) {
+        return false;
+    }
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != WSP_GGML_FILE_MAGIC) {
-            log("%s: invalid model data (bad magic)\n", __func__);
+    for (int b = b0; b < b0 + n; ++b) {
+        if (cache.refs[b] > 0) {
             return false;
         }
     }
 
-    //load hparams
-    {
-        auto & hparams = model.hparams;
-
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
-
-        assert(hparams.n_text_state == hparams.n_audio_state);
+    return true;
+}
 
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
+// first run of n consecutive free blocks, -1 if there is none
+static int kv_paged_find(const struct whisper_kv_paged & cache, int n) {
+    for (int b0 = 0; b0 + n <= cache.n_blocks; ++b0) {
+        int i = 0;
+        while (i < n && cache.refs[b0 + i] == 0) {
+            ++i;
         }
 
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
+        if (i == n) {
+            return b0;
         }
 
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
-        }
+        b0 += i;
+    }
 
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
-        }
+    return -1;
+}
 
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
-        }
+// copy the first n_tokens tokens of block src to block dst, in all layers
+static void kv_paged_copy(struct whisper_kv_paged & cache, int dst, int src, int n_tokens) {
+    for (int il = 0; il < cache.n_layer; ++il) {
+        const size_t offs_dst = (il*cache.n_slots + dst*WHISPER_KV_BLOCK_SIZE)*cache.row_size;
+        const size_t offs_src = (il*cache.n_slots + src*WHISPER_KV_BLOCK_SIZE)*cache.row_size;
 
-        const int32_t qntvr = hparams.ftype / WSP_GGML_QNT_VERSION_FACTOR;
+        memcpy((char *) cache.k->data + offs_dst, (char *) cache.k->data + offs_src, n_tokens*cache.row_size);
+        memcpy((char *) cache.v->data + offs_dst, (char *) cache.v->data + offs_src, n_tokens*cache.row_size);
+    }
+}
 
-        hparams.ftype %= WSP_GGML_QNT_VERSION_FACTOR;
+static int kv_seq_slot(const struct whisper_kv_seq & seq, int i) {
+    return seq.blocks[i/WHISPER_KV_BLOCK_SIZE]*WHISPER_KV_BLOCK_SIZE + i%WHISPER_KV_BLOCK_SIZE;
+}
 
-        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+// true when the first n_tokens tokens of the sequence are in consecutive slots, followed by n_kv - n_tokens more slots
+// of the cache: the decoder then reads its K and V in place instead of gathering them (the extra slots are masked)
+// the rows of a quantized cache are always gathered, they are dequantized by get_rows
+static bool kv_seq_is_contiguous(const struct whisper_kv_paged & cache, const struct whisper_kv_seq & seq, int n_tokens, int n_kv) {
+    const int n_blocks = (n_tokens + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+
+    if (wsp_ggml_is_quantized(cache.k->type) || n_blocks == 0 || (int) seq.blocks.size() < n_blocks) {
+        return false;
+    }
+
+    for (int b = 1; b < n_blocks; ++b) {
+        if (seq.blocks[b] != seq.blocks[0] + b) {
+            return false;
+        }
+    }
+
+    return seq.blocks[0]*WHISPER_KV_BLOCK_SIZE + n_kv <= cache.n_slots;
+}
+
+// keep only the first n_keep blocks of the sequence
+static void kv_seq_truncate(struct whisper_kv_paged & cache, struct whisper_kv_seq & seq, int n_keep) {
+    while ((int) seq.blocks.size() > n_keep) {
+        --cache.refs[seq.blocks.back()];
+        seq.blocks.pop_back();
+    }
+}
+
+static void kv_seq_clear(struct whisper_kv_paged & cache, struct whisper_kv_seq & seq) {
+    kv_seq_truncate(cache, seq, 0);
+    seq.n = 0;
+}
+
+// make dst use the same blocks as src - no data is copied
+static void kv_seq_copy(struct whisper_kv_paged & cache, struct whisper_kv_seq & dst, const struct whisper_kv_seq & src) {
+    if (&dst == &src) {
+        return;
+    }
+
+    for (int b : src.blocks) {
+        ++cache.refs[b];
+    }
+
+    kv_seq_truncate(cache, dst, 0);
+
+    dst.blocks = src.blocks;
+    dst.n      = src.n;
+}
+
+// prepare the sequence to store the tokens [n_past, n_past + n_tokens)
+//
+// the blocks after n_past are released and the slots of the new tokens are made contiguous and owned only by this
+// sequence, so they can be written with a single copy per layer:
+//   - a block at n_past that is shared with other sequences is copied first (copy-on-write)
+//   - the new blocks follow the block at n_past
+//
+// only the part of the block at n_past before n_past is ever copied
+static bool kv_seq_prepare(struct whisper_kv_paged & cache, struct whisper_kv_seq & seq, int n_past, int n_tokens) {
+    const int n_keep = (n_past + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+    const int n_end  = (n_past + n_tokens + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+    const int n_used = n_past%WHISPER_KV_BLOCK_SIZE; // tokens of the block at n_past that are kept
+
+    kv_seq_truncate(cache, seq, n_keep);
+
+    // blocks for past tokens that were never stored
+    while ((int) seq.blocks.size() < n_past/WHISPER_KV_BLOCK_SIZE) {
+        const int b = kv_paged_find(cache, 1);
+        if (b < 0) {
+            log("%s: no free block in the kv cache\n", __func__);
+            return false;
+        }
+
+        cache.refs[b] = 1;
+        seq.blocks.push_back(b);
+    }
+
+    // the block at n_past is kept and receives the first new tokens
+    const bool partial = n_used > 0 && (int) seq.blocks.size() == n_keep;
+
+    if (partial) {
+        const int b     = seq.blocks.back();
+        const int n_add = n_end - n_keep;
+
+        if (cache.refs[b] > 1 || !kv_paged_is_free(cache, b + 1, n_add)) {
+            const int b_new = kv_paged_find(cache, 1 + n_add);
+            if (b_new < 0) {
+                log("%s: failed to find %d free blocks in the kv cache\n", __func__, 1 + n_add);
+                return false;
+            }
+
+            kv_paged_copy(cache, b_new, b, n_used);
+
+            cache.refs[b_new] = 1;
+            --cache.refs[b];
+
+            seq.blocks.back() = b_new;
+        }
+    }
+
+    const int n_add = n_end - (int) seq.blocks.size();
+
+    if (n_add > 0) {
+        int b0 = -1;
+        if (partial) {
+            b0 = seq.blocks.back() + 1;
+            WHISPER_ASSERT(kv_paged_is_free(cache, b0, n_add));
+        } else {
+            b0 = kv_paged_find(cache, n_add);
+            if (b0 < 0) {
+                log("%s: failed to find %d free blocks in the kv cache\n", __func__, n_add);
+                return false;
+            }
+        }
+
+        for (int b = b0; b < b0 + n_add; ++b) {
+            cache.refs[b] = 1;
+            seq.blocks.push_back(b);
+        }
+    }
+
+    return true;
+}
+
+// the mel filters are triangles over a few FFT bins - keep only the range of non-zero weights of each filter
+static void whisper_filters_compress(whisper_filters & filters) {
+    filters.start.resize(filters.n_mel);
+    filters.end.resize(filters.n_mel);
+    filters.offs.resize(filters.n_mel);
+    filters.sparse.clear();
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const float * w = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+
+        while (k0 < k1 && w[k0] == 0.0f) {
+            ++k0;
+        }
+        while (k1 > k0 && w[k1 - 1] == 0.0f) {
+            --k1;
+        }
+
+        filters.start[j] = k0;
+        filters.end[j]   = k1;
+        filters.offs[j]  = filters.sparse.size();
+
+        filters.sparse.insert(filters.sparse.end(), w + k0, w + k1);
+    }
+}
+
+// page faults of the process so far, used to report the first-touch cost of a mapped model
+static void whisper_page_faults(int64_t & n_minor, int64_t & n_major) {
+    n_minor = 0;
+    n_major = 0;
+#if !defined(_WIN32)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        n_minor = usage.ru_minflt;
+        n_major = usage.ru_majflt;
+    }
+#endif
+}
+
+static whisper_mmap * whisper_mmap_open(const char * path) {
+#if defined(_WIN32)
+    (void) path;
+    return nullptr;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    whisper_mmap * mm = new whisper_mmap;
+    mm->addr = (uint8_t *) addr;
+    mm->size = st.st_size;
+
+    return mm;
+#endif
+}
+
+static void whisper_mmap_free(whisper_mmap * mm) {
+    if (mm == nullptr) {
+        return;
+    }
+#if !defined(_WIN32)
+    munmap(mm->addr, mm->size);
+#endif
+    delete mm;
+}
+
+static void whisper_loaded_model_free(whisper_loaded_model * loaded) {
+    if (loaded->model.ctx) {
+        wsp_ggml_free(loaded->model.ctx);
+    }
+    if (loaded->model.buf) {
+        delete loaded->model.buf;
+    }
+    whisper_mmap_free(loaded->model.mapping);
+
+    delete loaded;
+}
+
+// the weights can be used in place if they do not have to be byteswapped and are aligned for their type
+// (the quantized blocks start with a 16-bit scale)
+static bool whisper_mmap_can_use(wsp_ggml_type type, const void * data) {
+#if defined(WSP_GGML_BIG_ENDIAN)
+    (void) type;
+    (void) data;
+    return false;
+#else
+    const size_t align = type == WSP_GGML_TYPE_F32 ? sizeof(float) : sizeof(wsp_ggml_fp16_t);
+
+    return (uintptr_t) data % align == 0;
+#endif
+}
+
+// location of the data of a tensor in a mapped model file
+struct whisper_tensor_index {
+    struct wsp_ggml_tensor * tensor;
+
+    size_t offs;
+    size_t nbytes;
+};
+
+// set the data of the tensors of a mapped model file
+// the tensors are used in place when possible, the others are copied and byteswapped by mapping.n_threads threads
+static void whisper_model_load_tensors(whisper_model & model, const std::vector<whisper_tensor_index> & index) {
+    auto & mm = *model.mapping;
+
+    std::vector<const whisper_tensor_index *> copies;
+
+    for (const auto & ti : index) {
+        uint8_t * data = mm.addr + ti.offs;
+
+        if (mm.in_place) {
+            if (whisper_mmap_can_use(ti.tensor->type, data)) {
+                ti.tensor->data = data;
+                mm.n_mapped += ti.nbytes;
+                continue;
+            }
+
+            model.buf_copy.emplace_back(ti.nbytes);
+            ti.tensor->data = model.buf_copy.back().data();
+        }
+
+        copies.push_back(&ti);
+        mm.n_copied += ti.nbytes;
+    }
+
+    // largest first, so that the threads finish at about the same time
+    std::sort(copies.begin(), copies.end(), [](const whisper_tensor_index * a, const whisper_tensor_index * b) {
+        return a->nbytes > b->nbytes;
+    });
+
+    std::atomic<size_t> i_next(0);
+
+    auto worker = [&]() {
+        for (size_t i = i_next++; i < copies.size(); i = i_next++) {
+            const whisper_tensor_index & ti = *copies[i];
+
+            memcpy(ti.tensor->data, mm.addr + ti.offs, ti.nbytes);
+            BYTESWAP_TENSOR(ti.tensor);
+        }
+    };
+
+    const int n_threads = std::max(1, std::min(mm.n_threads, (int) copies.size()));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (auto & w : workers) {
+        w = std::thread(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+    log("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = wsp_ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (magic != WSP_GGML_FILE_MAGIC) {
+            log("%s: invalid model data (bad magic)\n", __func__);
+            return false;
+        }
+    }
+
+    //load hparams
+    {
+        auto & hparams = model.hparams;
+
+        read_safe(loader, hparams.n_vocab);
+        read_safe(loader, hparams.n_audio_ctx);
+        read_safe(loader, hparams.n_audio_state);
+        read_safe(loader, hparams.n_audio_head);
+        read_safe(loader, hparams.n_audio_layer);
+        read_safe(loader, hparams.n_text_ctx);
+        read_safe(loader, hparams.n_text_state);
+        read_safe(loader, hparams.n_text_head);
+        read_safe(loader, hparams.n_text_layer);
+        read_safe(loader, hparams.n_mels);
+        read_safe(loader, hparams.ftype);
+
+        assert(hparams.n_text_state == hparams.n_audio_state);
+
+        if (hparams.n_audio_layer == 4) {
+            model.type = e_model::MODEL_TINY;
+        }
+
+        if (hparams.n_audio_layer == 6) {
+            model.type = e_model::MODEL_BASE;
+        }
+
+        if (hparams.n_audio_layer == 12) {
+            model.type = e_model::MODEL_SMALL;
+        }
+
+        if (hparams.n_audio_layer == 24) {
+            model.type = e_model::MODEL_MEDIUM;
+        }
+
+        if (hparams.n_audio_layer == 32) {
+            model.type = e_model::MODEL_LARGE;
+        }
+
+        const int32_t qntvr = hparams.ftype / WSP_GGML_QNT_VERSION_FACTOR;
+
+        hparams.ftype %= WSP_GGML_QNT_VERSION_FACTOR;
+
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
         // in order to save memory and also to speed up the computation
         wctx.wtype = wsp_ggml_ftype_to_wsp_ggml_type((wsp_ggml_ftype) (model.hparams.ftype));
         if (wctx.wtype == WSP_GGML_TYPE_COUNT) {
@@ -896,6 +1590,17 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             return false;
         }
 
+        // the quantized weights are stored in rows of whole blocks - the k-quants need rows that are a multiple of 256
+        // (not the case for the tiny models), and are only available when ggml is built with WSP_GGML_USE_K_QUANTS
+        {
+            const int blck_size = wsp_ggml_blck_size(wctx.wtype);
+            if (blck_size == 0 || hparams.n_audio_state % blck_size != 0 || hparams.n_text_state % blck_size != 0) {
+                log("%s: invalid model (%s weights are not supported for n_state = %d)\n", __func__,
+                        wsp_ggml_type_name(wctx.wtype), hparams.n_audio_state);
+                return false;
+            }
+        }
+
         const size_t scale = model.hparams.ftype ? 1 : 2;
 
         log("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
@@ -914,15 +1619,11 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         // print memory requirements
         {
-            // this is the total memory required to run the inference
+            // this is the memory required by the model and the cross-attention KV cache
+            // the compute buffers are sized when the state is initialized, see whisper_init_state()
             const size_t mem_required =
-                     MEM_REQ_SCRATCH0.at(model.type) +
-                     MEM_REQ_SCRATCH1.at(model.type) +
-                     MEM_REQ_SCRATCH2.at(model.type) +
-                     MEM_REQ_SCRATCH3.at(model.type) +
                 scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type) +
-                scale*MEM_REQ_KV_CROSS.at(model.type) +
-                scale*std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type));
+                scale*MEM_REQ_KV_CROSS.at(model.type);
 
             // this is the memory required by one decoder
             const size_t mem_required_decoder =
@@ -935,8 +1636,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         // initialize all memory buffers
         // always have at least one decoder
 
+        // the model buffer is sized from the tensors of the model, see ctx_size below
         wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
 
         // we skip initialization of the state until it is needed
         // because it might be that state will always be provided externally.
@@ -952,6 +1653,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_compress(filters);
     }
 
     // load vocab
@@ -1148,10 +1851,22 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
     // create the ggml context
     {
+        const bool in_place = model.mapping && model.mapping->in_place;
+
+        if (in_place) {
+            // only the tensor objects - the data is set when the weights are loaded
+            const auto & hparams = model.hparams;
+
+            wctx.model.buf->resize((15 + 15*hparams.n_audio_layer + 24*hparams.n_text_layer)*wsp_ggml_tensor_overhead());
+        } else {
+            // the tensors of this model and type, MEM_REQ_MODEL is only the estimate that is logged
+            wctx.model.buf->resize(ctx_size);
+        }
+
         struct wsp_ggml_init_params params = {
             /*.mem_size   =*/ wctx.model.buf->size(),
             /*.mem_buffer =*/ wctx.model.buf->data(),
-            /*.no_alloc   =*/ false,
+            /*.no_alloc   =*/ in_place,
         };
 
         model.ctx = wsp_ggml_init(params);
@@ -1358,9 +2073,14 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     }
 
     // load weights
+    //
+    // from a mapped file, the headers of the tensors are read first to build an index of the tensor data,
+    // and the data is then loaded by several threads, see whisper_model_load_tensors()
     {
         size_t total_size = 0;
 
+        std::vector<whisper_tensor_index> index;
+
         model.n_loaded = 0;
 
         while (true) {
@@ -1415,17 +2135,43 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            loader->read(loader->context, tensor->data, wsp_ggml_nbytes(tensor));
-            BYTESWAP_TENSOR(tensor);
+            if (model.mapping) {
+                auto & mm = *model.mapping;
+
+                const size_t nbytes = wsp_ggml_nbytes(tensor);
+                if (mm.offs + nbytes > mm.size) {
+                    log("%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                index.push_back({ tensor, mm.offs, nbytes });
+
+                mm.offs += nbytes;
+            } else {
+                loader->read(loader->context, tensor->data, wsp_ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            }
 
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], wsp_ggml_type_name((wsp_ggml_type) ttype), wsp_ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += wsp_ggml_nbytes(tensor);
             model.n_loaded++;
         }
 
+        if (model.mapping) {
+            whisper_model_load_tensors(model, index);
+        }
+
         log("%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
 
-        if (model.n_loaded == 0) {
+        if (model.mapping && model.mapping->in_place) {
+            log("%s: mmap          = %7.2f MB in place, %7.2f MB copied\n", __func__,
+                    model.mapping->n_mapped/1024.0/1024.0, model.mapping->n_copied/1024.0/1024.0);
+        }
+
+        if (model.n_loaded == 0 && model.mapping) {
+            log("%s: ERROR no tensors in the mapped model file\n", __func__);
+            return false;
+        } else if (model.n_loaded == 0) {
             log("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
             log("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
@@ -1438,26 +2184,29 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
+// a window of the encoder graph: the spectrogram mel at mel_offset, encoded into the cross-attention cache of state
+struct whisper_encode_input {
+    const whisper_mel * mel;
+    int mel_offset;
+    whisper_state * state;
+};
+
+// build the encoder graph into gf: the encoder followed by the computation of the cross-attention KV cache
 //
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+// the windows are evaluated as a batch - the convolutions run per window, the transformer layers on the columns of
+// all the windows, with a batch dimension in the attention so the windows do not attend to each other
+// wstate provides the audio context and the CoreML / OpenVINO encoders, the windows must use the same audio context
 //
-static bool whisper_encode_internal(
+// the inputs are allocated explicitly so they stay alive for the whole graph
+// with a measure allocator the inputs are not filled and the CoreML / OpenVINO encoders are not run
+static bool whisper_build_graph_encoder(
         whisper_context & wctx,
           whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
-
-    const int64_t t_start_us = wsp_ggml_time_us();
-
+ const std::vector<whisper_encode_input> & inputs,
+ struct wsp_ggml_context * ctx0,
+  struct wsp_ggml_allocr * alloc,
+  struct wsp_ggml_cgraph & gf) {
     const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -1465,36 +2214,42 @@ static bool whisper_encode_internal(
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    const int n_mels  = hparams.n_mels;
+    const int n_batch = inputs.size();
 
-    struct wsp_ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+    const bool measure = wsp_ggml_allocr_is_measure(alloc);
 
-    struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
+    std::vector<struct wsp_ggml_tensor *> mels(n_batch);
 
-    wstate.use_buf(ctx0, 0);
+    for (int b = 0; b < n_batch; ++b) {
+        struct wsp_ggml_tensor * mel = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, 2*n_ctx, n_mels);
+        assert(mel->type == WSP_GGML_TYPE_F32);
 
-    struct wsp_ggml_tensor * mel = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == WSP_GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, wsp_ggml_nbytes(mel));
+        wsp_ggml_allocr_alloc(alloc, mel);
+
+        if (!measure) {
+            const whisper_mel & mel_inp = *inputs[b].mel;
+            const int mel_offset = inputs[b].mel_offset;
+
+            assert(mel_inp.n_mel == n_mels);
+
+            float * dst = (float *) mel->data;
+            memset(dst, 0, wsp_ggml_nbytes(mel));
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+            const int i0 = std::min(mel_offset, mel_inp.n_len);
+            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_stride + i];
+                }
             }
         }
+
+        mels[b] = mel;
     }
 
-    struct wsp_ggml_tensor * cur;
+    struct wsp_ggml_tensor * cur = nullptr;
 
 #ifndef WHISPER_USE_COREML
     const bool use_coreml = false;
@@ -1509,58 +2264,67 @@ static bool whisper_encode_internal(
 #endif
 
     if (!use_coreml && !use_openvino) {
-        // convolution + gelu
-        {
-            wstate.use_buf(ctx0, 1);
-
-            cur = wsp_ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = wsp_ggml_add(ctx0,
-                    wsp_ggml_repeat(ctx0,
-                        model.e_conv_1_b,
-                        cur),
-                    cur);
+        for (int b = 0; b < n_batch; ++b) {
+            struct wsp_ggml_tensor * conv;
 
-            cur = wsp_ggml_gelu(ctx0, cur);
+            // convolution + gelu
+            {
+                conv = wsp_ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mels[b], 1, 1);
+                conv = wsp_ggml_add(ctx0,
+                        wsp_ggml_repeat(ctx0,
+                            model.e_conv_1_b,
+                            conv),
+                        conv);
 
-            wstate.use_buf(ctx0, 0);
+                conv = wsp_ggml_gelu(ctx0, conv);
 
-            cur = wsp_ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = wsp_ggml_add(ctx0,
-                    wsp_ggml_repeat(ctx0,
-                        model.e_conv_2_b,
-                        cur),
-                    cur);
+                conv = wsp_ggml_conv_1d_ph(ctx0, model.e_conv_2_w, conv, 2, 1);
+                conv = wsp_ggml_add(ctx0,
+                        wsp_ggml_repeat(ctx0,
+                            model.e_conv_2_b,
+                            conv),
+                        conv);
 
-            cur = wsp_ggml_gelu(ctx0, cur);
-        }
+                conv = wsp_ggml_gelu(ctx0, conv);
+            }
 
-        wstate.use_buf(ctx0, 3);
+            // ===================================================================
+            // NOTE: experimenting with partial evaluation of the encoder (ignore)
+            //static int iter = -1;
+            //const int n_iter = 1500/n_ctx;
 
-        // ===================================================================
-        // NOTE: experimenting with partial evaluation of the encoder (ignore)
-        //static int iter = -1;
-        //const int n_iter = 1500/n_ctx;
+            //iter = (iter + 1) % n_iter;
 
-        //iter = (iter + 1) % n_iter;
+            //if (iter == 0) {
+            //    memset(model.memory_cross_k->data, 0, wsp_ggml_nbytes(model.memory_cross_k));
+            //    memset(model.memory_cross_v->data, 0, wsp_ggml_nbytes(model.memory_cross_v));
+            //}
 
-        //if (iter == 0) {
-        //    memset(model.memory_cross_k->data, 0, wsp_ggml_nbytes(model.memory_cross_k));
-        //    memset(model.memory_cross_v->data, 0, wsp_ggml_nbytes(model.memory_cross_v));
-        //}
+            static int iter = 0;
 
-        static int iter = 0;
+            const size_t e_pe_stride = model.e_pe->ne[0]*wsp_ggml_element_size(model.e_pe);
+            const size_t e_pe_offset = model.e_pe->ne[0]*wsp_ggml_element_size(model.e_pe)*n_ctx*iter;
 
-        const size_t e_pe_stride = model.e_pe->ne[0]*wsp_ggml_element_size(model.e_pe);
-        const size_t e_pe_offset = model.e_pe->ne[0]*wsp_ggml_element_size(model.e_pe)*n_ctx*iter;
+            struct wsp_ggml_tensor * e_pe = wsp_ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
 
-        struct wsp_ggml_tensor * e_pe = wsp_ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+            conv = wsp_ggml_add(ctx0, e_pe, wsp_ggml_transpose(ctx0, conv));
 
-        cur = wsp_ggml_add(ctx0, e_pe, wsp_ggml_transpose(ctx0, cur));
+            // ===================================================================
 
-        // ===================================================================
+            // original:
+            //cur = wsp_ggml_add(ctx0, model.e_pe, wsp_ggml_transpose(ctx0, cur));
 
-        // original:
-        //cur = wsp_ggml_add(ctx0, model.e_pe, wsp_ggml_transpose(ctx0, cur));
+            if (n_batch == 1) {
+                cur = conv;
+            } else {
+                // gather the windows in the columns of cur
+                if (b == 0) {
+                    cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx*n_batch);
+                }
+
+                cur = wsp_ggml_set_1d_inplace(ctx0, cur, conv, b*n_ctx*n_state*wsp_ggml_element_size(cur));
+            }
+        }
 
         struct wsp_ggml_tensor * inpL = cur;
 
@@ -1569,8 +2333,6 @@ static bool whisper_encode_internal(
 
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
                 cur = wsp_ggml_norm(ctx0, inpL);
 
                 // cur = ln_0_w*cur + ln_0_b
@@ -1583,8 +2345,6 @@ static bool whisper_encode_internal(
 
             // self-attention
             {
-                wstate.use_buf(ctx0, 1);
-
                 struct wsp_ggml_tensor * Qcur = wsp_ggml_mul_mat(ctx0,
                         layer.attn_q_w,
                         cur);
@@ -1616,8 +2376,6 @@ static bool whisper_encode_internal(
 
                 // ------
 
-                wstate.use_buf(ctx0, 0);
-
 #ifdef WHISPER_USE_FLASH_ATTN
                 struct wsp_ggml_tensor * Q =
                     wsp_ggml_permute(ctx0,
@@ -1642,20 +2400,23 @@ static bool whisper_encode_internal(
                                 1, 2, 0, 3),
                             wsp_ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
 
+                WHISPER_ASSERT(n_batch == 1);
+
                 struct wsp_ggml_tensor * KQV = wsp_ggml_flash_attn(ctx0, Q, K, V, false);
 #else
+                // the 4th dimension is the window
                 struct wsp_ggml_tensor * Q =
                     wsp_ggml_permute(ctx0,
                             wsp_ggml_cpy(ctx0,
                                 Qcur,
-                                wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                                wsp_ggml_new_tensor_4d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 struct wsp_ggml_tensor * K =
                     wsp_ggml_permute(ctx0,
                             wsp_ggml_cpy(ctx0,
                                 Kcur,
-                                wsp_ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                wsp_ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 // K * Q
@@ -1672,41 +2433,33 @@ static bool whisper_encode_internal(
                 struct wsp_ggml_tensor * V =
                     wsp_ggml_cpy(ctx0,
                             wsp_ggml_permute(ctx0,
-                                wsp_ggml_reshape_3d(ctx0,
+                                wsp_ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state/n_head, n_head, n_ctx),
+                                    n_state/n_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
-                            wsp_ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                            wsp_ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch)
                             );
 
                 struct wsp_ggml_tensor * KQV = wsp_ggml_mul_mat(ctx0, V, KQ_soft_max);
 #endif
                 struct wsp_ggml_tensor * KQV_merged = wsp_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                wstate.use_buf(ctx0, 1);
-
                 cur = wsp_ggml_cpy(ctx0,
                         KQV_merged,
-                        wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx));
+                        wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx*n_batch));
             }
 
             // projection
             {
-                wstate.use_buf(ctx0, 0);
-
                 cur = wsp_ggml_mul_mat(ctx0,
                         layer.attn_ln_1_w,
                         cur);
 
-                wstate.use_buf(ctx0, 1);
-
                 cur = wsp_ggml_add(ctx0,
                         wsp_ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
                         cur);
             }
 
-            wstate.use_buf(ctx0, 2);
-
             // add the input
             cur = wsp_ggml_add(ctx0, cur, inpL);
 
@@ -1716,12 +2469,8 @@ static bool whisper_encode_internal(
             {
                 // norm
                 {
-                    wstate.use_buf(ctx0, 0);
-
                     cur = wsp_ggml_norm(ctx0, inpFF);
 
-                    wstate.use_buf(ctx0, 1);
-
                     // cur = mlp_ln_w*cur + mlp_ln_b
                     cur = wsp_ggml_add(ctx0,
                             wsp_ggml_mul(ctx0,
@@ -1731,47 +2480,33 @@ static bool whisper_encode_internal(
                 }
 
 #ifdef WHISPER_USE_FLASH_FF
-                wstate.use_buf(ctx0, 0);
-
                 cur = wsp_ggml_flash_ff(ctx0,
-                        wsp_ggml_cpy(ctx0, cur, wsp_ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        wsp_ggml_cpy(ctx0, cur, wsp_ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx*n_batch)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
-                wstate.use_buf(ctx0, 0);
-
                 // fully connected
                 cur = wsp_ggml_mul_mat(ctx0,
                         layer.mlp_0_w,
                         cur);
 
-                wstate.use_buf(ctx0, 1);
-
                 cur = wsp_ggml_add(ctx0,
                         wsp_ggml_repeat(ctx0, layer.mlp_0_b, cur),
                         cur);
 
-                wstate.use_buf(ctx0, 0);
-
                 // GELU activation
                 cur = wsp_ggml_gelu(ctx0, cur);
 
-                wstate.use_buf(ctx0, 1);
-
                 // projection
                 cur = wsp_ggml_mul_mat(ctx0,
                         layer.mlp_1_w,
                         cur);
 
-                wstate.use_buf(ctx0, 0);
-
                 cur = wsp_ggml_add(ctx0,
                         wsp_ggml_repeat(ctx0, layer.mlp_1_b, cur),
                         cur);
 #endif
             }
 
-            wstate.use_buf(ctx0, 3);
-
             inpL = wsp_ggml_add(ctx0, cur, inpFF);
         }
 
@@ -1779,12 +2514,8 @@ static bool whisper_encode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_norm(ctx0, cur);
 
-            wstate.use_buf(ctx0, 1);
-
             // cur = ln_f_g*cur + ln_f_b
             cur = wsp_ggml_add(ctx0,
                     wsp_ggml_mul(ctx0,
@@ -1792,37 +2523,35 @@ static bool whisper_encode_internal(
                         cur),
                     wsp_ggml_repeat(ctx0, model.e_ln_b, cur));
         }
-
-        wstate.use_buf(ctx0, -1);
-
-        // run the computation
-        {
-            struct wsp_ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
-            wsp_ggml_build_forward_expand(&gf, cur);
-            wsp_ggml_graph_compute(ctx0, &gf);
-
-            //wsp_ggml_graph_print(&gf);
-        }
     }
 #ifdef WHISPER_USE_COREML
     else if (use_coreml) {
-        wstate.use_buf(ctx0, -1);
+        // the encoded features are computed outside of the graph and are an input of the cross-attention part
+        cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx*n_batch);
 
-        cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx);
+        wsp_ggml_allocr_alloc(alloc, cur);
 
-        whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) cur->data);
+        if (!measure) {
+            for (int b = 0; b < n_batch; ++b) {
+                whisper_coreml_encode(wstate.ctx_coreml, (float *) mels[b]->data, (float *) cur->data + b*n_ctx*n_state);
+            }
+        }
     }
 #endif
 #ifdef WHISPER_USE_OPENVINO
     else if (use_openvino) {
-        wstate.use_buf(ctx0, -1);
+        cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx*n_batch);
 
-        cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, n_ctx);
+        wsp_ggml_allocr_alloc(alloc, cur);
 
-        if (!whisper_openvino_encode(wstate.ctx_openvino, mel, cur)) {
-            return false;
+        if (!measure) {
+            for (int b = 0; b < n_batch; ++b) {
+                struct wsp_ggml_tensor * out = wsp_ggml_view_2d(ctx0, cur, n_state, n_ctx, cur->nb[1], b*n_ctx*cur->nb[1]);
+
+                if (!whisper_openvino_encode(wstate.ctx_openvino, mels[b], out)) {
+                    return false;
+                }
+            }
         }
     }
 #endif
@@ -1843,27 +2572,15 @@ static bool whisper_encode_internal(
 
     // pre-compute cross-attention memory
     {
-        struct wsp_ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = WSP_GGML_OP_NONE;
-        cur->src0 = nullptr;
-        cur->src1 = nullptr;
-
         for (int il = 0; il < model.hparams.n_text_layer; ++il) {
             auto& layer = model.layers_decoder[il];
 
-            wstate.use_buf(ctx0, 0);
-
             struct wsp_ggml_tensor* Kcross = wsp_ggml_mul_mat(ctx0,
                 layer.cross_attn_k_w,
                 cur);
 
             Kcross = wsp_ggml_scale_inplace(ctx0, Kcross, wsp_ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
 
-            wstate.use_buf(ctx0, 1);
-
             struct wsp_ggml_tensor* Vcross = wsp_ggml_mul_mat(ctx0,
                 layer.cross_attn_v_w,
                 cur);
@@ -1874,101 +2591,335 @@ static bool whisper_encode_internal(
                     Vcross),
                 Vcross);
 
-            wstate.use_buf(ctx0, -1);
+            // the columns of each window go to the cache of its state
+            for (int b = 0; b < n_batch; ++b) {
+                whisper_kv_cache & kv_cross = inputs[b].state->kv_cross;
+
+                const wsp_ggml_type kv_type = kv_cross.k->type;
+
+                // the padding of a quantized cache repeats the last audio token (n_ctx_pad == n_ctx otherwise)
+                const int n_ctx_pad = kv_cross_n_pad(kv_type, n_ctx);
+
+                const size_t k_row_size = kv_row_size(kv_type, n_state);
+                const size_t v_row_size = kv_row_size(kv_type, n_ctx_pad);
+
+                struct wsp_ggml_tensor * Kb = wsp_ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], b*n_ctx*Kcross->nb[1]);
+                struct wsp_ggml_tensor * Vb = wsp_ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], b*n_ctx*Vcross->nb[1]);
 
-            Vcross = wsp_ggml_transpose(ctx0, wsp_ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+                if (n_ctx_pad != n_ctx) {
+                    struct wsp_ggml_tensor * pad_idx = wsp_ggml_view_1d(ctx0, kv_cross.pad_idx, n_ctx_pad, 0);
 
-            struct wsp_ggml_tensor * k = wsp_ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (wsp_ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct wsp_ggml_tensor * v = wsp_ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*wsp_ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*wsp_ggml_element_size(wstate.kv_cross.v)*n_state);
+                    Kb = wsp_ggml_get_rows(ctx0, Kb, pad_idx);
+                    Vb = wsp_ggml_get_rows(ctx0, Vb, pad_idx);
+                }
+
+                Vb = wsp_ggml_transpose(ctx0, Vb);
+
+                // the quantization works on contiguous rows
+                if (wsp_ggml_is_quantized(kv_type)) {
+                    Vb = wsp_ggml_cpy(ctx0, Vb, wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_ctx_pad, n_state));
+                }
 
-            wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Kcross, k));
-            wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Vcross, v));
+                struct wsp_ggml_tensor * k = wsp_ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx_pad, k_row_size*(il*n_ctx_pad));
+                struct wsp_ggml_tensor * v = wsp_ggml_view_2d(ctx0, kv_cross.v, n_ctx_pad, n_state,
+                        v_row_size,
+                        v_row_size*(il*n_state));
+
+                wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Kb, k));
+                wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Vb, v));
+            }
         }
 
-        wsp_ggml_graph_compute(ctx0, &gf);
         //wsp_ggml_graph_print(&gf);
     }
 
-    ////////////////////////////////////////////////////////////////////////////
+    return true;
+}
+
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - mel:        the spectrogram, usually the one of wstate
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+      const whisper_mel & mel,
+              const int   mel_offset,
+              const int   n_threads){
+
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    // the cross-attention cache already holds the output of this window
+    if (wstate.encoded.mel_id == mel.id && wstate.encoded.mel_offset == mel_offset && wstate.encoded.n_audio_ctx == n_audio_ctx) {
+        WHISPER_PRINT_DEBUG("%s: reusing the encoder output at offset %d\n", __func__, mel_offset);
+        return true;
+    }
+
+    wstate.encoded.mel_id = -1;
+
+    const int64_t t_start_us = wsp_ggml_time_us();
+
+    // the first encode reads the encoder weights of a mapped model from disk
+    int64_t n_minor = 0;
+    int64_t n_major = 0;
+
+    const bool first_touch = wctx.model.mapping && wstate.n_encode == 0;
+    if (first_touch) {
+        whisper_page_faults(n_minor, n_major);
+    }
+
+    struct wsp_ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
+
+    wsp_ggml_allocr_reset(wstate.alloc);
+
+    struct wsp_ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
+
+    if (!whisper_build_graph_encoder(wctx, wstate, { { &mel, mel_offset, &wstate } }, ctx0, wstate.alloc, gf)) {
+        wsp_ggml_free(ctx0);
+        return false;
+    }
+
+    kv_cache_set_n_ctx(wstate.kv_cross, n_audio_ctx);
+
+    wsp_ggml_allocr_alloc_graph(wstate.alloc, &gf);
 
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-    //        wsp_ggml_used_mem(ctx0)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+    wstate.graph_compute(ctx0, &gf);
 
     wsp_ggml_free(ctx0);
 
     wstate.t_encode_us += wsp_ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    wstate.encoded.mel_id      = mel.id;
+    wstate.encoded.mel_offset  = mel_offset;
+    wstate.encoded.n_audio_ctx = n_audio_ctx;
+
+    if (first_touch) {
+        int64_t n_minor1 = 0;
+        int64_t n_major1 = 0;
+        whisper_page_faults(n_minor1, n_major1);
+
+        log("%s: first encode of the mapped model: %8.2f ms, %lld minor / %lld major page faults\n", __func__,
+                (wsp_ggml_time_us() - t_start_us)/1000.0, (long long) (n_minor1 - n_minor), (long long) (n_major1 - n_major));
+    }
+
     return true;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads) {
+    return whisper_encode_internal(wctx, wstate, wstate.mel, mel_offset, n_threads);
+}
+
+// evaluate the encoder on several windows as one batch, the output of each window goes to the cache of its state
 //
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+// the windows already held by the cache of their state are skipped, a single remaining window is encoded alone
+// the batch uses the compute buffers of the state of its first window, measured for each call
 //
-static bool whisper_decode_internal(
+static bool whisper_encode_batch_internal(
         whisper_context & wctx,
-          whisper_state & wstate,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
+  std::vector<whisper_encode_input> inputs,
               const int   n_threads) {
-    const int64_t t_start_us = wsp_ggml_time_us();
+    const auto & hparams = wctx.model.hparams;
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [&](const whisper_encode_input & inp) {
+        const whisper_state & wstate = *inp.state;
+        const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-    auto & kv_self = decoder.kv_self;
+        return wstate.encoded.mel_id == inp.mel->id && wstate.encoded.mel_offset == inp.mel_offset && wstate.encoded.n_audio_ctx == n_audio_ctx;
+    }), inputs.end());
 
-    WHISPER_ASSERT(!!kv_self.ctx);
+    if (inputs.empty()) {
+        return true;
+    }
 
-    auto & logits_out = wstate.logits;
+    if (inputs.size() == 1) {
+        return whisper_encode_internal(wctx, *inputs[0].state, *inputs[0].mel, inputs[0].mel_offset, n_threads);
+    }
 
-    const int n_vocab = hparams.n_vocab;
+    whisper_state & lead = *inputs[0].state;
 
-    const int n_ctx   = hparams.n_text_ctx;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
+    const int n_audio_ctx = lead.exp_n_audio_ctx > 0 ? lead.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-    const int N = n_tokens;
-    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int64_t t_start_us = wsp_ggml_time_us();
+
+    for (auto & inp : inputs) {
+        inp.state->encoded.mel_id = -1;
+    }
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    // upper bound for the meta data of the graph, as in whisper_init_state()
+    if (lead.buf_compute_batch.empty()) {
+        lead.buf_compute_batch.resize(2*WSP_GGML_MAX_NODES*(WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE + 64));
+    }
 
     struct wsp_ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
+        /*.mem_size   =*/ lead.buf_compute_batch.size(),
+        /*.mem_buffer =*/ lead.buf_compute_batch.data(),
+        /*.no_alloc   =*/ true,
     };
 
+    // the graph is measured once per batch size and audio context
+    {
+        const auto key = std::make_pair((int) inputs.size(), n_audio_ctx);
+
+        auto it = lead.mem_encode_batch.find(key);
+        if (it == lead.mem_encode_batch.end()) {
+            struct wsp_ggml_allocr * measure = wsp_ggml_allocr_new_measure(WHISPER_ALLOC_ALIGNMENT);
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
+
+            struct wsp_ggml_cgraph gf = {};
+
+            whisper_build_graph_encoder(wctx, lead, inputs, ctx0, measure, gf);
+
+            it = lead.mem_encode_batch.emplace(key, wsp_ggml_allocr_alloc_graph(measure, &gf)).first;
+
+            wsp_ggml_free(ctx0);
+            wsp_ggml_allocr_free(measure);
+        }
+
+        const size_t mem_encode = it->second;
+
+        if (lead.alloc_batch == nullptr || lead.buf_alloc_batch.size() < mem_encode + WHISPER_ALLOC_ALIGNMENT) {
+            if (lead.alloc_batch != nullptr) {
+                wsp_ggml_allocr_free(lead.alloc_batch);
+            }
+
+            lead.buf_alloc_batch.resize(mem_encode + WHISPER_ALLOC_ALIGNMENT);
+            lead.alloc_batch = wsp_ggml_allocr_new(lead.buf_alloc_batch.data(), lead.buf_alloc_batch.size(), WHISPER_ALLOC_ALIGNMENT);
+
+            log("%s: compute buffer of %d windows = %7.2f MB\n", __func__, (int) inputs.size(), lead.buf_alloc_batch.size()/1024.0/1024.0);
+        }
+    }
+
     struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
+    wsp_ggml_allocr_reset(lead.alloc_batch);
+
     struct wsp_ggml_cgraph gf = {};
     gf.n_threads = n_threads;
 
-    struct wsp_ggml_tensor * embd = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*wsp_ggml_element_size(embd));
+    if (!whisper_build_graph_encoder(wctx, lead, inputs, ctx0, lead.alloc_batch, gf)) {
+        wsp_ggml_free(ctx0);
+        return false;
+    }
+
+    for (auto & inp : inputs) {
+        kv_cache_set_n_ctx(inp.state->kv_cross, n_audio_ctx);
+    }
+
+    wsp_ggml_allocr_alloc_graph(lead.alloc_batch, &gf);
+
+    lead.graph_compute(ctx0, &gf);
+
+    wsp_ggml_free(ctx0);
+
+    lead.t_encode_us += wsp_ggml_time_us() - t_start_us;
+
+    for (auto & inp : inputs) {
+        whisper_state & wstate = *inp.state;
+
+        wstate.n_encode++;
+
+        wstate.encoded.mel_id      = inp.mel->id;
+        wstate.encoded.mel_offset  = inp.mel_offset;
+        wstate.encoded.n_audio_ctx = n_audio_ctx;
+    }
+
+    return true;
+}
+
+// build the decoder graph into dg.gf
+//
+//   - n_decoders: number of decoders to evaluate - with more than one decoder, n_tokens must be 1
+//   - n_past:     number of past tokens, used for the attention mask
+//   - n_kv:       number of self-attention KV entries to attend to (>= n_past + n_tokens)
+//   - contiguous: bit j is set when the slots of decoder j are contiguous (kv_seq_is_contiguous) - its K and V are
+//                 then views of the cache, they are gathered from the slots of its blocks otherwise
+//
+// the inputs are allocated with alloc right away, the rest of the graph by wsp_ggml_allocr_alloc_graph()
+// whisper_decode_graph_set_inputs() binds the graph to the KV cache blocks of the decoders and moves it to another n_past
+static void whisper_build_graph_decoder(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   n_decoders,
+ struct wsp_ggml_context * ctx0,
+  struct wsp_ggml_allocr * alloc,
+   whisper_decode_graph & dg,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_kv,
+              const int   contiguous) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int N  = n_tokens;
+    const int NB = N*n_decoders; // tokens in the batch
+    const int M  = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    const wsp_ggml_type kv_cross_type = wstate.kv_cross.k->type;
+    const int M_pad = kv_cross_n_pad(kv_cross_type, M);
+
+    WHISPER_ASSERT(n_past + N <= n_kv && n_kv <= n_ctx);
+    WHISPER_ASSERT(n_decoders == 1 || N == 1);
+
+    dg.n_tokens    = N;
+    dg.n_decoders  = n_decoders;
+    dg.n_kv        = n_kv;
+    dg.n_audio_ctx = M;
 
-    struct wsp_ggml_tensor * position = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
+    auto & kv_self = wstate.kv_self;
+
+    const int    n_slots  = kv_self.n_slots;
+    const size_t row_size = kv_self.row_size;
+
+    // type of the gathered V - the rows of n_kv tokens do not fit the blocks of a quantized type
+    const wsp_ggml_type v_type = wsp_ggml_is_quantized(kv_self.v->type) ? wctx.itype : kv_self.v->type;
+
+    dg.kv_self_k = kv_self.k;
+
+    dg.kv_idx.clear();
+    for (int j = 0; j < n_decoders; ++j) {
+        if (contiguous & (1 << j)) {
+            dg.kv_idx.push_back(nullptr);
+            continue;
+        }
+
+        struct wsp_ggml_tensor * kv_idx = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, n_kv);
+        wsp_ggml_allocr_alloc(alloc, kv_idx);
+
+        dg.kv_idx.push_back(kv_idx);
     }
 
-    wstate.use_buf(ctx0, 3);
+    struct wsp_ggml_tensor * embd     = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, NB);
+    struct wsp_ggml_tensor * position = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, NB);
+
+    wsp_ggml_allocr_alloc(alloc, embd);
+    wsp_ggml_allocr_alloc(alloc, position);
+
+    dg.embd     = embd;
+    dg.position = position;
 
     // token encoding + position encoding
     struct wsp_ggml_tensor * cur =
@@ -1983,8 +2934,6 @@ static bool whisper_decode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_norm(ctx0, inpL);
 
             // cur = ln_0_w*cur + ln_0_b
@@ -2016,102 +2965,156 @@ static bool whisper_decode_internal(
 
             Kcur = wsp_ggml_scale_inplace(ctx0, Kcur, wsp_ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            // store key and value to memory
-            {
-                struct wsp_ggml_tensor * Vcur = wsp_ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
-
-                Vcur = wsp_ggml_add(ctx0,
-                        wsp_ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+            struct wsp_ggml_tensor * Vcur = wsp_ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
 
-                Vcur = wsp_ggml_transpose(ctx0, wsp_ggml_reshape_2d(ctx0, Vcur, n_state, N));
+            Vcur = wsp_ggml_add(ctx0,
+                    wsp_ggml_repeat(ctx0,
+                        layer.attn_v_b,
+                        Vcur),
+                    Vcur);
+
+            // each decoder attends to its own tokens in the KV cache
+            for (int j = 0; j < n_decoders; ++j) {
+                struct wsp_ggml_tensor * Qcur_j = Qcur;
+                struct wsp_ggml_tensor * Kcur_j = Kcur;
+                struct wsp_ggml_tensor * Vcur_j = Vcur;
+
+                if (n_decoders > 1) {
+                    Qcur_j = wsp_ggml_view_2d(ctx0, Qcur, n_state, N, Qcur->nb[1], j*N*Qcur->nb[1]);
+                    Kcur_j = wsp_ggml_view_2d(ctx0, Kcur, n_state, N, Kcur->nb[1], j*N*Kcur->nb[1]);
+                    Vcur_j = wsp_ggml_view_2d(ctx0, Vcur, n_state, N, Vcur->nb[1], j*N*Vcur->nb[1]);
+                }
 
-                struct wsp_ggml_tensor * k = wsp_ggml_view_1d(ctx0, kv_self.k, N*n_state, (wsp_ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct wsp_ggml_tensor * v = wsp_ggml_view_2d(ctx0, kv_self.v, N, n_state,
-                        (   n_ctx)*wsp_ggml_element_size(kv_self.v),
-                        (il*n_ctx)*wsp_ggml_element_size(kv_self.v)*n_state + n_past*wsp_ggml_element_size(kv_self.v));
+                // the slots of the layer in the cache
+                struct wsp_ggml_tensor * k_layer = wsp_ggml_view_2d(ctx0, kv_self.k, n_state, n_slots, row_size, il*n_slots*row_size);
+                struct wsp_ggml_tensor * v_layer = wsp_ggml_view_2d(ctx0, kv_self.v, n_state, n_slots, row_size, il*n_slots*row_size);
 
-                wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Kcur, k));
-                wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Vcur, v));
-            }
+                // store key and value to memory
+                // the N new tokens are in contiguous slots, starting at the slot of n_past (see kv_seq_prepare)
+                {
+                    struct wsp_ggml_tensor * k = wsp_ggml_view_1d(ctx0, kv_self.k, N*n_state, il*n_slots*row_size);
+                    struct wsp_ggml_tensor * v = wsp_ggml_view_1d(ctx0, kv_self.v, N*n_state, il*n_slots*row_size);
 
-            // ------
+                    struct wsp_ggml_tensor * k_cpy = wsp_ggml_cpy(ctx0, Kcur_j, k);
+                    struct wsp_ggml_tensor * v_cpy = wsp_ggml_cpy(ctx0, Vcur_j, v);
 
-            wstate.use_buf(ctx0, 0);
+                    for (auto * t : { k, k_cpy, v, v_cpy }) {
+                        dg.kv_views.push_back({ t, (char *) t->data, row_size, j, false });
+                    }
 
-            struct wsp_ggml_tensor * Q =
-                wsp_ggml_permute(ctx0,
-                        wsp_ggml_cpy(ctx0,
-                            Qcur,
-                            wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
+                    wsp_ggml_build_forward_expand(&dg.gf, k_cpy);
+                    wsp_ggml_build_forward_expand(&dg.gf, v_cpy);
+                }
 
-            struct wsp_ggml_tensor * K =
-                wsp_ggml_permute(ctx0,
-                        wsp_ggml_reshape_3d(ctx0,
-                            wsp_ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*wsp_ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+                // ------
 
-            wstate.use_buf(ctx0, 1);
+                struct wsp_ggml_tensor * Q =
+                    wsp_ggml_permute(ctx0,
+                            wsp_ggml_cpy(ctx0,
+                                Qcur_j,
+                                wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            0, 2, 1, 3);
 
-            // K * Q
-            struct wsp_ggml_tensor * KQ = wsp_ggml_mul_mat(ctx0, K, Q);
+                const bool in_place = contiguous & (1 << j);
 
-            //struct wsp_ggml_tensor * KQ_scaled =
-            //    wsp_ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            wsp_ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                struct wsp_ggml_tensor * K = nullptr;
+                if (in_place) {
+                    // the n_kv slots from the first token of the decoder, bound by whisper_decode_graph_set_inputs()
+                    const size_t es = wsp_ggml_element_size(kv_self.k);
 
-            struct wsp_ggml_tensor * KQ_masked = wsp_ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                    K = wsp_ggml_view_3d(ctx0, kv_self.k, n_state/n_head, n_kv, n_head, row_size, es*n_state/n_head, il*n_slots*row_size);
+                    dg.kv_views.push_back({ K, (char *) K->data, row_size, j, true });
+                } else {
+                    // gather the tokens of the decoder from their slots
+                    // get_rows converts to F32 - convert back to the type of the cache for the same precision as a
+                    // contiguous cache. a quantized cache is dequantized by get_rows and K stays in F32
+                    K = wsp_ggml_get_rows(ctx0, k_layer, dg.kv_idx[j]);
+                    if (kv_self.k->type != WSP_GGML_TYPE_F32 && !wsp_ggml_is_quantized(kv_self.k->type)) {
+                        K = wsp_ggml_cpy(ctx0, K, wsp_ggml_new_tensor_2d(ctx0, kv_self.k->type, n_state, n_kv));
+                    }
 
-            struct wsp_ggml_tensor * KQ_soft_max = wsp_ggml_soft_max_inplace(ctx0, KQ_masked);
+                    K = wsp_ggml_permute(ctx0,
+                            wsp_ggml_reshape_3d(ctx0, K, n_state/n_head, n_head, n_kv),
+                            0, 2, 1, 3);
+                }
 
-            struct wsp_ggml_tensor * V =
-                wsp_ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_state/n_head, n_head,
-                        n_ctx*wsp_ggml_element_size(kv_self.v),
-                        n_ctx*wsp_ggml_element_size(kv_self.v)*n_state/n_head,
-                        il*n_ctx*wsp_ggml_element_size(kv_self.v)*n_state);
+                // K * Q
+                struct wsp_ggml_tensor * KQ = wsp_ggml_mul_mat(ctx0, K, Q);
 
-            struct wsp_ggml_tensor * KQV = wsp_ggml_mul_mat(ctx0, V, KQ_soft_max);
+                //struct wsp_ggml_tensor * KQ_scaled =
+                //    wsp_ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            wsp_ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            struct wsp_ggml_tensor * KQV_merged = wsp_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct wsp_ggml_tensor * KQ_masked = wsp_ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                dg.kq_masks.push_back(KQ_masked);
 
-            cur = wsp_ggml_cpy(ctx0,
-                    KQV_merged,
-                    wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, N));
+                struct wsp_ggml_tensor * KQ_soft_max = wsp_ggml_soft_max_inplace(ctx0, KQ_masked);
+
+                struct wsp_ggml_tensor * V_rows = nullptr;
+                if (in_place) {
+                    const size_t es = wsp_ggml_element_size(kv_self.v);
+
+                    V_rows = wsp_ggml_view_3d(ctx0, kv_self.v, n_state/n_head, n_head, n_kv, es*n_state/n_head, row_size, il*n_slots*row_size);
+                    dg.kv_views.push_back({ V_rows, (char *) V_rows->data, row_size, j, true });
+                } else {
+                    V_rows = wsp_ggml_reshape_3d(ctx0,
+                            wsp_ggml_get_rows(ctx0, v_layer, dg.kv_idx[j]),
+                            n_state/n_head, n_head, n_kv);
+                }
+
+                struct wsp_ggml_tensor * V_perm = wsp_ggml_permute(ctx0, V_rows, 1, 2, 0, 3);
+                if (in_place) {
+                    dg.kv_views.push_back({ V_perm, (char *) V_perm->data, row_size, j, true });
+                }
+
+                struct wsp_ggml_tensor * V =
+                    wsp_ggml_cpy(ctx0,
+                            V_perm,
+                            wsp_ggml_new_tensor_3d(ctx0, v_type, n_kv, n_state/n_head, n_head));
+
+                struct wsp_ggml_tensor * KQV = wsp_ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct wsp_ggml_tensor * KQV_merged = wsp_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                if (n_decoders == 1) {
+                    cur = wsp_ggml_cpy(ctx0,
+                            KQV_merged,
+                            wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, N));
+                } else {
+                    // gather the results of the decoders in the columns of cur
+                    if (j == 0) {
+                        cur = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, NB);
+                    }
+
+                    cur = wsp_ggml_set_1d_inplace(ctx0, cur,
+                            wsp_ggml_cpy(ctx0,
+                                KQV_merged,
+                                wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, N)),
+                            j*N*n_state*wsp_ggml_element_size(cur));
+                }
+            }
         }
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = wsp_ggml_add(ctx0,
                     wsp_ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         struct wsp_ggml_tensor * inpCA = wsp_ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_norm(ctx0, inpCA); // note: we use inpCA here
 
             // cur = ln_0_w*cur + ln_0_b
@@ -2139,8 +3142,8 @@ static bool whisper_decode_internal(
             // Kcross is already scaled
             struct wsp_ggml_tensor * Kcross =
                 wsp_ggml_reshape_3d(ctx0,
-                        wsp_ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*wsp_ggml_element_size(wstate.kv_cross.k)*n_state),
-                        n_state/n_head, n_head, M);
+                        wsp_ggml_view_1d(ctx0, wstate.kv_cross.k, M_pad*n_state, il*M_pad*kv_row_size(kv_cross_type, n_state)),
+                        n_state/n_head, n_head, M_pad);
 
             //struct wsp_ggml_tensor * Vcross =
             //    wsp_ggml_reshape_3d(ctx0,
@@ -2154,10 +3157,10 @@ static bool whisper_decode_internal(
 
             struct wsp_ggml_tensor * V =
                 wsp_ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        M, n_state/n_head, n_head,
-                        M*wsp_ggml_element_size(wstate.kv_cross.v),
-                        M*wsp_ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        il*M*wsp_ggml_element_size(wstate.kv_cross.v)*n_state);
+                        M_pad, n_state/n_head, n_head,
+                        kv_row_size(kv_cross_type, M_pad),
+                        kv_row_size(kv_cross_type, M_pad)*n_state/n_head,
+                        il*kv_row_size(kv_cross_type, M_pad)*n_state);
 
             // ------
 
@@ -2165,7 +3168,7 @@ static bool whisper_decode_internal(
                 wsp_ggml_permute(ctx0,
                         wsp_ggml_cpy(ctx0,
                             Qcur,
-                            wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, NB)),
                         0, 2, 1, 3);
 
             struct wsp_ggml_tensor * K = wsp_ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
@@ -2182,35 +3185,35 @@ static bool whisper_decode_internal(
             // no masking for cross-attention
             //struct wsp_ggml_tensor * KQ_masked = wsp_ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
 
+            // except for the padding of a quantized cache
+            if (M_pad != M) {
+                KQ = wsp_ggml_add_inplace(ctx0, KQ,
+                        wsp_ggml_repeat(ctx0, wsp_ggml_view_1d(ctx0, wstate.kv_cross.mask, M_pad, 0), KQ));
+            }
+
             struct wsp_ggml_tensor * KQ_soft_max = wsp_ggml_soft_max_inplace(ctx0, KQ);
 
             struct wsp_ggml_tensor * KQV = wsp_ggml_mul_mat(ctx0, V, KQ_soft_max);
 
             struct wsp_ggml_tensor * KQV_merged = wsp_ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            // cur = KQV_merged.contiguous().view(n_state, N)
+            // cur = KQV_merged.contiguous().view(n_state, NB)
             cur = wsp_ggml_cpy(ctx0,
                     KQV_merged,
-                    wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, N));
+                    wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, NB));
         }
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_mul_mat(ctx0,
                     layer.cross_attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = wsp_ggml_add(ctx0,
                     wsp_ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         cur = wsp_ggml_add(ctx0, cur, inpCA);
 
@@ -2220,12 +3223,8 @@ static bool whisper_decode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
                 cur = wsp_ggml_norm(ctx0, inpFF);
 
-                wstate.use_buf(ctx0, 1);
-
                 // cur = mlp_ln_w*cur + mlp_ln_b
                 cur = wsp_ggml_add(ctx0,
                         wsp_ggml_mul(ctx0,
@@ -2234,40 +3233,28 @@ static bool whisper_decode_internal(
                         wsp_ggml_repeat(ctx0, layer.mlp_ln_b, cur));
             }
 
-            wstate.use_buf(ctx0, 0);
-
             // fully connected
             cur = wsp_ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = wsp_ggml_add(ctx0,
                     wsp_ggml_repeat(ctx0, layer.mlp_0_b, cur),
                     cur);
 
-            wstate.use_buf(ctx0, 0);
-
             // GELU activation
             cur = wsp_ggml_gelu(ctx0, cur);
 
-            wstate.use_buf(ctx0, 1);
-
             // projection
             cur = wsp_ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 0);
-
             cur = wsp_ggml_add(ctx0,
                     wsp_ggml_repeat(ctx0, layer.mlp_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 3);
-
         inpL = wsp_ggml_add(ctx0, cur, inpFF);
     }
 
@@ -2275,12 +3262,8 @@ static bool whisper_decode_internal(
 
     // norm
     {
-        wstate.use_buf(ctx0, 0);
-
         cur = wsp_ggml_norm(ctx0, cur);
 
-        wstate.use_buf(ctx0, 1);
-
         cur = wsp_ggml_add(ctx0,
                 wsp_ggml_mul(ctx0,
                     wsp_ggml_repeat(ctx0, model.d_ln_w, cur),
@@ -2288,1716 +3271,3258 @@ static bool whisper_decode_internal(
                 wsp_ggml_repeat(ctx0, model.d_ln_b, cur));
     }
 
-    wstate.use_buf(ctx0, 0);
-
-    // compute logits only for the last token
+    // compute logits only for the last token (of each decoder - with several decoders there is a single token)
     // comment this line to compute logits for all N tokens
     // might be useful in the future
-    cur = wsp_ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    if (n_decoders == 1) {
+        cur = wsp_ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    }
 
     struct wsp_ggml_tensor * logits = wsp_ggml_mul_mat(ctx0, model.d_te, cur);
 
-    wstate.use_buf(ctx0, -1);
+    wsp_ggml_build_forward_expand(&dg.gf, logits);
 
-    // run the computation
-    {
-        wsp_ggml_build_forward_expand(&gf, logits);
-        wsp_ggml_graph_compute       (ctx0, &gf);
-    }
+    dg.logits = logits;
+}
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), wsp_ggml_get_data(logits), sizeof(float)*N*n_vocab);
+// the blocks of the decoders must be prepared for the new tokens (kv_seq_prepare)
+static void whisper_decode_graph_set_inputs(
+   whisper_decode_graph & dg,
+ whisper_decoder * const * decoders,
+    const whisper_token * tokens,
+                    int   n_past) {
+    const int n_batch = dg.n_tokens*dg.n_decoders;
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), wsp_ggml_get_data(logits), sizeof(float)*n_vocab);
+    memcpy(dg.embd->data, tokens, n_batch*wsp_ggml_element_size(dg.embd));
 
-    if (N > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        wsp_ggml_used_mem(ctx0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+    for (int i = 0; i < n_batch; ++i) {
+        ((int32_t *) dg.position->data)[i] = n_past + i % dg.n_tokens;
     }
 
-    wsp_ggml_free(ctx0);
-
-    wstate.t_decode_us += wsp_ggml_time_us() - t_start_us;
-    wstate.n_decode++;
+    for (int j = 0; j < dg.n_decoders; ++j) {
+        const auto & seq = decoders[j]->kv_self;
 
-    return true;
-}
+        // contiguous slots are read in place, see kv_views
+        if (dg.kv_idx[j] == nullptr) {
+            continue;
+        }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+        // the slots after the new tokens are masked - any valid slot will do
+        int32_t * kv_idx = (int32_t *) dg.kv_idx[j]->data;
+        for (int i = 0; i < dg.n_kv; ++i) {
+            kv_idx[i] = i < n_past + dg.n_tokens ? kv_seq_slot(seq, i) : 0;
+        }
+    }
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    for (auto & view : dg.kv_views) {
+        view.tensor->data = view.data + kv_seq_slot(decoders[view.decoder]->kv_self, view.first ? 0 : n_past)*view.stride;
+    }
 
-    return std::string(buf);
+    for (auto * mask : dg.kq_masks) {
+        ((int32_t *) mask->src1->data)[0] = n_past;
+    }
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-static float sin_vals[SIN_COS_N_COUNT];
-static float cos_vals[SIN_COS_N_COUNT];
+// max number of decoders evaluated in one graph
+// each decoder adds its own self-attention to every layer, which is limited by the number of nodes of a graph
+static int whisper_decode_batch_max(const whisper_hparams & hparams) {
+    // upper bounds of the number of graph nodes per layer: shared part + self-attention of each decoder
+    const int n_nodes_layer   = 32;
+    const int n_nodes_decoder = 44;
 
-// In FFT, we frequently use sine and cosine operations with the same values. 
-// We can use precalculated values to speed up the process.
-static void fill_sin_cos_table() {
-    static bool is_filled = false;
-    if (is_filled) return;
-    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
-        sin_vals[i] = sinf(theta);
-        cos_vals[i] = cosf(theta);
-    }
-    is_filled = true;
+    const int n_batch = (WSP_GGML_MAX_NODES/hparams.n_text_layer - n_nodes_layer)/n_nodes_decoder;
+
+    return std::max(1, std::min(n_batch, WHISPER_MAX_DECODERS));
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+// find a cached graph for a single-token decode, or build a new one
+static whisper_decode_graph & whisper_get_decode_graph(
+        whisper_context & wctx,
+          whisper_state & wstate,
+ whisper_decoder * const * decoders,
+              const int   n_decoders,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_ctx = hparams.n_text_ctx;
+    const int M     = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-    out.resize(N*2);
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    const int n_kv = std::min(n_ctx, ((n_past + n_tokens + WHISPER_DECODE_GRAPH_N_KV_PAD - 1)/WHISPER_DECODE_GRAPH_N_KV_PAD)*WHISPER_DECODE_GRAPH_N_KV_PAD);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    // one bit per decoder index, and one bit per decoder of the graph that reads its slots in place
+    int decoder_mask = 0;
+    int contiguous   = 0;
+    for (int j = 0; j < n_decoders; ++j) {
+        decoder_mask |= 1 << int(decoders[j] - wstate.decoders);
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*cos_vals[idx]; // cos(t)
-            im -= in[n]*sin_vals[idx]; // sin(t)
+        if (kv_seq_is_contiguous(wstate.kv_self, decoders[j]->kv_self, n_past + n_tokens, n_kv)) {
+            contiguous |= 1 << j;
         }
-
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    const auto key = std::make_tuple(n_tokens, n_kv, decoder_mask, contiguous, (const wsp_ggml_tensor *) wstate.kv_cross.k);
 
-    int N = in.size();
+    auto & graphs = wstate.decode_graphs;
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+    auto it = graphs.find(key);
+    if (it != graphs.end()) {
+        const auto & dg = it->second;
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+        if (dg.n_audio_ctx != M || dg.n_threads != n_threads || dg.n_decoders != n_decoders || dg.kv_self_k != wstate.kv_self.k) {
+            graphs.erase(it);
+            it = graphs.end();
+        }
     }
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    if (it == graphs.end()) {
+        if ((int) graphs.size() >= WHISPER_MAX_DECODE_GRAPHS) {
+            auto lru = graphs.begin();
+            for (auto jt = graphs.begin(); jt != graphs.end(); ++jt) {
+                if (jt->second.i_used < lru->second.i_used) {
+                    lru = jt;
+                }
+            }
+            graphs.erase(lru);
+        }
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+        whisper_decode_graph & dg = graphs[key];
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
-        }
-    }
+        // measure the size of the graph in the compute buffer
+        size_t mem_size = 0;
+        {
+            struct wsp_ggml_init_params params = {
+                /*.mem_size   =*/ wstate.buf_compute.size(),
+                /*.mem_buffer =*/ wstate.buf_compute.data(),
+                /*.no_alloc   =*/ true,
+            };
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+            wsp_ggml_allocr_reset(wstate.alloc);
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < N/2; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = cos_vals[idx]; // cos(t)
-        float im = -sin_vals[idx]; // sin(t)
+            whisper_build_graph_decoder(wctx, wstate, n_decoders, ctx0, wstate.alloc, dg, n_tokens, n_past, n_kv, contiguous);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+            mem_size = wsp_ggml_used_mem(ctx0) + WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE + 256;
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+            wsp_ggml_free(ctx0);
+        }
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
-    }
-}
+        // build it again in its own buffer and place its tensors in the compute buffer
+        // the context is released right away - the tensors stay valid in dg.buf
+        {
+            dg.gf = {};
+            dg.kv_views.clear();
+            dg.kq_masks.clear();
+            dg.buf.resize(mem_size);
+
+            struct wsp_ggml_init_params params = {
+                /*.mem_size   =*/ dg.buf.size(),
+                /*.mem_buffer =*/ dg.buf.data(),
+                /*.no_alloc   =*/ true,
+            };
 
-static bool hann_window(int length, bool periodic, std::vector<float> & output) {
-    if (output.size() < length) {
-        output.resize(length);
-    }
-    int offset = -1;
-    if (periodic) {
-        offset = 0;
-    }
-    for (int i = 0; i < length; i++) {
-        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
-    }
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-    return true;
-}
+            wsp_ggml_allocr_reset(wstate.alloc);
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    int n_fft = 1 + (frame_size / 2);
-    int i = ith;
+            whisper_build_graph_decoder(wctx, wstate, n_decoders, ctx0, wstate.alloc, dg, n_tokens, n_past, n_kv, contiguous);
+            dg.gf.n_threads = n_threads;
+            dg.n_threads    = n_threads;
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+            wsp_ggml_allocr_alloc_graph(wstate.alloc, &dg.gf);
 
-        // apply Hanning window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+            // only the header - the data is bound to the work buffer of the state in graph_compute()
+            dg.gf.work_size = wsp_ggml_graph_work_size(&dg.gf);
+            if (dg.gf.work_size > 0) {
+                dg.gf.work = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I8, dg.gf.work_size);
+            }
+
+            wsp_ggml_free(ctx0);
         }
 
-        // FFT
-        fft(fft_in, fft_out);
+        it = graphs.find(key);
+    }
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < frame_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+    it->second.i_used = ++wstate.n_decode_graph_uses;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
+    return it->second;
+}
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - decoders:   the decoders to evaluate at once - with more than one decoder, each gets a single token
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt (n_tokens per decoder)
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with, the same for all decoders
+//
+// the logits of decoder j are stored in wstate.logits[j*n_vocab, (j + 1)*n_vocab)
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+ whisper_decoder * const * decoders,
+              const int   n_decoders,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    const int64_t t_start_us = wsp_ggml_time_us();
 
-            sum = log10(std::max(sum, 1e-10));
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-            mel.data[j * mel.n_len + i] = sum;
-        }
+    WHISPER_ASSERT(!!wstate.kv_self.ctx);
+
+    // same as the encoder: the first decode reads the decoder weights of a mapped model from disk
+    int64_t n_minor = 0;
+    int64_t n_major = 0;
+
+    const bool first_touch = model.mapping && wstate.n_decode == 0;
+    if (first_touch) {
+        whisper_page_faults(n_minor, n_major);
     }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+    for (int j = 0; j < n_decoders; ++j) {
+        if (!kv_seq_prepare(wstate.kv_self, decoders[j]->kv_self, n_past, n_tokens)) {
+            log("%s: failed to prepare the kv cache of the decoder\n", __func__);
+            return false;
         }
     }
-}
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
-              whisper_state & wstate,
-              const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   frame_size,
-              const int   frame_step,
-              const int   n_mel,
-              const int   n_threads,
-              const whisper_filters & filters,
-              const bool   debug,
-              whisper_mel & mel) {
-    const int64_t t_start_us = wsp_ggml_time_us();
+    auto & logits_out = wstate.logits;
 
-    // Hanning window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    std::vector<float> hann;
-    hann_window(frame_size, true, hann);
+    const int n_vocab = hparams.n_vocab;
 
+    const int N = n_tokens;
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, n_ctx = %d\n", __func__, n_past, N, hparams.n_text_ctx);
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+    // extract logits only for the last token
+    logits_out.resize(n_decoders*n_vocab);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+    if (N == 1) {
+        // the sampling loop decodes one token at a time - re-use the graph from the previous tokens
+        whisper_decode_graph & dg = whisper_get_decode_graph(wctx, wstate, decoders, n_decoders, N, n_past, n_threads);
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+        whisper_decode_graph_set_inputs(dg, decoders, tokens, n_past);
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+        dg.gf.n_threads = n_threads;
+        wstate.graph_compute(nullptr, &dg.gf);
 
+        memcpy(logits_out.data(), wsp_ggml_get_data(dg.logits), sizeof(float)*n_decoders*n_vocab);
+    } else {
+        WHISPER_ASSERT(n_decoders == 1);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
+        struct wsp_ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_compute.size(),
+            /*.mem_buffer =*/ wstate.buf_compute.data(),
+            /*.no_alloc   =*/ true,
+        };
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+        wsp_ggml_allocr_reset(wstate.alloc);
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
+        whisper_decode_graph dg;
 
-    mmax -= 8.0;
+        const int contiguous = kv_seq_is_contiguous(wstate.kv_self, decoders[0]->kv_self, n_past + N, n_past + N) ? 1 : 0;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+        whisper_build_graph_decoder(wctx, wstate, n_decoders, ctx0, wstate.alloc, dg, N, n_past, n_past + N, contiguous);
+        wsp_ggml_allocr_alloc_graph(wstate.alloc, &dg.gf);
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        whisper_decode_graph_set_inputs(dg, decoders, tokens, n_past);
+
+        // run the computation
+        dg.gf.n_threads = n_threads;
+        wstate.graph_compute(ctx0, &dg.gf);
+
+        // extract logits for all N tokens
+        //logits_out.resize(N*n_vocab);
+        //memcpy(logits_out.data(), wsp_ggml_get_data(logits), sizeof(float)*N*n_vocab);
+
+        memcpy(logits_out.data(), wsp_ggml_get_data(dg.logits), sizeof(float)*n_vocab);
+
+        wsp_ggml_free(ctx0);
     }
 
-    wstate.t_mel_us += wsp_ggml_time_us() - t_start_us;
+    wstate.t_decode_us += wsp_ggml_time_us() - t_start_us;
+    wstate.n_decode++;
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
-        }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
+    if (first_touch) {
+        int64_t n_minor1 = 0;
+        int64_t n_major1 = 0;
+        whisper_page_faults(n_minor1, n_major1);
+
+        log("%s: first decode of the mapped model: %8.2f ms, %lld minor / %lld major page faults\n", __func__,
+                (wsp_ggml_time_us() - t_start_us)/1000.0, (long long) (n_minor1 - n_minor), (long long) (n_major1 - n_major));
     }
 
     return true;
 }
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    whisper_decoder * decoders[1] = { &decoder };
+
+    return whisper_decode_internal(wctx, wstate, decoders, 1, tokens, n_tokens, n_past, n_threads);
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+// mixed radix FFT
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the real input of n samples is packed in n/2 complex numbers (even samples in the real part, odd samples in the
+// imaginary part), transformed with a Stockham FFT and split into the n/2 + 1 bins of the real FFT
+// n = 400 = 2^4*5^2 is done with radix 4, 2, 5, 5 stages - any even n is supported
+// the twiddle factors are computed once in the plan and the transform does not allocate memory
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static void whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    WHISPER_ASSERT(n > 0 && n%2 == 0);
 
-        std::regex re(pat);
-        std::smatch m;
+    plan = whisper_fft_plan();
+    plan.n = n;
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+    const int nh = n/2;
+
+    // dedicated butterflies first, then the remaining primes
+    std::vector<int> radices;
+    {
+        int r = nh;
+        while (r%4 == 0) {
+            radices.push_back(4);
+            r /= 4;
+        }
+        for (int f : { 2, 3, 5 }) {
+            while (r%f == 0) {
+                radices.push_back(f);
+                r /= f;
+            }
+        }
+        for (int f = 7; r > 1; f += 2) {
+            while (r%f == 0) {
+                radices.push_back(f);
+                r /= f;
             }
-            str = m.suffix();
         }
     }
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+    int len = nh;
+    int s   = 1;
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
-                log("unknown token\n");
-                ++i;
+    for (int radix : radices) {
+        whisper_fft_stage stage;
+        stage.radix = radix;
+        stage.m     = len/radix;
+        stage.s     = s;
+        stage.i_tw  = plan.tw_re.size();
+        stage.i_rt  = plan.rt_re.size();
+
+        for (int p = 0; p < stage.m; ++p) {
+            for (int u = 1; u < radix; ++u) {
+                const double theta = -2.0*M_PI*p*u/len;
+                plan.tw_re.push_back(cos(theta));
+                plan.tw_im.push_back(sin(theta));
             }
         }
-    }
 
-    return tokens;
-}
+        if (radix > 5) {
+            for (int u = 0; u < radix; ++u) {
+                const double theta = -2.0*M_PI*u/radix;
+                plan.rt_re.push_back(cos(theta));
+                plan.rt_im.push_back(sin(theta));
+            }
+        }
 
-//
-// interface implementation
-//
+        plan.stages.push_back(stage);
 
-#ifdef WHISPER_USE_COREML
-// replace .bin with -encoder.mlmodelc
-static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+        len /= radix;
+        s   *= radix;
     }
 
-    // match "-qx_x"
-    pos = path_bin.rfind('-');
-    if (pos != std::string::npos) {
-        auto sub = path_bin.substr(pos);
-        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
-            path_bin = path_bin.substr(0, pos);
-        }
+    for (int k = 0; k <= nh; ++k) {
+        const double theta = -2.0*M_PI*k/n;
+        plan.sp_re.push_back(cos(theta));
+        plan.sp_im.push_back(sin(theta));
     }
+}
 
-    path_bin += "-encoder.mlmodelc";
+// vectors of V::n floats - the FFT butterflies and the mel filterbank are written once for a vector type: the SIMD
+// version handles the multiples of the vector width, the scalar version the rest
+struct whisper_f32x1 {
+    typedef float type;
+    enum { n = 1 };
 
-    return path_bin;
-}
-#endif
+    static type load (const float * p)   { return *p; }
+    static void store(float * p, type a) { *p = a; }
+    static type set1 (float a)           { return a; }
+    static type add  (type a, type b)    { return a + b; }
+    static type sub  (type a, type b)    { return a - b; }
+    static type mul  (type a, type b)    { return a * b; }
+};
 
-#ifdef WHISPER_USE_OPENVINO
-// replace .bin with-encoder-openvino.xml
-static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
+#if defined(__AVX__)
+#define WHISPER_F32_SIMD whisper_f32x8
+struct whisper_f32x8 {
+    typedef __m256 type;
+    enum { n = 8 };
+
+    static type load (const float * p)   { return _mm256_loadu_ps(p); }
+    static void store(float * p, type a) { _mm256_storeu_ps(p, a); }
+    static type set1 (float a)           { return _mm256_set1_ps(a); }
+    static type add  (type a, type b)    { return _mm256_add_ps(a, b); }
+    static type sub  (type a, type b)    { return _mm256_sub_ps(a, b); }
+    static type mul  (type a, type b)    { return _mm256_mul_ps(a, b); }
+};
+#elif defined(__ARM_NEON)
+#define WHISPER_F32_SIMD whisper_f32x4
+struct whisper_f32x4 {
+    typedef float32x4_t type;
+    enum { n = 4 };
+
+    static type load (const float * p)   { return vld1q_f32(p); }
+    static void store(float * p, type a) { vst1q_f32(p, a); }
+    static type set1 (float a)           { return vdupq_n_f32(a); }
+    static type add  (type a, type b)    { return vaddq_f32(a, b); }
+    static type sub  (type a, type b)    { return vsubq_f32(a, b); }
+    static type mul  (type a, type b)    { return vmulq_f32(a, b); }
+};
+#endif
 
-    path_bin += "-encoder-openvino.xml";
+// y = a*w
+template <typename V>
+static inline void whisper_fft_store_mul(float * y_re, float * y_im, typename V::type a_re, typename V::type a_im, float w_re, float w_im) {
+    const typename V::type vw_re = V::set1(w_re);
+    const typename V::type vw_im = V::set1(w_im);
 
-    return path_bin;
+    V::store(y_re, V::sub(V::mul(a_re, vw_re), V::mul(a_im, vw_im)));
+    V::store(y_im, V::add(V::mul(a_re, vw_im), V::mul(a_im, vw_re)));
 }
 
-static std::string whisper_openvino_get_path_cache(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
-
-    path_bin += "-encoder-openvino-cache";
+// butterflies of sub-transform p of a stage, for the interleaved sequences q, q + 1, ... < s
+// input  u-th element: x[q + s*(p + u*m)]
+// output u-th element: y[q + s*(radix*p + u)]*w[u - 1]
+// returns the first q that was not processed
+template <typename V>
+static int whisper_fft_pass_2(const whisper_fft_stage & st, int p, int q, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    typedef typename V::type v;
 
-    return path_bin;
-}
-#endif
+    const int s  = st.s;
+    const int sm = st.s*st.m;
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    fill_sin_cos_table();
-    whisper_state * state = new whisper_state;
+    for (; q + V::n <= s; q += V::n) {
+        const int i = q + s*p;
+        const int o = q + s*2*p;
 
-    const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
+        const v a0_re = V::load(x_re + i),      a0_im = V::load(x_im + i);
+        const v a1_re = V::load(x_re + i + sm), a1_im = V::load(x_im + i + sm);
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
-        log("%s: kv_cache_init() failed for self-attention cache\n", __func__);
-        delete state;
-        return nullptr;
-    }
+        V::store(y_re + o, V::add(a0_re, a1_re));
+        V::store(y_im + o, V::add(a0_im, a1_im));
 
-    {
-        const size_t memory_size = wsp_ggml_nbytes(state->decoders[0].kv_self.k) + wsp_ggml_nbytes(state->decoders[0].kv_self.v);
-        log("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+        whisper_fft_store_mul<V>(y_re + o + s, y_im + o + s, V::sub(a0_re, a1_re), V::sub(a0_im, a1_im), w_re[0], w_im[0]);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
-        log("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-        delete state;
-        return nullptr;
-    }
+    return q;
+}
 
-    {
-        const size_t memory_size = wsp_ggml_nbytes(state->kv_cross.k) + wsp_ggml_nbytes(state->kv_cross.v);
-        log("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
+template <typename V>
+static int whisper_fft_pass_3(const whisper_fft_stage & st, int p, int q, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    typedef typename V::type v;
 
-#ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+    const int s  = st.s;
+    const int sm = st.s*st.m;
 
-    log("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    log("%s: first run on a device may take a while ...\n", __func__);
+    const v half = V::set1(0.5f);
+    const v sin3 = V::set1(0.86602540378443864676f); // sin(2*pi/3)
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        log("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
-#ifndef WHISPER_COREML_ALLOW_FALLBACK
-        return nullptr;
-#endif
-    } else {
-        log("%s: Core ML model loaded\n", __func__);
-    }
-#endif
+    for (; q + V::n <= s; q += V::n) {
+        const int i = q + s*p;
+        const int o = q + s*3*p;
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+        const v a0_re = V::load(x_re + i),        a0_im = V::load(x_im + i);
+        const v a1_re = V::load(x_re + i + sm),   a1_im = V::load(x_im + i + sm);
+        const v a2_re = V::load(x_re + i + 2*sm), a2_im = V::load(x_im + i + 2*sm);
 
-    state->logits_id.reserve(ctx->model.hparams.n_vocab);
+        const v t1_re = V::add(a1_re, a2_re), t1_im = V::add(a1_im, a2_im);
+        const v t2_re = V::sub(a1_re, a2_re), t2_im = V::sub(a1_im, a2_im);
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+        const v m1_re = V::sub(a0_re, V::mul(half, t1_re));
+        const v m1_im = V::sub(a0_im, V::mul(half, t1_im));
 
-    state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
-    state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
+        // -i*sin3*t2
+        const v m2_re = V::mul(sin3, t2_im);
+        const v m2_im = V::sub(V::set1(0.0f), V::mul(sin3, t2_re));
 
-    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-    state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
-    state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
-    state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
+        V::store(y_re + o, V::add(a0_re, t1_re));
+        V::store(y_im + o, V::add(a0_im, t1_im));
 
-    state->rng = std::mt19937(0);
+        whisper_fft_store_mul<V>(y_re + o + s,   y_im + o + s,   V::add(m1_re, m2_re), V::add(m1_im, m2_im), w_re[0], w_im[0]);
+        whisper_fft_store_mul<V>(y_re + o + 2*s, y_im + o + 2*s, V::sub(m1_re, m2_re), V::sub(m1_im, m2_im), w_re[1], w_im[1]);
+    }
 
-    return state;
+    return q;
 }
 
-int whisper_ctx_init_openvino_encoder(
-        struct whisper_context * ctx,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-#ifndef WHISPER_USE_OPENVINO
-    (void)(ctx);
-    (void)(model_path);
-    (void)(device);
-    (void)(cache_dir);
+template <typename V>
+static int whisper_fft_pass_4(const whisper_fft_stage & st, int p, int q, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    typedef typename V::type v;
 
-    return 1;
-#else
-    if (!model_path && ctx->path_model.empty()) {
-        log("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
-        return 1;
-    }
+    const int s  = st.s;
+    const int sm = st.s*st.m;
 
-    std::string path_encoder;
-    if (!model_path) {
-        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
-        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
-    } else {
-        path_encoder = model_path;
-    }
+    for (; q + V::n <= s; q += V::n) {
+        const int i = q + s*p;
+        const int o = q + s*4*p;
 
-    std::string path_cache;
-    if (!cache_dir) {
-        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
-        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
-    } else {
-        path_cache = cache_dir;
-    }
+        const v a0_re = V::load(x_re + i),        a0_im = V::load(x_im + i);
+        const v a1_re = V::load(x_re + i + sm),   a1_im = V::load(x_im + i + sm);
+        const v a2_re = V::load(x_re + i + 2*sm), a2_im = V::load(x_im + i + 2*sm);
+        const v a3_re = V::load(x_re + i + 3*sm), a3_im = V::load(x_im + i + 3*sm);
 
-    log("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
-    log("%s: first run on a device may take a while ...\n", __func__);
+        const v t0_re = V::add(a0_re, a2_re), t0_im = V::add(a0_im, a2_im);
+        const v t1_re = V::sub(a0_re, a2_re), t1_im = V::sub(a0_im, a2_im);
+        const v t2_re = V::add(a1_re, a3_re), t2_im = V::add(a1_im, a3_im);
 
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
-        log("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
-        return 1;
-    } else {
-        log("%s: OpenVINO model loaded\n", __func__);
+        // -i*(a1 - a3)
+        const v t3_re = V::sub(a1_im, a3_im), t3_im = V::sub(a3_re, a1_re);
+
+        V::store(y_re + o, V::add(t0_re, t2_re));
+        V::store(y_im + o, V::add(t0_im, t2_im));
+
+        whisper_fft_store_mul<V>(y_re + o + s,   y_im + o + s,   V::add(t1_re, t3_re), V::add(t1_im, t3_im), w_re[0], w_im[0]);
+        whisper_fft_store_mul<V>(y_re + o + 2*s, y_im + o + 2*s, V::sub(t0_re, t2_re), V::sub(t0_im, t2_im), w_re[1], w_im[1]);
+        whisper_fft_store_mul<V>(y_re + o + 3*s, y_im + o + 3*s, V::sub(t1_re, t3_re), V::sub(t1_im, t3_im), w_re[2], w_im[2]);
     }
 
-    return 0;
-#endif
+    return q;
 }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+template <typename V>
+static int whisper_fft_pass_5(const whisper_fft_stage & st, int p, int q, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    typedef typename V::type v;
 
-    log("%s: loading model from '%s'\n", __func__, path_model);
+    const int s  = st.s;
+    const int sm = st.s*st.m;
 
-    auto fin = std::ifstream(path_model, std::ios::binary);
-    if (!fin) {
-        log("%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
-    }
+    const v c1 = V::set1( 0.30901699437494742410f); // cos(2*pi/5)
+    const v c2 = V::set1(-0.80901699437494742410f); // cos(4*pi/5)
+    const v s1 = V::set1( 0.95105651629515357212f); // sin(2*pi/5)
+    const v s2 = V::set1( 0.58778525229247312917f); // sin(4*pi/5)
 
-    whisper_model_loader loader = {};
+    for (; q + V::n <= s; q += V::n) {
+        const int i = q + s*p;
+        const int o = q + s*5*p;
 
-    loader.context = &fin;
+        const v a0_re = V::load(x_re + i),        a0_im = V::load(x_im + i);
+        const v a1_re = V::load(x_re + i + sm),   a1_im = V::load(x_im + i + sm);
+        const v a2_re = V::load(x_re + i + 2*sm), a2_im = V::load(x_im + i + 2*sm);
+        const v a3_re = V::load(x_re + i + 3*sm), a3_im = V::load(x_im + i + 3*sm);
+        const v a4_re = V::load(x_re + i + 4*sm), a4_im = V::load(x_im + i + 4*sm);
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+        const v b1_re = V::add(a1_re, a4_re), b1_im = V::add(a1_im, a4_im);
+        const v b2_re = V::add(a2_re, a3_re), b2_im = V::add(a2_im, a3_im);
+        const v d1_re = V::sub(a1_re, a4_re), d1_im = V::sub(a1_im, a4_im);
+        const v d2_re = V::sub(a2_re, a3_re), d2_im = V::sub(a2_im, a3_im);
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+        const v r1_re = V::add(a0_re, V::add(V::mul(c1, b1_re), V::mul(c2, b2_re)));
+        const v r1_im = V::add(a0_im, V::add(V::mul(c1, b1_im), V::mul(c2, b2_im)));
+        const v r2_re = V::add(a0_re, V::add(V::mul(c2, b1_re), V::mul(c1, b2_re)));
+        const v r2_im = V::add(a0_im, V::add(V::mul(c2, b1_im), V::mul(c1, b2_im)));
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+        const v i1_re = V::add(V::mul(s1, d1_re), V::mul(s2, d2_re));
+        const v i1_im = V::add(V::mul(s1, d1_im), V::mul(s2, d2_im));
+        const v i2_re = V::sub(V::mul(s2, d1_re), V::mul(s1, d2_re));
+        const v i2_im = V::sub(V::mul(s2, d1_im), V::mul(s1, d2_im));
 
-    auto ctx = whisper_init_no_state(&loader);
+        V::store(y_re + o, V::add(a0_re, V::add(b1_re, b2_re)));
+        V::store(y_im + o, V::add(a0_im, V::add(b1_im, b2_im)));
 
-    if (ctx) {
-        ctx->path_model = path_model;
+        // r -/+ i*i
+        whisper_fft_store_mul<V>(y_re + o + s,   y_im + o + s,   V::add(r1_re, i1_im), V::sub(r1_im, i1_re), w_re[0], w_im[0]);
+        whisper_fft_store_mul<V>(y_re + o + 2*s, y_im + o + 2*s, V::add(r2_re, i2_im), V::sub(r2_im, i2_re), w_re[1], w_im[1]);
+        whisper_fft_store_mul<V>(y_re + o + 3*s, y_im + o + 3*s, V::sub(r2_re, i2_im), V::add(r2_im, i2_re), w_re[2], w_im[2]);
+        whisper_fft_store_mul<V>(y_re + o + 4*s, y_im + o + 4*s, V::sub(r1_re, i1_im), V::add(r1_im, i1_re), w_re[3], w_im[3]);
     }
 
-    return ctx;
+    return q;
 }
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
-
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
-
-    log("%s: loading model from buffer\n", __func__);
+template <typename V>
+static int whisper_fft_pass(const whisper_fft_stage & st, int p, int q, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    switch (st.radix) {
+        case 2: return whisper_fft_pass_2<V>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+        case 3: return whisper_fft_pass_3<V>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+        case 4: return whisper_fft_pass_4<V>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+        case 5: return whisper_fft_pass_5<V>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+    }
 
-    whisper_model_loader loader = {};
+    return q;
+}
 
-    loader.context = &ctx;
+// any other radix - direct DFT of the radix elements
+static void whisper_fft_pass_generic(const whisper_fft_plan & plan, const whisper_fft_stage & st, int p, const float * w_re, const float * w_im,
+        const float * x_re, const float * x_im, float * y_re, float * y_im) {
+    const int r  = st.radix;
+    const int s  = st.s;
+    const int sm = st.s*st.m;
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+    const float * rt_re = plan.rt_re.data() + st.i_rt;
+    const float * rt_im = plan.rt_im.data() + st.i_rt;
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+    for (int q = 0; q < s; ++q) {
+        const int i = q + s*p;
+        const int o = q + s*r*p;
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
+        for (int u = 0; u < r; ++u) {
+            float c_re = 0.0f;
+            float c_im = 0.0f;
 
-        return size_to_copy;
-    };
+            for (int t = 0; t < r; ++t) {
+                const int k = (t*u)%r;
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+                c_re += x_re[i + t*sm]*rt_re[k] - x_im[i + t*sm]*rt_im[k];
+                c_im += x_re[i + t*sm]*rt_im[k] + x_im[i + t*sm]*rt_re[k];
+            }
 
-        return buf->current_offset >= buf->size;
-    };
-
-    loader.close = [](void * /*ctx*/) { };
-
-    return whisper_init_no_state(&loader);
+            if (u == 0) {
+                y_re[o] = c_re;
+                y_im[o] = c_im;
+            } else {
+                whisper_fft_store_mul<whisper_f32x1>(y_re + o + u*s, y_im + o + u*s, c_re, c_im, w_re[u - 1], w_im[u - 1]);
+            }
+        }
+    }
 }
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    wsp_ggml_time_init();
+// FFT of plan.n real samples
+//
+//   - work: 2*plan.n floats
+//   - out:  plan.n/2 + 1 complex bins, bin_0 to bin_nyquist (interleaved real and imaginary parts)
+//
+static void whisper_fft_real(const whisper_fft_plan & plan, const float * in, float * work, float * out) {
+    const int nh = plan.n/2;
 
-    whisper_context * ctx = new whisper_context;
+    float * x_re = work;
+    float * x_im = work + nh;
+    float * y_re = work + 2*nh;
+    float * y_im = work + 3*nh;
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        log("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
+    for (int i = 0; i < nh; ++i) {
+        x_re[i] = in[2*i + 0];
+        x_im[i] = in[2*i + 1];
     }
 
-    loader->close(loader->context);
+    for (const auto & st : plan.stages) {
+        for (int p = 0; p < st.m; ++p) {
+            const float * w_re = plan.tw_re.data() + st.i_tw + p*(st.radix - 1);
+            const float * w_im = plan.tw_im.data() + st.i_tw + p*(st.radix - 1);
 
-    return ctx;
-}
+            if (st.radix > 5) {
+                whisper_fft_pass_generic(plan, st, p, w_re, w_im, x_re, x_im, y_re, y_im);
+                continue;
+            }
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
-    if (!ctx) {
-        return nullptr;
-    }
+            int q = 0;
+#if defined(WHISPER_F32_SIMD)
+            q = whisper_fft_pass<WHISPER_F32_SIMD>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+#endif
+            whisper_fft_pass<whisper_f32x1>(st, p, q, w_re, w_im, x_re, x_im, y_re, y_im);
+        }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+        std::swap(x_re, y_re);
+        std::swap(x_im, y_im);
     }
 
-    return ctx;
-}
+    // X[k] = (Z[k] + conj(Z[nh - k]))/2 + e^(-2*pi*i*k/n)*(Z[k] - conj(Z[nh - k]))/2i
+    for (int k = 0; k <= nh; ++k) {
+        const int k0 = k%nh;
+        const int k1 = (nh - k)%nh;
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
-    if (!ctx) {
-        return nullptr;
-    }
+        const float e_re =  0.5f*(x_re[k0] + x_re[k1]);
+        const float e_im =  0.5f*(x_im[k0] - x_im[k1]);
+        const float o_re =  0.5f*(x_im[k0] + x_im[k1]);
+        const float o_im = -0.5f*(x_re[k0] - x_re[k1]);
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+        out[2*k + 0] = e_re + plan.sp_re[k]*o_re - plan.sp_im[k]*o_im;
+        out[2*k + 1] = e_im + plan.sp_re[k]*o_im + plan.sp_im[k]*o_re;
     }
-
-    return ctx;
 }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    whisper_context * ctx = whisper_init_no_state(loader);
-    if (!ctx) {
-        return nullptr;
+static bool hann_window(int length, bool periodic, std::vector<float> & output) {
+    if (output.size() < length) {
+        output.resize(length);
     }
-
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    int offset = -1;
+    if (periodic) {
+        offset = 0;
+    }
+    for (int i = 0; i < length; i++) {
+        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
     }
 
-    return ctx;
+    return true;
 }
 
-void whisper_free_state(struct whisper_state * state)
-{
-    if (state) {
-        kv_cache_free(state->kv_cross);
-
-        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
-            kv_cache_free(state->decoders[i].kv_self);
-        }
-
-#ifdef WHISPER_USE_COREML
-        if (state->ctx_coreml != nullptr) {
-            whisper_coreml_free(state->ctx_coreml);
-            state->ctx_coreml = nullptr;
-        }
-#endif
-
-#ifdef WHISPER_USE_OPENVINO
-        if (state->ctx_openvino != nullptr) {
-            whisper_openvino_free(state->ctx_openvino);
-            state->ctx_openvino = nullptr;
-        }
-#endif
+// sum of a[k]*b[k]
+template <typename V>
+static inline float whisper_dot_f32(const float * a, const float * b, int n) {
+    typename V::type acc = V::set1(0.0f);
 
-        delete state;
+    int k = 0;
+    for (; k + V::n <= n; k += V::n) {
+        acc = V::add(acc, V::mul(V::load(a + k), V::load(b + k)));
     }
-}
-
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        if (ctx->model.ctx) {
-            wsp_ggml_free(ctx->model.ctx);
-        }
-        if (ctx->model.buf) {
-            delete ctx->model.buf;
-        }
 
-        whisper_free_state(ctx->state);
+    float tmp[V::n];
+    V::store(tmp, acc);
 
-        delete ctx;
+    float sum = 0.0f;
+    for (int i = 0; i < V::n; ++i) {
+        sum += tmp[i];
     }
-}
-
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
+    for (; k < n; ++k) {
+        sum += a[k]*b[k];
     }
+
+    return sum;
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        log("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
-    }
+// natural log of (1 + x) * 2^e for x in [sqrt(0.5) - 1, sqrt(2) - 1]
+// ref: cephes logf
+template <typename V>
+static inline typename V::type whisper_log_poly(typename V::type x, typename V::type e) {
+    typedef typename V::type v;
 
-    return 0;
-}
+    const v z = V::mul(x, x);
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+    v y = V::set1(7.0376836292e-2f);
+    y = V::add(V::mul(y, x), V::set1(-1.1514610310e-1f));
+    y = V::add(V::mul(y, x), V::set1( 1.1676998740e-1f));
+    y = V::add(V::mul(y, x), V::set1(-1.2420140846e-1f));
+    y = V::add(V::mul(y, x), V::set1( 1.4249322787e-1f));
+    y = V::add(V::mul(y, x), V::set1(-1.6668057665e-1f));
+    y = V::add(V::mul(y, x), V::set1( 2.0000714765e-1f));
+    y = V::add(V::mul(y, x), V::set1(-2.4999993993e-1f));
+    y = V::add(V::mul(y, x), V::set1( 3.3333331174e-1f));
+    y = V::mul(V::mul(y, x), z);
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        log("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
-    }
+    y = V::add(y, V::mul(e, V::set1(-2.12194440e-4f)));
+    y = V::sub(y, V::mul(z, V::set1(0.5f)));
 
-    return 0;
+    return V::add(V::add(x, y), V::mul(e, V::set1(0.693359375f)));
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+// x = log10(max(x, 1e-10)) for n values
+// AVX2 and NEON take 8 / 4 values at a time, the other builds (AVX-only included) and the tail use the scalar loop:
+// all the paths use whisper_log_poly, so the values are the same as with the vector paths, not those of log10f
+static void whisper_log10_clamp(float * x, int n) {
+    const float log10_e = 0.43429448190325182765f;
 
-// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
-// TODO
+    int i = 0;
 
-// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
-// TODO
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        const __m256  v = _mm256_max_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(1e-10f));
+        const __m256i b = _mm256_castps_si256(v);
 
-// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
-// TODO
+        // v = m*2^e, m in [1, 2)
+        const __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(b, 23), _mm256_set1_epi32(127));
+        __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(b, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
 
-int whisper_set_mel_with_state(
-        struct whisper_context * /*ctx*/,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != WHISPER_N_MEL) {
-        log("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
-        return -1;
-    }
+        // m in [sqrt(0.5), sqrt(2))
+        const __m256 mask = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+        m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), mask);
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+        const __m256 ef = _mm256_add_ps(_mm256_cvtepi32_ps(e), _mm256_and_ps(mask, _mm256_set1_ps(1.0f)));
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+        const __m256 r = whisper_log_poly<whisper_f32x8>(_mm256_sub_ps(m, _mm256_set1_ps(1.0f)), ef);
 
-    return 0;
-}
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(r, _mm256_set1_ps(log10_e)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t v = vmaxq_f32(vld1q_f32(x + i), vdupq_n_f32(1e-10f));
+        const int32x4_t   b = vreinterpretq_s32_f32(v);
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+        // v = m*2^e, m in [1, 2)
+        const int32x4_t e = vsubq_s32(vshrq_n_s32(b, 23), vdupq_n_s32(127));
+        float32x4_t m = vreinterpretq_f32_s32(vorrq_s32(vandq_s32(b, vdupq_n_s32(0x007fffff)), vdupq_n_s32(0x3f800000)));
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return -1;
-    }
+        // m in [sqrt(0.5), sqrt(2))
+        const uint32x4_t mask = vcgtq_f32(m, vdupq_n_f32(1.41421356f));
+        m = vbslq_f32(mask, vmulq_f32(m, vdupq_n_f32(0.5f)), m);
 
-    return 0;
-}
+        const float32x4_t ef = vaddq_f32(vcvtq_f32_s32(e), vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(vdupq_n_f32(1.0f)))));
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return -1;
+        const float32x4_t r = whisper_log_poly<whisper_f32x4>(vsubq_f32(m, vdupq_n_f32(1.0f)), ef);
+
+        vst1q_f32(x + i, vmulq_f32(r, vdupq_n_f32(log10_e)));
     }
+#endif
 
-    return 0;
-}
+    for (; i < n; ++i) {
+        const float v = std::max(x[i], 1e-10f);
 
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    const int selected_decoder_id = 0;
+        uint32_t b;
+        memcpy(&b, &v, sizeof(b));
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return 1;
-    }
+        const int e = int(b >> 23) - 127;
 
-    return 0;
-}
+        b = (b & 0x007fffff) | 0x3f800000;
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    // TODO: add selected_decoder_id to state
-    const int selected_decoder_id = 0;
+        float m;
+        memcpy(&m, &b, sizeof(m));
 
-    if (ctx->state == nullptr) {
-        log("%s: ERROR state was not loaded.\n", __func__);
-        return false;
-    }
+        float ef = e;
+        if (m > 1.41421356f) {
+            m  *= 0.5f;
+            ef += 1.0f;
+        }
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return 1;
+        x[i] = whisper_log_poly<whisper_f32x1>(m - 1.0f, ef)*log10_e;
     }
-
-    return 0;
 }
 
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
+// log mel of the frame that starts at samples[0] - the samples after n_avail are zero
+// the n_mel values are written to out[0], out[out_stride], ...
+static void log_mel_spectrogram_frame(const float * hann, const float * samples, int n_avail, int frame_size,
+                                      const whisper_filters & filters, const whisper_fft_plan & fft_plan,
+                                      float * fft_in, float * fft_out, float * fft_work,
+                                      int n_mel, float * out, int out_stride) {
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    int n_fft = 1 + (frame_size / 2);
 
-    if (n_max_tokens < (int) res.size()) {
-        log("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
-        return -1;
+    // apply Hanning window (~10% faster)
+    for (int j = 0; j < std::min(frame_size, n_avail); j++) {
+        fft_in[j] = hann[j] * samples[j];
     }
-
-    for (int i = 0; i < (int) res.size(); i++) {
-        tokens[i] = res[i];
+    // fill the rest with zeros
+    if (n_avail < frame_size) {
+        std::fill(fft_in + n_avail, fft_in + frame_size, 0.0);
     }
 
-    return res.size();
-}
+    // FFT
+    whisper_fft_real(fft_plan, fft_in, fft_work, fft_out);
 
-int whisper_lang_max_id() {
-    auto max_id = 0;
-    for (const auto & kv : g_lang) {
-        max_id = std::max(max_id, kv.second.first);
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
     }
 
-    return max_id;
-}
+    // mel spectrogram - only the non-zero weights of each filter
+    // fft_in is no longer needed and holds the n_mel values until the log
+    float * mel = fft_in;
 
-int whisper_lang_id(const char * lang) {
-    if (!g_lang.count(lang)) {
-        for (const auto & kv : g_lang) {
-            if (kv.second.second == lang) {
-                return kv.second.first;
-            }
-        }
+    for (int j = 0; j < n_mel; j++) {
+        const int k0 = filters.start[j];
+        const int nk = std::min<int>(filters.end[j], n_fft) - k0;
 
-        log("%s: unknown language '%s'\n", __func__, lang);
-        return -1;
+#if defined(WHISPER_F32_SIMD)
+        mel[j] = nk > 0 ? whisper_dot_f32<WHISPER_F32_SIMD>(fft_out + k0, filters.sparse.data() + filters.offs[j], nk) : 0.0f;
+#else
+        mel[j] = nk > 0 ? whisper_dot_f32<whisper_f32x1>(fft_out + k0, filters.sparse.data() + filters.offs[j], nk) : 0.0f;
+#endif
     }
-    return g_lang.at(lang).first;
-}
 
-const char * whisper_lang_str(int id) {
-    for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.first.c_str();
-        }
-    }
+    whisper_log10_clamp(mel, n_mel);
 
-    log("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
+    for (int j = 0; j < n_mel; j++) {
+        out[j * out_stride] = mel[j];
+    }
 }
 
-int whisper_lang_auto_detect_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    const int seek = offset_ms/10;
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, const whisper_fft_plan & fft_plan, whisper_mel & mel) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(2 * (1 + frame_size / 2));
+    std::vector<float> fft_work(2 * frame_size);
 
-    if (seek < 0) {
-        log("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
+    int i = ith;
 
-    if (seek >= state->mel.n_len_org) {
-        log("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
-    }
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        log("%s: failed to encode\n", __func__);
-        return -6;
+        log_mel_spectrogram_frame(hann.data(), samples.data() + offset, n_samples - offset, frame_size, filters, fft_plan,
+                fft_in.data(), fft_out.data(), fft_work.data(), mel.n_mel, mel.data.data() + i, mel.n_len);
     }
 
-    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
-
-    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
-        log("%s: failed to decode\n", __func__);
-        return -7;
+    // Otherwise fft_out are all zero
+    double sum = log10(1e-10);
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = sum;
+        }
     }
+}
 
-    auto & logits_id = state->logits_id;
-    logits_id.clear();
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const whisper_fft_plan & fft_plan,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = wsp_ggml_time_us();
 
-    for (const auto & kv : g_lang) {
-        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
-    }
+    WHISPER_ASSERT(fft_plan.n == frame_size);
 
-    // sort descending
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
+    // Hanning window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    // the 30 seconds of zeros at the end are not stored: the frames that would read them are all zero and are not
+    // computed by the workers (see log_mel_spectrogram_worker_thread)
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 200 zeros at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.end(), 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    // the samples past the end of shorter audio are zeros, as in whisper_mel_stream_push()
+    for (int64_t j = 0; j < stage_2_pad; ++j) {
+        samples_padded[j] = stage_2_pad - j < n_samples ? samples[stage_2_pad - j] : 0.0f;
     }
 
-    // softmax
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (n_samples + stage_1_pad + stage_2_pad * 2 - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.n_stride  = mel.n_len;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+
     {
-        const auto max = logits_id[0].first;
+        // the workers share the samples - they are only read
+        std::vector<std::thread> workers(n_threads - 1);
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw] = std::thread(
+                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), std::cref(samples_padded),
+                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
+                    std::cref(filters), std::cref(fft_plan), std::ref(mel));
+        }
 
-        double sum = 0.0f;
-        for (auto & kv : logits_id) {
-            kv.first = exp(kv.first - max);
-            sum += kv.first;
+        // main thread
+        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, fft_plan, mel);
+
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw].join();
         }
+    }
 
-        for (auto & kv : logits_id) {
-            kv.first /= sum;
+    // clamping and normalization
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
         }
     }
 
-    {
-        for (const auto & prob : logits_id) {
-            if (lang_probs) {
-                lang_probs[prob.second] = prob.first;
-            }
+    mmax -= 8.0;
 
-            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
         }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 
-    return logits_id[0].second;
-}
+    mel.id++;
 
-int whisper_lang_auto_detect(
-        struct whisper_context * ctx,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
-}
+    wstate.t_mel_us += wsp_ggml_time_us() - t_start_us;
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
+    return true;
 }
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::string> words;
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
-}
+        std::regex re(pat);
+        std::smatch m;
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+    // find the longest tokens that form the words:
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
-}
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = vocab.token_to_id.find(sub);
+                if (it != vocab.token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                log("unknown token\n");
+                ++i;
+            }
+        }
+    }
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
+    return tokens;
 }
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+//
+// interface implementation
+//
 
-int whisper_model_ftype(struct whisper_context * ctx) {
-    return ctx->model.hparams.ftype;
-}
+#ifdef WHISPER_USE_COREML
+// replace .bin with -encoder.mlmodelc
+static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
 
-int whisper_model_type(struct whisper_context * ctx) {
-    return ctx->model.type;
+    // match "-qx_x"
+    pos = path_bin.rfind('-');
+    if (pos != std::string::npos) {
+        auto sub = path_bin.substr(pos);
+        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
+            path_bin = path_bin.substr(0, pos);
+        }
+    }
+
+    path_bin += "-encoder.mlmodelc";
+
+    return path_bin;
 }
+#endif
 
-const char *whisper_model_type_readable(struct whisper_context * ctx) {
-    switch (ctx->model.type) {
-    case e_model::MODEL_TINY:
-        return "tiny";
-    case e_model::MODEL_BASE:
-        return "base";
-    case e_model::MODEL_SMALL:
-        return "small";
-    case e_model::MODEL_MEDIUM:
-        return "medium";
-    case e_model::MODEL_LARGE:
-        return "large";
-    default:
-        return "unknown";
+#ifdef WHISPER_USE_OPENVINO
+// replace .bin with-encoder-openvino.xml
+static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
     }
-}
 
-int whisper_n_len_from_state(struct whisper_state * state) {
-    return state->mel.n_len_org;
-}
+    path_bin += "-encoder-openvino.xml";
 
-int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->state->mel.n_len_org;
+    return path_bin;
 }
 
-int whisper_n_vocab(struct whisper_context * ctx) {
-    return ctx->vocab.n_vocab;
-}
+static std::string whisper_openvino_get_path_cache(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
 
-int whisper_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+    path_bin += "-encoder-openvino-cache";
 
-int whisper_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
+    return path_bin;
 }
+#endif
 
-int whisper_is_multilingual(struct whisper_context * ctx) {
-    return ctx->vocab.is_multilingual() ? 1 : 0;
-}
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
 
-float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->state->logits.data();
-}
+    // grown by whisper_full() when more decoders are used
+    if (!kv_paged_reserve(ctx->model.hparams, state->kv_self, ctx->ktype, kv_paged_n_blocks(ctx->model.hparams, 1))) {
+        log("%s: kv_paged_reserve() failed for self-attention cache\n", __func__);
+        delete state;
+        return nullptr;
+    }
 
-float * whisper_get_logits_from_state(struct whisper_state * state) {
-    return state->logits.data();
-}
+    {
+        const size_t memory_size = wsp_ggml_nbytes(state->kv_self.k) + wsp_ggml_nbytes(state->kv_self.v);
+        log("%s: kv self size  = %7.2f MB (%s)\n", __func__, memory_size / 1024.0 / 1024.0, wsp_ggml_type_name(state->kv_self.k->type));
+    }
 
-const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
-}
+    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->ktype, ctx->model.hparams.n_audio_ctx)) {
+        log("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+        delete state;
+        return nullptr;
+    }
 
-whisper_token whisper_token_eot(struct whisper_context * ctx) {
-    return ctx->vocab.token_eot;
-}
+    {
+        const size_t memory_size = wsp_ggml_nbytes(state->kv_cross.k) + wsp_ggml_nbytes(state->kv_cross.v);
+        log("%s: kv cross size = %7.2f MB (%s)\n", __func__, memory_size / 1024.0 / 1024.0, wsp_ggml_type_name(state->kv_cross.k->type));
+    }
 
-whisper_token whisper_token_sot(struct whisper_context * ctx) {
-    return ctx->vocab.token_sot;
-}
+#ifdef WHISPER_USE_COREML
+    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
 
-whisper_token whisper_token_solm(struct whisper_context * ctx) {
-    return ctx->vocab.token_solm;
-}
+    log("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+    log("%s: first run on a device may take a while ...\n", __func__);
 
-whisper_token whisper_token_prev(struct whisper_context * ctx) {
-    return ctx->vocab.token_prev;
-}
+    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+    if (!state->ctx_coreml) {
+        log("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+#ifndef WHISPER_COREML_ALLOW_FALLBACK
+        return nullptr;
+#endif
+    } else {
+        log("%s: Core ML model loaded\n", __func__);
+    }
+#endif
 
-whisper_token whisper_token_nosp(struct whisper_context * ctx) {
-    return ctx->vocab.token_nosp;
-}
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
 
-whisper_token whisper_token_not(struct whisper_context * ctx) {
-    return ctx->vocab.token_not;
-}
+    state->logits_id.reserve(ctx->model.hparams.n_vocab);
 
-whisper_token whisper_token_beg(struct whisper_context * ctx) {
-    return ctx->vocab.token_beg;
-}
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
 
-whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
-    return whisper_token_sot(ctx) + 1 + lang_id;
-}
+    state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
+    state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
 
-whisper_token whisper_token_translate(struct whisper_context * ctx) {
-    return ctx->vocab.token_translate;
-}
+    // measure the largest encoder and decoder graphs to size the compute buffers
+    // buf_compute holds the tensor meta data, buf_alloc the tensor data
+    {
+        const auto & hparams = ctx->model.hparams;
 
-whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
-    return ctx->vocab.token_transcribe;
-}
+        // upper bound for the meta data of a graph - reduced to the measured size below
+        state->buf_compute.resize(2*WSP_GGML_MAX_NODES*(WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE + 64));
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = wsp_ggml_time_us();
+        struct wsp_ggml_init_params params = {
+            /*.mem_size   =*/ state->buf_compute.size(),
+            /*.mem_buffer =*/ state->buf_compute.data(),
+            /*.no_alloc   =*/ true,
+        };
 
-    log("\n");
-    log("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+        size_t mem_meta   = 0;
+        size_t mem_encode = 0;
+        size_t mem_decode = 0;
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+        // encoder + cross-attention KV cache, full audio context
+        {
+            struct wsp_ggml_allocr * measure = wsp_ggml_allocr_new_measure(WHISPER_ALLOC_ALIGNMENT);
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-        log("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        log("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        log("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        log("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        log("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
-    }
-    log("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
-}
+            struct wsp_ggml_cgraph gf = {};
 
-void whisper_reset_timings(struct whisper_context * ctx) {
-    if (ctx->state != nullptr) {
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-    }
-}
+            whisper_build_graph_encoder(*ctx, *state, { { &state->mel, 0, state } }, ctx0, measure, gf);
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
-}
+            mem_encode = wsp_ggml_allocr_alloc_graph(measure, &gf);
+            mem_meta   = std::max(mem_meta, wsp_ggml_used_mem(ctx0));
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
-}
+            wsp_ggml_free(ctx0);
+            wsp_ggml_allocr_free(measure);
+        }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+        // decoder, full text context in a single call
+        {
+            struct wsp_ggml_allocr * measure = wsp_ggml_allocr_new_measure(WHISPER_ALLOC_ALIGNMENT);
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-    s  = "";
-    s += "AVX = "       + std::to_string(wsp_ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(wsp_ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(wsp_ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(wsp_ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(wsp_ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(wsp_ggml_cpu_has_arm_fma())   + " | ";
-    s += "F16C = "      + std::to_string(wsp_ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(wsp_ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(wsp_ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(wsp_ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(wsp_ggml_cpu_has_sse3())      + " | ";
-    s += "SSSE3 = "     + std::to_string(wsp_ggml_cpu_has_ssse3())     + " | ";
-    s += "VSX = "       + std::to_string(wsp_ggml_cpu_has_vsx())       + " | ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+            whisper_decode_graph dg;
 
-    return s.c_str();
-}
+            // the slots are gathered: the largest graph
+            whisper_build_graph_decoder(*ctx, *state, 1, ctx0, measure, dg, hparams.n_text_ctx, 0, hparams.n_text_ctx, 0);
 
-////////////////////////////////////////////////////////////////////////////
+            mem_decode = wsp_ggml_allocr_alloc_graph(measure, &dg.gf);
+            mem_meta   = std::max(mem_meta, wsp_ggml_used_mem(ctx0));
 
-struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params params = whisper_full_default_params(strategy);
+            wsp_ggml_free(ctx0);
+            wsp_ggml_allocr_free(measure);
+        }
 
-    struct whisper_full_params* result = new whisper_full_params();
-    *result = params;
-    return result;
-}
+        // decoder, largest batch of decoders with one token each
+        {
+            struct wsp_ggml_allocr * measure = wsp_ggml_allocr_new_measure(WHISPER_ALLOC_ALIGNMENT);
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy          =*/ strategy,
+            whisper_decode_graph dg;
 
-        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx    =*/ 16384,
-        /*.offset_ms         =*/ 0,
-        /*.duration_ms       =*/ 0,
+            const int n_batch = whisper_decode_batch_max(hparams);
 
-        /*.translate         =*/ false,
-        /*.no_context        =*/ true,
-        /*.single_segment    =*/ false,
-        /*.print_special     =*/ false,
-        /*.print_progress    =*/ true,
-        /*.print_realtime    =*/ false,
-        /*.print_timestamps  =*/ true,
+            whisper_build_graph_decoder(*ctx, *state, n_batch, ctx0, measure, dg, 1, 0, hparams.n_text_ctx, 0);
 
-        /*.token_timestamps  =*/ false,
-        /*.thold_pt          =*/ 0.01f,
-        /*.thold_ptsum       =*/ 0.01f,
-        /*.max_len           =*/ 0,
-        /*.split_on_word     =*/ false,
-        /*.max_tokens        =*/ 0,
+            mem_decode = std::max(mem_decode, wsp_ggml_allocr_alloc_graph(measure, &dg.gf));
+            mem_meta   = std::max(mem_meta, wsp_ggml_used_mem(ctx0));
 
-        /*.speed_up          =*/ false,
-        /*.debug_mode        =*/ false,
-        /*.audio_ctx         =*/ 0,
+            wsp_ggml_free(ctx0);
+            wsp_ggml_allocr_free(measure);
+        }
 
-        /*.tdrz_enable       =*/ false,
+        // + the header of the work buffer
+        state->buf_compute.resize(mem_meta + WSP_GGML_TENSOR_SIZE + WSP_GGML_OBJECT_SIZE + 4096);
+        state->buf_compute.shrink_to_fit();
 
-        /*.initial_prompt    =*/ nullptr,
-        /*.prompt_tokens     =*/ nullptr,
-        /*.prompt_n_tokens   =*/ 0,
+        state->buf_alloc.resize(std::max(mem_encode, mem_decode) + WHISPER_ALLOC_ALIGNMENT);
+        state->alloc = wsp_ggml_allocr_new(state->buf_alloc.data(), state->buf_alloc.size(), WHISPER_ALLOC_ALIGNMENT);
 
-        /*.language          =*/ "en",
-        /*.detect_language   =*/ false,
+        log("%s: compute buffer (meta)   = %7.2f MB\n", __func__, state->buf_compute.size() / 1024.0 / 1024.0);
+        log("%s: compute buffer (encode) = %7.2f MB\n", __func__, mem_encode / 1024.0 / 1024.0);
+        log("%s: compute buffer (decode) = %7.2f MB\n", __func__, mem_decode / 1024.0 / 1024.0);
+    }
 
-        /*.suppress_blank    =*/ true,
-        /*.suppress_non_speech_tokens =*/ false,
+    state->rng = std::mt19937(0);
 
-        /*.temperature       =*/  0.0f,
-        /*.max_initial_ts    =*/  1.0f,
-        /*.length_penalty    =*/ -1.0f,
+    return state;
+}
 
-        /*.temperature_inc   =*/  0.4f,
-        /*.entropy_thold     =*/  2.4f,
-        /*.logprob_thold     =*/ -1.0f,
-        /*.no_speech_thold   =*/  0.6f,
+void whisper_state_set_n_threads_max(struct whisper_state * state, int n_threads) {
+    state->n_threads_max.store(std::max(0, n_threads), std::memory_order_relaxed);
+}
 
-        /*.greedy            =*/ {
-            /*.best_of   =*/ -1,
-        },
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifndef WHISPER_USE_OPENVINO
+    (void)(ctx);
+    (void)(model_path);
+    (void)(device);
+    (void)(cache_dir);
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+    return 1;
+#else
+    if (!model_path && ctx->path_model.empty()) {
+        log("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
+        return 1;
+    }
 
-            /*.patience  =*/ -1.0f,
-        },
+    std::string path_encoder;
+    if (!model_path) {
+        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
+        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
+    } else {
+        path_encoder = model_path;
+    }
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+    std::string path_cache;
+    if (!cache_dir) {
+        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
+        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
+    } else {
+        path_cache = cache_dir;
+    }
 
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
+    log("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
+    log("%s: first run on a device may take a while ...\n", __func__);
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!ctx->state->ctx_openvino) {
+        log("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
+        return 1;
+    } else {
+        log("%s: OpenVINO model loaded\n", __func__);
+    }
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
-    };
+    return 0;
+#endif
+}
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
-                };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
+int whisper_ctx_set_kv_type(struct whisper_context * ctx, enum whisper_kv_type type) {
+    wsp_ggml_type ktype;
+
+    switch (type) {
+        case WHISPER_KV_TYPE_F16:  ktype = WSP_GGML_TYPE_F16;  break;
+        case WHISPER_KV_TYPE_F32:  ktype = WSP_GGML_TYPE_F32;  break;
+        case WHISPER_KV_TYPE_Q8_0: ktype = WSP_GGML_TYPE_Q8_0; break;
+        default:
             {
-                result.beam_search = {
-                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                log("%s: invalid kv type %d\n", __func__, (int) type);
+                return 1;
+            }
+    }
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
+    // the attention heads are the rows of the quantized dot products
+    const auto & hparams = ctx->model.hparams;
+    if ((hparams.n_text_state/hparams.n_text_head) % kv_row_align(ktype) != 0) {
+        log("%s: %s kv cache is not supported for head size %d\n", __func__, wsp_ggml_type_name(ktype), hparams.n_text_state/hparams.n_text_head);
+        return 1;
     }
 
-    return result;
-}
+    if (ktype == ctx->ktype) {
+        return 0;
+    }
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+    ctx->ktype = ktype;
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+    if (ctx->state) {
+        whisper_free_state(ctx->state);
 
-    return txt[0] == ' ';
+        ctx->state = whisper_init_state(ctx);
+        if (!ctx->state) {
+            log("%s: failed to re-create the state\n", __func__);
+            return 2;
+        }
+    }
+
+    return 0;
 }
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+// the weights are copied by a few threads - more do not help, the copies are limited by the memory / storage bandwidth
+static int whisper_load_n_threads() {
+    return std::max(1, std::min(4, (int) std::thread::hardware_concurrency()));
+}
 
-    int res = 1;
-    int acc = 0;
+// read the model file sequentially
+static struct whisper_context * whisper_init_from_file_read(const char * path_model) {
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        log("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
 
-    std::string text;
+    whisper_model_loader loader = {};
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
-        }
+    loader.context = &fin;
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+    auto ctx = whisper_init_no_state(&loader);
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+    if (ctx) {
+        ctx->path_model = path_model;
+    }
 
-            acc = 0;
-            text = "";
+    return ctx;
+}
 
-            segment = state.result_all.back();
-            i = -1;
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
-        }
-    }
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
 
-    state.result_all.back().text = std::move(text);
+    log("%s: loading model from buffer\n", __func__);
 
-    return res;
-}
+    whisper_model_loader loader = {};
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+    loader.context = &ctx;
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-    const struct whisper_full_params   params,
-              struct whisper_decoder & decoder,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+        return size_to_copy;
+    };
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_no_state(&loader);
+}
+
+// the context takes the ownership of the mapping, also when the model fails to load
+static struct whisper_context * whisper_init_with_mapping(struct whisper_model_loader * loader, whisper_mmap * mapping) {
+    wsp_ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+
+    ctx->model.mapping = mapping;
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        log("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
     }
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
-    {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+    loader->close(loader->context);
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
+    if (mapping && !mapping->in_place) {
+        whisper_mmap_free(mapping);
+        ctx->model.mapping = nullptr;
+    }
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+    whisper_fft_plan_init(ctx->fft_plan,    WHISPER_N_FFT);
+    whisper_fft_plan_init(ctx->fft_plan_pv, 2*WHISPER_N_FFT);
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
-        }
+    return ctx;
+}
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_with_mapping(loader, nullptr);
+}
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+// map the model file and load the weights with n_threads threads
+// with in_place, the weights are used in the mapping when possible and the context keeps the file mapped
+// falls back to reading the file if it cannot be mapped
+static struct whisper_context * whisper_init_from_file_map(const char * path_model, bool in_place, int n_threads) {
+    whisper_mmap * mapping = whisper_mmap_open(path_model);
+    if (!mapping) {
+        log("%s: failed to map '%s' - reading the file instead\n", __func__, path_model);
+        return whisper_init_from_file_read(path_model);
+    }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+    mapping->in_place  = in_place;
+    mapping->n_threads = n_threads;
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
-        }
+    whisper_model_loader loader = {};
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+    loader.context = mapping;
 
-            //log("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_mmap * mm = reinterpret_cast<whisper_mmap *>(ctx);
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                }
-            }
-        }
+        size_t size_to_copy = mm->offs + read_size < mm->size ? read_size : mm->size - mm->offs;
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
-
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+        memcpy(output, mm->addr + mm->offs, size_to_copy);
+        mm->offs += size_to_copy;
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+        return size_to_copy;
+    };
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+    loader.eof = [](void * ctx) {
+        whisper_mmap * mm = reinterpret_cast<whisper_mmap *>(ctx);
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+        return mm->offs >= mm->size;
+    };
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+    loader.close = [](void * /*ctx*/) { };
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+    int64_t n_minor = 0;
+    int64_t n_major = 0;
+    whisper_page_faults(n_minor, n_major);
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+    auto ctx = whisper_init_with_mapping(&loader, mapping);
 
-            //log("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+    if (ctx) {
+        int64_t n_minor1 = 0;
+        int64_t n_major1 = 0;
+        whisper_page_faults(n_minor1, n_major1);
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
-    }
+        log("%s: load time = %8.2f ms, %lld minor / %lld major page faults\n", __func__,
+                ctx->t_load_us/1000.0, (long long) (n_minor1 - n_minor), (long long) (n_major1 - n_major));
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
-        }
+        ctx->path_model = path_model;
     }
 
-#if 0
-    // print first 100 logits - token string : logit
-    for (int i = 0; i < 100; i++) {
-        const auto token   = vocab.id_to_token.at(i);
-        const auto prob    = probs[i];
-        const auto logit   = logits[i];
-        const auto logprob = logprobs[i];
-        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    }
+    return ctx;
+}
 
-    // "And", "and", " And", " and"
-    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
 
-    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+    log("%s: loading model from '%s'\n", __func__, path_model);
 
-    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
+    return whisper_init_from_file_map(path_model, false, whisper_load_n_threads());
 }
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+struct whisper_context * whisper_init_from_file_mmap_no_state(const char * path_model) {
+    log("%s: loading model from '%s'\n", __func__, path_model);
 
-    const auto & vocab = ctx.vocab;
+    return whisper_init_from_file_map(path_model, true, whisper_load_n_threads());
+}
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+// models loaded with whisper_init_from_file_shared(), by path
+// the entries expire when the last context of a model is freed
+static std::mutex g_model_registry_mutex;
+static std::map<std::string, std::weak_ptr<whisper_loaded_model>> g_model_registry;
 
-    const int n_logits = vocab.n_vocab;
+struct whisper_context * whisper_init_from_file_shared_no_state(const char * path_model) {
+    std::lock_guard<std::mutex> lock(g_model_registry_mutex);
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    std::shared_ptr<whisper_loaded_model> loaded;
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    auto it = g_model_registry.find(path_model);
+    if (it != g_model_registry.end()) {
+        loaded = it->second.lock();
+    }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
+    if (!loaded) {
+        whisper_context * ctx = whisper_init_from_file_mmap_no_state(path_model);
+        if (ctx) {
+            g_model_registry[path_model] = ctx->loaded;
         }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+        return ctx;
     }
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
-        }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+    log("%s: sharing the model loaded from '%s' with %ld other context(s)\n", __func__, path_model, loaded.use_count() - 1);
 
-        result.id   = dist(state.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
-    }
+    wsp_ggml_time_init();
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
+    whisper_context * ctx = new whisper_context(loaded);
+
+    ctx->t_start_us = wsp_ggml_time_us();
+    ctx->wtype      = wsp_ggml_ftype_to_wsp_ggml_type((wsp_ggml_ftype) ctx->model.hparams.ftype);
+    ctx->path_model = path_model;
+
+    whisper_fft_plan_init(ctx->fft_plan,    WHISPER_N_FFT);
+    whisper_fft_plan_init(ctx->fft_plan_pv, 2*WHISPER_N_FFT);
+
+    ctx->t_load_us = wsp_ggml_time_us() - ctx->t_start_us;
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file_shared(const char * path_model) {
+    whisper_context * ctx = whisper_init_from_file_shared_no_state(path_model);
+    if (!ctx) {
+        return nullptr;
     }
 
-    state.n_sample++;
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
 
-    return result;
+    return ctx;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
+    if (!ctx) {
+        return nullptr;
+    }
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
 
-    const int n_logits = vocab.n_vocab;
+    return ctx;
+}
 
-    auto & logits_id = state.logits_id;
+struct whisper_context * whisper_init_from_file_mmap(const char * path_model) {
+    whisper_context * ctx = whisper_init_from_file_mmap_no_state(path_model);
+    if (!ctx) {
+        return nullptr;
+    }
 
-    logits_id.clear();
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id.push_back({ logits[i], i });
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
     }
 
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + k, logits_id.end(),
-            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
-                return a.first > b.first;
-            });
+    return ctx;
+}
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
+    if (!ctx) {
+        return nullptr;
+    }
 
-    whisper_token tid = vocab.token_beg;
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    return ctx;
+}
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    whisper_context * ctx = whisper_init_no_state(loader);
+    if (!ctx) {
+        return nullptr;
+    }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+// max number of values converted / quantized at once by whisper_model_quantize()
+// bounds the memory used for the largest tensors (the token embeddings of the large model are 66M values)
+#define WHISPER_QUANTIZE_CHUNK (4*1024*1024)
+
+// the 2-D weights are quantized, the other tensors are kept in the types expected by the loader:
+// F16 for the convolution weights, F32 for the biases, the norms and the positional embeddings
+static wsp_ggml_type whisper_quantize_tensor_type(const std::string & name, int n_dims, wsp_ggml_type wtype) {
+    const std::string suffix = ".weight";
+
+    if (n_dims == 2 && name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        return wtype;
+    }
+
+    return n_dims == 3 ? WSP_GGML_TYPE_F16 : WSP_GGML_TYPE_F32;
+}
+
+int whisper_model_quantize(const char * path_in, const char * path_out, int ftype, int n_threads) {
+#if defined(WSP_GGML_BIG_ENDIAN)
+    (void) path_in;
+    (void) path_out;
+    (void) ftype;
+    (void) n_threads;
+
+    log("%s: not supported on big-endian hosts\n", __func__);
+    return 1;
+#else
+    const int64_t t_start_us = wsp_ggml_time_us();
+
+    switch (ftype) {
+        case WSP_GGML_FTYPE_MOSTLY_Q4_0:
+        case WSP_GGML_FTYPE_MOSTLY_Q4_1:
+        case WSP_GGML_FTYPE_MOSTLY_Q5_0:
+        case WSP_GGML_FTYPE_MOSTLY_Q5_1:
+        case WSP_GGML_FTYPE_MOSTLY_Q8_0:
+        case WSP_GGML_FTYPE_MOSTLY_Q2_K:
+        case WSP_GGML_FTYPE_MOSTLY_Q3_K:
+        case WSP_GGML_FTYPE_MOSTLY_Q4_K:
+        case WSP_GGML_FTYPE_MOSTLY_Q5_K:
+        case WSP_GGML_FTYPE_MOSTLY_Q6_K:
+            break;
+        default:
+            log("%s: invalid quantization type %d\n", __func__, ftype);
+            return 1;
+    }
+
+    const wsp_ggml_type wtype = wsp_ggml_ftype_to_wsp_ggml_type((wsp_ggml_ftype) ftype);
+    const int blck_size = wsp_ggml_blck_size(wtype);
+
+    n_threads = std::max(1, n_threads);
+
+    // initialize the fp16 tables
+    {
+        struct wsp_ggml_init_params params = { 0, NULL, false };
+        struct wsp_ggml_context * ctx = wsp_ggml_init(params);
+        wsp_ggml_free(ctx);
+    }
+
+    auto fin = std::ifstream(path_in, std::ios::binary);
+    if (!fin) {
+        log("%s: failed to open '%s'\n", __func__, path_in);
+        return 1;
+    }
+
+    auto fout = std::ofstream(path_out, std::ios::binary);
+    if (!fout) {
+        log("%s: failed to open '%s' for writing\n", __func__, path_out);
+        return 1;
+    }
+
+    // do not leave a partial model behind
+    auto fail = [&]() {
+        fout.close();
+        std::remove(path_out);
+        return 1;
+    };
+
+    auto copy = [&](size_t n) {
+        char tmp[4096];
+        while (n > 0 && fin) {
+            const size_t k = std::min(n, sizeof(tmp));
+            fin.read(tmp, k);
+            fout.write(tmp, k);
+            n -= k;
+        }
+        return (bool) fin;
+    };
+
+    // magic + hparams
+    whisper_hparams hparams;
+    {
+        uint32_t magic = 0;
+        fin.read((char *) &magic, sizeof(magic));
+        if (magic != WSP_GGML_FILE_MAGIC) {
+            log("%s: invalid model data (bad magic)\n", __func__);
+            return fail();
+        }
+
+        int32_t * fields[] = {
+            &hparams.n_vocab, &hparams.n_audio_ctx, &hparams.n_audio_state, &hparams.n_audio_head, &hparams.n_audio_layer,
+            &hparams.n_text_ctx, &hparams.n_text_state, &hparams.n_text_head, &hparams.n_text_layer, &hparams.n_mels, &hparams.ftype,
+        };
+        for (int32_t * f : fields) {
+            fin.read((char *) f, sizeof(*f));
+        }
+        if (!fin) {
+            log("%s: invalid model data (truncated hparams)\n", __func__);
+            return fail();
+        }
+
+        const int32_t ftype_in = hparams.ftype % WSP_GGML_QNT_VERSION_FACTOR;
+        if (ftype_in != WSP_GGML_FTYPE_ALL_F32 && ftype_in != WSP_GGML_FTYPE_MOSTLY_F16) {
+            log("%s: the input model must be F32 or F16\n", __func__);
+            return fail();
+        }
+
+        if (blck_size == 0 || hparams.n_audio_state % blck_size != 0 || hparams.n_text_state % blck_size != 0) {
+            log("%s: %s weights are not supported for n_state = %d\n", __func__, wsp_ggml_type_name(wtype), hparams.n_audio_state);
+            return fail();
+        }
+
+        hparams.ftype = ftype + WSP_GGML_QNT_VERSION*WSP_GGML_QNT_VERSION_FACTOR;
+
+        fout.write((const char *) &magic, sizeof(magic));
+        for (int32_t * f : fields) {
+            fout.write((const char *) f, sizeof(*f));
+        }
+    }
+
+    // mel filters
+    {
+        int32_t n_mel = 0;
+        int32_t n_fft = 0;
+        fin.read((char *) &n_mel, sizeof(n_mel));
+        fin.read((char *) &n_fft, sizeof(n_fft));
+        fout.write((const char *) &n_mel, sizeof(n_mel));
+        fout.write((const char *) &n_fft, sizeof(n_fft));
+
+        if (!fin || n_mel < 0 || n_fft < 0 || !copy((size_t) n_mel*n_fft*sizeof(float))) {
+            log("%s: invalid model data (truncated mel filters)\n", __func__);
+            return fail();
+        }
+    }
+
+    // vocab
+    {
+        int32_t n_vocab = 0;
+        fin.read((char *) &n_vocab, sizeof(n_vocab));
+        fout.write((const char *) &n_vocab, sizeof(n_vocab));
+
+        for (int i = 0; i < n_vocab && fin; i++) {
+            uint32_t len = 0;
+            fin.read((char *) &len, sizeof(len));
+            fout.write((const char *) &len, sizeof(len));
+            copy(len);
+        }
+
+        if (!fin) {
+            log("%s: invalid model data (truncated vocab)\n", __func__);
+            return fail();
+        }
+    }
+
+    // weights
+    //
+    // the data of each tensor is converted in chunks of rows of at most WHISPER_QUANTIZE_CHUNK values, the rows of
+    // a chunk are quantized by n_threads threads
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+
+    std::vector<int64_t> hist_all(1 << 4, 0);
+
+    std::vector<uint8_t> buf_in;
+    std::vector<float>   buf_f32;
+    std::vector<uint8_t> buf_out;
+
+    std::vector<std::vector<int64_t>> hist_thread(n_threads, std::vector<int64_t>(1 << 4, 0));
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        fin.read((char *) &n_dims, sizeof(n_dims));
+        fin.read((char *) &length, sizeof(length));
+        fin.read((char *) &ttype,  sizeof(ttype));
+
+        if (fin.eof()) {
+            break;
+        }
+
+        if (!fin || n_dims < 1 || n_dims > 4 || length <= 0 || (ttype != WSP_GGML_TYPE_F32 && ttype != WSP_GGML_TYPE_F16)) {
+            log("%s: invalid model data (bad tensor header)\n", __func__);
+            return fail();
+        }
+
+        int32_t ne[4] = { 1, 1, 1, 1 };
+        for (int i = 0; i < n_dims; ++i) {
+            fin.read((char *) &ne[i], sizeof(ne[i]));
+        }
+
+        std::string name(length, 0);
+        fin.read(&name[0], length);
+
+        if (!fin || ne[0] <= 0) {
+            log("%s: invalid model data (bad tensor header)\n", __func__);
+            return fail();
+        }
+
+        const wsp_ggml_type type_in  = (wsp_ggml_type) ttype;
+        const wsp_ggml_type type_out = whisper_quantize_tensor_type(name, n_dims, wtype);
+
+        if (wsp_ggml_is_quantized(type_out) && ne[0] % blck_size != 0) {
+            log("%s: tensor '%s' has %d columns, not a multiple of %d\n", __func__, name.c_str(), ne[0], blck_size);
+            return fail();
+        }
+
+        const int32_t ttype_out = type_out;
+
+        fout.write((const char *) &n_dims, sizeof(n_dims));
+        fout.write((const char *) &length, sizeof(length));
+        fout.write((const char *) &ttype_out, sizeof(ttype_out));
+        fout.write((const char *) ne, n_dims*sizeof(ne[0]));
+        fout.write(name.data(), length);
+
+        const size_t n_cols = ne[0];
+        const size_t n_rows = (size_t) ne[1]*ne[2]*ne[3];
+
+        const size_t row_size_in  = n_cols*wsp_ggml_type_size(type_in);
+        const size_t row_size_out = n_cols/wsp_ggml_blck_size(type_out)*wsp_ggml_type_size(type_out);
+
+        total_size_org += n_rows*row_size_in;
+        total_size_new += n_rows*row_size_out;
+
+        if (type_in == type_out) {
+            if (!copy(n_rows*row_size_in)) {
+                log("%s: invalid model data (truncated tensor)\n", __func__);
+                return fail();
+            }
+            continue;
+        }
+
+        const size_t rows_per_chunk = std::max<size_t>(1, WHISPER_QUANTIZE_CHUNK/n_cols);
+
+        for (size_t ir0 = 0; ir0 < n_rows; ir0 += rows_per_chunk) {
+            const size_t nr = std::min(rows_per_chunk, n_rows - ir0);
+
+            buf_in.resize(nr*row_size_in);
+            buf_f32.resize(nr*n_cols);
+            buf_out.resize(nr*row_size_out);
+
+            fin.read((char *) buf_in.data(), buf_in.size());
+            if (!fin) {
+                log("%s: invalid model data (truncated tensor)\n", __func__);
+                return fail();
+            }
+
+            // rows [ir_begin, ir_end) of the chunk
+            auto convert = [&](int ith, size_t ir_begin, size_t ir_end) {
+                const size_t i0 = ir_begin*n_cols;
+                const size_t n  = (ir_end - ir_begin)*n_cols;
+
+                const float * src = buf_f32.data();
+                if (type_in == WSP_GGML_TYPE_F16) {
+                    wsp_ggml_fp16_to_fp32_row((const wsp_ggml_fp16_t *) buf_in.data() + i0, buf_f32.data() + i0, n);
+                } else {
+                    src = (const float *) buf_in.data();
+                }
+
+                if (type_out == WSP_GGML_TYPE_F32) {
+                    memcpy((float *) buf_out.data() + i0, src + i0, n*sizeof(float));
+                } else if (type_out == WSP_GGML_TYPE_F16) {
+                    wsp_ggml_fp32_to_fp16_row(src + i0, (wsp_ggml_fp16_t *) buf_out.data() + i0, n);
+                } else {
+                    wsp_ggml_quantize_chunk(type_out, src, buf_out.data(), i0, n, hist_thread[ith].data());
+                }
+            };
+
+            const int nth = wsp_ggml_is_quantized(type_out) ? (int) std::min<size_t>(n_threads, nr) : 1;
+            const size_t dr = (nr + nth - 1)/nth;
+
+            std::vector<std::thread> workers(nth - 1);
+            for (int ith = 1; ith < nth; ++ith) {
+                workers[ith - 1] = std::thread(convert, ith, std::min(nr, ith*dr), std::min(nr, (ith + 1)*dr));
+            }
+
+            convert(0, 0, std::min(nr, dr));
+
+            for (auto & w : workers) {
+                w.join();
+            }
+
+            fout.write((const char *) buf_out.data(), buf_out.size());
+        }
+    }
+
+    if (!fout) {
+        log("%s: failed to write the output file\n", __func__);
+        return fail();
+    }
+
+    fout.close();
+
+    for (const auto & hist : hist_thread) {
+        for (size_t j = 0; j < hist.size(); ++j) {
+            hist_all[j] += hist[j];
+        }
+    }
+
+    int64_t sum_all = 0;
+    for (size_t j = 0; j < hist_all.size(); ++j) {
+        sum_all += hist_all[j];
+    }
+
+    log("%s: quantized '%s' to %s in %8.2f ms\n", __func__, path_in, wsp_ggml_type_name(wtype), (wsp_ggml_time_us() - t_start_us)/1000.0);
+    log("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    log("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+
+    std::string hist_str;
+    for (size_t j = 0; j < hist_all.size(); ++j) {
+        char tmp[16];
+        snprintf(tmp, sizeof(tmp), " %5.3f", sum_all > 0 ? hist_all[j]/(double) sum_all : 0.0);
+        hist_str += tmp;
+    }
+    log("%s: hist:%s\n", __func__, hist_str.c_str());
+
+    return 0;
+#endif
+}
+
+void whisper_free_state(struct whisper_state * state)
+{
+    if (state) {
+        whisper_free_state(state->ahead);
+
+        kv_cache_free(state->kv_cross);
+
+        kv_paged_free(state->kv_self);
+
+        if (state->threadpool != nullptr) {
+            wsp_ggml_threadpool_free(state->threadpool);
+            state->threadpool = nullptr;
+        }
+
+        if (state->alloc != nullptr) {
+            wsp_ggml_allocr_free(state->alloc);
+            state->alloc = nullptr;
+        }
+
+        if (state->alloc_batch != nullptr) {
+            wsp_ggml_allocr_free(state->alloc_batch);
+            state->alloc_batch = nullptr;
+        }
+
+#ifdef WHISPER_USE_COREML
+        if (state->ctx_coreml != nullptr) {
+            whisper_coreml_free(state->ctx_coreml);
+            state->ctx_coreml = nullptr;
+        }
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+        if (state->ctx_openvino != nullptr) {
+            whisper_openvino_free(state->ctx_openvino);
+            state->ctx_openvino = nullptr;
+        }
+#endif
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        // the model is freed with its last context
+        whisper_free_state(ctx->state);
+        for (auto * state : ctx->parallel_states) {
+            whisper_free_state(state);
+        }
+
+        delete ctx;
+    }
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, ctx->fft_plan, false, state->mel)) {
+        log("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_mel_stream_push_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples) {
+    const int64_t t_start_us = wsp_ggml_time_us();
+
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_mel      = WHISPER_N_MEL;
+    const int pad        = frame_size / 2;
+
+    if (n_samples < 0) {
+        log("%s: invalid number of samples: %d\n", __func__, n_samples);
+        return -1;
+    }
+
+    auto & ms = state->mel_stream;
+
+    const int n_final_prev = ms.n_final;
+
+    // the reflective padding uses samples 1 to pad
+    for (int i = 0; i < n_samples && (int) ms.head.size() <= pad; ++i) {
+        ms.head.push_back(samples[i]);
+    }
+
+    ms.pending.insert(ms.pending.end(), samples, samples + n_samples);
+    ms.n_samples += n_samples;
+
+    const int64_t n_total = ms.n_samples;
+
+    // same layout as log_mel_spectrogram(): pad reflected samples, the audio, then zeros
+    auto sample_padded = [&](int64_t j) -> float {
+        if (j < pad) {
+            return pad - j < (int64_t) ms.head.size() ? ms.head[pad - j] : 0.0f;
+        }
+        j -= pad;
+        return j < n_total ? ms.pending[j - ms.i_pending] : 0.0f;
+    };
+
+    const int n_len   = (n_total + WHISPER_SAMPLE_RATE * 30) / frame_step;
+    const int n_frame = std::min<int64_t>((n_total + pad) / frame_step + 1, n_len); // frames that are not all zero
+    const int n_final = n_total > pad ? (n_total - pad) / frame_step + 1 : 0;
+
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+    std::vector<float> frame(frame_size);
+    std::vector<float> fft_in(frame_size);
+    std::vector<float> fft_out(2 * (1 + frame_size / 2));
+    std::vector<float> fft_work(2 * frame_size);
+
+    ms.data.resize((size_t) n_final * n_mel);
+    ms.tail.resize((size_t) (n_frame - n_final) * n_mel);
+
+    for (int i = ms.n_final; i < n_frame; ++i) {
+        const int64_t offset = (int64_t) i * frame_step;
+
+        for (int j = 0; j < frame_size; ++j) {
+            frame[j] = sample_padded(offset + j);
+        }
+
+        float * out = i < n_final ? ms.data.data() + (size_t) i * n_mel : ms.tail.data() + (size_t) (i - n_final) * n_mel;
+
+        log_mel_spectrogram_frame(hann.data(), frame.data(), std::min<int64_t>(frame_size, n_total + pad - offset), frame_size,
+                ctx->model.filters, ctx->fft_plan, fft_in.data(), fft_out.data(), fft_work.data(), n_mel, out, 1);
+
+        if (i < n_final) {
+            for (int j = 0; j < n_mel; ++j) {
+                if (out[j] > ms.mmax) {
+                    ms.mmax = out[j];
+                }
+            }
+        }
+    }
+
+    ms.n_final = n_final;
+
+    // drop the samples that are only used by final frames
+    {
+        const int64_t i_pending = std::max<int64_t>(0, (int64_t) n_final * frame_step - pad);
+        if (i_pending > ms.i_pending) {
+            ms.pending.erase(ms.pending.begin(), ms.pending.begin() + (i_pending - ms.i_pending));
+            ms.i_pending = i_pending;
+        }
+    }
+
+    // clamping and normalization over the whole spectrogram, as in log_mel_spectrogram()
+    auto & mel = state->mel;
+
+    const float zero = log10(1e-10);
+
+    double mmax = ms.mmax;
+    for (float v : ms.tail) {
+        if (v > mmax) {
+            mmax = v;
+        }
+    }
+    if (n_frame < n_len && zero > mmax) {
+        mmax = zero;
+    }
+
+    mmax -= 8.0;
+
+    auto value = [&](int i, int j) -> float {
+        float v = i < n_final ? ms.data[(size_t) i * n_mel + j] : i < n_frame ? ms.tail[(size_t) (i - n_final) * n_mel + j] : zero;
+
+        if (v < mmax) {
+            v = mmax;
+        }
+
+        return (v + 4.0)/4.0;
+    };
+
+    // only the columns that changed are written, unless the floor moved or the columns do not fit
+    const bool full = mel.id != ms.mel_id || mmax != ms.floor || n_len > mel.n_stride;
+
+    mel.n_mel     = n_mel;
+    mel.n_len     = n_len;
+    mel.n_len_org = 1 + (n_total + pad - frame_size) / frame_step;
+
+    if (full) {
+        if (n_len > mel.n_stride || mel.id != ms.mel_id) {
+            // room for ~15 s more of audio
+            mel.n_stride = n_len + n_len/2;
+            mel.data.resize((size_t) n_mel * mel.n_stride);
+        }
+
+        for (int j = 0; j < n_mel; ++j) {
+            float * row = mel.data.data() + (size_t) j * mel.n_stride;
+            for (int i = 0; i < n_len; ++i) {
+                row[i] = value(i, j);
+            }
+        }
+    } else {
+        // the frames that were not final at the last push, then the new zero columns
+        for (int j = 0; j < n_mel; ++j) {
+            float * row = mel.data.data() + (size_t) j * mel.n_stride;
+            for (int i = n_final_prev; i < n_frame; ++i) {
+                row[i] = value(i, j);
+            }
+            for (int i = std::max(n_frame, ms.n_len); i < n_len; ++i) {
+                row[i] = value(i, j);
+            }
+        }
+    }
+
+    mel.id++;
+
+    ms.mel_id = mel.id;
+    ms.n_len  = n_len;
+    ms.floor  = mmax;
+
+    state->t_mel_us += wsp_ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_mel_stream_push(struct whisper_context * ctx, const float * samples, int n_samples) {
+    return whisper_mel_stream_push_with_state(ctx, ctx->state, samples, n_samples);
+}
+
+void whisper_mel_stream_reset_with_state(struct whisper_state * state) {
+    state->mel_stream = whisper_mel_stream();
+}
+
+void whisper_mel_stream_reset(struct whisper_context * ctx) {
+    whisper_mel_stream_reset_with_state(ctx->state);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, ctx->fft_plan_pv, false, state->mel)) {
+        log("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
+// TODO
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != WHISPER_N_MEL) {
+        log("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
+        return -1;
+    }
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+    state->mel.n_stride  = n_len;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    state->mel.id++;
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode_batch(struct whisper_context * ctx, const struct whisper_encode_window * windows, int n_windows, int n_threads) {
+    if (n_windows < 1 || n_windows > WHISPER_ENCODE_BATCH_MAX) {
+        log("%s: ERROR the number of windows must be between 1 and %d, got %d\n", __func__, WHISPER_ENCODE_BATCH_MAX, n_windows);
+        return -1;
+    }
+
+    std::vector<whisper_encode_input> inputs;
+
+    int n_audio_ctx_0 = 0;
+
+    for (int i = 0; i < n_windows; ++i) {
+        whisper_state * dst = windows[i].dst;
+        whisper_state * src = windows[i].src ? windows[i].src : dst;
+
+        if (dst == nullptr) {
+            log("%s: ERROR window %d has no state\n", __func__, i);
+            return -1;
+        }
+
+        for (const auto & inp : inputs) {
+            if (inp.state == dst) {
+                log("%s: ERROR windows %d and %d use the same state\n", __func__, (int) (&inp - inputs.data()), i);
+                return -1;
+            }
+        }
+
+        const int n_audio_ctx = dst->exp_n_audio_ctx > 0 ? dst->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+
+        if (i == 0) {
+            n_audio_ctx_0 = n_audio_ctx;
+        } else if (n_audio_ctx != n_audio_ctx_0) {
+            log("%s: ERROR window %d has an audio context of %d, the first window %d\n", __func__, i, n_audio_ctx, n_audio_ctx_0);
+            return -1;
+        }
+
+        inputs.push_back({ &src->mel, windows[i].offset, dst });
+    }
+
+    if (!whisper_encode_batch_internal(*ctx, std::move(inputs), n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    const int selected_decoder_id = 0;
+
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    // TODO: add selected_decoder_id to state
+    const int selected_decoder_id = 0;
+
+    if (ctx->state == nullptr) {
+        log("%s: ERROR state was not loaded.\n", __func__);
+        return false;
+    }
+
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const auto res = tokenize(ctx->vocab, text);
+
+    if (n_max_tokens < (int) res.size()) {
+        log("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
+        return -1;
+    }
+
+    for (int i = 0; i < (int) res.size(); i++) {
+        tokens[i] = res[i];
+    }
+
+    return res.size();
+}
+
+int whisper_lang_max_id() {
+    auto max_id = 0;
+    for (const auto & kv : g_lang) {
+        max_id = std::max(max_id, kv.second.first);
+    }
+
+    return max_id;
+}
+
+int whisper_lang_id(const char * lang) {
+    if (!g_lang.count(lang)) {
+        for (const auto & kv : g_lang) {
+            if (kv.second.second == lang) {
+                return kv.second.first;
+            }
+        }
+
+        log("%s: unknown language '%s'\n", __func__, lang);
+        return -1;
+    }
+    return g_lang.at(lang).first;
+}
+
+const char * whisper_lang_str(int id) {
+    for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.first.c_str();
+        }
+    }
+
+    log("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        log("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        log("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder
+    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        log("%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        log("%s: failed to decode\n", __func__);
+        return -7;
+    }
+
+    auto & logits_id = state->logits_id;
+    logits_id.clear();
+
+    for (const auto & kv : g_lang) {
+        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    }
+
+    // sort descending
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    // softmax
+    {
+        const auto max = logits_id[0].first;
+
+        double sum = 0.0f;
+        for (auto & kv : logits_id) {
+            kv.first = exp(kv.first - max);
+            sum += kv.first;
+        }
+
+        for (auto & kv : logits_id) {
+            kv.first /= sum;
+        }
+    }
+
+    {
+        for (const auto & prob : logits_id) {
+            if (lang_probs) {
+                lang_probs[prob.second] = prob.first;
+            }
+
+            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        }
+    }
+
+    return logits_id[0].second;
+}
+
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+int whisper_model_type(struct whisper_context * ctx) {
+    return ctx->model.type;
+}
+
+const char *whisper_model_type_readable(struct whisper_context * ctx) {
+    switch (ctx->model.type) {
+    case e_model::MODEL_TINY:
+        return "tiny";
+    case e_model::MODEL_BASE:
+        return "base";
+    case e_model::MODEL_SMALL:
+        return "small";
+    case e_model::MODEL_MEDIUM:
+        return "medium";
+    case e_model::MODEL_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len_org;
+}
+
+int whisper_n_len(struct whisper_context * ctx) {
+    return ctx->state->mel.n_len_org;
+}
+
+int whisper_n_vocab(struct whisper_context * ctx) {
+    return ctx->vocab.n_vocab;
+}
+
+int whisper_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_is_multilingual(struct whisper_context * ctx) {
+    return ctx->vocab.is_multilingual() ? 1 : 0;
+}
+
+float * whisper_get_logits(struct whisper_context * ctx) {
+    return ctx->state->logits.data();
+}
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
+}
+
+const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
+    return ctx->vocab.id_to_token.at(token).c_str();
+}
+
+whisper_token whisper_token_eot(struct whisper_context * ctx) {
+    return ctx->vocab.token_eot;
+}
+
+whisper_token whisper_token_sot(struct whisper_context * ctx) {
+    return ctx->vocab.token_sot;
+}
+
+whisper_token whisper_token_solm(struct whisper_context * ctx) {
+    return ctx->vocab.token_solm;
+}
+
+whisper_token whisper_token_prev(struct whisper_context * ctx) {
+    return ctx->vocab.token_prev;
+}
+
+whisper_token whisper_token_nosp(struct whisper_context * ctx) {
+    return ctx->vocab.token_nosp;
+}
+
+whisper_token whisper_token_not(struct whisper_context * ctx) {
+    return ctx->vocab.token_not;
+}
+
+whisper_token whisper_token_beg(struct whisper_context * ctx) {
+    return ctx->vocab.token_beg;
+}
+
+whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
+    return whisper_token_sot(ctx) + 1 + lang_id;
+}
+
+whisper_token whisper_token_translate(struct whisper_context * ctx) {
+    return ctx->vocab.token_translate;
+}
+
+whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
+    return ctx->vocab.token_transcribe;
+}
+
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = wsp_ggml_time_us();
+
+    log("\n");
+    log("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+
+        const int32_t n_sample = std::max(1, ctx->state->n_sample);
+        const int32_t n_encode = std::max(1, ctx->state->n_encode);
+        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+
+        log("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        log("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
+        log("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
+        log("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        log("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+        if (ctx->state->t_vad_us > 0) {
+            log("%s:      vad time = %8.2f ms / %5d skips (%8.2f s of silence skipped)\n", __func__, 1e-3f * ctx->state->t_vad_us, ctx->state->n_vad_skip, 1e-3f * ctx->state->t_vad_skipped_ms);
+        }
+    }
+    log("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+void whisper_reset_timings(struct whisper_context * ctx) {
+    if (ctx->state != nullptr) {
+        ctx->state->t_sample_us = 0;
+        ctx->state->t_encode_us = 0;
+        ctx->state->t_decode_us = 0;
+        ctx->state->t_vad_us = 0;
+        ctx->state->t_vad_skipped_ms = 0;
+        ctx->state->n_vad_skip = 0;
+    }
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(wsp_ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(wsp_ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(wsp_ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(wsp_ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(wsp_ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(wsp_ggml_cpu_has_arm_fma())   + " | ";
+    s += "F16C = "      + std::to_string(wsp_ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(wsp_ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(wsp_ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(wsp_ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(wsp_ggml_cpu_has_sse3())      + " | ";
+    s += "SSSE3 = "     + std::to_string(wsp_ggml_cpu_has_ssse3())     + " | ";
+    s += "VSX = "       + std::to_string(wsp_ggml_cpu_has_vsx())       + " | ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    return s.c_str();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params params = whisper_full_default_params(strategy);
+
+    struct whisper_full_params* result = new whisper_full_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy          =*/ strategy,
+
+        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.hybrid_sync       =*/ false,
+        /*.n_max_text_ctx    =*/ 16384,
+        /*.offset_ms         =*/ 0,
+        /*.duration_ms       =*/ 0,
+
+        /*.translate         =*/ false,
+        /*.no_context        =*/ true,
+        /*.single_segment    =*/ false,
+        /*.print_special     =*/ false,
+        /*.print_progress    =*/ true,
+        /*.print_realtime    =*/ false,
+        /*.print_timestamps  =*/ true,
+
+        /*.token_timestamps  =*/ false,
+        /*.thold_pt          =*/ 0.01f,
+        /*.thold_ptsum       =*/ 0.01f,
+        /*.max_len           =*/ 0,
+        /*.split_on_word     =*/ false,
+        /*.max_tokens        =*/ 0,
+
+        /*.speed_up          =*/ false,
+        /*.debug_mode        =*/ false,
+        /*.audio_ctx         =*/ 0,
+        /*.n_threads_ahead   =*/ 0,
+        /*.vad_skip_silence  =*/ false,
+        /*.vad_thold         =*/ 15.0f,
+
+        /*.tdrz_enable       =*/ false,
+
+        /*.initial_prompt    =*/ nullptr,
+        /*.prompt_tokens     =*/ nullptr,
+        /*.prompt_n_tokens   =*/ 0,
+
+        /*.language          =*/ "en",
+        /*.detect_language   =*/ false,
+
+        /*.suppress_blank    =*/ true,
+        /*.suppress_non_speech_tokens =*/ false,
+
+        /*.temperature       =*/  0.0f,
+        /*.max_initial_ts    =*/  1.0f,
+        /*.length_penalty    =*/ -1.0f,
+
+        /*.temperature_inc   =*/  0.4f,
+        /*.entropy_thold     =*/  2.4f,
+        /*.logprob_thold     =*/ -1.0f,
+        /*.no_speech_thold   =*/  0.6f,
+
+        /*.greedy            =*/ {
+            /*.best_of   =*/ -1,
+        },
+
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
+
+            /*.patience  =*/ -1.0f,
+        },
+
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
+
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.abort_callback           =*/ nullptr,
+        /*.abort_callback_user_data =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
+
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return txt[0] == ' ';
+}
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+//
+// logits_inp: the logits of the decoder from the last whisper_decode_internal() call
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params   params,
+              struct whisper_decoder & decoder,
+                         const float * logits_inp,
+                               float   temperature) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.id_to_token.size();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        logits.resize(n_logits);
+        memcpy(logits.data(), logits_inp, n_logits*sizeof(float));
+
+        if (temperature > 0.0f) {
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] /= temperature;
+            }
+        }
+
+        // will be populated a bit later
+        probs.resize(n_logits);
+        logprobs.resize(n_logits);
+    }
+
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot]           = -INFINITY;
+                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+            }
+        }
+
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        logits[vocab.token_not] = -INFINITY;
+
+        // suppress sot and nosp tokens
+        logits[vocab.token_sot]  = -INFINITY;
+        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            logits[vocab.token_solm] = -INFINITY;
+        }
+
+        // suppress task tokens
+        logits[vocab.token_translate]  = -INFINITY;
+        logits[vocab.token_transcribe] = -INFINITY;
+
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
+
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        if (params.suppress_non_speech_tokens) {
+            for (const std::string & token : non_speech_tokens) {
+                const std::string suppress_tokens[] = {token, " " + token};
+                for (const std::string & suppress_token : suppress_tokens) {
+                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
+                    }
+                }
+            }
+
+            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+                logits[vocab.token_to_id.at(" -")] = -INFINITY;
+            }
+            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            }
+        }
+
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+            //log("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    for (int i = vocab.token_beg; i < n_logits; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                } else {
+                    for (int i = 0; i < vocab.token_eot; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                }
+            }
+        }
+
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
+
+            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // populate the logprobs array (log_softmax)
+        {
+            const float logit_max = *std::max_element(logits.begin(), logits.end());
+            float logsumexp = 0.0f;
+            for (int i = 0; i < n_logits; ++i) {
+                if (logits[i] > -INFINITY) {
+                    logsumexp += expf(logits[i] - logit_max);
+                }
+            }
+            logsumexp = logf(logsumexp) + logit_max;
+
+            for (int i = 0; i < n_logits; ++i) {
+                if (logits[i] > -INFINITY) {
+                    logprobs[i] = logits[i] - logsumexp;
+                } else {
+                    logprobs[i] = -INFINITY;
+                }
+            }
+        }
+
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over timestamps
+            float timestamp_logprob = -INFINITY;
+            {
+                float logsumexp = 0.0f;
+                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
+                for (int i = vocab.token_beg; i < n_logits; ++i) {
+                    if (logprobs[i] > -INFINITY) {
+                        logsumexp += expf(logprobs[i] - logprob_max);
+                    }
+                }
+                if (logsumexp > 0.0f) {
+                    timestamp_logprob = logf(logsumexp) + logprob_max;
+                }
+            }
+
+            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+
+            //log("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+            if (timestamp_logprob > max_text_token_logprob) {
+                for (int i = 0; i < vocab.token_beg; ++i) {
+                    logits[i]   = -INFINITY;
+                    logprobs[i] = -INFINITY;
+                }
+            }
+        }
+    }
+
+    // compute probs
+    {
+        for (int i = 0; i < n_logits; ++i) {
+            if (logits[i] == -INFINITY) {
+                probs[i] = 0.0f;
+            } else {
+                probs[i] = expf(logprobs[i]);
+            }
+        }
+    }
+
+#if 0
+    // print first 100 logits - token string : logit
+    for (int i = 0; i < 100; i++) {
+        const auto token   = vocab.id_to_token.at(i);
+        const auto prob    = probs[i];
+        const auto logit   = logits[i];
+        const auto logprob = logprobs[i];
+        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    }
+
+    // "And", "and", " And", " and"
+    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+
+    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+
+    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
+
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
+        }
+
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
+
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
+            }
+        }
+    } else {
+        std::discrete_distribution<> dist(probs.begin(), probs.end());
+
+        result.id   = dist(state.rng);
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
+
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+static std::vector<whisper_token_data> whisper_sample_token_topk(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                        int   k) {
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logits   = decoder.logits;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    auto & logits_id = state.logits_id;
+
+    logits_id.clear();
+    for (int i = 0; i < n_logits; ++i) {
+        logits_id.push_back({ logits[i], i });
+    }
+
+    std::partial_sort(
+            logits_id.begin(),
+            logits_id.begin() + k, logits_id.end(),
+            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
+                return a.first > b.first;
+            });
+
+    std::vector<whisper_token_data> result;
+    result.reserve(k);
+
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
 
             sum_ts += probs[i];
             if (max_ts < probs[i]) {
@@ -4006,1201 +6531,2394 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
             }
         }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
+
+    for (int i = 0; i < k; ++i) {
+        const auto id = logits_id[i].second;
+
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
+
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
+
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
+
+    double penalty = sequence.result_len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
+    {
+        const int n = 32;
+
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+// audio context of the encoder for a window of n_frames mel frames with WHISPER_AUDIO_CTX_ADAPTIVE
+// each encoder position covers 2 frames
+static int whisper_audio_ctx_adaptive(const whisper_hparams & hparams, int n_frames) {
+    const int n_pos = (std::max(0, std::min(n_frames, 100*WHISPER_CHUNK_SIZE)) + 1)/2 + WHISPER_AUDIO_CTX_MARGIN;
+
+    return std::min(hparams.n_audio_ctx, ((n_pos + WHISPER_AUDIO_CTX_BUCKET - 1)/WHISPER_AUDIO_CTX_BUCKET)*WHISPER_AUDIO_CTX_BUCKET);
+}
+
+// encode of the next window of whisper_full() on other threads, while the current window is decoded
+struct whisper_encode_ahead {
+    std::thread worker;
+
+    bool ok = false;
+
+    ~whisper_encode_ahead() {
+        wait();
+    }
+
+    void wait() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+// speech regions [begin, end) of the PCM signal, in mel frames (10 ms)
+// a frame is speech when its energy is thold dB above the noise floor (10th percentile of the frames), or 30 dB below
+// the loudest frame when that is lower so that audio loud throughout is kept, and never when it is below -70 dBFS
+// the regions are padded by 200 ms on each side and the gaps shorter than 1 s are merged
+static std::vector<std::pair<int, int>> whisper_vad_regions(const float * samples, int n_samples, float thold) {
+    const int n_frames = n_samples/WHISPER_HOP_LENGTH;
+    const int n_pad    = 20;
+    const int n_gap    = 100;
+
+    std::vector<std::pair<int, int>> regions;
+    if (n_frames == 0) {
+        return regions;
+    }
+
+    std::vector<float> db(n_frames);
+    for (int i = 0; i < n_frames; ++i) {
+        const float * x = samples + i*WHISPER_HOP_LENGTH;
+
+        float sum = 0.0f;
+        for (int j = 0; j < WHISPER_HOP_LENGTH; ++j) {
+            sum += x[j]*x[j];
+        }
+        db[i] = 10.0f*log10f(sum/WHISPER_HOP_LENGTH + 1e-12f);
+    }
+
+    float db_floor;
+    {
+        std::vector<float> sorted = db;
+        std::nth_element(sorted.begin(), sorted.begin() + n_frames/10, sorted.end());
+        db_floor = sorted[n_frames/10];
+    }
+    const float db_peak = *std::max_element(db.begin(), db.end());
+    const float db_thold = std::max(std::min(db_floor + thold, db_peak - 30.0f), -70.0f);
+
+    for (int i = 0; i < n_frames; ) {
+        if (db[i] <= db_thold) {
+            ++i;
+            continue;
+        }
+
+        int j = i;
+        while (j < n_frames && db[j] > db_thold) {
+            ++j;
+        }
+
+        const int begin = std::max(0, i - n_pad);
+        const int end   = std::min(n_frames, j + n_pad);
+
+        if (!regions.empty() && begin - regions.back().second < n_gap) {
+            regions.back().second = end;
+        } else {
+            regions.emplace_back(begin, end);
+        }
+
+        i = j;
+    }
+
+    return regions;
+}
+
+// first frame of speech at or after seek, seek_end when there is none
+static int whisper_vad_next_speech(const std::vector<std::pair<int, int>> & regions, int seek, int seek_end) {
+    for (const auto & region : regions) {
+        if (region.second > seek) {
+            return std::min(seek_end, std::max(seek, region.first));
+        }
+    }
+
+    return seek_end;
+}
+
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    // clear old results
+    auto & result_all = state->result_all;
+
+    result_all.clear();
+
+    state->sync_mode = params.hybrid_sync ? WSP_GGML_SYNC_HYBRID : WSP_GGML_SYNC_SPIN;
+
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (params.speed_up) {
+            // TODO: Replace PV with more advanced algorithm
+            log("%s: failed to compute log mel spectrogram\n", __func__);
+            return -1;
+        } else {
+            if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+                log("%s: failed to compute log mel spectrogram\n", __func__);
+                return -2;
+            }
+        }
+    }
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
+    // the windows start at the next speech, the timestamps stay those of the audio
+    const bool vad = params.vad_skip_silence && n_samples > 0 && !params.speed_up;
+
+    state->vad_regions.clear();
+    if (vad) {
+        const int64_t t_start_us = wsp_ggml_time_us();
+
+        state->vad_regions = whisper_vad_regions(samples, n_samples, params.vad_thold);
+
+        state->t_vad_us += wsp_ggml_time_us() - t_start_us;
+    } else if (params.vad_skip_silence) {
+        log("%s: vad_skip_silence needs the PCM samples and no speed_up - the silence is not skipped\n", __func__);
+    }
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    // set before the language detection: it encodes the first window like the transcription, which reuses its output
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx) || (params.audio_ctx < 0 && params.audio_ctx != WHISPER_AUDIO_CTX_ADAPTIVE)) {
+        log("%s: invalid audio_ctx %d (maximum allowed %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    if (params.audio_ctx == WHISPER_AUDIO_CTX_ADAPTIVE) {
+        state->exp_n_audio_ctx = whisper_audio_ctx_adaptive(ctx->model.hparams, std::min(seek_end, state->mel.n_len_org) - seek_start);
+    } else {
+        state->exp_n_audio_ctx = params.audio_ctx;
+    }
+
+    // auto-detect language if not specified
+    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+        // with the VAD, the language is detected on the first speech rather than on the silence before it
+        const int seek_speech = vad ? whisper_vad_next_speech(state->vad_regions, seek_start, seek_end) : seek_start;
+        const int offset_ms   = seek_speech < seek_end ? 10*seek_speech : params.offset_ms;
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, offset_ms, params.n_threads, probs.data());
+        if (lang_id < 0) {
+            log("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id = lang_id;
+        params.language = whisper_lang_str(lang_id);
+
+        log("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+        if (params.detect_language) {
+            return 0;
+        }
+    }
+
+    if (params.token_timestamps) {
+        state->t_beg    = 0;
+        state->t_last   = 0;
+        state->tid_last = 0;
+        if (n_samples > 0) {
+            state->energy = get_signal_energy(samples, n_samples, 32);
+        }
+    }
+
+    // if length of spectrogram is less than 1.0s (100 frames), then return
+    // basically don't process anything that is less than 1.0s
+    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
+    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
+        return 0;
+    }
+
+    // a set of temperatures to use
+    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
+    std::vector<float> temperatures;
+    if (params.temperature_inc > 0.0f) {
+        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
+            temperatures.push_back(t);
+        }
+    } else {
+        temperatures.push_back(params.temperature);
+    }
+
+    // initialize the decoders
+    int n_decoders = 1;
+
+    switch (params.strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                n_decoders = params.greedy.best_of;
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
+            } break;
+    };
+
+    n_decoders = std::max(1, n_decoders);
+
+    // TAGS: WHISPER_DECODER_INIT
+    if (state->kv_self.n_blocks < kv_paged_n_blocks(ctx->model.hparams, n_decoders)) {
+        if (!kv_paged_reserve(ctx->model.hparams, state->kv_self, state->kv_self.k->type, kv_paged_n_blocks(ctx->model.hparams, n_decoders))) {
+            log("%s: kv_paged_reserve() failed for self-attention, %d decoders\n", __func__, n_decoders);
+            return -4;
+        }
+
+        // the cached graphs point to the previous cache
+        state->decode_graphs.clear();
+
+        WHISPER_PRINT_DEBUG("%s: resized self-attention kv cache, %d decoders\n", __func__, n_decoders);
+    }
+
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state->decoders[j];
+
+        if (decoder.probs.empty()) {
+            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+
+            decoder.probs.resize   (ctx->vocab.n_vocab);
+            decoder.logits.resize  (ctx->vocab.n_vocab);
+            decoder.logprobs.resize(ctx->vocab.n_vocab);
+        }
+    }
+
+    // the accumulated text context so far
+    auto & prompt_past = state->prompt_past;
+    if (params.no_context) {
+        prompt_past.clear();
+    }
+
+    // prepare prompt
+    {
+        std::vector<whisper_token> prompt_tokens;
+
+        // initial prompt
+        if (!params.prompt_tokens && params.initial_prompt) {
+            prompt_tokens.resize(1024);
+            prompt_tokens.resize(whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size()));
+            params.prompt_tokens   = prompt_tokens.data();
+            params.prompt_n_tokens = prompt_tokens.size();
+        }
+
+        // prepend the prompt tokens to the prompt_past
+        if (params.prompt_tokens && params.prompt_n_tokens > 0) {
+            // parse tokens from the pointer
+            for (int i = 0; i < params.prompt_n_tokens; i++) {
+                prompt_past.push_back(params.prompt_tokens[i]);
+            }
+            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
+        }
+    }
+
+    // these tokens determine the task that will be performed
+    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
+        if (params.translate) {
+            prompt_init.push_back(whisper_token_translate(ctx));
+        } else {
+            prompt_init.push_back(whisper_token_transcribe(ctx));
+        }
+    }
+
+    int seek = seek_start;
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    // beam-search helpers
+    std::vector<whisper_kv_seq> kv_seqs;
+
+    struct beam_candidate {
+        int decoder_idx;
+        int seek_delta;
+
+        bool has_ts;
+
+        whisper_sequence sequence;
+    };
+
+    std::vector<beam_candidate> beam_candidates;
+
+    // the next window is encoded ahead into the cross-attention cache of a second state, assuming it starts where
+    // the current window ends - this is the case when the window is decoded up to its end, e.g. with single_segment
+    // the state takes that cache when the assumption holds, the next window is encoded again otherwise
+    // after a window that ended early (on a timestamp), the next one is not encoded ahead
+    whisper_encode_ahead ahead;
+
+    bool ahead_likely = true;
+
+    if (params.n_threads_ahead > 0 && state->ahead == nullptr) {
+        state->ahead = whisper_init_state(ctx);
+        if (state->ahead == nullptr) {
+            log("%s: failed to create the state to encode ahead - the windows are encoded one after the other\n", __func__);
+        }
+    }
+
+    const bool encode_ahead = params.n_threads_ahead > 0 && state->ahead != nullptr;
+
+    // main loop
+    while (true) {
+        if (params.progress_callback) {
+            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+
+            params.progress_callback(
+                ctx, ctx->state, progress_cur, params.progress_callback_user_data);
+        }
+
+        if (vad) {
+            const int seek_speech = whisper_vad_next_speech(state->vad_regions, seek, seek_end);
+            if (seek_speech > seek) {
+                WHISPER_PRINT_DEBUG("%s: skipping silence %d .. %d\n", __func__, seek, seek_speech);
+
+                state->t_vad_skipped_ms += 10*(seek_speech - seek);
+                state->n_vad_skip++;
+
+                seek = seek_speech;
+            }
+        }
+
+        // of only 1 second left, then stop
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                log("%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
+
+        if (params.abort_callback && params.abort_callback(params.abort_callback_user_data)) {
+            log("%s: abort_callback returned true - aborting\n", __func__);
+            break;
+        }
+
+        // the adaptive audio context follows the audio left in the window
+        if (params.audio_ctx == WHISPER_AUDIO_CTX_ADAPTIVE) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_adaptive(ctx->model.hparams, std::min(seek_end, state->mel.n_len_org) - seek);
+        }
+
+        if (encode_ahead) {
+            ahead.wait();
+
+            const auto & encoded = state->ahead->encoded;
+
+            const int n_audio_ctx = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+
+            if (ahead.ok && encoded.mel_id == state->mel.id && encoded.mel_offset == seek && encoded.n_audio_ctx == n_audio_ctx) {
+                // the caches are swapped, so the encoded windows still match their cache
+                std::swap(state->kv_cross, state->ahead->kv_cross);
+                std::swap(state->encoded,  state->ahead->encoded);
+            }
+        }
+
+        // encode audio features starting at offset seek
+        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+            log("%s: failed to encode\n", __func__);
+            return -6;
+        }
+
+        // the next window starts at the end of this one, or at the next speech after it
+        const int seek_next = vad ?
+            whisper_vad_next_speech(state->vad_regions, seek + 100*WHISPER_CHUNK_SIZE, seek_end) : seek + 100*WHISPER_CHUNK_SIZE;
+
+        if (encode_ahead && ahead_likely && seek_next + 100 < seek_end) {
+
+            whisper_state * st = state->ahead;
+
+            st->sync_mode       = state->sync_mode;
+            st->exp_n_audio_ctx = params.audio_ctx == WHISPER_AUDIO_CTX_ADAPTIVE ?
+                whisper_audio_ctx_adaptive(ctx->model.hparams, std::min(seek_end, state->mel.n_len_org) - seek_next) : params.audio_ctx;
+
+            // the main thread only reads the spectrogram until the worker is joined
+            ahead.ok     = false;
+            ahead.worker = std::thread([ctx, state, st, seek_next, &params, &ahead]() {
+                ahead.ok = whisper_encode_internal(*ctx, *st, state->mel, seek_next, params.n_threads_ahead);
+            });
+        }
+
+        // if there is a very short audio segment left to process, we remove any past prompt since it tends
+        // to confuse the decoder and often make it repeat or hallucinate stuff
+        if (seek > seek_start && seek + 500 >= seek_end) {
+            prompt_past.clear();
+        }
+
+        int best_decoder_id = 0;
+
+        // set when the abort callback stops the decoding of the window
+        bool aborted = false;
+
+        for (int it = 0; it < (int) temperatures.size(); ++it) {
+            const float t_cur = temperatures[it];
+
+            int n_decoders_cur = 1;
+
+            switch (params.strategy) {
+                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        }
+                    } break;
+                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        } else {
+                            n_decoders_cur = params.beam_search.beam_size;
+                        }
+                    } break;
+            };
+
+            n_decoders_cur = std::max(1, n_decoders_cur);
+
+            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+
+            // release the blocks of all the decoders, also the ones that are not used at this temperature,
+            // so the prompt is stored in free contiguous blocks
+            for (int j = 0; j < n_decoders; ++j) {
+                kv_seq_clear(state->kv_self, state->decoders[j].kv_self);
+            }
+
+            // TAGS: WHISPER_DECODER_INIT
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                decoder.sequence.tokens.clear();
+                decoder.sequence.result_len       = 0;
+                decoder.sequence.sum_logprobs_all = 0.0;
+                decoder.sequence.sum_logprobs     = -INFINITY;
+                decoder.sequence.avg_logprobs     = -INFINITY;
+                decoder.sequence.entropy          = 0.0;
+                decoder.sequence.score            = -INFINITY;
+
+                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+
+                decoder.failed    = false;
+                decoder.completed = false;
+                decoder.has_ts    = false;
+            }
+
+            // init prompt and kv cache for the current iteration
+            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
+            {
+                prompt.clear();
+
+                // if we have already generated some text, use it as a prompt to condition the next generation
+                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
+                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+
+                    prompt = { whisper_token_prev(ctx) };
+                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
+                }
+
+                // init new transcription with sot, language (opt) and task tokens
+                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+
+                // print the prompt
+                WHISPER_PRINT_DEBUG("\n\n");
+                for (int i = 0; i < (int) prompt.size(); i++) {
+                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+                }
+                WHISPER_PRINT_DEBUG("\n\n");
+
+                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
+                    log("%s: failed to decode\n", __func__);
+                    return -7;
+                }
+
+                {
+                    const int64_t t_start_sample_us = wsp_ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, params, state->decoders[0], state->logits.data(), t_cur);
+
+                    state->decoders[0].kv_self.n += prompt.size();
+
+                    for (int j = 1; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        // share the blocks of the prompt
+                        kv_seq_copy(state->kv_self, decoder.kv_self, state->decoders[0].kv_self);
+
+                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                    }
+
+                    state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
+                }
+            }
+
+            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+                if (params.abort_callback && params.abort_callback(params.abort_callback_user_data)) {
+                    aborted = true;
+                    break;
+                }
+
+                const int64_t t_start_sample_us = wsp_ggml_time_us();
+
+                // store the block tables of all decoders when doing beam-search
+                // the blocks are shared, not copied
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    kv_seqs.resize(n_decoders_cur);
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        kv_seq_copy(state->kv_self, kv_seqs[j], decoder.kv_self);
+                    }
+
+                    beam_candidates.clear();
+                }
+
+                // generate new sequence candidates for each decoder
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.completed || decoder.failed) {
+                        continue;
+                    }
+
+                    switch (params.strategy) {
+                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                            {
+                                if (t_cur < 1e-6f) {
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                                } else {
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                                }
+
+                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                            } break;
+                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                            {
+                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+
+                                for (const auto & token : tokens_new) {
+                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
+                                    beam_candidates.back().sequence.tokens.push_back(token);
+                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+
+                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
+                                }
+                            } break;
+                    };
+                }
+
+                // for beam-search, choose the top candidates and update the KV caches
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    std::sort(
+                            beam_candidates.begin(),
+                            beam_candidates.end(),
+                            [](const beam_candidate & a, const beam_candidate & b) {
+                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                    });
+
+                    uint32_t cur_c = 0;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        auto & cur = beam_candidates[cur_c++];
+
+                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
+                            ++cur_c;
+                        }
+
+                        decoder.sequence   = cur.sequence;
+                        decoder.seek_delta = cur.seek_delta;
+                        decoder.has_ts     = cur.has_ts;
+
+                        kv_seq_copy(state->kv_self, decoder.kv_self, kv_seqs[cur.decoder_idx]);
+
+                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    }
+
+                    for (auto & seq : kv_seqs) {
+                        kv_seq_clear(state->kv_self, seq);
+                    }
+                }
+
+                // update the decoder state
+                // - check if the sequence is completed
+                // - check if the sequence is failed
+                // - update sliding window based on timestamp tokens
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.completed || decoder.failed) {
+                        continue;
+                    }
+
+                    auto & has_ts     = decoder.has_ts;
+                    auto & failed     = decoder.failed;
+                    auto & completed  = decoder.completed;
+                    auto & seek_delta = decoder.seek_delta;
+                    auto & result_len = decoder.sequence.result_len;
+
+                    {
+                        const auto & token = decoder.sequence.tokens.back();
+
+                        // timestamp token - update sliding window
+                        if (token.id > whisper_token_beg(ctx)) {
+                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+
+                            // do not allow to go back in time
+                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                                failed = true; // TODO: maybe this is not a failure ?
+                                continue;
+                            }
+
+                            seek_delta = seek_delta_new;
+                            result_len = i + 1;
+                            has_ts = true;
+                        }
+
+#ifdef WHISPER_DEBUG
+                        {
+                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                        }
+#endif
+
+                        // end of segment
+                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
+                           ) {
+                            if (result_len == 0) {
+                                if (seek + seek_delta + 100 >= seek_end) {
+                                    result_len = i + 1;
+                                } else {
+                                    failed = true;
+                                    continue;
+                                }
+                            }
+
+                            if (params.single_segment) {
+                                result_len = i + 1;
+                                seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            }
+
+                            completed = true;
+                            continue;
+                        }
+
+                        // TESTS: if no tensors are loaded, it means we are running tests
+                        if (ctx->model.n_loaded == 0) {
+                            seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            completed = true;
+                            continue;
+                        }
+                    }
+
+                    // sometimes, the decoding can get stuck in a repetition loop
+                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                        failed = true;
+                        continue;
+                    }
+                }
+
+                // check if all decoders have finished (i.e. completed or failed)
+                {
+                    bool completed_all = true;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        completed_all = false;
+                    }
+
+                    if (completed_all) {
+                        break;
+                    }
+                }
+
+                state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
+
+                // obtain logits for the next token
+                // the running decoders are evaluated together, so the weights are read once per step for all of them
+                {
+                    whisper_decoder * batch[WHISPER_MAX_DECODERS];
+                    int n_batch = 0;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.failed || decoder.completed) {
+                            continue;
+                        }
+
+                        decoder.tokens_tmp.resize(1);
+                        decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+
+                        //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+
+                        batch[n_batch++] = &decoder;
+                    }
+
+                    const int n_batch_max = whisper_decode_batch_max(ctx->model.hparams);
+
+                    for (int i0 = 0; i0 < n_batch; ) {
+                        // the decoders of a batch must be at the same position
+                        int i1 = i0 + 1;
+                        while (i1 < n_batch && i1 - i0 < n_batch_max && batch[i1]->kv_self.n == batch[i0]->kv_self.n) {
+                            ++i1;
+                        }
+
+                        whisper_token tokens[WHISPER_MAX_DECODERS];
+                        for (int i = i0; i < i1; ++i) {
+                            tokens[i - i0] = batch[i]->tokens_tmp[0];
+                        }
+
+                        if (!whisper_decode_internal(*ctx, *state, batch + i0, i1 - i0, tokens, 1, batch[i0]->kv_self.n, params.n_threads)) {
+                            log("%s: failed to decode\n", __func__);
+                            return -8;
+                        }
+
+                        {
+                            const int64_t t_start_sample_us = wsp_ggml_time_us();
+
+                            for (int i = i0; i < i1; ++i) {
+                                whisper_process_logits(*ctx, *state, params, *batch[i], state->logits.data() + (i - i0)*ctx->vocab.n_vocab, t_cur);
+
+                                ++batch[i]->kv_self.n;
+                            }
+
+                            state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
+                        }
+
+                        i0 = i1;
+                    }
+                }
+            }
+
+            if (aborted) {
+                break;
+            }
+
+            // rank the resulting sequences and select the best one
+            {
+                double best_score = -INFINITY;
+
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.failed) {
+                        continue;
+                    }
+
+                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
+                    whisper_sequence_score(params, decoder.sequence);
+
+                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+
+                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                        decoder.failed = true;
+                        state->n_fail_h++;
+
+                        continue;
+                    }
+
+                    if (best_score < decoder.sequence.score) {
+                        best_score = decoder.sequence.score;
+                        best_decoder_id = j;
+                    }
+                }
+
+                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+            }
+
+            // was the decoding successful for the current temperature?
+            // do fallback only if:
+            // - we are not at the last temperature
+            // - we are not at the end of the audio (3 sec)
+            if (it != (int) temperatures.size() - 1 &&
+                seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
+                bool success = true;
+
+                const auto & decoder = state->decoders[best_decoder_id];
+
+                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+                    success = false;
+                    state->n_fail_p++;
+                }
+
+                if (success) {
+                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
+                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
+                    //}
+
+                    break;
+                }
+            }
+
+            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
+        }
+
+        if (aborted) {
+            log("%s: abort_callback returned true - aborting\n", __func__);
+            break;
+        }
+
+        // output results through a user-provided callback
+        {
+            const auto & best_decoder = state->decoders[best_decoder_id];
+
+            const auto seek_delta = best_decoder.seek_delta;
+            const auto result_len = best_decoder.sequence.result_len;
+
+            const auto & tokens_cur = best_decoder.sequence.tokens;
+
+            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+
+            // update prompt_past
+            prompt_past.clear();
+            if (prompt.front() == whisper_token_prev(ctx)) {
+                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
+            }
+
+            for (int i = 0; i < result_len; ++i) {
+                prompt_past.push_back(tokens_cur[i].id);
+            }
+
+            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
+                int  i0 = 0;
+                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+
+                std::string text;
+                bool speaker_turn_next = false;
+
+                for (int i = 0; i < (int) tokens_cur.size(); i++) {
+                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+
+                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
+                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
+                    }
+
+                    // [TDRZ] record if speaker turn was predicted after current segment
+                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
+                        speaker_turn_next = true;
+                    }
+
+                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
+                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+
+                        if (!text.empty()) {
+                            const auto tt0 = params.speed_up ? 2*t0 : t0;
+                            const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+                            if (params.print_realtime) {
+                                if (params.print_timestamps) {
+                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                } else {
+                                    printf("%s", text.c_str());
+                                    fflush(stdout);
+                                }
+                            }
+
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+
+                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
+                            for (int j = i0; j <= i; j++) {
+                                result_all.back().tokens.push_back(tokens_cur[j]);
+                            }
+
+                            int n_new = 1;
+
+                            if (params.token_timestamps) {
+                                whisper_exp_compute_token_level_timestamps(
+                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+                                if (params.max_len > 0) {
+                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                                }
+                            }
+                            if (params.new_segment_callback) {
+                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                            }
+                        }
+                        text = "";
+                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                            i++;
+                        }
+                        i--;
+                        t0 = t1;
+                        i0 = i + 1;
+                        speaker_turn_next = false;
+                    }
+                }
+
+                if (!text.empty()) {
+                    const auto t1 = seek + seek_delta;
+
+                    const auto tt0 = params.speed_up ? 2*t0 : t0;
+                    const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
+                        }
+                    }
+
+                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
+                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
+                        result_all.back().tokens.push_back(tokens_cur[j]);
+                    }
+
+                    int n_new = 1;
+
+                    if (params.token_timestamps) {
+                        whisper_exp_compute_token_level_timestamps(
+                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                        }
+                    }
+                    if (params.new_segment_callback) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                    }
+                }
+            }
+
+            // update audio window
+            seek += seek_delta;
+
+            ahead_likely = seek_delta == 100*WHISPER_CHUNK_SIZE;
+
+            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
+
+    return 0;
+}
+
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+// sample of [i0, i1) with the lowest PCM signal energy, the nearest to i_mid among equals
+static int whisper_quiet_split(const float * samples, int n_samples, int i0, int i1, int i_mid) {
+    // energy averaged over 100 ms, computed with the margin of the window so that the borders are not biased
+    const int hw = WHISPER_SAMPLE_RATE/20;
+
+    const int j0 = std::max(0, i0 - hw);
+    const int j1 = std::min(n_samples, i1 + hw);
+
+    const std::vector<float> energy = get_signal_energy(samples + j0, j1 - j0, hw);
+
+    int best = i_mid;
+    for (int i = i0; i < i1; ++i) {
+        const float e = energy[i - j0];
+        const float e_best = energy[best - j0];
+        if (e < e_best || (e == e_best && std::abs(i - i_mid) < std::abs(best - i_mid))) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// drop the text tokens at the start of next that repeat the ones at the end of prev, and rebuild its text
+// returns false when no text is left in next
+static bool whisper_stitch_segments(
+        struct whisper_context & ctx,
+        const whisper_segment & prev,
+              whisper_segment & next,
+                         bool   print_special) {
+    const whisper_token token_eot = whisper_token_eot(&ctx);
+
+    std::vector<whisper_token> text_prev;
+    std::vector<int> text_next; // indices in next.tokens
+    for (const auto & token : prev.tokens) {
+        if (token.id < token_eot) {
+            text_prev.push_back(token.id);
+        }
+    }
+    for (int i = 0; i < (int) next.tokens.size(); ++i) {
+        if (next.tokens[i].id < token_eot) {
+            text_next.push_back(i);
+        }
+    }
+
+    // longest suffix of prev that is a prefix of next
+    // a single token such as " the" or "," can really be said on both sides, so at least 2 tokens must match
+    const int n_dup_min = 2;
+
+    int n_dup = 0;
+    for (int k = (int) std::min(text_prev.size(), text_next.size()); k >= n_dup_min; --k) {
+        bool match = true;
+        for (int j = 0; j < k && match; ++j) {
+            match = text_prev[text_prev.size() - k + j] == next.tokens[text_next[j]].id;
+        }
+        if (match) {
+            n_dup = k;
+            break;
+        }
     }
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = logits_id[i].second;
+    if (n_dup == 0) {
+        return true;
+    }
+    if (n_dup == (int) text_next.size()) {
+        return false;
+    }
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+    for (int j = n_dup - 1; j >= 0; --j) {
+        next.tokens.erase(next.tokens.begin() + text_next[j]);
+    }
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+    next.text.clear();
+    for (const auto & token : next.tokens) {
+        if (print_special || token.id < token_eot) {
+            next.text += whisper_token_to_str(&ctx, token.id);
         }
     }
 
-    state.n_sample++;
-
-    return result;
+    return true;
 }
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
+// split the audio in n_processors chunks and transcribe them on the default state and the pooled states
+// with split_on_silence, the chunks end in the quietest part near their nominal end and overlap by overlap_ms:
+// each segment is kept by the chunk that owns its middle, and the text repeated across a boundary is dropped
+static int whisper_full_parallel_impl(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors,
+        bool split_on_silence,
+        int overlap_ms) {
+    if (n_processors == 1) {
+        return whisper_full(ctx, params, samples, n_samples);
     }
+    int ret = 0;
 
-    double result = 0.0f;
+    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
+    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
+    // chunk i owns [splits[i], splits[i + 1]) and is transcribed on [begins[i], ends[i])
+    std::vector<int> splits(n_processors + 1);
+    splits[0] = offset_samples;
+    splits[n_processors] = n_samples;
+    for (int i = 1; i < n_processors; ++i) {
+        splits[i] = offset_samples + i*n_samples_per_processor;
+
+        if (split_on_silence) {
+            // search up to 5 s around the nominal split, and at most a quarter of a chunk
+            const int radius = std::min(n_samples_per_processor/4, 5*WHISPER_SAMPLE_RATE);
+            const int i0 = std::max(splits[i - 1] + 1, splits[i] - radius);
+            const int i1 = std::min(n_samples, splits[i] + radius);
+            splits[i] = whisper_quiet_split(samples, n_samples, i0, i1, splits[i]);
+        }
     }
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    const int overlap_samples = split_on_silence ? std::max(0, (WHISPER_SAMPLE_RATE*overlap_ms)/1000) : 0;
 
-    double penalty = sequence.result_len;
+    std::vector<int> begins(n_processors);
+    std::vector<int> ends(n_processors);
+    for (int i = 0; i < n_processors; ++i) {
+        begins[i] = i == 0 ? 0 : std::max(offset_samples, splits[i] - overlap_samples);
+        ends[i]   = std::min(n_samples, splits[i + 1] + overlap_samples);
+    }
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    // prepare separate states for each thread, kept with the context for the next calls
+    while ((int) ctx->parallel_states.size() < n_processors - 1) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            log("%s: failed to initialize the states\n", __func__);
+            return -1;
+        }
+        ctx->parallel_states.push_back(state);
     }
 
-    sequence.score = result/penalty;
+    std::vector<whisper_state *> states(ctx->parallel_states.begin(), ctx->parallel_states.begin() + n_processors - 1);
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+    struct timings {
+        int64_t t_mel_us;
+        int64_t t_sample_us;
+        int64_t t_encode_us;
+        int64_t t_decode_us;
+        int64_t t_vad_us;
+        int64_t t_vad_skipped_ms;
+        int32_t n_vad_skip;
+    };
 
-        int cnt = 0;
-        double entropy = 0.0f;
+    std::vector<timings> timings_start(n_processors - 1);
+    std::vector<int> rets(n_processors - 1, 0);
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+    // the calling thread will process the first chunk
+    // while the other threads will process the remaining chunks
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+    std::vector<std::thread> workers(n_processors - 1);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        whisper_state * state = states[i];
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
-        }
+        // the text of the previous call is not the context of this chunk
+        state->prompt_past.clear();
+        timings_start[i] = {
+            state->t_mel_us, state->t_sample_us, state->t_encode_us, state->t_decode_us,
+            state->t_vad_us, state->t_vad_skipped_ms, state->n_vad_skip,
+        };
 
-        sequence.entropy = entropy;
-    }
-}
+        const int start_samples = begins[i + 1];
+        const int n_samples_cur = ends[i + 1] - start_samples;
 
-int whisper_full_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    // clear old results
-    auto & result_all = state->result_all;
+        auto params_cur = params;
 
-    result_all.clear();
+        params_cur.offset_ms = 0;
+        params_cur.print_progress = false;
+        params_cur.print_realtime = false;
 
-    if (n_samples > 0) {
-        // compute log mel spectrogram
-        if (params.speed_up) {
-            // TODO: Replace PV with more advanced algorithm
-            log("%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
-        } else {
-            if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-                log("%s: failed to compute log mel spectrogram\n", __func__);
-                return -2;
-            }
-        }
+        params_cur.new_segment_callback = nullptr;
+        params_cur.new_segment_callback_user_data = nullptr;
+
+        params_cur.progress_callback = nullptr;
+        params_cur.progress_callback_user_data = nullptr;
+
+        workers[i] = std::thread([&rets, ctx, state, i, params_cur, samples, start_samples, n_samples_cur]() {
+            rets[i] = whisper_full_with_state(ctx, state, params_cur, samples + start_samples, n_samples_cur);
+        });
     }
 
-    // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+    {
+        auto params_cur = params;
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            log("%s: failed to auto-detect language\n", __func__);
-            return -3;
-        }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
+        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
+        params_cur.print_realtime = false;
 
-        log("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-        if (params.detect_language) {
-            return 0;
+        // the segments past the first split can be dropped, they are reported once stitched
+        if (split_on_silence) {
+            params_cur.new_segment_callback = nullptr;
+            params_cur.new_segment_callback_user_data = nullptr;
         }
+
+        // Run the first transformation using default state but only for the first chunk.
+        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, ends[0]);
     }
 
-    if (params.token_timestamps) {
-        state->t_beg    = 0;
-        state->t_last   = 0;
-        state->tid_last = 0;
-        if (n_samples > 0) {
-            state->energy = get_signal_energy(samples, n_samples, 32);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        workers[i].join();
+        if (ret == 0) {
+            ret = rets[i];
         }
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+    auto & result_all = ctx->state->result_all;
 
-    // if length of spectrogram is less than 1.0s (100 frames), then return
-    // basically don't process anything that is less than 1.0s
-    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
-    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
-        return 0;
-    }
+    // time of a split in the unit of the segments (10 ms)
+    auto split_t = [&](int i) -> int64_t {
+        return (100*(int64_t) splits[i])/WHISPER_SAMPLE_RATE;
+    };
 
-    // a set of temperatures to use
-    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
-    std::vector<float> temperatures;
-    if (params.temperature_inc > 0.0f) {
-        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
-            temperatures.push_back(t);
+    auto owned = [&](const whisper_segment & segment, int i) -> bool {
+        const int64_t t_mid = (segment.t0 + segment.t1)/2;
+        return (i == 0 || t_mid >= split_t(i)) && (i == n_processors - 1 || t_mid < split_t(i + 1));
+    };
+
+    if (split_on_silence) {
+        result_all.erase(std::remove_if(result_all.begin(), result_all.end(),
+                    [&](const whisper_segment & segment) { return !owned(segment, 0); }), result_all.end());
+
+        // the segments are reported together, as the last n_new segments of the state
+        if (params.new_segment_callback && !result_all.empty()) {
+            params.new_segment_callback(ctx, ctx->state, result_all.size(), params.new_segment_callback_user_data);
         }
-    } else {
-        temperatures.push_back(params.temperature);
     }
 
-    // initialize the decoders
-    int n_decoders = 1;
+    // combine results into result_state->result_all from all other states
+    for (int i = 0; i < n_processors - 1; ++i) {
+        auto& results_i = states[i]->result_all;
 
-    switch (params.strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                n_decoders = params.greedy.best_of;
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
-            } break;
-    };
+        const int64_t offset_t = (100*(int64_t) begins[i + 1])/WHISPER_SAMPLE_RATE;
 
-    n_decoders = std::max(1, n_decoders);
+        for (auto& result : results_i) {
+            // correct the segment timestamp taking into account the offset
+            result.t0 += offset_t;
+            result.t1 += offset_t;
+
+            if (split_on_silence) {
+                for (auto & token : result.tokens) {
+                    if (token.t0 >= 0) {
+                        token.t0 += offset_t;
+                        token.t1 += offset_t;
+                    }
+                }
 
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
+                if (!owned(result, i + 1)) {
+                    continue;
+                }
 
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                log("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
+                // the overlap of the chunks can transcribe the same words on both sides of the split
+                if (!result_all.empty() && result.t0 < result_all.back().t1 &&
+                    !whisper_stitch_segments(*ctx, result_all.back(), result, params.print_special)) {
+                    continue;
+                }
             }
 
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
+            // make sure that segments are not overlapping
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
+            }
 
-            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+            result_all.push_back(std::move(result));
 
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
+            // call the new_segment_callback for each segment
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
         }
-    }
 
-    // the accumulated text context so far
-    auto & prompt_past = state->prompt_past;
-    if (params.no_context) {
-        prompt_past.clear();
-    }
+        results_i.clear();
 
-    // prepare prompt
-    {
-        std::vector<whisper_token> prompt_tokens;
+        ctx->state->t_mel_us += states[i]->t_mel_us - timings_start[i].t_mel_us;
 
-        // initial prompt
-        if (!params.prompt_tokens && params.initial_prompt) {
-            prompt_tokens.resize(1024);
-            prompt_tokens.resize(whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size()));
-            params.prompt_tokens   = prompt_tokens.data();
-            params.prompt_n_tokens = prompt_tokens.size();
-        }
+        ctx->state->t_sample_us += states[i]->t_sample_us - timings_start[i].t_sample_us;
+        ctx->state->t_encode_us += states[i]->t_encode_us - timings_start[i].t_encode_us;
+        ctx->state->t_decode_us += states[i]->t_decode_us - timings_start[i].t_decode_us;
+        ctx->state->t_vad_us    += states[i]->t_vad_us    - timings_start[i].t_vad_us;
 
-        // prepend the prompt tokens to the prompt_past
-        if (params.prompt_tokens && params.prompt_n_tokens > 0) {
-            // parse tokens from the pointer
-            for (int i = 0; i < params.prompt_n_tokens; i++) {
-                prompt_past.push_back(params.prompt_tokens[i]);
-            }
-            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
-        }
+        // the skipped audio adds up, it is not averaged
+        ctx->state->t_vad_skipped_ms += states[i]->t_vad_skipped_ms - timings_start[i].t_vad_skipped_ms;
+        ctx->state->n_vad_skip       += states[i]->n_vad_skip       - timings_start[i].n_vad_skip;
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
+    // average the timings
+    ctx->state->t_mel_us    /= n_processors;
+    ctx->state->t_sample_us /= n_processors;
+    ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_decode_us /= n_processors;
+    ctx->state->t_vad_us    /= n_processors;
 
-    // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
-        if (params.translate) {
-            prompt_init.push_back(whisper_token_translate(ctx));
-        } else {
-            prompt_init.push_back(whisper_token_transcribe(ctx));
-        }
+    // print information about the audio boundaries
+    log("\n");
+    log("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
+    for (int i = 1; i < n_processors; ++i) {
+        log("%s: split %d - %s\n", __func__, i, to_timestamp(split_t(i)).c_str());
+    }
+    if (!split_on_silence) {
+        log("%s: the transcription quality may be degraded near these boundaries\n", __func__);
     }
 
-    int seek = seek_start;
+    return ret;
+}
+
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    return whisper_full_parallel_impl(ctx, params, samples, n_samples, n_processors, false, 0);
+}
+
+int whisper_full_parallel_vad(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors,
+        int overlap_ms) {
+    return whisper_full_parallel_impl(ctx, params, samples, n_samples, n_processors, true, overlap_ms);
+}
+
+int64_t whisper_full_vad_skipped_ms_from_state(struct whisper_state * state) {
+    return state->t_vad_skipped_ms;
+}
+
+int64_t whisper_full_vad_skipped_ms(struct whisper_context * ctx) {
+    return ctx->state->t_vad_skipped_ms;
+}
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
 
-    // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
+int whisper_full_n_segments(struct whisper_context * ctx) {
+    return ctx->state->result_all.size();
+}
 
-    std::vector<kv_buf> kv_bufs;
+int whisper_full_lang_id_from_state(struct whisper_state * state) {
+    return state->lang_id;
+}
 
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+int whisper_full_lang_id(struct whisper_context * ctx) {
+    return ctx->state->lang_id;
+}
 
-        bool has_ts;
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
+}
 
-        whisper_sequence sequence;
-    };
+int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t0;
+}
 
-    std::vector<beam_candidate> beam_candidates;
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
+}
 
-    // main loop
-    while (true) {
-        if (params.progress_callback) {
-            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t1;
+}
 
-            params.progress_callback(
-                ctx, ctx->state, progress_cur, params.progress_callback_user_data);
-        }
+bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].speaker_turn_next;
+}
 
-        // of only 1 second left, then stop
-        if (seek + 100 >= seek_end) {
-            break;
-        }
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
+}
 
-        if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
-                log("%s: encoder_begin_callback returned false - aborting\n", __func__);
-                break;
-            }
-        }
+const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].text.c_str();
+}
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
-            log("%s: failed to encode\n", __func__);
-            return -6;
-        }
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
+}
 
-        // if there is a very short audio segment left to process, we remove any past prompt since it tends
-        // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
-            prompt_past.clear();
-        }
+int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].tokens.size();
+}
 
-        int best_decoder_id = 0;
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+}
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+}
 
-            int n_decoders_cur = 1;
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
+}
 
-            switch (params.strategy) {
-                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        }
-                    } break;
-                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
-                        }
-                    } break;
-            };
+whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].id;
+}
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
+}
 
-            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token];
+}
 
-            // TAGS: WHISPER_DECODER_INIT
-            for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
+}
 
-                decoder.kv_self.n = 0;
+float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].p;
+}
 
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+// =================================================================================================
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+//
+// Temporary interface needed for exposing ggml interface
+// Will be removed in the future when ggml becomes a separate library
+//
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
-            }
+WHISPER_API int whisper_bench_memcpy(int n_threads) {
+    fputs(whisper_bench_memcpy_str(n_threads), stderr);
+    return 0;
+}
 
-            // init prompt and kv cache for the current iteration
-            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
-            {
-                prompt.clear();
+WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                // if we have already generated some text, use it as a prompt to condition the next generation
-                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+    wsp_ggml_time_init();
 
-                    prompt = { whisper_token_prev(ctx) };
-                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
-                }
+    size_t n    = 20;
+    size_t arr  = n_threads > 0 ? 1024llu : n_threads; // trick to avoid compiler optimizations
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+    // 1GB MB array
+    const size_t size = arr*1024llu*1024llu;
 
-                // print the prompt
-                WHISPER_PRINT_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_PRINT_DEBUG("\n\n");
+    // single-thread
+    {
+        char * src = (char *) malloc(size);
+        char * dst = (char *) malloc(size);
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
-                    log("%s: failed to decode\n", __func__);
-                    return -7;
-                }
+        for (size_t i = 0; i < size; i++) src[i] = i;
 
-                {
-                    const int64_t t_start_sample_us = wsp_ggml_time_us();
+        memcpy(dst, src, size); // heat-up
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+        double tsum = 0.0;
+        double sum  = 0.0;
 
-                    state->decoders[0].kv_self.n += prompt.size();
+        for (size_t i = 0; i < n; i++) {
+            const int64_t t0 = wsp_ggml_time_us();
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+            memcpy(dst, src, size);
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, wsp_ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, wsp_ggml_nbytes(decoder.kv_self.v));
+            const int64_t t1 = wsp_ggml_time_us();
 
-                        decoder.kv_self.n += prompt.size();
+            tsum += (t1 - t0)*1e-6;
 
-                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+            src[rand() % size] = rand() % 256;
+        }
 
-                    state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
-                }
-            }
+        snprintf(strbuf, sizeof(strbuf), "memcpy: %.2f GB/s (1 thread)\n", (double) (n*size)/(tsum*1024llu*1024llu*1024llu));
+        s += strbuf;
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = wsp_ggml_time_us();
+        // needed to prevent the compiler from optimizing the memcpy away
+        {
+            for (size_t i = 0; i < size; i++) sum += dst[i];
 
-                // store the KV caches of all decoders when doing beam-search
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+            snprintf(strbuf, sizeof(strbuf), "sum:    %f\n", sum);
+            s += strbuf;
+        }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+        free(src);
+        free(dst);
+    }
 
-                        kv_bufs[j].k.resize(wsp_ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(wsp_ggml_nbytes(decoder.kv_self.v));
+    return s.c_str();
+}
 
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
-                    }
+WHISPER_API int whisper_bench_wsp_ggml_mul_mat(int n_threads) {
+    fputs(whisper_bench_wsp_ggml_mul_mat_str(n_threads), stderr);
+    return 0;
+}
 
-                    beam_candidates.clear();
-                }
+WHISPER_API const char * whisper_bench_wsp_ggml_mul_mat_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                // generate new sequence candidates for each decoder
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+    wsp_ggml_time_init();
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+    const int n_max = 128;
 
-                    switch (params.strategy) {
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                            {
-                                if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
-                                } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
-                                }
+    const std::vector<size_t> sizes = {
+        64, 128, 256, 512, 1024, 2048, 4096,
+    };
 
-                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                            } break;
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                            {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+    const size_t N_max = sizes.back();
 
-                                for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
-                                    beam_candidates.back().sequence.tokens.push_back(token);
-                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+    // a: N*N*sizeof(float)
+    // b: N*N*sizeof(float)
+    // c: N*N*sizeof(float)
+    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
+    std::vector<char> buf(4llu*N_max*N_max*sizeof(float) + 4*512);
 
-                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
-                                }
-                            } break;
-                    };
-                }
+    // put a bunch of random data in the buffer
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                    });
+    for (int j = 0; j < (int) sizes.size(); j++) {
+        int n_q4_0 = 0;
+        int n_q4_1 = 0;
+        int n_q5_0 = 0;
+        int n_q5_1 = 0;
+        int n_q8_0 = 0;
+        int n_fp16 = 0;
+        int n_fp32 = 0;
 
-                    uint32_t cur_c = 0;
+        // GFLOPS/s
+        double s_q4_0 = 0.0;
+        double s_q4_1 = 0.0;
+        double s_q5_0 = 0.0;
+        double s_q5_1 = 0.0;
+        double s_q8_0 = 0.0;
+        double s_fp16 = 0.0;
+        double s_fp32 = 0.0;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+        const size_t N = sizes[j];
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+        for (int k = 0; k < 7; ++k) {
+            const wsp_ggml_type wtype =
+                k == 0 ? WSP_GGML_TYPE_Q4_0 :
+                k == 1 ? WSP_GGML_TYPE_Q4_1 :
+                k == 2 ? WSP_GGML_TYPE_Q5_0 :
+                k == 3 ? WSP_GGML_TYPE_Q5_1 :
+                k == 4 ? WSP_GGML_TYPE_Q8_0 :
+                k == 5 ? WSP_GGML_TYPE_F16  : WSP_GGML_TYPE_F32;
 
-                        auto & cur = beam_candidates[cur_c++];
+            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
+            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
 
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
-                            ++cur_c;
-                        }
+            struct wsp_ggml_init_params gparams = {
+                /*.mem_size   =*/ buf.size(),
+                /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
+            };
 
-                        decoder.sequence   = cur.sequence;
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
+            struct wsp_ggml_context * ctx0 = wsp_ggml_init(gparams);
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+            struct wsp_ggml_tensor * a = wsp_ggml_new_tensor_2d(ctx0, wtype,         N, N);
+            struct wsp_ggml_tensor * b = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, N, N);
 
-                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
-                    }
-                }
+            struct wsp_ggml_tensor * c = wsp_ggml_mul_mat(ctx0, a, b);
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            struct wsp_ggml_cgraph gf = wsp_ggml_build_forward(c);
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+            gf.n_threads = n_threads;
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+            double tsum = 0.0;
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+            // heat-up
+            wsp_ggml_graph_compute(ctx0, &gf);
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+            for (int i = 0; i < n_max; ++i) {
+                const int64_t t0 = wsp_ggml_time_us();
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+                wsp_ggml_graph_compute(ctx0, &gf);
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+                const int64_t t1 = wsp_ggml_time_us();
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+                tsum += (t1 - t0)*1e-6;
+                n++;
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
-                           ) {
-                            if (result_len == 0) {
-                                if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+                if (tsum > 1.0 && n >= 3) {
+                    break;
+                }
+            }
 
-                            if (params.single_segment) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+            wsp_ggml_free(ctx0);
 
-                            completed = true;
-                            continue;
-                        }
+            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+        }
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
-                    }
+        // Q4_0 | Q4_1
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
+        s += strbuf;
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        failed = true;
-                        continue;
-                    }
-                }
+        // Q5_0 | Q5_1 | Q8_0
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
+        s += strbuf;
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
+        // F16 | F32
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        s += strbuf;
+    }
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    return s.c_str();
+}
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+WHISPER_API int whisper_bench_graph_sync(int n_threads) {
+    fputs(whisper_bench_graph_sync_str(n_threads), stderr);
+    return 0;
+}
 
-                        completed_all = false;
-                    }
+WHISPER_API const char * whisper_bench_graph_sync_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                    if (completed_all) {
-                        break;
-                    }
-                }
+    wsp_ggml_time_init();
 
-                state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
+    // mimic a single-token decoder pass: a stack of small matrix-vector products
+    const int n_state = 512;
+    const int n_layer = 6;
+    const int n_max   = 256;
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+    std::vector<char> buf(n_layer*8llu*n_state*n_state*sizeof(wsp_ggml_fp16_t) + 64llu*1024*1024);
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+    struct wsp_ggml_init_params gparams = {
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
+        /*.no_alloc   =*/ false,
+    };
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+    struct wsp_ggml_context * ctx0 = wsp_ggml_init(gparams);
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+    struct wsp_ggml_tensor * cur = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_F32, n_state);
+    wsp_ggml_set_f32(cur, 0.01f);
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        log("%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+    for (int il = 0; il < n_layer; ++il) {
+        struct wsp_ggml_tensor * w0 = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F16, n_state,   4*n_state);
+        struct wsp_ggml_tensor * w1 = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F16, 4*n_state, n_state);
+        wsp_ggml_set_f32(w0, 0.001f);
+        wsp_ggml_set_f32(w1, 0.001f);
 
-                    {
-                        const int64_t t_start_sample_us = wsp_ggml_time_us();
+        struct wsp_ggml_tensor * inpL = cur;
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+        cur = wsp_ggml_norm(ctx0, cur);
+        cur = wsp_ggml_gelu(ctx0, wsp_ggml_mul_mat(ctx0, w0, cur));
+        cur = wsp_ggml_mul_mat(ctx0, w1, cur);
+        cur = wsp_ggml_add(ctx0, cur, inpL);
+    }
 
-                        ++decoder.kv_self.n;
+    struct wsp_ggml_threadpool * pool = wsp_ggml_threadpool_new(n_threads);
 
-                        state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
-                    }
-                }
-            }
+    for (int k = 0; k < 2; ++k) {
+        const wsp_ggml_sync_mode mode = k == 0 ? WSP_GGML_SYNC_SPIN : WSP_GGML_SYNC_HYBRID;
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+        struct wsp_ggml_cgraph gf = wsp_ggml_build_forward(cur);
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+        gf.n_threads = n_threads;
+        gf.sync_mode = mode;
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+        // heat-up
+        wsp_ggml_graph_compute_with_pool(ctx0, &gf, pool);
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+        const clock_t c0 = clock();
+        const int64_t t0 = wsp_ggml_time_us();
 
-                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+        for (int i = 0; i < n_max; ++i) {
+            wsp_ggml_graph_compute_with_pool(ctx0, &gf, pool);
+        }
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+        const int64_t t1 = wsp_ggml_time_us();
+        const clock_t c1 = clock();
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+        const double t_wall = 1e-3*(t1 - t0)/n_max;
+        const double t_cpu  = 1e3*double(c1 - c0)/CLOCKS_PER_SEC/n_max;
 
-                        continue;
-                    }
+        snprintf(strbuf, sizeof(strbuf), "%-6s: %3d threads, wall %7.3f ms / token, cpu %7.3f ms / token (%4.1f cores busy)\n",
+                mode == WSP_GGML_SYNC_SPIN ? "spin" : "hybrid", n_threads, t_wall, t_cpu, t_cpu/t_wall);
+        s += strbuf;
+    }
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+    wsp_ggml_threadpool_free(pool);
+    wsp_ggml_free(ctx0);
 
-                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
-            }
+    return s.c_str();
+}
+
+// peak resident set size of the process in bytes, 0 if not available
+static size_t whisper_peak_rss() {
+#if defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss*1024llu;
+#endif
+#endif
+}
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            // - we are not at the end of the audio (3 sec)
-            if (it != (int) temperatures.size() - 1 &&
-                seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
-                bool success = true;
+// triangular filters, like the ones of the models
+static whisper_filters whisper_bench_mel_filters() {
+    whisper_filters filters;
+    filters.n_mel = WHISPER_N_MEL;
+    filters.n_fft = 1 + WHISPER_N_FFT/2;
+    filters.data.assign(filters.n_mel*filters.n_fft, 0.0f);
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const int c = 1 + j*(filters.n_fft - 2)/filters.n_mel;
+        const int w = 1 + j/16;
+        for (int k = std::max(0, c - w); k <= std::min(filters.n_fft - 1, c + w); ++k) {
+            filters.data[j*filters.n_fft + k] = 1.0f - float(abs(k - c))/(w + 1);
+        }
+    }
 
-                const auto & decoder = state->decoders[best_decoder_id];
+    whisper_filters_compress(filters);
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    success = false;
-                    state->n_fail_p++;
-                }
+    return filters;
+}
 
-                if (success) {
-                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
-                    //}
+WHISPER_API int whisper_bench_pcm_to_mel(int n_threads) {
+    fputs(whisper_bench_pcm_to_mel_str(n_threads), stderr);
+    return 0;
+}
 
-                    break;
-                }
-            }
+WHISPER_API const char * whisper_bench_pcm_to_mel_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
-        }
+    wsp_ggml_time_init();
 
-        // output results through a user-provided callback
-        {
-            const auto & best_decoder = state->decoders[best_decoder_id];
+    // 10 minutes of audio
+    const int n_samples = 10*60*WHISPER_SAMPLE_RATE;
 
-            const auto seek_delta = best_decoder.seek_delta;
-            const auto result_len = best_decoder.sequence.result_len;
+    std::vector<float> pcm(n_samples);
+    for (int i = 0; i < n_samples; ++i) {
+        pcm[i] = 0.1f*sinf(2.0f*M_PI*440.0f*i/WHISPER_SAMPLE_RATE) + 0.01f*((i*37)%101 - 50)/50.0f;
+    }
 
-            const auto & tokens_cur = best_decoder.sequence.tokens;
+    const whisper_filters filters = whisper_bench_mel_filters();
 
-            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+    whisper_fft_plan fft_plan;
+    whisper_fft_plan_init(fft_plan, WHISPER_N_FFT);
 
-            // update prompt_past
-            prompt_past.clear();
-            if (prompt.front() == whisper_token_prev(ctx)) {
-                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
-            }
+    whisper_state * state = new whisper_state;
 
-            for (int i = 0; i < result_len; ++i) {
-                prompt_past.push_back(tokens_cur[i].id);
-            }
+    const size_t rss0 = whisper_peak_rss();
 
-            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
-                int  i0 = 0;
-                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+    for (int nt = 1; ; nt = std::min(2*nt, n_threads)) {
+        const int64_t t0 = wsp_ggml_time_us();
 
-                std::string text;
-                bool speaker_turn_next = false;
+        log_mel_spectrogram(*state, pcm.data(), n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, nt, filters, fft_plan, false, state->mel);
 
-                for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+        const int64_t t1 = wsp_ggml_time_us();
 
-                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                    }
+        const size_t rss1 = whisper_peak_rss();
 
-                    // [TDRZ] record if speaker turn was predicted after current segment
-                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
-                        speaker_turn_next = true;
-                    }
+        // the peak only grows - it would grow with the number of threads if each one used its own copy of the audio
+        snprintf(strbuf, sizeof(strbuf), "pcm_to_mel: %3d threads, %d s of audio: %9.2f ms, peak RSS %8.2f MB (+%8.2f MB)\n",
+                nt, n_samples/WHISPER_SAMPLE_RATE, 1e-3*(t1 - t0), rss1/1024.0/1024.0, (rss1 - rss0)/1024.0/1024.0);
+        s += strbuf;
 
-                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
-                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+        if (nt >= n_threads) {
+            break;
+        }
+    }
 
-                        if (!text.empty()) {
-                            const auto tt0 = params.speed_up ? 2*t0 : t0;
-                            const auto tt1 = params.speed_up ? 2*t1 : t1;
+    delete state;
 
-                            if (params.print_realtime) {
-                                if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                                } else {
-                                    printf("%s", text.c_str());
-                                    fflush(stdout);
-                                }
-                            }
+    return s.c_str();
+}
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+WHISPER_API int whisper_bench_log_mel(int n_threads) {
+    fputs(whisper_bench_log_mel_str(n_threads), stderr);
+    return 0;
+}
 
-                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
+WHISPER_API const char * whisper_bench_log_mel_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                            int n_new = 1;
+    wsp_ggml_time_init();
 
-                            if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+    const whisper_filters filters = whisper_bench_mel_filters();
 
-                                if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                                }
-                            }
-                            if (params.new_segment_callback) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                            }
-                        }
-                        text = "";
-                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                            i++;
-                        }
-                        i--;
-                        t0 = t1;
-                        i0 = i + 1;
-                        speaker_turn_next = false;
-                    }
-                }
+    whisper_fft_plan fft_plan;
+    whisper_fft_plan_init(fft_plan, WHISPER_N_FFT);
 
-                if (!text.empty()) {
-                    const auto t1 = seek + seek_delta;
+    std::vector<float> hann;
+    hann_window(WHISPER_N_FFT, true, hann);
 
-                    const auto tt0 = params.speed_up ? 2*t0 : t0;
-                    const auto tt1 = params.speed_up ? 2*t1 : t1;
+    std::vector<float> frame(WHISPER_N_FFT);
+    for (int i = 0; i < WHISPER_N_FFT; ++i) {
+        frame[i] = 0.1f*sinf(2.0f*M_PI*440.0f*i/WHISPER_SAMPLE_RATE) + 0.01f*((i*37)%101 - 50)/50.0f;
+    }
 
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
+    const int n_frames = 20000; // per thread
 
-                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+    // FFT only, then the whole frame: window + FFT + power spectrum + filterbank + log
+    for (int k = 0; k < 2; ++k) {
+        std::vector<std::thread> workers(n_threads);
 
-                    int n_new = 1;
+        const int64_t t0 = wsp_ggml_time_us();
 
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+        for (int iw = 0; iw < n_threads; ++iw) {
+            workers[iw] = std::thread([&, k]() {
+                std::vector<float> fft_in(WHISPER_N_FFT);
+                std::vector<float> fft_out(2*(1 + WHISPER_N_FFT/2));
+                std::vector<float> fft_work(2*WHISPER_N_FFT);
+                std::vector<float> out(WHISPER_N_MEL);
 
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                for (int i = 0; i < n_frames; ++i) {
+                    if (k == 0) {
+                        whisper_fft_real(fft_plan, frame.data(), fft_work.data(), fft_out.data());
+                    } else {
+                        log_mel_spectrogram_frame(hann.data(), frame.data(), WHISPER_N_FFT, WHISPER_N_FFT, filters, fft_plan,
+                                fft_in.data(), fft_out.data(), fft_work.data(), WHISPER_N_MEL, out.data(), 1);
                     }
                 }
-            }
-
-            // update audio window
-            seek += seek_delta;
+            });
+        }
 
-            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        for (auto & w : workers) {
+            w.join();
         }
+
+        const int64_t t1 = wsp_ggml_time_us();
+
+        snprintf(strbuf, sizeof(strbuf), "log_mel: %-5s: %3d threads, %8.3f us / frame, %8.2f Mframes / s\n",
+                k == 0 ? "fft" : "frame", n_threads, 1.0*(t1 - t0)/n_frames, 1.0*n_frames*n_threads/(t1 - t0));
+        s += strbuf;
     }
 
-    return 0;
+    return s.c_str();
 }
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+WHISPER_API int whisper_bench_model_load(const char * path_model, int n_threads) {
+    fputs(whisper_bench_model_load_str(path_model, n_threads), stderr);
+    return 0;
 }
 
-int whisper_full_parallel(
-        struct whisper_context * ctx,
-        struct whisper_full_params params,
-        const float * samples,
-        int n_samples,
-        int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
-    }
-    int ret = 0;
+WHISPER_API const char * whisper_bench_model_load_str(const char * path_model, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    const int n_runs = 3;
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    // the first run of each loader may read the file from the storage, the next ones from the page cache
+    for (int k = 0; k < 4; ++k) {
+        const char * name = k == 0 ? "read" : k == 3 ? "mmap" : "copy";
+        const int    nt   = k == 0 ? 1 : k == 1 ? 1 : n_threads;
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+        int64_t t_first = 0;
+        int64_t t_min   = 0;
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        for (int i = 0; i < n_runs; ++i) {
+            // the loaders are verbose
+            const whisper_log_callback log_cb = whisper_log;
+            whisper_log = nullptr;
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+            whisper_context * ctx = nullptr;
+            switch (k) {
+                case 0: ctx = whisper_init_from_file_read(path_model);           break;
+                case 1: ctx = whisper_init_from_file_map(path_model, false, nt); break;
+                case 2: ctx = whisper_init_from_file_map(path_model, false, nt); break;
+                case 3: ctx = whisper_init_from_file_map(path_model, true,  nt); break;
+            }
 
-        auto params_cur = params;
+            whisper_log = log_cb;
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+            if (ctx == nullptr) {
+                snprintf(strbuf, sizeof(strbuf), "model_load: failed to load '%s'\n", path_model);
+                s += strbuf;
+                return s.c_str();
+            }
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+            t_first = i == 0 ? ctx->t_load_us : t_first;
+            t_min   = i == 0 ? ctx->t_load_us : std::min(t_min, ctx->t_load_us);
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+            whisper_free(ctx);
+        }
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        snprintf(strbuf, sizeof(strbuf), "model_load: %-4s: %3d threads, t_load_us first = %9lld, min = %9lld\n",
+                name, nt, (long long) t_first, (long long) t_min);
+        s += strbuf;
     }
 
-    {
-        auto params_cur = params;
+    return s.c_str();
+}
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+WHISPER_API int whisper_bench_kv_cache(int n_threads) {
+    fputs(whisper_bench_kv_cache_str(n_threads), stderr);
+    return 0;
+}
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
-    }
+WHISPER_API const char * whisper_bench_kv_cache_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
-    }
+    wsp_ggml_time_init();
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    // the decoder of the medium model: one cross-attention layer for a beam of 5 tokens
+    const int n_state = 1024;
+    const int n_head  = 16;
+    const int n_layer = 24;
+    const int n_ctx   = 448;  // text context
+    const int M       = 1500; // audio context
+    const int NB      = 5;
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    const int n_max = 128;
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
 
-            // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
-            }
+    std::vector<float> kv_data(3*n_state*M);
+    for (auto & x : kv_data) {
+        x = dist(rng);
+    }
 
-            ctx->state->result_all.push_back(std::move(result));
+    // the output of the F32 cache is the reference
+    std::vector<float> ref(n_state*NB);
 
-            // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
-            }
-        }
+    std::vector<char> buf(8llu*n_state*M*sizeof(float) + 16*1024*1024);
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+    for (int k = 0; k < 3; ++k) {
+        const wsp_ggml_type type = k == 0 ? WSP_GGML_TYPE_F32 : k == 1 ? WSP_GGML_TYPE_F16 : WSP_GGML_TYPE_Q8_0;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
+        const int M_pad = kv_cross_n_pad(type, M);
 
-        whisper_free_state(states[i]);
-    }
+        struct wsp_ggml_init_params gparams = {
+            /*.mem_size   =*/ buf.size(),
+            /*.mem_buffer =*/ buf.data(),
+            /*.no_alloc   =*/ false,
+        };
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+        struct wsp_ggml_context * ctx0 = wsp_ggml_init(gparams);
 
-    // print information about the audio boundaries
-    log("\n");
-    log("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        log("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
-    }
-    log("%s: the transcription quality may be degraded near these boundaries\n", __func__);
+        // K and V of the layer, padded like the cache (see whisper_kv_cache)
+        struct wsp_ggml_tensor * Kf = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, M_pad);
+        struct wsp_ggml_tensor * Vf = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, M_pad, n_state);
+        struct wsp_ggml_tensor * Q  = wsp_ggml_new_tensor_3d(ctx0, WSP_GGML_TYPE_F32, n_state/n_head, n_head, NB);
 
-    return ret;
-}
+        struct wsp_ggml_tensor * mask = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_F32, M_pad);
 
-int whisper_full_n_segments_from_state(struct whisper_state * state) {
-    return state->result_all.size();
-}
+        for (int i = 0; i < M_pad; ++i) {
+            const int it = std::min(i, M - 1);
+
+            memcpy((float *) Kf->data + i*n_state, kv_data.data() + it*n_state, n_state*sizeof(float));
+            for (int j = 0; j < n_state; ++j) {
+                ((float *) Vf->data)[j*M_pad + i] = kv_data[(M + it)*n_state + j];
+            }
+
+            ((float *) mask->data)[i] = i < M ? 0.0f : -INFINITY;
+        }
 
-int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->state->result_all.size();
-}
+        memcpy(Q->data, kv_data.data() + 2*n_state*M, n_state*NB*sizeof(float));
 
-int whisper_full_lang_id_from_state(struct whisper_state * state) {
-    return state->lang_id;
-}
+        struct wsp_ggml_tensor * kc = wsp_ggml_new_tensor_1d(ctx0, type, n_state*M_pad);
+        struct wsp_ggml_tensor * vc = wsp_ggml_new_tensor_1d(ctx0, type, n_state*M_pad);
 
-int whisper_full_lang_id(struct whisper_context * ctx) {
-    return ctx->state->lang_id;
-}
+        // fill the cache
+        {
+            struct wsp_ggml_cgraph gf = {};
+            gf.n_threads = n_threads;
 
-int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t0;
-}
+            wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Kf, wsp_ggml_view_2d(ctx0, kc, n_state, M_pad, kv_row_size(type, n_state), 0)));
+            wsp_ggml_build_forward_expand(&gf, wsp_ggml_cpy(ctx0, Vf, wsp_ggml_view_2d(ctx0, vc, M_pad, n_state, kv_row_size(type, M_pad), 0)));
 
-int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t0;
-}
+            wsp_ggml_graph_compute(ctx0, &gf);
+        }
 
-int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t1;
-}
+        // the cross-attention of whisper_build_graph_decoder()
+        struct wsp_ggml_tensor * K =
+            wsp_ggml_permute(ctx0,
+                    wsp_ggml_reshape_3d(ctx0, kc, n_state/n_head, n_head, M_pad),
+                    0, 2, 1, 3);
+
+        struct wsp_ggml_tensor * V =
+            wsp_ggml_view_3d(ctx0, vc,
+                    M_pad, n_state/n_head, n_head,
+                    kv_row_size(type, M_pad),
+                    kv_row_size(type, M_pad)*n_state/n_head,
+                    0);
+
+        struct wsp_ggml_tensor * KQ = wsp_ggml_mul_mat(ctx0, K, wsp_ggml_permute(ctx0, Q, 0, 2, 1, 3));
+        if (M_pad != M) {
+            KQ = wsp_ggml_add_inplace(ctx0, KQ, wsp_ggml_repeat(ctx0, mask, KQ));
+        }
 
-int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t1;
-}
+        struct wsp_ggml_tensor * KQV = wsp_ggml_mul_mat(ctx0, V, wsp_ggml_soft_max_inplace(ctx0, KQ));
 
-bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].speaker_turn_next;
-}
+        struct wsp_ggml_tensor * cur =
+            wsp_ggml_cpy(ctx0,
+                    wsp_ggml_permute(ctx0, KQV, 0, 2, 1, 3),
+                    wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, n_state, NB));
 
-const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].text.c_str();
-}
+        struct wsp_ggml_cgraph gf = wsp_ggml_build_forward(cur);
+        gf.n_threads = n_threads;
 
-const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].text.c_str();
-}
+        // heat-up
+        wsp_ggml_graph_compute(ctx0, &gf);
 
-int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].tokens.size();
-}
+        int    n    = 0;
+        double tsum = 0.0;
 
-int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].tokens.size();
-}
+        for (int i = 0; i < n_max; ++i) {
+            const int64_t t0 = wsp_ggml_time_us();
 
-const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+            wsp_ggml_graph_compute(ctx0, &gf);
 
-const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+            const int64_t t1 = wsp_ggml_time_us();
 
-whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].id;
-}
+            tsum += (t1 - t0)*1e-6;
+            n++;
 
-whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].id;
-}
+            if (tsum > 1.0 && n >= 3) {
+                break;
+            }
+        }
 
-struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token];
-}
+        // relative RMS error of the attention output
+        const float * out = (const float *) cur->data;
+        if (k == 0) {
+            memcpy(ref.data(), out, ref.size()*sizeof(float));
+        }
 
-struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token];
-}
+        double sum_err = 0.0;
+        double sum_ref = 0.0;
+        for (size_t i = 0; i < ref.size(); ++i) {
+            sum_err += (out[i] - ref[i])*(out[i] - ref[i]);
+            sum_ref += ref[i]*ref[i];
+        }
 
-float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].p;
-}
+        wsp_ggml_free(ctx0);
 
-float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].p;
-}
+        const double mb_cross = 2.0*n_layer*kv_row_size(type, (int64_t) n_state*M_pad)/1024.0/1024.0;
+        const double mb_self  = 2.0*n_layer*kv_row_size(type, (int64_t) n_state*n_ctx)/1024.0/1024.0;
 
-// =================================================================================================
+        snprintf(strbuf, sizeof(strbuf), "kv_cache: %-4s: cross %7.2f MB, self %6.2f MB per decoder | attention %7.3f ms (%3d runs), rel. error %.2e\n",
+                wsp_ggml_type_name(type), mb_cross, mb_self, 1e3*tsum/n, n, sqrt(sum_err/sum_ref));
+        s += strbuf;
+    }
 
-//
-// Temporary interface needed for exposing ggml interface
-// Will be removed in the future when ggml becomes a separate library
-//
+    return s.c_str();
+}
 
-WHISPER_API int whisper_bench_memcpy(int n_threads) {
-    fputs(whisper_bench_memcpy_str(n_threads), stderr);
+WHISPER_API int whisper_bench_audio_ctx(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    fputs(whisper_bench_audio_ctx_str(ctx, samples, n_samples, n_threads), stderr);
     return 0;
 }
 
-WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
+WHISPER_API const char * whisper_bench_audio_ctx_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
     static std::string s;
     s = "";
     char strbuf[256];
 
-    wsp_ggml_time_init();
-
-    size_t n    = 20;
-    size_t arr  = n_threads > 0 ? 1024llu : n_threads; // trick to avoid compiler optimizations
+    const std::vector<int> lengths_s = { 2, 3, 5, 8, 12, 20, 30 };
 
-    // 1GB MB array
-    const size_t size = arr*1024llu*1024llu;
+    // text tokens of the transcription of the first n samples and the time it took
+    auto transcribe = [&](int n, int audio_ctx, std::vector<whisper_token> & tokens) -> int64_t {
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-    // single-thread
-    {
-        char * src = (char *) malloc(size);
-        char * dst = (char *) malloc(size);
+        wparams.n_threads       = n_threads;
+        wparams.print_progress  = false;
+        wparams.temperature_inc = 0.0f;
+        wparams.audio_ctx       = audio_ctx;
 
-        for (size_t i = 0; i < size; i++) src[i] = i;
+        const int64_t t_start_us = wsp_ggml_time_us();
 
-        memcpy(dst, src, size); // heat-up
+        if (whisper_full(ctx, wparams, samples, n) != 0) {
+            return -1;
+        }
 
-        double tsum = 0.0;
-        double sum  = 0.0;
+        const int64_t t_us = wsp_ggml_time_us() - t_start_us;
 
-        for (size_t i = 0; i < n; i++) {
-            const int64_t t0 = wsp_ggml_time_us();
+        tokens.clear();
+        for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                if (id < whisper_token_eot(ctx)) {
+                    tokens.push_back(id);
+                }
+            }
+        }
 
-            memcpy(dst, src, size);
+        return t_us;
+    };
 
-            const int64_t t1 = wsp_ggml_time_us();
+    std::vector<whisper_token> tokens_full;
+    std::vector<whisper_token> tokens_adaptive;
 
-            tsum += (t1 - t0)*1e-6;
+    if (n_samples < lengths_s.front()*WHISPER_SAMPLE_RATE) {
+        snprintf(strbuf, sizeof(strbuf), "audio_ctx: at least %d s of audio are needed\n", lengths_s.front());
+        s += strbuf;
+        return s.c_str();
+    }
 
-            src[rand() % size] = rand() % 256;
+    for (int len_s : lengths_s) {
+        const int n = len_s*WHISPER_SAMPLE_RATE;
+        if (n > n_samples) {
+            break;
         }
 
-        snprintf(strbuf, sizeof(strbuf), "memcpy: %.2f GB/s (1 thread)\n", (double) (n*size)/(tsum*1024llu*1024llu*1024llu));
-        s += strbuf;
+        // the first run of each mode builds the graphs for its audio context
+        transcribe(n, 0, tokens_full);
+        transcribe(n, WHISPER_AUDIO_CTX_ADAPTIVE, tokens_adaptive);
 
-        // needed to prevent the compiler from optimizing the memcpy away
-        {
-            for (size_t i = 0; i < size; i++) sum += dst[i];
+        const int64_t t_full     = transcribe(n, 0, tokens_full);
+        const int64_t t_adaptive = transcribe(n, WHISPER_AUDIO_CTX_ADAPTIVE, tokens_adaptive);
 
-            snprintf(strbuf, sizeof(strbuf), "sum:    %f\n", sum);
-            s += strbuf;
+        if (t_full < 0 || t_adaptive < 0) {
+            s += "audio_ctx: failed to transcribe\n";
+            return s.c_str();
         }
 
-        free(src);
-        free(dst);
+        // token edit distance of the adaptive transcription to the full one
+        std::vector<int> d0(tokens_adaptive.size() + 1);
+        std::vector<int> d1(tokens_adaptive.size() + 1);
+        for (size_t j = 0; j < d0.size(); ++j) {
+            d0[j] = j;
+        }
+        for (size_t i = 1; i <= tokens_full.size(); ++i) {
+            d1[0] = i;
+            for (size_t j = 1; j < d0.size(); ++j) {
+                d1[j] = std::min({ d0[j] + 1, d1[j - 1] + 1, d0[j - 1] + (tokens_full[i - 1] != tokens_adaptive[j - 1]) });
+            }
+            d0.swap(d1);
+        }
+
+        const int n_audio_ctx = whisper_audio_ctx_adaptive(ctx->model.hparams, n/WHISPER_HOP_LENGTH);
+
+        snprintf(strbuf, sizeof(strbuf), "audio_ctx: %2d s: full %8.1f ms | adaptive %4d: %8.1f ms, x%5.2f | %3d / %3d tokens differ\n",
+                len_s, 1e-3*t_full, n_audio_ctx, 1e-3*t_adaptive, double(t_full)/t_adaptive, d0.back(), (int) tokens_full.size());
+        s += strbuf;
     }
 
     return s.c_str();
 }
 
-WHISPER_API int whisper_bench_wsp_ggml_mul_mat(int n_threads) {
-    fputs(whisper_bench_wsp_ggml_mul_mat_str(n_threads), stderr);
+WHISPER_API int whisper_bench_encode_batch(struct whisper_context * ctx, int n_threads) {
+    fputs(whisper_bench_encode_batch_str(ctx, n_threads), stderr);
     return 0;
 }
 
-WHISPER_API const char * whisper_bench_wsp_ggml_mul_mat_str(int n_threads) {
+WHISPER_API const char * whisper_bench_encode_batch_str(struct whisper_context * ctx, int n_threads) {
     static std::string s;
     s = "";
     char strbuf[256];
 
-    wsp_ggml_time_init();
+    const int n_mel   = ctx->model.hparams.n_mels;
+    const int n_frame = 2*ctx->model.hparams.n_audio_ctx;
 
-    const int n_max = 128;
+    // one window per state, the spectrogram is read from the first one
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < WHISPER_ENCODE_BATCH_MAX; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            break;
+        }
+        states.push_back(state);
+    }
 
-    const std::vector<size_t> sizes = {
-        64, 128, 256, 512, 1024, 2048, 4096,
+    std::vector<float> mel((size_t) n_mel*n_frame*WHISPER_ENCODE_BATCH_MAX);
+    {
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (auto & v : mel) {
+            v = dist(rng);
+        }
+    }
+
+    if ((int) states.size() < WHISPER_ENCODE_BATCH_MAX ||
+        whisper_set_mel_with_state(ctx, states[0], mel.data(), n_frame*WHISPER_ENCODE_BATCH_MAX, n_mel) != 0) {
+        s += "encode_batch: failed to initialize the states\n";
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+        return s.c_str();
+    }
+
+    auto kv_cross_data = [](const whisper_state * state) {
+        const auto & kv = state->kv_cross;
+        std::vector<uint8_t> data((uint8_t *) kv.k->data, (uint8_t *) kv.k->data + wsp_ggml_nbytes(kv.k));
+        data.insert(data.end(), (uint8_t *) kv.v->data, (uint8_t *) kv.v->data + wsp_ggml_nbytes(kv.v));
+        return data;
     };
 
-    const size_t N_max = sizes.back();
+    for (int n = 1; n <= WHISPER_ENCODE_BATCH_MAX; ++n) {
+        std::vector<whisper_encode_window> windows;
+        for (int i = 0; i < n; ++i) {
+            windows.push_back({ states[0], states[i], i*n_frame });
+        }
 
-    // a: N*N*sizeof(float)
-    // b: N*N*sizeof(float)
-    // c: N*N*sizeof(float)
-    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
-    std::vector<char> buf(4llu*N_max*N_max*sizeof(float) + 4*512);
+        std::vector<std::vector<uint8_t>> kv_single;
 
-    // put a bunch of random data in the buffer
-    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+        int64_t t_single = 0;
+        int64_t t_batch  = 0;
 
-    for (int j = 0; j < (int) sizes.size(); j++) {
-        int n_q4_0 = 0;
-        int n_q4_1 = 0;
-        int n_q5_0 = 0;
-        int n_q5_1 = 0;
-        int n_q8_0 = 0;
-        int n_fp16 = 0;
-        int n_fp32 = 0;
+        // the first pass of each mode allocates the compute buffers
+        for (int pass = 0; pass < 2; ++pass) {
+            kv_single.clear();
 
-        // GFLOPS/s
-        double s_q4_0 = 0.0;
-        double s_q4_1 = 0.0;
-        double s_q5_0 = 0.0;
-        double s_q5_1 = 0.0;
-        double s_q8_0 = 0.0;
-        double s_fp16 = 0.0;
-        double s_fp32 = 0.0;
+            const int64_t t_start_us = wsp_ggml_time_us();
+            for (int i = 0; i < n; ++i) {
+                states[i]->encoded.mel_id = -1;
+                whisper_encode_batch(ctx, &windows[i], 1, n_threads);
+                kv_single.push_back(kv_cross_data(states[i]));
+            }
+            t_single = wsp_ggml_time_us() - t_start_us;
+        }
 
-        const size_t N = sizes[j];
+        bool match = true;
 
-        for (int k = 0; k < 7; ++k) {
-            const wsp_ggml_type wtype =
-                k == 0 ? WSP_GGML_TYPE_Q4_0 :
-                k == 1 ? WSP_GGML_TYPE_Q4_1 :
-                k == 2 ? WSP_GGML_TYPE_Q5_0 :
-                k == 3 ? WSP_GGML_TYPE_Q5_1 :
-                k == 4 ? WSP_GGML_TYPE_Q8_0 :
-                k == 5 ? WSP_GGML_TYPE_F16  : WSP_GGML_TYPE_F32;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int i = 0; i < n; ++i) {
+                states[i]->encoded.mel_id = -1;
+            }
 
-            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
-            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
+            const int64_t t_start_us = wsp_ggml_time_us();
+            whisper_encode_batch(ctx, windows.data(), n, n_threads);
+            t_batch = wsp_ggml_time_us() - t_start_us;
+        }
 
-            struct wsp_ggml_init_params gparams = {
-                /*.mem_size   =*/ buf.size(),
-                /*.mem_buffer =*/ buf.data(),
-                /*.no_alloc   =*/ false,
-            };
+        for (int i = 0; i < n; ++i) {
+            match = match && kv_cross_data(states[i]) == kv_single[i];
+        }
 
-            struct wsp_ggml_context * ctx0 = wsp_ggml_init(gparams);
+        snprintf(strbuf, sizeof(strbuf), "encode_batch: %d windows: single %8.1f ms | batch %8.1f ms, x%5.2f | cross KV %s\n",
+                n, 1e-3*t_single, 1e-3*t_batch, double(t_single)/t_batch, match ? "identical" : "differs");
+        s += strbuf;
+    }
 
-            struct wsp_ggml_tensor * a = wsp_ggml_new_tensor_2d(ctx0, wtype,         N, N);
-            struct wsp_ggml_tensor * b = wsp_ggml_new_tensor_2d(ctx0, WSP_GGML_TYPE_F32, N, N);
+    for (auto * state : states) {
+        whisper_free_state(state);
+    }
 
-            struct wsp_ggml_tensor * c = wsp_ggml_mul_mat(ctx0, a, b);
+    return s.c_str();
+}
 
-            struct wsp_ggml_cgraph gf = wsp_ggml_build_forward(c);
+WHISPER_API int whisper_bench_mel_stream(struct whisper_context * ctx, int n_threads) {
+    fputs(whisper_bench_mel_stream_str(ctx, n_threads), stderr);
+    return 0;
+}
 
-            gf.n_threads = n_threads;
+WHISPER_API const char * whisper_bench_mel_stream_str(struct whisper_context * ctx, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-            double tsum = 0.0;
+    wsp_ggml_time_init();
 
-            // heat-up
-            wsp_ggml_graph_compute(ctx0, &gf);
+    // 20 s of audio
+    const int n_samples = 20*WHISPER_SAMPLE_RATE;
 
-            for (int i = 0; i < n_max; ++i) {
-                const int64_t t0 = wsp_ggml_time_us();
+    std::vector<float> pcm(n_samples);
+    for (int i = 0; i < n_samples; ++i) {
+        pcm[i] = 0.1f*sinf(2.0f*M_PI*440.0f*i/WHISPER_SAMPLE_RATE) + 0.01f*((i*37)%101 - 50)/50.0f;
+    }
 
-                wsp_ggml_graph_compute(ctx0, &gf);
+    // only the spectrograms of the states are used
+    whisper_state * state_stream = new whisper_state;
+    whisper_state * state_batch  = new whisper_state;
 
-                const int64_t t1 = wsp_ggml_time_us();
+    // irregular chunks: shorter than a hop, than the padding and than a frame, and longer ones
+    const int chunk_sizes[] = { 1, 159, 160, 161, 199, 200, 201, 399, 400, 401, 1000, 3200, 7919, 16000 };
+    const int n_chunk_sizes = sizeof(chunk_sizes)/sizeof(chunk_sizes[0]);
 
-                tsum += (t1 - t0)*1e-6;
-                n++;
+    std::mt19937 rng(0);
 
-                if (tsum > 1.0 && n >= 3) {
-                    break;
-                }
-            }
+    int n_pushed = 0;
+    int n_pushes = 0;
+    int n_differ = 0;
 
-            wsp_ggml_free(ctx0);
+    int64_t t_stream = 0;
 
-            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+    while (n_pushed < n_samples) {
+        const int n = std::min(n_samples - n_pushed, chunk_sizes[rng() % n_chunk_sizes]);
+
+        const int64_t t_start_us = wsp_ggml_time_us();
+        if (whisper_mel_stream_push_with_state(ctx, state_stream, pcm.data() + n_pushed, n) != 0) {
+            s += "mel_stream: whisper_mel_stream_push_with_state() failed\n";
+            break;
         }
+        t_stream += wsp_ggml_time_us() - t_start_us;
 
-        // Q4_0 | Q4_1
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
-        s += strbuf;
+        n_pushed += n;
+        n_pushes++;
 
-        // Q5_0 | Q5_1 | Q8_0
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
-        s += strbuf;
+        // after each push, the spectrogram must be the one of all the samples pushed so far
+        whisper_pcm_to_mel_with_state(ctx, state_batch, pcm.data(), n_pushed, n_threads);
 
-        // F16 | F32
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
-        s += strbuf;
+        const auto & mel_stream = state_stream->mel;
+        const auto & mel_batch  = state_batch->mel;
+
+        bool same =
+            mel_stream.n_len     == mel_batch.n_len &&
+            mel_stream.n_len_org == mel_batch.n_len_org &&
+            mel_stream.n_mel     == mel_batch.n_mel;
+
+        // the rows of the streaming spectrogram have room to grow
+        for (int j = 0; same && j < mel_batch.n_mel; ++j) {
+            same = memcmp(mel_stream.data.data() + (size_t) j*mel_stream.n_stride,
+                          mel_batch.data.data()  + (size_t) j*mel_batch.n_stride, mel_batch.n_len*sizeof(float)) == 0;
+        }
+
+        n_differ += !same;
     }
 
+    int64_t t_batch = 0;
+    {
+        const int64_t t_start_us = wsp_ggml_time_us();
+        whisper_pcm_to_mel_with_state(ctx, state_batch, pcm.data(), n_samples, n_threads);
+        t_batch = wsp_ggml_time_us() - t_start_us;
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "mel_stream: %d s of audio in %d pushes: stream %8.2f ms | batch %8.2f ms (%d threads) | %s (%d pushes differ)\n",
+            n_samples/WHISPER_SAMPLE_RATE, n_pushes, 1e-3*t_stream, 1e-3*t_batch, n_threads, n_differ == 0 ? "identical" : "differs", n_differ);
+    s += strbuf;
+
+    delete state_stream;
+    delete state_batch;
+
     return s.c_str();
 }
 
@@ -5261,12 +8979,17 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
 
     std::vector<float> result(n_samples);
 
+    // running sum of the window, so that wide windows cost the same as narrow ones
+    double sum = 0;
+    for (int j = 0; j < std::min(hw, n_samples); j++) {
+        sum += fabs(signal[j]);
+    }
     for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
-            }
+        if (i + hw < n_samples) {
+            sum += fabs(signal[i + hw]);
+        }
+        if (i - hw - 1 >= 0) {
+            sum -= fabs(signal[i - hw - 1]);
         }
         result[i] = sum/(2*hw + 1);
     }
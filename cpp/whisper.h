@@ -25,6 +25,9 @@
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
 
+// whisper_full_params.audio_ctx: size the encoder to the audio of each window
+#define WHISPER_AUDIO_CTX_ADAPTIVE -1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -103,14 +106,54 @@ extern "C" {
     WHISPER_API struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init(struct whisper_model_loader * loader);
 
+    // Same as whisper_init_from_file, but the model file is memory-mapped: the weights are used in place when
+    // their alignment and the endianness allow it, and are copied otherwise.
+    // The pages of the weights are read when they are first used and are shared with the other processes that
+    // map the same file. Falls back to whisper_init_from_file if the file cannot be mapped.
+    // The file must not be modified while the context is alive.
+    WHISPER_API struct whisper_context * whisper_init_from_file_mmap(const char * path_model);
+
+    // Same as whisper_init_from_file_mmap, but the contexts created for the same path share one read-only copy of
+    // the model: only the first call loads it, the next ones only allocate their own state.
+    // The model is freed with the last of its contexts.
+    WHISPER_API struct whisper_context * whisper_init_from_file_shared(const char * path_model);
+
     // These are the same as the above, but the internal state of the context is not allocated automatically
     // It is the responsibility of the caller to allocate the state using whisper_init_state() (#523)
     WHISPER_API struct whisper_context * whisper_init_from_file_no_state(const char * path_model);
     WHISPER_API struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader);
+    WHISPER_API struct whisper_context * whisper_init_from_file_mmap_no_state(const char * path_model);
+    WHISPER_API struct whisper_context * whisper_init_from_file_shared_no_state(const char * path_model);
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Limit the number of threads used by the computations of the state, 0 removes the limit.
+    // It can be called from another thread while whisper_full_with_state() runs on the state: the limit applies
+    // from the next encoder or decoder graph. Used to share a fixed number of cores between several states.
+    WHISPER_API void whisper_state_set_n_threads_max(struct whisper_state * state, int n_threads);
+
+    // Quantize the weights of the F32 / F16 model file path_in to ftype and write the result to path_out.
+    // ftype is a wsp_ggml_ftype value: 2 = Q4_0, 3 = Q4_1, 7 = Q8_0, 8 = Q5_0, 9 = Q5_1, 10 .. 14 = Q2_K .. Q6_K
+    // (the k-quants need n_state to be a multiple of 256, so they cannot be used with the tiny models).
+    // The model is processed in chunks of a few MB, the 2-D weights are quantized by n_threads threads.
+    // Returns 0 on success. On failure, path_out is removed.
+    WHISPER_API int whisper_model_quantize(const char * path_in, const char * path_out, int ftype, int n_threads);
+
+    // Precision of the self- and cross-attention KV caches
+    enum whisper_kv_type {
+        WHISPER_KV_TYPE_F16  = 0, // default
+        WHISPER_KV_TYPE_F32  = 1,
+        WHISPER_KV_TYPE_Q8_0 = 2, // blocks of 32 int8 values with a scale, about half the size of F16
+    };
+
+    // Set the type of the KV caches of the states of the context.
+    // The states created before the call keep their type, except the default state which is re-created
+    // (its spectrogram and results are lost) - call it before whisper_ctx_init_openvino_encoder().
+    // With Q8_0 the attention is computed directly on the quantized cache.
+    // Returns 0 on success
+    WHISPER_API int whisper_ctx_set_kv_type(struct whisper_context * ctx, enum whisper_kv_type type);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -165,6 +208,26 @@ extern "C" {
                            int   n_samples,
                            int   n_threads);
 
+    // Streaming log mel spectrogram.
+    // Appends n_samples new samples of RAW PCM audio to the audio pushed so far and computes only the mel frames that
+    // were not final yet. After each call, the spectrogram of the state is the same as the one computed by
+    // whisper_pcm_to_mel() for all the samples pushed since the last reset.
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_push(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples);
+
+    WHISPER_API int whisper_mel_stream_push_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples);
+
+    // Forget the audio pushed with whisper_mel_stream_push() and start a new stream.
+    WHISPER_API void whisper_mel_stream_reset(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_stream_reset_with_state(struct whisper_state * state);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -197,6 +260,31 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // A window of a batched encode: the log mel spectrogram of src at offset is encoded into the
+    // cross-attention cache of dst, as whisper_encode_with_state(ctx, dst, offset, n_threads) would do.
+    // src can be NULL to use the spectrogram of dst - several windows of one long spectrogram are encoded by
+    // pointing them to the same src with a different dst each.
+    struct whisper_encode_window {
+        struct whisper_state * src;
+        struct whisper_state * dst;
+        int offset;
+    };
+
+    #define WHISPER_ENCODE_BATCH_MAX 4
+
+    // Run the Whisper encoder on up to WHISPER_ENCODE_BATCH_MAX windows at once.
+    // The windows are evaluated as one graph with a batch dimension, with one set of graph nodes for all of them.
+    // On the CPU it is not faster than a separate whisper_encode_with_state() call per window, see
+    // whisper_bench_encode_batch() - the matrix products of a window already keep the threads busy.
+    // The dst states must be distinct and use the same audio context.
+    // The compute buffer of the batch is kept by the dst state of the first window.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+    const struct whisper_encode_window * windows,
+                               int   n_windows,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -334,6 +422,12 @@ extern "C" {
     // If it returns false, the computation is aborted
     typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, struct whisper_state * state, void * user_data);
 
+    // Abort callback
+    // If not NULL, called before each decoder step of whisper_full()
+    // If it returns true, the computation is aborted and the text of the window being decoded is discarded
+    // It is called from the thread running whisper_full(), so it should only read a flag set by the other thread
+    typedef bool (*whisper_abort_callback)(void * user_data);
+
     // Logits filter callback
     // Can be used to modify the logits before sampling
     // If not NULL, called after applying temperature to logits
@@ -352,6 +446,7 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+        bool hybrid_sync;       // threads spin briefly and then sleep between graph nodes instead of busy-waiting (lower CPU usage)
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -376,7 +471,12 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, WHISPER_AUDIO_CTX_ADAPTIVE = from the
+                                // length of each window, in buckets of 2.56 s with 1.28 s of margin)
+        int  n_threads_ahead;   // encode the next window on this many more threads while the current one is decoded (0 = off)
+                                // the encode is used when the window is decoded up to its end, it is repeated otherwise
+        bool  vad_skip_silence; // start the windows at the next speech, found from the energy of the samples (no extra model)
+        float vad_thold;        // speech threshold in dB above the noise floor of the audio (~15)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -428,6 +528,10 @@ extern "C" {
         whisper_encoder_begin_callback encoder_begin_callback;
         void * encoder_begin_callback_user_data;
 
+        // called before each decoder step, the computation stops within one token when it returns true
+        whisper_abort_callback abort_callback;
+        void * abort_callback_user_data;
+
         // called by each decoder to filter obtained logits
         whisper_logits_filter_callback logits_filter_callback;
         void * logits_filter_callback_user_data;
@@ -458,6 +562,7 @@ extern "C" {
     // Not thread safe if executed in parallel on the same context.
     // It seems this approach can offer some speedup in some cases.
     // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The states of the chunks after the first one are kept with the context and reused by the next calls.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -465,6 +570,21 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // Same as whisper_full_parallel(), with the chunks split in the quietest part (lowest signal energy) within 5 s of
+    // their nominal boundary and overlapping by overlap_ms (~1000). Each segment is kept by the chunk where its middle is,
+    // and the words transcribed on both sides of a boundary are kept once.
+    WHISPER_API int whisper_full_parallel_vad(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                                   int   n_processors,
+                                   int   overlap_ms);
+
+    // Audio skipped as silence by vad_skip_silence since the last whisper_reset_timings(), in ms
+    WHISPER_API int64_t whisper_full_vad_skipped_ms           (struct whisper_context * ctx);
+    WHISPER_API int64_t whisper_full_vad_skipped_ms_from_state(struct whisper_state * state);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -518,6 +638,37 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_wsp_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_wsp_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_graph_sync      (int n_threads);
+    WHISPER_API const char * whisper_bench_graph_sync_str  (int n_threads);
+    WHISPER_API int          whisper_bench_pcm_to_mel      (int n_threads);
+    WHISPER_API const char * whisper_bench_pcm_to_mel_str  (int n_threads);
+    WHISPER_API int          whisper_bench_log_mel         (int n_threads);
+    WHISPER_API const char * whisper_bench_log_mel_str     (int n_threads);
+
+    // load the model with the different loaders (read / parallel copy / in place) and report the load times
+    // run it on each model size to track the cold-start time
+    WHISPER_API int          whisper_bench_model_load      (const char * path_model, int n_threads);
+    WHISPER_API const char * whisper_bench_model_load_str  (const char * path_model, int n_threads);
+
+    // memory of the KV caches of the medium model and time / error of one cross-attention layer for each KV type
+    // the error is relative to the F32 cache
+    WHISPER_API int          whisper_bench_kv_cache        (int n_threads);
+    WHISPER_API const char * whisper_bench_kv_cache_str    (int n_threads);
+
+    // transcribe the first 2, 3, 5, 8, 12, 20 and 30 seconds of the samples with the full and the adaptive audio
+    // context (WHISPER_AUDIO_CTX_ADAPTIVE) and report the times and the number of text tokens that differ
+    WHISPER_API int          whisper_bench_audio_ctx       (struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+    WHISPER_API const char * whisper_bench_audio_ctx_str   (struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+
+    // encode 1 .. WHISPER_ENCODE_BATCH_MAX windows of a synthetic spectrogram one at a time and as one batch
+    // (whisper_encode_batch) and report the times and whether the cross-attention caches match
+    WHISPER_API int          whisper_bench_encode_batch    (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_encode_batch_str(struct whisper_context * ctx, int n_threads);
+
+    // push 20 s of audio with whisper_mel_stream_push() in chunks of irregular sizes and check after each push that
+    // the spectrogram is bit-identical to the one of whisper_pcm_to_mel() on the samples pushed so far
+    WHISPER_API int          whisper_bench_mel_stream      (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_mel_stream_str  (struct whisper_context * ctx, int n_threads);
 
     // Control logging output; default behavior is to print to stderr
 
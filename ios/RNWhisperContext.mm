@@ -7,7 +7,7 @@
 + (instancetype)initWithModelPath:(NSString *)modelPath contextId:(int)contextId {
     RNWhisperContext *context = [[RNWhisperContext alloc] init];
     context->contextId = contextId;
-    context->ctx = whisper_init_from_file([modelPath UTF8String]);
+    context->ctx = whisper_init_from_file_shared([modelPath UTF8String]);
     context->dQueue = dispatch_queue_create(
         [[NSString stringWithFormat:@"RNWhisperContext-%d", contextId] UTF8String],
         DISPATCH_QUEUE_SERIAL
@@ -335,6 +335,7 @@ void AudioInputCallback(void * inUserData,
     params.print_timestamps = false;
     params.print_special    = false;
     params.speed_up         = options[@"speedUp"] != nil ? [options[@"speedUp"] boolValue] : false;
+    params.audio_ctx        = options[@"audioCtx"] != nil ? [options[@"audioCtx"] intValue] : 0;
     params.translate        = options[@"translate"] != nil ? [options[@"translate"] boolValue] : false;
     params.language         = options[@"language"] != nil ? [options[@"language"] UTF8String] : "auto";
     params.n_threads        = n_threads > 0 ? n_threads : default_n_threads;
@@ -374,11 +375,7 @@ void AudioInputCallback(void * inUserData,
         params.initial_prompt = [options[@"prompt"] UTF8String];
     }
 
-    params.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-        bool is_aborted = *(bool*)user_data;
-        return !is_aborted;
-    };
-    params.encoder_begin_callback_user_data = rn_whisper_assign_abort_map(jobId);
+    rn_whisper_set_abort_callbacks(&params, rn_whisper_assign_abort_token(jobId));
 
     return params;
 }
@@ -400,7 +397,7 @@ void AudioInputCallback(void * inUserData,
     whisper_reset_timings(self->ctx);
 
     int code = whisper_full(self->ctx, params, audioData, audioDataCount);
-    rn_whisper_remove_abort_map(jobId);
+    rn_whisper_remove_abort_token(jobId);
     // if (code == 0) {
     //     whisper_print_timings(self->ctx);
     // }
@@ -416,7 +413,7 @@ void AudioInputCallback(void * inUserData,
     whisper_reset_timings(self->ctx);
 
     int code = whisper_full(self->ctx, params, audioData, audioDataCount);
-    rn_whisper_remove_abort_map(jobId);
+    rn_whisper_remove_abort_token(jobId);
     // if (code == 0) {
     //     whisper_print_timings(self->ctx);
     // }
@@ -30,6 +30,8 @@ export type TranscribeOptions = {
   bestOf?: number,
   /** Speed up audio by x2 (reduced accuracy) */
   speedUp?: boolean,
+  /** Audio context size of the encoder (Default: 0 for the full 30 s window, -1 to size it to the audio, faster on short clips) */
+  audioCtx?: number,
   /** Initial Prompt */
   prompt?: string,
 }